@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef APRINTER_BIT_SCAN_H
+#define APRINTER_BIT_SCAN_H
+
+#include <aprinter/meta/IntTypeInfo.h>
+#include <aprinter/base/Hints.h>
+
+namespace APrinter {
+
+/*
+ * Returns the index of the lowest set bit in x, which must not be zero.
+ */
+template <typename Type>
+AMBRO_ALWAYS_INLINE
+int CountTrailingZeros (Type x)
+{
+    static_assert(!IntTypeInfo<Type>::Signed, "");
+    
+    if (sizeof(Type) <= sizeof(unsigned int)) {
+        return __builtin_ctz(x);
+    }
+    else if (sizeof(Type) <= sizeof(unsigned long)) {
+        return __builtin_ctzl(x);
+    }
+    else {
+        return __builtin_ctzll(x);
+    }
+}
+
+}
+
+#endif
@@ -31,6 +31,8 @@
 #include <inttypes.h>
 
 #include <aprinter/meta/ChooseInt.h>
+#include <aprinter/meta/BitsInInt.h>
+#include <aprinter/meta/PowerOfTwo.h>
 #include <aprinter/meta/StructIf.h>
 #include <aprinter/meta/FunctionIf.h>
 #include <aprinter/meta/BasicMetaUtils.h>
@@ -70,7 +72,7 @@ public:
     
 private:
     static_assert(NumCacheEntries > 0, "");
-    static_assert(NumCacheEntries <= 64, "");
+    static_assert(NumCacheEntries <= 1024, "");
     static_assert(NumIoUnits > 0 && NumIoUnits <= NumCacheEntries, "");
     static_assert(MaxIoBlocks > 0 && MaxIoBlocks <= NumCacheEntries, "");
     static_assert(MaxIoBlocks <= TheBlockAccess::MaxIoBlocks, "");
@@ -92,6 +94,7 @@ private:
     using CacheEntryIndexType = ChooseIntForMax<NumCacheEntries, true>;
     using IoUnitIndexType = ChooseIntForMax<NumIoUnits, true>;
     using IoBlockIndexType = ChooseIntForMax<MaxIoBlocks, true>;
+    using IoCandidateIndexType = ChooseIntForMax<2 * MaxIoBlocks, false>;
     
     static int const NumBuffers = NumCacheEntries + (Writable ? TheBlockAccess::MaxBufferLocks : 0);
     using BufferIndexType = ChooseIntForMax<NumBuffers, true>;
@@ -99,18 +102,58 @@ private:
     using NumRefsType = uint8_t;
     static NumRefsType const MaxNumRefs = (NumRefsType)-1;
     
+    // Open-addressing hash table from block index to the assigned entry,
+    // at most half full.
+    static int const HashBits = BitsInInt<2 * NumCacheEntries - 1>::Value;
+    static int const HashTableSize = PowerOfTwo<int, HashBits>::Value;
+    
+    // Classes of entries with regard to allocation. Entries which are
+    // neither free nor being released nor evictable are not in any list.
+    // The evictable classes are in order of eviction preference, and
+    // each list is ordered from the least recently used entry.
+    enum EvictClass : uint8_t {
+        EVICT_FREE,
+        EVICT_RELEASING,
+        EVICT_CLEAN,
+        EVICT_DIRTY,
+        EVICT_WEAK_CLEAN,
+        EVICT_WEAK_DIRTY,
+        NumEvictClasses,
+        EVICT_NONE = NumEvictClasses
+    };
+    
 public:
     using BlockIndexType = typename TheBlockAccess::BlockIndexType;
     static size_t const BlockSize = TheBlockAccess::BlockSize;
     
+    // Counters for benchmarking. A block request is a hit if the block was
+    // already assigned to a cache entry (possibly still being read).
+    struct Stats {
+        uint32_t hits;
+        uint32_t misses;
+        uint32_t read_ops;
+        uint32_t read_blocks;
+        uint32_t write_ops;
+        uint32_t write_blocks;
+    };
+    
     static void init (Context c)
     {
         auto *o = Object::self(c);
         
+        o->stats = Stats{};
         o->io_queue.init();
         o->io_queue_event.init(c, APRINTER_CB_STATFUNC_T(&BlockCache::io_queue_event_handler));
         writable_init(c);
         
+        for (auto &slot : o->hash_table) {
+            slot = -1;
+        }
+        
+        for (auto &list : o->evict_lists) {
+            list.init();
+        }
+        
         for (CacheEntry &entry : o->cache_entries) {
             entry.init(c);
         }
@@ -140,60 +183,52 @@ public:
         o->io_queue_event.deinit(c);
     }
     
-    static BlockIndexType hintBlocks (Context c, BlockIndexType protect_block, BlockIndexType start_block, BlockIndexType end_block, BlockIndexType write_stride, uint8_t write_count)
+    static Stats getStats (Context c)
     {
         auto *o = Object::self(c);
         TheDebugObject::access(c);
-        AMBRO_ASSERT(protect_block <= start_block)
-        AMBRO_ASSERT(start_block <= end_block)
-        
-        // Create two lists, of:
-        // 1) Block indices in the given range which are already in the cache.
-        // 2) Indices of cache entries which we may use to assign the blocks.
         
-        BlockIndexType cached_blocks[NumCacheEntries];
-        CacheEntryIndexType num_cached_blocks = 0;
+        return o->stats;
+    }
+    
+    static void resetStats (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
         
-        CacheEntryIndexType free_entries[NumCacheEntries];
-        CacheEntryIndexType num_free_entries = 0;
+        o->stats = Stats{};
+    }
+    
+    // Returns the data of a block if it is in the cache and has been read, or null
+    // otherwise, without referencing the block or starting any I/O. The data may
+    // only be looked at before returning to the event loop.
+    static char const * peekBlock (Context c, BlockIndexType block)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
         
-        for (auto i : LoopRange<CacheEntryIndexType>(NumCacheEntries)) {
-            CacheEntry *e = &o->cache_entries[i];
-            if (e->isAssigned(c)) {
-                BlockIndexType block = e->getBlock(c);
-                if (block >= protect_block && block < end_block) {
-                    if (block >= start_block) {
-                        cached_blocks[num_cached_blocks++] = block;
-                    }
-                    // This entry is assigned with a block in the while protected range,
-                    // so prevent it from being reassigned now to another hinted block.
-                    continue;
-                }
-            }
-            if (!e->isBeingReleased(c) && !e->isReferencedIncludingWeak(c) && (!e->isAssigned(c) || e->canReassign(c))) {
-                free_entries[num_free_entries++] = i;
-            }
+        CacheEntryIndexType entry_index = hash_find(c, block);
+        if (entry_index == -1 || !o->cache_entries[entry_index].isInitialized(c)) {
+            return nullptr;
         }
-        
-        // Assign blocks based on information in these lists.
+        return o->cache_entries[entry_index].getDataForReading(c);
+    }
+    
+    static BlockIndexType hintBlocks (Context c, BlockIndexType protect_block, BlockIndexType start_block, BlockIndexType end_block, BlockIndexType write_stride, uint8_t write_count)
+    {
+        TheDebugObject::access(c);
+        AMBRO_ASSERT(protect_block <= start_block)
+        AMBRO_ASSERT(start_block <= end_block)
         
         BlockIndexType block = start_block;
-        while (block < end_block && num_free_entries > 0) {
-            // Skip this block if it is already in the cache.
-            bool already = false;
-            for (auto i : LoopRange<CacheEntryIndexType>(num_cached_blocks)) {
-                if (cached_blocks[i] == block) {
-                    already = true;
-                    break;
-                }
+        while (block < end_block) {
+            CacheEntry *free_entry = find_entry_for_hint(c, protect_block, end_block);
+            if (!free_entry) {
+                break;
             }
             
-            if (!already) {
-                // Pop a free entry from the list.
-                CacheEntryIndexType free_entry_index = free_entries[--num_free_entries];
-                CacheEntry *free_entry = &o->cache_entries[free_entry_index];
-                
-                // Assign this block to this entry.
+            // Assign this block to this entry, unless the block is already in the cache.
+            if (hash_find(c, block) == -1) {
                 free_entry->assignBlockAndAttachUser(c, block, write_stride, write_count, false, nullptr);
             }
             
@@ -503,6 +538,15 @@ public:
         
         void attach_to_entry (Context c, CacheEntryIndexType entry_index, BlockIndexType block, BlockIndexType write_stride, uint8_t write_count)
         {
+            auto *o = Object::self(c);
+            
+            CacheEntry *entry = &o->cache_entries[entry_index];
+            if (entry->isAssigned(c) && entry->getBlock(c) == block) {
+                o->stats.hits++;
+            } else {
+                o->stats.misses++;
+            }
+            
             m_entry_index = entry_index;
             get_entry(c)->assignBlockAndAttachUser(c, block, write_stride, write_count, get_no_need_to_read(), this);
             if (!get_entry(c)->isInitialized(c)) {
@@ -680,60 +724,133 @@ private:
     {
         auto *o = Object::self(c);
         
-        CacheEntryIndexType free_entry = -1;
-        CacheEntryIndexType evictable_entry = -1;
-        CacheEntryIndexType releasing_entry = -1;
+        CacheEntryIndexType found_entry = hash_find(c, block);
+        if (found_entry != -1) {
+            return o->cache_entries[found_entry].isBeingReleased(c) ? -1 : found_entry;
+        }
         
-        for (auto entry_index : LoopRange<CacheEntryIndexType>(NumCacheEntries)) {
-            CacheEntry *ce = &o->cache_entries[entry_index];
-            
-            if (ce->isAssigned(c) && ce->getBlock(c) == block) {
-                return ce->isBeingReleased(c) ? -1 : entry_index;
-            }
-            
-            if (!ce->isBeingReleased(c)) {
-                if (!ce->isAssigned(c)) {
-                    free_entry = entry_index;
-                }
-                else if (!Writable ? ce->canReassign(c) : (ce->isAssigned(c) && !ce->isReferenced(c))) {
-                    if (evictable_entry == -1 || eviction_lesser_than(c, ce, &o->cache_entries[evictable_entry])) {
-                        evictable_entry = entry_index;
-                    }
-                }
-            } else {
-                releasing_entry = entry_index;
-            }
+        CacheEntry *fe = o->evict_lists[EVICT_FREE].first();
+        if (fe) {
+            return fe->get_entry_index(c);
         }
         
-        if (free_entry != -1) {
-            return free_entry;
+        // The least recently used entry of the most preferred nonempty class.
+        CacheEntry *ee = nullptr;
+        for (int evict_class = EVICT_CLEAN; evict_class < NumEvictClasses; evict_class++) {
+            ee = o->evict_lists[evict_class].first();
+            if (ee) {
+                break;
+            }
         }
         
-        if (evictable_entry != -1) {
-            CacheEntry *ee = &o->cache_entries[evictable_entry];
-            
+        CacheEntry *re = o->evict_lists[EVICT_RELEASING].first();
+        
+        if (ee) {
             if (!Writable) {
                 AMBRO_ASSERT(ee->canReassign(c))
-                return evictable_entry;
+                return ee->get_entry_index(c);
             }
             
-            if (ee->canReassign(c) && (releasing_entry == -1 || !eviction_lesser_than(c, &o->cache_entries[releasing_entry], ee))) {
-                return evictable_entry;
+            if (ee->canReassign(c) && (!re || !eviction_lesser_than(c, re, ee))) {
+                return ee->get_entry_index(c);
             }
             
-            if (releasing_entry == -1) {
+            if (!re) {
                 ee->startRelease(c);
-                releasing_entry = evictable_entry;
+                re = ee;
             }
         }
         
-        if (Writable && releasing_entry != -1) {
+        if (Writable && re) {
             return -1;
         }
         
         return -2;
     }
     
+    // Finds an entry which hintBlocks may assign a block to: one which is free,
+    // or unreferenced (also weakly) and reassignable and not assigned to a block
+    // in the protected range.
+    static CacheEntry * find_entry_for_hint (Context c, BlockIndexType protect_block, BlockIndexType end_block)
+    {
+        auto *o = Object::self(c);
+        
+        CacheEntry *fe = o->evict_lists[EVICT_FREE].first();
+        if (fe) {
+            return fe;
+        }
+        
+        auto *list = &o->evict_lists[EVICT_CLEAN];
+        for (CacheEntry *ce = list->first(); ce; ce = list->next(ce)) {
+            BlockIndexType block = ce->getBlock(c);
+            if (ce->canReassign(c) && !(block >= protect_block && block < end_block)) {
+                return ce;
+            }
+        }
+        
+        return nullptr;
+    }
+    
+    static size_t hash_block (BlockIndexType block)
+    {
+        uint32_t key = (uint32_t)(block ^ (block >> 16 >> 16));
+        return (uint32_t)(key * UINT32_C(2654435761)) >> (32 - HashBits);
+    }
+    
+    static CacheEntryIndexType hash_find (Context c, BlockIndexType block)
+    {
+        auto *o = Object::self(c);
+        
+        for (size_t slot = hash_block(block);; slot = (slot + 1) % HashTableSize) {
+            CacheEntryIndexType entry_index = o->hash_table[slot];
+            if (entry_index == -1 || o->cache_entries[entry_index].m_block == block) {
+                return entry_index;
+            }
+        }
+    }
+    
+    static void hash_insert (Context c, CacheEntry *ce)
+    {
+        auto *o = Object::self(c);
+        
+        size_t slot = hash_block(ce->m_block);
+        while (o->hash_table[slot] != -1) {
+            AMBRO_ASSERT(o->cache_entries[o->hash_table[slot]].m_block != ce->m_block)
+            slot = (slot + 1) % HashTableSize;
+        }
+        o->hash_table[slot] = ce->get_entry_index(c);
+    }
+    
+    static void hash_remove (Context c, CacheEntry *ce)
+    {
+        auto *o = Object::self(c);
+        
+        CacheEntryIndexType entry_index = ce->get_entry_index(c);
+        
+        size_t slot = hash_block(ce->m_block);
+        while (o->hash_table[slot] != entry_index) {
+            AMBRO_ASSERT(o->hash_table[slot] != -1)
+            slot = (slot + 1) % HashTableSize;
+        }
+        
+        // Backward-shift deletion: move up any following entries which
+        // would otherwise become unreachable from their home slot.
+        size_t hole = slot;
+        while (true) {
+            slot = (slot + 1) % HashTableSize;
+            CacheEntryIndexType other_index = o->hash_table[slot];
+            if (other_index == -1) {
+                break;
+            }
+            size_t home = hash_block(o->cache_entries[other_index].m_block);
+            if ((slot - home) % HashTableSize >= (slot - hole) % HashTableSize) {
+                o->hash_table[hole] = other_index;
+                hole = slot;
+            }
+        }
+        o->hash_table[hole] = -1;
+    }
+    
     /**
      * Determines if eviction of e1 is preferred to eviction of e2.
      * 
@@ -788,10 +905,14 @@ private:
         auto *o = Object::self(c);
         TheDebugObject::access(c);
         
-        for (CacheEntry &ce : o->cache_entries) {
-            if (ce.isBeingReleased(c) && !ce.isAssigned(c)) {
-                ce.completeRelease(c);
+        auto *list = &o->evict_lists[EVICT_RELEASING];
+        CacheEntry *ce = list->first();
+        while (ce) {
+            CacheEntry *next = list->next(ce);
+            if (!ce->isAssigned(c)) {
+                ce->completeRelease(c);
             }
+            ce = next;
         }
         
         report_allocation_event(c, false);
@@ -834,6 +955,7 @@ private:
     };
     
     class CacheEntry : private CacheEntryWritableMemebers<Writable> {
+        friend BlockCache;
         friend class IoDispatcher;
         friend class IoUnit;
         
@@ -847,6 +969,8 @@ private:
             m_state = State::INVALID;
             IoQueue::markRemoved(this);
             writable_entry_init(c);
+            m_evict_class = EVICT_NONE;
+            update_evict_class(c);
         }
         
         void deinit (Context c)
@@ -979,7 +1103,11 @@ private:
                 
                 break_weak_refs(c);
                 
+                if (isAssigned(c)) {
+                    hash_remove(c, this);
+                }
                 m_block = block;
+                hash_insert(c, this);
                 writable_assign(c, write_stride, write_count);
                 
                 if (Writable && no_need_to_read) {
@@ -997,6 +1125,8 @@ private:
                 m_cache_users_list.prepend(user);
                 m_num_hard_refs++;
             }
+            
+            update_evict_class(c);
         }
         
         enum class DetachMode {HARD_TO_WEAK, DETACH_HARD, DETACH_WEAK};
@@ -1011,6 +1141,8 @@ private:
             if (mode != DetachMode::DETACH_WEAK) {
                 m_num_hard_refs--;
             }
+            
+            update_evict_class(c);
         }
         
         void hardenWeakUser (Context c, CacheRef *user)
@@ -1020,6 +1152,7 @@ private:
             AMBRO_ASSERT(!isBeingReleased(c))
             
             m_num_hard_refs++;
+            update_evict_class(c);
         }
         
         APRINTER_FUNCTION_IF(Writable, void, markDirty (Context c))
@@ -1057,6 +1190,8 @@ private:
             break_weak_refs(c);
             
             this->m_releasing = true;
+            update_evict_class(c);
+            
             if (m_state == State::IDLE) {
                 scheduleWriting(c);
             }
@@ -1066,15 +1201,64 @@ private:
         {
             AMBRO_ASSERT(this->m_releasing)
             this->m_releasing = false;
+            update_evict_class(c);
         }
         
-    private:
         CacheEntryIndexType get_entry_index (Context c)
         {
             auto *o = Object::self(c);
             return (this - o->cache_entries);
         }
         
+    private:
+        APRINTER_FUNCTION_IF_ELSE(Writable, EvictClass, get_evict_class (Context c), {
+            if (isBeingReleased(c)) {
+                return EVICT_RELEASING;
+            }
+            if (!isAssigned(c)) {
+                return EVICT_FREE;
+            }
+            if (isReferenced(c)) {
+                return EVICT_NONE;
+            }
+            bool weak = isReferencedIncludingWeak(c);
+            bool dirty = isDirty(c);
+            return weak ? (dirty ? EVICT_WEAK_DIRTY : EVICT_WEAK_CLEAN) : (dirty ? EVICT_DIRTY : EVICT_CLEAN);
+        }, {
+            if (!isAssigned(c)) {
+                return EVICT_FREE;
+            }
+            if (!canReassign(c)) {
+                return EVICT_NONE;
+            }
+            return isReferencedIncludingWeak(c) ? EVICT_WEAK_CLEAN : EVICT_CLEAN;
+        })
+        
+        // Must be called after anything that may affect get_evict_class.
+        // An entry which changes class becomes the most recently used in
+        // the new class.
+        void update_evict_class (Context c)
+        {
+            auto *o = Object::self(c);
+            
+            EvictClass evict_class = get_evict_class(c);
+            if (evict_class != m_evict_class) {
+                if (m_evict_class != EVICT_NONE) {
+                    o->evict_lists[m_evict_class].remove(this);
+                }
+                if (evict_class != EVICT_NONE) {
+                    o->evict_lists[evict_class].append(this);
+                }
+                m_evict_class = evict_class;
+            }
+        }
+        
+        void unassign (Context c)
+        {
+            hash_remove(c, this);
+            m_state = State::INVALID;
+        }
+        
         APRINTER_FUNCTION_IF_OR_EMPTY(Writable, void, writable_entry_init (Context c))
         {
             auto *o = Object::self(c);
@@ -1162,10 +1346,15 @@ private:
             if (m_state == State::READING) {
                 APRINTER_BLOCKCACHE_MSG("c RD %" PRIu32 " e%d", (uint32_t)m_block, (int)error);
                 if (isBeingReleased(c)) {
-                    m_state = State::INVALID;
+                    unassign(c);
                     return schedule_allocations_check(c);
                 }
-                m_state = error ? State::INVALID : State::IDLE;
+                if (error) {
+                    unassign(c);
+                } else {
+                    m_state = State::IDLE;
+                }
+                update_evict_class(c);
                 raise_read_completed(c, error);
                 AMBRO_ASSERT(!error || !isReferencedIncludingWeak(c))
             }
@@ -1238,6 +1427,7 @@ private:
             this->m_last_write_failed = error;
             this->m_flush_write_failed = error;
             this->m_dirt_state = (!error && this->m_dirt_state == DirtState::WRITING) ? DirtState::CLEAN : DirtState::DIRTY;
+            update_evict_class(c);
             
             if (!error && this->m_dirt_state == DirtState::DIRTY && (!o->waiting_flush_requests.isEmpty() || this->m_releasing)) {
                 return write_event_handler(c);
@@ -1249,7 +1439,7 @@ private:
                     report_allocation_event(c, true);
                 } else {
                     AMBRO_ASSERT(this->m_dirt_state == DirtState::CLEAN)
-                    m_state = State::INVALID;
+                    unassign(c);
                     schedule_allocations_check(c);
                 }
             }
@@ -1264,12 +1454,15 @@ private:
         
         DoubleEndedList<CacheRef, &CacheRef::m_list_node, false> m_cache_users_list;
         DoubleEndedListNode<CacheEntry> m_queue_node;
+        DoubleEndedListNode<CacheEntry> m_evict_node;
         BlockIndexType m_block;
         NumRefsType m_num_hard_refs;
         State m_state;
+        EvictClass m_evict_class;
         
     public:
         using IoQueue = DoubleEndedList<CacheEntry, &CacheEntry::m_queue_node>;
+        using EvictList = DoubleEndedList<CacheEntry, &CacheEntry::m_evict_node>;
     };
     
     class IoDispatcher {
@@ -1280,7 +1473,25 @@ private:
             AMBRO_ASSERT(e->isIoActive(c))
             AMBRO_ASSERT(CacheEntry::IoQueue::isRemoved(e))
             
-            o->io_queue.append(e);
+            // Writes are kept sorted by block among the writes queued after the
+            // last queued read, so that a flush goes out in block order.
+            CacheEntry *before = nullptr;
+            if (Writable && e->m_state == CacheEntry::State::WRITING) {
+                BlockIndexType block = e->get_io_block_index();
+                for (CacheEntry *qe = o->io_queue.first(); qe; qe = o->io_queue.next(qe)) {
+                    if (qe->m_state != CacheEntry::State::WRITING) {
+                        before = nullptr;
+                    } else if (!before && qe->get_io_block_index() > block) {
+                        before = qe;
+                    }
+                }
+            }
+            
+            if (before) {
+                o->io_queue.insertBefore(e, before);
+            } else {
+                o->io_queue.append(e);
+            }
             if (!o->io_queue_event.isSet(c)) {
                 o->io_queue_event.appendNowNotAlready(c);
             }
@@ -1361,9 +1572,9 @@ private:
             m_num_blocks = 1;
             m_entry_indices[0] = (first_e - o->cache_entries);
             
-            // Try to extend the I/O operation into the blocks that follow the requested block.
+            // Try to extend the I/O operation into the blocks around the requested block.
             if (MaxIoBlocks > 1) {
-                extend_io(c, first_e, start_block);
+                start_block = extend_io(c, first_e, start_block);
             }
             
             // Build transfer descriptors.
@@ -1374,6 +1585,14 @@ private:
             
             APRINTER_BLOCKCACHE_MSG("c I%c %" PRIu32 " %d", (is_write?'W':'R'), start_block, (int)m_num_blocks);
             
+            if (is_write) {
+                o->stats.write_ops++;
+                o->stats.write_blocks += m_num_blocks;
+            } else {
+                o->stats.read_ops++;
+                o->stats.read_blocks += m_num_blocks;
+            }
+            
             // Finally start this I/O.
             m_state = is_write ? State::WRITING : State::READING;
             m_block_user.startReadOrWrite(c, is_write, start_block, m_num_blocks, TransferVector<DataWordType>{m_descriptors, m_num_blocks});
@@ -1385,7 +1604,8 @@ private:
             m_block_user.setLocker(c, APRINTER_CB_OBJFUNC_T(&IoUnit::block_user_locker<>, this));
         }
         
-        void extend_io (Context c, CacheEntry *first_e, BlockIndexType start_block)
+        // Returns the first block of the resulting I/O operation.
+        BlockIndexType extend_io (Context c, CacheEntry *first_e, BlockIndexType req_block)
         {
             auto *o = Object::self(c);
             
@@ -1393,13 +1613,17 @@ private:
             // involved entries will be a single-block write (see also extension check below).
             // The rationale is that a multi-block write may have failed due to a specific block.
             if (first_e->hasLastWriteFailed(c)) {
-                return;
+                return req_block;
             }
             
-            // Clear entry indices for the remainder of the block sequence (needed for next step).
-            for (auto i : LoopRange<IoBlockIndexType>(1, MaxIoBlocks)) {
-                m_entry_indices[i] = -1;
+            // Candidate entries for the blocks from req_block-(MaxIoBlocks-1) to
+            // req_block+(MaxIoBlocks-1), with the requested block in the middle.
+            static IoCandidateIndexType const Center = MaxIoBlocks - 1;
+            CacheEntryIndexType candidates[2 * MaxIoBlocks - 1];
+            for (auto i : LoopRange<IoCandidateIndexType>(2 * MaxIoBlocks - 1)) {
+                candidates[i] = -1;
             }
+            candidates[Center] = m_entry_indices[0];
             
             // Find candidate blocks to add to the sequence.
             for (CacheEntry &this_e : o->cache_entries) {
@@ -1410,8 +1634,17 @@ private:
                 
                 // Check if the entry has a place in the sequence.
                 BlockIndexType block_index = this_e.get_io_block_index();
-                if (!(block_index > start_block && block_index - start_block < MaxIoBlocks)) {
-                    continue;
+                IoCandidateIndexType cand_index;
+                if (block_index > req_block) {
+                    if (!(block_index - req_block < MaxIoBlocks)) {
+                        continue;
+                    }
+                    cand_index = Center + (block_index - req_block);
+                } else {
+                    if (!(block_index < req_block && req_block - block_index < MaxIoBlocks)) {
+                        continue;
+                    }
+                    cand_index = Center - (req_block - block_index);
                 }
                 
                 // See above...
@@ -1434,29 +1667,44 @@ private:
                 // The entry is a candidate, add it to the list.
                 // Unless some other entry is already in this place - but the only way this can
                 // happen if the user caused a conflict with the write strides.
-                IoBlockIndexType io_index = block_index - start_block;
-                if (m_entry_indices[io_index] == -1) {
-                    m_entry_indices[io_index] = (&this_e - o->cache_entries);
+                if (candidates[cand_index] == -1) {
+                    candidates[cand_index] = (&this_e - o->cache_entries);
                 }
             }
             
-            // Extend the chain into the candidate entries as much as possible,
-            // keeping it contiguous. Update these entries to reflect start of I/O.
-            while (m_num_blocks < MaxIoBlocks && m_entry_indices[m_num_blocks] != -1) {
-                CacheEntry *this_e = &o->cache_entries[m_entry_indices[m_num_blocks]];
+            // Extend the chain into the candidate entries as much as possible, keeping it
+            // contiguous. Going backward first means that a run of dirty blocks is written
+            // from its start, no matter which of its blocks requested the write.
+            IoCandidateIndexType first_index = Center;
+            IoCandidateIndexType end_index = Center + 1;
+            while (end_index - first_index < MaxIoBlocks && first_index > 0 && candidates[first_index - 1] != -1) {
+                first_index--;
+            }
+            while (end_index - first_index < MaxIoBlocks && candidates[end_index] != -1) {
+                end_index++;
+            }
+            
+            // Update the added entries to reflect start of I/O.
+            m_num_blocks = 0;
+            for (auto i : LoopRange<IoCandidateIndexType>(first_index, end_index)) {
+                CacheEntry *this_e = &o->cache_entries[candidates[i]];
                 
-                if (this_e->isIoActive(c)) {
-                    // It was queued, so remove it from the I/O queue.
-                    o->io_queue.remove(this_e);
-                    CacheEntry::IoQueue::markRemoved(this_e);
-                } else {
-                    // It was idle, notify it that writing has started.
-                    AMBRO_ASSERT(Writable)
-                    this_e->write_starting(c);
+                if (i != Center) {
+                    if (this_e->isIoActive(c)) {
+                        // It was queued, so remove it from the I/O queue.
+                        o->io_queue.remove(this_e);
+                        CacheEntry::IoQueue::markRemoved(this_e);
+                    } else {
+                        // It was idle, notify it that writing has started.
+                        AMBRO_ASSERT(Writable)
+                        this_e->write_starting(c);
+                    }
                 }
                 
-                m_num_blocks++;
+                m_entry_indices[m_num_blocks++] = candidates[i];
             }
+            
+            return req_block - (Center - first_index);
         }
         
         APRINTER_FUNCTION_IF(Writable, void, block_user_locker (Context c, bool lock_else_unlock))
@@ -1514,10 +1762,13 @@ public:
         TheDebugObject
     >>, public CacheWritableMembers<Writable> {
         CacheEntry cache_entries[NumCacheEntries];
+        CacheEntryIndexType hash_table[HashTableSize];
+        typename CacheEntry::EvictList evict_lists[NumEvictClasses];
         IoUnit io_units[NumIoUnits];
         typename CacheEntry::IoQueue io_queue;
         typename Context::EventLoop::QueuedEvent io_queue_event;
         DataWordType buffers[NumBuffers][BlockSizeInWords];
+        Stats stats;
     };
 };
 
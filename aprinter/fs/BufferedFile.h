@@ -26,6 +26,7 @@
 #define APRINTER_BUFFERED_FILE_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 
 #include <aprinter/meta/MinMax.h>
@@ -47,7 +48,8 @@ private:
         OPEN_ACCESS, OPEN_BASEDIR, OPEN_OPEN, OPEN_OPENWR,
         READY,
         WRITE_EVENT, WRITE_WRITE, WRITE_TRUNCATE, WRITE_FLUSH,
-        READ_EVENT, READ_READ
+        READ_EVENT, READ_READ,
+        SEEK_SEEK
     };
     
 public:
@@ -79,7 +81,9 @@ public:
         reset_internal(c);
     }
     
-    void startOpen (Context c, char const *filename, bool in_current_dir, OpenMode mode, char const *basedir=nullptr)
+    // For OPEN_WRITE, write_size_hint may give the expected final size of the file,
+    // which allows the filesystem to allocate it contiguously (0 if unknown).
+    void startOpen (Context c, char const *filename, bool in_current_dir, OpenMode mode, char const *basedir=nullptr, uint32_t write_size_hint=0)
     {
         AMBRO_ASSERT(m_state == State::IDLE)
         AMBRO_ASSERT(filename)
@@ -90,6 +94,7 @@ public:
         m_basedir = basedir;
         m_in_current_dir = in_current_dir;
         m_write_mode = (mode == OpenMode::OPEN_WRITE);
+        m_write_size_hint = write_size_hint;
         m_access_client.requestAccess(c, m_write_mode);
     }
     
@@ -122,6 +127,7 @@ public:
         AMBRO_ASSERT(m_state == State::READY)
         AMBRO_ASSERT(!m_write_mode)
         
+        m_read_ref = false;
         m_read_data = data;
         m_read_avail = avail;
         m_read_pos = 0;
@@ -129,6 +135,69 @@ public:
         m_event.prependNowNotAlready(c);
     }
     
+    // Reference-based reading, avoiding a copy into a caller buffer.
+    // The completion handler reports the number of bytes available at
+    // getReadRefPointer (0 at end of file). These stay valid, with the cached
+    // block pinned, until consumeReadRef or any other operation on the file.
+    void startReadRef (Context c)
+    {
+        AMBRO_ASSERT(m_state == State::READY)
+        AMBRO_ASSERT(!m_write_mode)
+        
+        m_read_ref = true;
+        m_state = State::READ_EVENT;
+        m_event.prependNowNotAlready(c);
+    }
+    
+    char const * getReadRefPointer (Context c)
+    {
+        AMBRO_ASSERT(m_state == State::READY)
+        AMBRO_ASSERT(!m_write_mode)
+        AMBRO_ASSERT(m_read_ref)
+        AMBRO_ASSERT(m_read_buffer_pos < m_read_buffer_length)
+        
+        return m_fs_file.getReadPointer(c) + m_read_buffer_pos;
+    }
+    
+    void consumeReadRef (Context c, size_t length)
+    {
+        AMBRO_ASSERT(m_state == State::READY)
+        AMBRO_ASSERT(!m_write_mode)
+        AMBRO_ASSERT(m_read_ref)
+        AMBRO_ASSERT(length <= m_read_buffer_length - m_read_buffer_pos)
+        
+        m_read_buffer_pos += length;
+        if (length > 0 && m_read_buffer_pos == m_read_buffer_length) {
+            m_fs_file.finishRead(c);
+        }
+    }
+    
+    // Moves the read position to the given offset, which must be a multiple
+    // of the block size and not beyond the end of the file.
+    void startSeek (Context c, uint32_t offset)
+    {
+        AMBRO_ASSERT(m_state == State::READY)
+        AMBRO_ASSERT(!m_write_mode)
+        AMBRO_ASSERT(offset % TheFs::BlockSize == 0)
+        AMBRO_ASSERT(offset <= m_fs_file.getFileSize(c))
+        
+        if (m_read_buffer_pos < m_read_buffer_length) {
+            m_fs_file.finishRead(c);
+        }
+        m_read_buffer_pos = TheFs::BlockSize;
+        m_read_buffer_length = TheFs::BlockSize;
+        
+        m_state = State::SEEK_SEEK;
+        m_fs_file.startSeek(c, offset);
+    }
+    
+    uint32_t getFileSize (Context c)
+    {
+        AMBRO_ASSERT(m_state == State::READY)
+        
+        return m_fs_file.getFileSize(c);
+    }
+    
     bool isReady (Context c)
     {
         return (m_state == State::READY);
@@ -206,6 +275,7 @@ private:
         
         if (m_write_mode) {
             m_state = State::OPEN_OPENWR;
+            m_fs_file.setSizeHint(c, m_write_size_hint);
             m_fs_file.startOpenWritable(c);
         } else {
             m_state = State::READY;
@@ -217,7 +287,7 @@ private:
     
     void fs_file_handler (Context c, bool io_error, size_t read_length)
     {
-        AMBRO_ASSERT(m_state == State::OPEN_OPENWR || m_state == State::WRITE_WRITE || m_state == State::READ_READ || m_state == State::WRITE_TRUNCATE)
+        AMBRO_ASSERT(m_state == State::OPEN_OPENWR || m_state == State::WRITE_WRITE || m_state == State::READ_READ || m_state == State::WRITE_TRUNCATE || m_state == State::SEEK_SEEK)
         AMBRO_ASSERT(m_have_file)
         
         if (io_error) {
@@ -243,6 +313,10 @@ private:
             m_read_buffer_length = read_length;
             m_event.prependNowNotAlready(c);
         }
+        else if (m_state == State::SEEK_SEEK) {
+            m_state = State::READY;
+            return m_completion_handler(c, Error::NO_ERROR, 0);
+        }
         else { // m_state == State::WRITE_TRUNCATE
             AMBRO_ASSERT(!m_have_flush)
             
@@ -311,6 +385,16 @@ private:
     
     void handle_event_read (Context c)
     {
+        if (m_read_ref) {
+            if (m_read_buffer_pos == TheFs::BlockSize) {
+                m_state = State::READ_READ;
+                m_fs_file.startRead(c);
+                return;
+            }
+            m_state = State::READY;
+            return m_completion_handler(c, Error::NO_ERROR, m_read_buffer_length - m_read_buffer_pos);
+        }
+        
         size_t to_copy = MinValue(m_read_avail, (size_t)(m_read_buffer_length - m_read_buffer_pos));
         if (to_copy > 0) {
             memcpy(m_read_data, m_fs_file.getReadPointer(c) + m_read_buffer_pos, to_copy);
@@ -344,12 +428,14 @@ private:
         typename TheFs::template FlushRequest<> m_fs_flush;
     };
     State m_state;
+    uint32_t m_write_size_hint;
     bool m_have_opener : 1;
     bool m_have_file : 1;
     bool m_have_flush : 1;
     bool m_write_mode : 1;
     bool m_in_current_dir : 1;
     bool m_write_eof : 1;
+    bool m_read_ref : 1;
     union {
         struct {
             char const *m_filename;
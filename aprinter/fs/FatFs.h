@@ -63,11 +63,17 @@ public:
     struct Object;
     static bool const FsWritable = Params::Writable;
     static bool const EnableReadHinting = Params::EnableReadHinting;
+    static bool const EnableFileExtents = (Params::NumFileExtents > 0);
+    static bool const EnableFreeBitmap = (FsWritable && Params::FreeBitmapClusters > 0);
+    static bool const EnableLookupCache = (Params::NumLookupCacheEntries > 0);
     static int const MaxFileNameSize = Params::MaxFileNameSize;
     
 private:
     static_assert(Params::NumCacheEntries >= 1, "");
     static_assert(Params::MaxFileNameSize >= 12, "");
+    static_assert(Params::NumFileExtents >= 0, "");
+    static_assert(Params::FreeBitmapClusters >= 0, "");
+    static_assert(Params::NumLookupCacheEntries >= 0, "");
     
     using TheDebugObject = DebugObject<Context, Object>;
     APRINTER_MAKE_INSTANCE(TheBlockCache, (BlockCacheArg<Context, Object, TheBlockAccess, Params::NumCacheEntries, Params::NumIoUnits, Params::MaxIoBlocks, FsWritable>))
@@ -80,6 +86,15 @@ private:
     using CacheBlockRef = typename TheBlockCache::CacheRef;
     using CacheFlushRequest = typename TheBlockCache::template FlushRequest<>;
     
+    // Read-ahead limits (in blocks). The FAT read-ahead while building the free
+    // bitmap may use half the cache. File read-ahead shares the cache with the
+    // FAT, directories and other files until the hinted blocks are read, so its
+    // window is limited to a quarter of the cache. It starts out covering one
+    // maximum-size I/O within that limit.
+    static BlockIndexType const ReadAheadMaxBlocks = MaxValue(1, Params::NumCacheEntries / 2);
+    static BlockIndexType const FileReadAheadMaxBlocks = MaxValue(1, Params::NumCacheEntries / 4);
+    static BlockIndexType const FileReadAheadMinBlocks = MinValue((BlockIndexType)Params::MaxIoBlocks, FileReadAheadMaxBlocks);
+    
     static_assert(BlockSize >= 0x47, "BlockSize not enough for EBPB");
     static_assert(BlockSize % 32 == 0, "BlockSize not a multiple of 32");
     static_assert(BlockSize >= 512, "BlockSize not enough for FS Information Sector");
@@ -91,6 +106,13 @@ private:
     using ClusterBlockIndexType = uint16_t;
     using DirEntriesPerBlockType = ChooseIntForMax<DirEntriesPerBlock, false>;
     using FileNameLenType = ChooseIntForMax<Params::MaxFileNameSize, false>;
+    using ExtentIndexType = ChooseIntForMax<MaxValue(1, Params::NumFileExtents), false>;
+    
+    static size_t const FreeBitmapWords = (MaxValue(1, Params::FreeBitmapClusters) + 31) / 32;
+    
+    // Names longer than this are not entered into the lookup cache.
+    static size_t const LookupCacheNameSize = MinValue(32, Params::MaxFileNameSize);
+    using LookupCacheIndexType = ChooseIntForMax<MaxValue(1, Params::NumLookupCacheEntries), false>;
     
     static size_t const EbpbStatusBitsOffset = 0x41;
     static uint8_t const StatusBitsDirty = 0x01;
@@ -111,6 +133,7 @@ private:
     enum class FsState : uint8_t {INIT, READY, FAILED};
     enum class WriteMountState : uint8_t {NOT_MOUNTED, MOUNT_META, MOUNT_FSINFO, MOUNT_FLUSH, MOUNTED, UMOUNT_FLUSH1, UMOUNT_META, UMOUNT_FLUSH2};
     enum class AllocationState : uint8_t {IDLE, CHECK_EVENT, REQUESTING_BLOCK};
+    enum class BitmapState : uint8_t {UNSUPPORTED, INVALID, BUILDING, READY};
     
     template <bool Writable> class ClusterChain;
     template <bool Writable> class DirEntryRef;
@@ -158,6 +181,7 @@ public:
         o->init_block_ref.requestBlock(c, get_abs_block_index(c, 0), 0, 1, CacheBlockRef::FLAG_NO_IMMEDIATE_COMPLETION);
         
         fs_writable_init(c);
+        lookup_cache_reset(c);
         
         TheDebugObject::init(c);
     }
@@ -176,6 +200,18 @@ public:
         TheBlockCache::deinit(c);
     }
     
+    using CacheStats = typename TheBlockCache::Stats;
+    
+    static CacheStats getCacheStats (Context c)
+    {
+        return TheBlockCache::getStats(c);
+    }
+    
+    static void resetCacheStats (Context c)
+    {
+        TheBlockCache::resetStats(c);
+    }
+    
     static FsEntry getRootEntry (Context c)
     {
         auto *o = Object::self(c);
@@ -251,7 +287,7 @@ public:
     };
     
     class Opener {
-        enum class State : uint8_t {NO_NAMES, REQUESTING_ENTRY, COMPLETED};
+        enum class State : uint8_t {NO_NAMES, CACHE_HIT, REQUESTING_ENTRY, COMPLETED};
         
     public:
         enum class OpenerStatus : uint8_t {SUCCESS, NOT_FOUND, ERROR};
@@ -271,25 +307,30 @@ public:
             
             m_path_comp = path;
             find_name_component_length();
+            m_dir_cluster = dir_entry.cluster_index;
             
             if (m_path_comp_len == 0) {
                 m_state = State::NO_NAMES;
-                m_no_names_event.init(c, APRINTER_CB_OBJFUNC_T(&Opener::no_names_event_handler, this));
-                m_no_names_event.prependNowNotAlready(c);
-                m_no_names_entry = dir_entry;
+                m_event_entry = dir_entry;
+            } else if (lookup_cache_find(c, m_dir_cluster, m_path_comp, m_path_comp_len, &m_event_entry)) {
+                m_state = State::CACHE_HIT;
             } else {
                 m_state = State::REQUESTING_ENTRY;
-                m_dir_iter.init(c, dir_entry.cluster_index, APRINTER_CB_OBJFUNC_T(&Opener::dir_iter_handler, this));
+                m_dir_iter.init(c, m_dir_cluster, APRINTER_CB_OBJFUNC_T(&Opener::dir_iter_handler, this));
                 m_dir_iter.requestEntry(c);
+                return;
             }
+            
+            m_event.init(c, APRINTER_CB_OBJFUNC_T(&Opener::event_handler, this));
+            m_event.prependNowNotAlready(c);
         }
         
         void deinit (Context c)
         {
             TheDebugObject::access(c);
             
-            if (m_state == State::NO_NAMES) {
-                m_no_names_event.deinit(c);
+            if (m_state == State::NO_NAMES || m_state == State::CACHE_HIT) {
+                m_event.deinit(c);
             }
             else if (m_state == State::REQUESTING_ENTRY) {
                 m_dir_iter.deinit(c);
@@ -313,16 +354,22 @@ public:
             return skipped_slashes;
         }
         
-        void no_names_event_handler (Context c)
+        void event_handler (Context c)
         {
             TheDebugObject::access(c);
-            AMBRO_ASSERT(m_state == State::NO_NAMES)
+            AMBRO_ASSERT(m_state == State::NO_NAMES || m_state == State::CACHE_HIT)
+            
+            FsEntry entry = m_event_entry;
+            m_event.deinit(c);
+            
+            if (m_state == State::CACHE_HIT) {
+                return entry_found(c, entry);
+            }
             
             m_state = State::COMPLETED;
-            m_no_names_event.deinit(c);
             
-            if (m_no_names_entry.type == m_entry_type) {
-                return m_handler(c, OpenerStatus::SUCCESS, m_no_names_entry);
+            if (entry.type == m_entry_type) {
+                return m_handler(c, OpenerStatus::SUCCESS, entry);
             } else {
                 return m_handler(c, OpenerStatus::NOT_FOUND, FsEntry{});
             }
@@ -347,41 +394,54 @@ public:
             
             m_dir_iter.deinit(c);
             
-            m_path_comp += m_path_comp_len;
-            bool skipped_slashes = find_name_component_length();
+            lookup_cache_insert(c, m_dir_cluster, m_path_comp, m_path_comp_len, entry);
             
-            if (m_path_comp_len > 0) {
+            return entry_found(c, entry);
+        }
+        
+        // Moves on to the next path component after the current one was found,
+        // resolving components from the lookup cache as long as possible.
+        void entry_found (Context c, FsEntry entry)
+        {
+            while (true) {
+                m_path_comp += m_path_comp_len;
+                bool skipped_slashes = find_name_component_length();
+                
+                if (m_path_comp_len == 0) {
+                    m_state = State::COMPLETED;
+                    if (entry.type == m_entry_type && !skipped_slashes) {
+                        return m_handler(c, OpenerStatus::SUCCESS, entry);
+                    } else {
+                        return m_handler(c, OpenerStatus::NOT_FOUND, FsEntry{});
+                    }
+                }
+                
                 if (entry.type != EntryType::DIR_TYPE) {
                     m_state = State::COMPLETED;
                     return m_handler(c, OpenerStatus::NOT_FOUND, FsEntry{});
                 }
-                m_dir_iter.init(c, entry.cluster_index, APRINTER_CB_OBJFUNC_T(&Opener::dir_iter_handler, this));
-                m_dir_iter.requestEntry(c);
-                return;
+                
+                m_dir_cluster = entry.cluster_index;
+                if (!lookup_cache_find(c, m_dir_cluster, m_path_comp, m_path_comp_len, &entry)) {
+                    break;
+                }
             }
             
-            m_state = State::COMPLETED;
-            if (entry.type == m_entry_type && !skipped_slashes) {
-                return m_handler(c, OpenerStatus::SUCCESS, entry);
-            } else {
-                return m_handler(c, OpenerStatus::NOT_FOUND, FsEntry{});
-            }
-        }
-        
-        static bool compare_filename_equal (char const *str1, char const *str2, size_t str2_len)
-        {
-            return Params::CaseInsens ? AsciiCaseInsensStringEqualToMem(str1, str2, str2_len) : (strlen(str1) == str2_len && !memcmp(str1, str2, str2_len));
+            m_state = State::REQUESTING_ENTRY;
+            m_dir_iter.init(c, m_dir_cluster, APRINTER_CB_OBJFUNC_T(&Opener::dir_iter_handler, this));
+            m_dir_iter.requestEntry(c);
         }
         
         EntryType m_entry_type;
         State m_state;
         char const *m_path_comp;
         size_t m_path_comp_len;
+        ClusterIndexType m_dir_cluster;
         OpenerHandler m_handler;
         union {
             struct {
-                typename Context::EventLoop::QueuedEvent m_no_names_event;
-                FsEntry m_no_names_entry;
+                typename Context::EventLoop::QueuedEvent m_event;
+                FsEntry m_event_entry;
             };
             DirectoryIterator m_dir_iter;
         };
@@ -394,10 +454,14 @@ public:
         DirEntriesPerBlockType m_dir_entry_block_offset;
         bool m_no_need_to_read_for_write;
         WriteReference<true> m_write_ref;
+        uint32_t m_size_hint;
     };
     
     APRINTER_STRUCT_IF_TEMPLATE(FileHintingMembers) {
+        uint32_t m_hint_next_file_pos;
+        BlockIndexType m_hint_next_block;
         BlockIndexType m_hint_block_pos;
+        BlockIndexType m_hint_window;
     };
     
     template <bool Writable>
@@ -409,7 +473,8 @@ public:
             READ_EVENT, READ_NEXT_CLUSTER, READ_BLOCK, READ_READY,
             OPENWR_EVENT, OPENWR_DIR_ENTRY,
             WRITE_EVENT, WRITE_NEXT_CLUSTER, WRITE_BLOCK, WRITE_READY,
-            TRUNC_EVENT, TRUNC_CHAIN
+            TRUNC_EVENT, TRUNC_CHAIN,
+            SEEK_EVENT, SEEK_CHAIN
         };
         
     public:
@@ -441,6 +506,7 @@ public:
             m_file_pos = 0;
             m_block_in_cluster = o->blocks_per_cluster;
             
+            hinting_init(c);
             writable_init(c, file_entry);
         }
         
@@ -472,6 +538,27 @@ public:
             m_block_in_cluster = o->blocks_per_cluster;
         }
         
+        // The offset must be a multiple of the block size and not beyond the end
+        // of the file. On failure, the file is left rewound.
+        void startSeek (Context c, uint32_t offset)
+        {
+            TheDebugObject::access(c);
+            AMBRO_ASSERT(m_state == State::IDLE)
+            AMBRO_ASSERT(offset % BlockSize == 0)
+            AMBRO_ASSERT(offset <= m_file_size)
+            
+            m_file_pos = offset;
+            m_state = State::SEEK_EVENT;
+            m_event.prependNowNotAlready(c);
+        }
+        
+        uint32_t getFileSize (Context c)
+        {
+            TheDebugObject::access(c);
+            
+            return m_file_size;
+        }
+        
         void startReadUserBuf (Context c, DataWordType *buf)
         {
             TheDebugObject::access(c);
@@ -523,6 +610,15 @@ public:
             m_event.prependNowNotAlready(c);
         }
         
+        // Gives the expected final size of the file when it will be written, so that
+        // the clusters appended to it can be reserved as one contiguous run.
+        APRINTER_FUNCTION_IF(Writable, void, setSizeHint (Context c, uint32_t size_hint))
+        {
+            TheDebugObject::access(c);
+            
+            this->m_size_hint = size_hint;
+        }
+        
         APRINTER_FUNCTION_IF(Writable, void, closeWritable (Context c))
         {
             TheDebugObject::access(c);
@@ -585,6 +681,7 @@ public:
             
             this->m_dir_entry_block_index = file_entry.dir_entry_block_index;
             this->m_dir_entry_block_offset = file_entry.dir_entry_block_offset;
+            this->m_size_hint = 0;
         }
         
         APRINTER_FUNCTION_IF_OR_EMPTY(Writable, void, writable_deinit (Context c))
@@ -626,20 +723,66 @@ public:
             }
         }
         
+        APRINTER_FUNCTION_IF_OR_EMPTY(EnableReadHinting, void, hinting_init (Context c))
+        {
+            this->m_hint_next_file_pos = UINT32_MAX;
+            this->m_hint_next_block = 0;
+            this->m_hint_block_pos = 0;
+            this->m_hint_window = FileReadAheadMinBlocks;
+        }
+        
         APRINTER_FUNCTION_IF_OR_EMPTY(EnableReadHinting, void, do_read_hinting (Context c, BlockIndexType abs_block_idx))
         {
             auto *o = Object::self(c);
             
-            if (m_block_in_cluster == 0 || abs_block_idx >= this->m_hint_block_pos) {
-                BlockIndexType cluster_start_block = abs_block_idx - m_block_in_cluster;
-                BlockIndexType cluster_end_block = cluster_start_block + o->blocks_per_cluster;
-                if (m_block_in_cluster == 0) {
-                    this->m_hint_block_pos = cluster_start_block + 1;
-                }
-                if (m_block_in_cluster == 0 || abs_block_idx >= this->m_hint_block_pos) {
-                    this->m_hint_block_pos = TheBlockCache::hintBlocks(c, this->m_hint_block_pos, this->m_hint_block_pos, cluster_end_block, 0, 1);
-                }
+            // A read which does not follow the previous one in the file (first read
+            // or seek) is not followed by any read-ahead, since we cannot tell
+            // whether more reads will follow it. If the next read follows this one,
+            // read-ahead starts with the smallest window.
+            uint32_t block_file_pos = m_file_pos - m_file_pos % BlockSize;
+            bool sequential = (block_file_pos == this->m_hint_next_file_pos);
+            this->m_hint_next_file_pos = block_file_pos + BlockSize;
+            if (!sequential) {
+                this->m_hint_next_block = abs_block_idx + 1;
+                this->m_hint_block_pos = this->m_hint_next_block;
+                this->m_hint_window = FileReadAheadMinBlocks;
+                return;
+            }
+            
+            // The file may have continued in a cluster which is not adjacent,
+            // in which case the blocks hinted so far are not of any use.
+            if (abs_block_idx != this->m_hint_next_block) {
+                this->m_hint_block_pos = abs_block_idx + 1;
+            }
+            this->m_hint_next_block = abs_block_idx + 1;
+            if (this->m_hint_block_pos < this->m_hint_next_block) {
+                this->m_hint_block_pos = this->m_hint_next_block;
             }
+            
+            // Hint more blocks once half of the window has been consumed, doubling
+            // the window each time while the reads stay sequential.
+            if (this->m_hint_block_pos - this->m_hint_next_block > this->m_hint_window / 2) {
+                return;
+            }
+            
+            uint32_t file_blocks_left = (m_file_size - m_file_pos - 1) / BlockSize;
+            BlockIndexType end_block = this->m_hint_next_block + MinValueU(this->m_hint_window, file_blocks_left);
+            
+            // Don't hint past the end of the current cluster, unless the FAT
+            // (if its block is in the cache) says that the next cluster is adjacent.
+            ClusterIndexType cluster = m_chain.getCurrentCluster(c);
+            BlockIndexType cluster_end_block = abs_block_idx - m_block_in_cluster + o->blocks_per_cluster;
+            while (cluster_end_block < end_block && peek_fat_entry(c, cluster) == cluster + 1) {
+                cluster++;
+                cluster_end_block += o->blocks_per_cluster;
+            }
+            end_block = MinValue(end_block, cluster_end_block);
+            end_block = MinValue(end_block, o->block_range.end_block);
+            
+            if (this->m_hint_block_pos < end_block) {
+                this->m_hint_block_pos = TheBlockCache::hintBlocks(c, this->m_hint_next_block, this->m_hint_block_pos, end_block, 0, 1);
+            }
+            this->m_hint_window = MinValue(FileReadAheadMaxBlocks, (BlockIndexType)(2 * this->m_hint_window));
         }
         
         APRINTER_FUNCTION_IF_OR_EMPTY(Writable, void, handle_event_write (Context c))
@@ -681,6 +824,38 @@ public:
             m_chain.startTruncate(c);
         }
         
+        void handle_event_seek (Context c)
+        {
+            auto *o = Object::self(c);
+            
+            if (m_file_pos == 0) {
+                m_chain.rewind(c);
+                m_block_in_cluster = o->blocks_per_cluster;
+                return complete_request(c, false);
+            }
+            // Go to the cluster containing the block before the offset, so that
+            // an offset at a cluster boundary ends up in the same state as reading
+            // up to it.
+            uint32_t cluster_size = (uint32_t)o->blocks_per_cluster * BlockSize;
+            ClusterIndexType cluster_pos = (m_file_pos - 1) / cluster_size;
+            m_block_in_cluster = (m_file_pos - cluster_pos * cluster_size) / BlockSize;
+            m_state = State::SEEK_CHAIN;
+            m_chain.requestSeek(c, cluster_pos);
+        }
+        
+        void handle_chain_seek (Context c, bool error)
+        {
+            auto *o = Object::self(c);
+            
+            if (error || m_chain.endReached(c)) {
+                m_chain.rewind(c);
+                m_file_pos = 0;
+                m_block_in_cluster = o->blocks_per_cluster;
+                return complete_request(c, true);
+            }
+            return complete_request(c, false);
+        }
+        
         APRINTER_FUNCTION_IF_OR_EMPTY(Writable, void, extra_first_cluster_update (Context c, bool first_cluster_changed))
         {
             AMBRO_ASSERT(!first_cluster_changed || this->m_write_ref.isTaken(c))
@@ -711,7 +886,7 @@ public:
                 return complete_request(c, true);
             }
             if (m_chain.endReached(c)) {
-                m_chain.requestNew(c);
+                m_chain.requestNew(c, get_clusters_wanted(c));
                 return;
             }
             m_block_in_cluster = 0;
@@ -758,8 +933,22 @@ public:
             return complete_request(c, error);
         }
         
+        // Number of clusters still needed to reach the size hint from the current position.
+        APRINTER_FUNCTION_IF(Writable, ClusterIndexType, get_clusters_wanted (Context c))
+        {
+            auto *o = Object::self(c);
+            
+            if (this->m_size_hint <= m_file_pos) {
+                return 1;
+            }
+            uint32_t remaining = this->m_size_hint - m_file_pos;
+            uint32_t cluster_size = (uint32_t)o->blocks_per_cluster * BlockSize;
+            return remaining / cluster_size + (remaining % cluster_size != 0);
+        }
+        
         APRINTER_FUNCTION_IF(Writable, void, clean_up_writability (Context c))
         {
+            m_chain.releaseReserved(c);
             this->m_write_ref.release(c);
             this->m_dir_entry.reset(c);
         }
@@ -782,6 +971,9 @@ public:
             else if (Writable && m_state == State::TRUNC_EVENT) {
                 handle_event_trunc(c);
             }
+            else if (m_state == State::SEEK_EVENT) {
+                handle_event_seek(c);
+            }
             else {
                 AMBRO_ASSERT(false);
             }
@@ -803,6 +995,9 @@ public:
             else if (Writable && m_state == State::TRUNC_CHAIN) {
                 return complete_request(c, error);
             }
+            else if (m_state == State::SEEK_CHAIN) {
+                handle_chain_seek(c, error);
+            }
             else {
                 AMBRO_ASSERT(false);
             }
@@ -1052,6 +1247,7 @@ private:
             o->write_mount_state = WriteMountState::NOT_MOUNTED;
         } else {
             o->write_mount_state = WriteMountState::MOUNTED;
+            bitmap_reset(c);
         }
         return WriteMountHandler::call(c, error);
     }
@@ -1222,6 +1418,21 @@ private:
         return mask_cluster_entry(ReadBinaryInt<uint32_t, BinaryLittleEndian>(entry_ptr));
     }
     
+    // Reads a FAT entry only if its block is already in the cache, returning
+    // FreeClusterMarker otherwise.
+    static ClusterIndexType peek_fat_entry (Context c, ClusterIndexType cluster_idx)
+    {
+        if (!is_cluster_idx_valid_for_fat(c, cluster_idx)) {
+            return FreeClusterMarker;
+        }
+        char const *block_data = TheBlockCache::peekBlock(c, get_abs_block_index_for_fat_entry(c, cluster_idx));
+        if (!block_data) {
+            return FreeClusterMarker;
+        }
+        char const *entry_ptr = block_data + ((size_t)4 * (cluster_idx % FatEntriesPerBlock));
+        return mask_cluster_entry(ReadBinaryInt<uint32_t, BinaryLittleEndian>(entry_ptr));
+    }
+    
     APRINTER_FUNCTION_IF_EXT(FsWritable, static, void, update_fat_entry_in_cache_block (Context c, CacheBlockRef *block_ref, ClusterIndexType cluster_idx, ClusterIndexType value))
     {
         AMBRO_ASSERT(is_cluster_idx_valid_for_fat(c, cluster_idx))
@@ -1249,6 +1460,7 @@ private:
         }
         update_fat_entry_in_cache_block(c, block_ref, cluster_index, FreeClusterMarker);
         update_fs_info_free_clusters(c, true);
+        bitmap_update(c, cluster_index, true);
         return true;
     }
     
@@ -1352,6 +1564,7 @@ private:
             o->alloc_state = AllocationState::IDLE;
             o->alloc_event.unset(c);
             o->write_block_ref.reset(c);
+            bitmap_drop_candidate(c);
         }
     }
     
@@ -1369,6 +1582,8 @@ private:
         AMBRO_ASSERT(o->alloc_state != AllocationState::IDLE)
         AMBRO_ASSERT(!o->allocating_chains_list.isEmpty())
         
+        bitmap_drop_candidate(c);
+        
         ClusterChain<true> *complete_request = nullptr;
         bool have_more_requests = false;
         for (ClusterChain<true> *chain = o->allocating_chains_list.first(); chain; chain = o->allocating_chains_list.next(chain)) {
@@ -1396,6 +1611,10 @@ private:
         AMBRO_ASSERT(o->alloc_state == AllocationState::CHECK_EVENT)
         AMBRO_ASSERT(o->write_mount_state == WriteMountState::MOUNTED)
         
+        if (bitmap_in_use(c)) {
+            return bitmap_alloc_event(c);
+        }
+        
         while (true) {
             ClusterIndexType current_cluster = 2 + o->alloc_position;
             
@@ -1423,6 +1642,211 @@ private:
         }
     }
     
+    // The free-cluster bitmap has a bit set for each cluster which is believed
+    // to be free. It is built on the first allocation after mounting by reading
+    // the whole FAT, and then kept up to date by allocations and releases.
+    // The FAT entry is still checked before a cluster is taken.
+    APRINTER_FUNCTION_IF_OR_EMPTY_EXT(EnableFreeBitmap, static, void, bitmap_reset (Context c))
+    {
+        auto *o = Object::self(c);
+        bool supported = (o->num_valid_clusters <= Params::FreeBitmapClusters);
+        o->bitmap_state = supported ? BitmapState::INVALID : BitmapState::UNSUPPORTED;
+        o->alloc_candidate = 0;
+    }
+    
+    APRINTER_FUNCTION_IF_ELSE_EXT(EnableFreeBitmap, static, bool, bitmap_in_use (Context c), {
+        return Object::self(c)->bitmap_state != BitmapState::UNSUPPORTED;
+    }, {
+        return false;
+    })
+    
+    APRINTER_FUNCTION_IF_EXT(EnableFreeBitmap, static, bool, bitmap_is_free (Context c, ClusterIndexType pos))
+    {
+        auto *o = Object::self(c);
+        AMBRO_ASSERT(pos < o->num_valid_clusters)
+        
+        return (o->free_bitmap[pos / 32] >> (pos % 32)) & 1;
+    }
+    
+    APRINTER_FUNCTION_IF_EXT(EnableFreeBitmap, static, void, bitmap_set (Context c, ClusterIndexType pos, bool is_free))
+    {
+        auto *o = Object::self(c);
+        AMBRO_ASSERT(pos < o->num_valid_clusters)
+        
+        uint32_t mask = (uint32_t)1 << (pos % 32);
+        if (is_free) {
+            o->free_bitmap[pos / 32] |= mask;
+        } else {
+            o->free_bitmap[pos / 32] &= ~mask;
+        }
+    }
+    
+    APRINTER_FUNCTION_IF_OR_EMPTY_EXT(EnableFreeBitmap, static, void, bitmap_update (Context c, ClusterIndexType cluster_index, bool is_free))
+    {
+        auto *o = Object::self(c);
+        if ((o->bitmap_state == BitmapState::BUILDING || o->bitmap_state == BitmapState::READY) && is_cluster_idx_valid_for_data(c, cluster_index)) {
+            bitmap_set(c, cluster_index - 2, is_free);
+        }
+    }
+    
+    APRINTER_FUNCTION_IF_OR_EMPTY_EXT(EnableFreeBitmap, static, void, bitmap_drop_candidate (Context c))
+    {
+        auto *o = Object::self(c);
+        if (o->alloc_candidate != 0) {
+            bitmap_update(c, o->alloc_candidate, true);
+            o->alloc_candidate = 0;
+        }
+    }
+    
+    // Finds the first run of at least 'wanted' free clusters starting at the allocation
+    // position, or the longest run if there is none so long. Returns false if there
+    // are no free clusters.
+    APRINTER_FUNCTION_IF_EXT(EnableFreeBitmap, static, bool, bitmap_find_run (Context c, ClusterIndexType wanted, ClusterIndexType *out_start, ClusterIndexType *out_length))
+    {
+        auto *o = Object::self(c);
+        ClusterIndexType num_clusters = o->num_valid_clusters;
+        
+        ClusterIndexType best_start = 0;
+        ClusterIndexType best_length = 0;
+        ClusterIndexType run_length = 0;
+        ClusterIndexType pos = o->alloc_position;
+        ClusterIndexType left = num_clusters;
+        
+        while (left > 0) {
+            // Runs do not wrap around the end.
+            if (pos == 0) {
+                run_length = 0;
+            }
+            
+            // Skip whole words of allocated clusters.
+            if (run_length == 0 && pos % 32 == 0 && left >= 32 && num_clusters - pos >= 32 && o->free_bitmap[pos / 32] == 0) {
+                left -= 32;
+                pos = (num_clusters - pos == 32) ? 0 : (pos + 32);
+                continue;
+            }
+            
+            if (bitmap_is_free(c, pos)) {
+                run_length++;
+                if (run_length > best_length) {
+                    best_start = pos + 1 - run_length;
+                    best_length = run_length;
+                    if (best_length >= wanted) {
+                        break;
+                    }
+                }
+            } else {
+                run_length = 0;
+            }
+            
+            left--;
+            pos = (pos + 1 == num_clusters) ? 0 : (pos + 1);
+        }
+        
+        *out_start = best_start;
+        *out_length = best_length;
+        return best_length > 0;
+    }
+    
+    // Keeps the FAT blocks ahead of the bitmap build position being read into the cache.
+    APRINTER_FUNCTION_IF_EXT(EnableFreeBitmap, static, void, bitmap_build_hint (Context c, ClusterIndexType cluster_idx))
+    {
+        auto *o = Object::self(c);
+        
+        BlockIndexType block = get_abs_block_index_for_fat_entry(c, cluster_idx);
+        BlockIndexType end_block = get_abs_block_index_for_fat_entry(c, 2 + (o->num_valid_clusters - 1)) + 1;
+        if (o->bitmap_hint_block <= block) {
+            o->bitmap_hint_block = block + 1;
+        }
+        if (o->bitmap_hint_block - block > ReadAheadMaxBlocks / 2) {
+            return;
+        }
+        end_block = MinValue(end_block, (BlockIndexType)(block + 1 + ReadAheadMaxBlocks));
+        if (o->bitmap_hint_block < end_block) {
+            BlockIndexType num_blocks_per_fat = o->num_fat_entries / FatEntriesPerBlock;
+            o->bitmap_hint_block = TheBlockCache::hintBlocks(c, block, o->bitmap_hint_block, end_block, num_blocks_per_fat, o->num_fats);
+        }
+    }
+    
+    APRINTER_FUNCTION_IF_OR_EMPTY_EXT(EnableFreeBitmap, static, void, bitmap_alloc_event (Context c))
+    {
+        auto *o = Object::self(c);
+        AMBRO_ASSERT(o->bitmap_state != BitmapState::UNSUPPORTED)
+        
+        if (o->bitmap_state == BitmapState::INVALID) {
+            o->bitmap_state = BitmapState::BUILDING;
+            o->bitmap_build_pos = 0;
+            o->bitmap_hint_block = 0;
+        }
+        
+        // Build the bitmap one FAT block at a time.
+        while (o->bitmap_state == BitmapState::BUILDING) {
+            if (o->bitmap_build_pos == o->num_valid_clusters) {
+                o->bitmap_state = BitmapState::READY;
+                break;
+            }
+            
+            ClusterIndexType first_cluster = 2 + o->bitmap_build_pos;
+            bool available = request_fat_cache_block(c, &o->write_block_ref, first_cluster, false);
+            bitmap_build_hint(c, first_cluster);
+            if (!available) {
+                o->alloc_state = AllocationState::REQUESTING_BLOCK;
+                return;
+            }
+            
+            ClusterIndexType block_end = o->bitmap_build_pos + (FatEntriesPerBlock - first_cluster % FatEntriesPerBlock);
+            ClusterIndexType end = MinValue(block_end, o->num_valid_clusters);
+            for (ClusterIndexType pos = o->bitmap_build_pos; pos < end; pos++) {
+                bool is_free = (read_fat_entry_in_cache_block(c, &o->write_block_ref, 2 + pos) == FreeClusterMarker);
+                bitmap_set(c, pos, is_free);
+            }
+            o->bitmap_build_pos = end;
+        }
+        
+        ClusterChain<true> *chain = o->allocating_chains_list.first();
+        AMBRO_ASSERT(chain)
+        
+        while (true) {
+            // Choose a cluster: the next one reserved for the chain, or the start of a
+            // newly reserved run if the chain is expected to need more clusters.
+            if (o->alloc_candidate == 0) {
+                if (chain->m_reserve_count == 0) {
+                    ClusterIndexType run_start;
+                    ClusterIndexType run_length;
+                    if (!bitmap_find_run(c, chain->m_reserve_wanted, &run_start, &run_length)) {
+                        return complete_allocation(c, true);
+                    }
+                    run_length = MinValue(run_length, chain->m_reserve_wanted);
+                    for (ClusterIndexType i = 0; i < run_length; i++) {
+                        bitmap_set(c, run_start + i, false);
+                    }
+                    chain->m_reserve_next = 2 + run_start;
+                    chain->m_reserve_count = run_length;
+                    o->alloc_position = (run_start + run_length == o->num_valid_clusters) ? 0 : (run_start + run_length);
+                }
+                o->alloc_candidate = chain->m_reserve_next;
+                chain->m_reserve_next++;
+                chain->m_reserve_count--;
+            }
+            
+            ClusterIndexType current_cluster = o->alloc_candidate;
+            if (!request_fat_cache_block(c, &o->write_block_ref, current_cluster, false)) {
+                o->alloc_state = AllocationState::REQUESTING_BLOCK;
+                return;
+            }
+            o->alloc_candidate = 0;
+            
+            // The bitmap may be out of date if the FAT was modified elsewhere; such a
+            // cluster is just skipped, since its bit has already been cleared.
+            ClusterIndexType fat_value = read_fat_entry_in_cache_block(c, &o->write_block_ref, current_cluster);
+            if (fat_value == FreeClusterMarker) {
+                update_fat_entry_in_cache_block(c, &o->write_block_ref, current_cluster, EndOfChainMarker);
+                update_fs_info_free_clusters(c, false);
+                update_fs_info_allocated_cluster(c);
+                return complete_allocation(c, false, current_cluster);
+            }
+        }
+    }
+    
     APRINTER_FUNCTION_IF_EXT(FsWritable, static, void, alloc_block_ref_handler (Context c, bool error))
     {
         auto *o = Object::self(c);
@@ -1441,16 +1865,123 @@ private:
         entry->dir_entry_block_offset = dir_entry_block_offset;
     }
     
+    // The lookup cache remembers recently resolved directory entries by the
+    // first cluster of the containing directory and the name used to look them up,
+    // so that the Opener can skip scanning directories on repeated opens.
+    // Entries are replaced round-robin and dropped when their directory entry
+    // is written through a DirEntryRef.
+    APRINTER_FUNCTION_IF_OR_EMPTY_EXT(EnableLookupCache, static, void, lookup_cache_reset (Context c))
+    {
+        auto *o = Object::self(c);
+        for (auto &ce : o->lookup_cache) {
+            ce.name_len = 0;
+        }
+        o->lookup_cache_next = 0;
+    }
+    
+    static bool compare_filename_equal (char const *str1, char const *str2, size_t str2_len)
+    {
+        return Params::CaseInsens ? AsciiCaseInsensStringEqualToMem(str1, str2, str2_len) : (strlen(str1) == str2_len && !memcmp(str1, str2, str2_len));
+    }
+    
+    static uint32_t lookup_cache_hash (char const *name, size_t name_len)
+    {
+        uint32_t hash = UINT32_C(2166136261);
+        for (auto i : LoopRange<size_t>(name_len)) {
+            char ch = Params::CaseInsens ? AsciiToLower(name[i]) : name[i];
+            hash = (hash ^ (uint8_t)ch) * UINT32_C(16777619);
+        }
+        return hash;
+    }
+    
+    APRINTER_FUNCTION_IF_ELSE_EXT(EnableLookupCache, static, bool, lookup_cache_find (Context c, ClusterIndexType dir_cluster, char const *name, size_t name_len, FsEntry *out_entry), {
+        auto *o = Object::self(c);
+        
+        if (name_len > LookupCacheNameSize) {
+            return false;
+        }
+        
+        uint32_t hash = lookup_cache_hash(name, name_len);
+        for (auto const &ce : o->lookup_cache) {
+            if (ce.name_len == name_len && ce.name_hash == hash && ce.dir_cluster == dir_cluster &&
+                compare_filename_equal(ce.name, name, name_len))
+            {
+                *out_entry = ce.entry;
+                return true;
+            }
+        }
+        return false;
+    }, {
+        return false;
+    })
+    
+    APRINTER_FUNCTION_IF_OR_EMPTY_EXT(EnableLookupCache, static, void, lookup_cache_insert (Context c, ClusterIndexType dir_cluster, char const *name, size_t name_len, FsEntry entry))
+    {
+        auto *o = Object::self(c);
+        
+        if (name_len == 0 || name_len > LookupCacheNameSize) {
+            return;
+        }
+        
+        auto &ce = o->lookup_cache[o->lookup_cache_next];
+        ce.entry = entry;
+        ce.dir_cluster = dir_cluster;
+        ce.name_hash = lookup_cache_hash(name, name_len);
+        ce.name_len = name_len;
+        memcpy(ce.name, name, name_len);
+        ce.name[name_len] = '\0';
+        
+        o->lookup_cache_next = (o->lookup_cache_next == Params::NumLookupCacheEntries - 1) ? 0 : (o->lookup_cache_next + 1);
+    }
+    
+    APRINTER_FUNCTION_IF_OR_EMPTY_EXT(FsWritable && EnableLookupCache, static, void, lookup_cache_invalidate (Context c, BlockIndexType dir_entry_block_index, DirEntriesPerBlockType dir_entry_block_offset))
+    {
+        auto *o = Object::self(c);
+        for (auto &ce : o->lookup_cache) {
+            if (ce.name_len != 0 && ce.entry.dir_entry_block_index == dir_entry_block_index &&
+                ce.entry.dir_entry_block_offset == dir_entry_block_offset)
+            {
+                ce.name_len = 0;
+            }
+        }
+    }
+    
     APRINTER_STRUCT_IF_TEMPLATE(ClusterChainExtraMembers) {
         CacheBlockRef m_fat_cache_ref2;
         DoubleEndedListNode<ClusterChain<true>> m_allocating_chains_node;
         ClusterIndexType m_prev_cluster;
     };
     
+    // Clusters reserved for a chain which is being extended: a contiguous run of
+    // m_reserve_count clusters starting at m_reserve_next, taken out of the free
+    // bitmap but not yet allocated in the FAT. m_reserve_wanted is how many clusters
+    // the chain expects to need, including the one being requested.
+    APRINTER_STRUCT_IF_TEMPLATE(ClusterChainReserveMembers) {
+        ClusterIndexType m_reserve_next;
+        ClusterIndexType m_reserve_count;
+        ClusterIndexType m_reserve_wanted;
+    };
+    
+    // Runs of adjacent clusters seen while following a cluster chain, in chain
+    // order. Extent i starts at chain position m_extent_pos[i] with cluster
+    // m_extent_cluster[i], and the extents cover the first m_known_length
+    // positions of the chain.
+    APRINTER_STRUCT_IF_TEMPLATE(ClusterChainExtentMembers) {
+        ClusterIndexType m_extent_cluster[Params::NumFileExtents];
+        ClusterIndexType m_extent_pos[Params::NumFileExtents];
+        ClusterIndexType m_known_length;
+        ClusterIndexType m_current_pos;
+        ExtentIndexType m_num_extents;
+        ExtentIndexType m_current_extent;
+    };
+    
     template <bool Writable>
-    class ClusterChain : public ClusterChainExtraMembers<Writable> {
+    class ClusterChain : public ClusterChainExtraMembers<Writable>, public ClusterChainExtentMembers<EnableFileExtents>,
+                         public ClusterChainReserveMembers<(Writable && EnableFreeBitmap)> {
         static_assert(!Writable || FsWritable, "");
         
+        static bool const ReserveClusters = (Writable && EnableFreeBitmap);
+        
         enum class State : uint8_t {
             IDLE,
             NEXT_CHECK, NEXT_REQUESTING_FAT,
@@ -1472,6 +2003,8 @@ private:
             m_first_cluster = first_cluster;
             
             extra_init(c);
+            extents_reset(c);
+            reserve_init(c);
             
             rewind_internal(c);
         }
@@ -1494,6 +2027,19 @@ private:
         {
             AMBRO_ASSERT(m_state == State::IDLE)
             
+            m_advance_count = 1;
+            m_state = State::NEXT_CHECK;
+            m_event.prependNowNotAlready(c);
+        }
+        
+        // Moves to the cluster at the given position in the chain, with the same
+        // result as rewind followed by cluster_pos+1 calls of requestNext.
+        void requestSeek (Context c, ClusterIndexType cluster_pos)
+        {
+            AMBRO_ASSERT(m_state == State::IDLE)
+            
+            rewind_internal(c);
+            m_advance_count = cluster_pos + 1;
             m_state = State::NEXT_CHECK;
             m_event.prependNowNotAlready(c);
         }
@@ -1513,13 +2059,16 @@ private:
             return m_current_cluster;
         }
         
-        APRINTER_FUNCTION_IF(Writable, void, requestNew (Context c))
+        // wanted_clusters is the number of clusters the chain is expected to need
+        // (including this one), for reserving a contiguous run if possible.
+        APRINTER_FUNCTION_IF(Writable, void, requestNew (Context c, ClusterIndexType wanted_clusters=1))
         {
             auto *o = Object::self(c);
             AMBRO_ASSERT(o->write_mount_state == WriteMountState::MOUNTED)
             AMBRO_ASSERT(m_state == State::IDLE)
             AMBRO_ASSERT(m_iter_state == IterState::END)
             
+            reserve_set_wanted(c, wanted_clusters);
             m_state = State::NEW_CHECK;
             m_event.prependNowNotAlready(c);
         }
@@ -1535,11 +2084,33 @@ private:
         {
             AMBRO_ASSERT(m_state == State::IDLE)
             
+            extents_reset(c);
+            releaseReserved(c);
             m_state = State::TRUNCATE_CHECK;
             m_event.prependNowNotAlready(c);
         }
         
+        // Returns any reserved clusters which have not been used to the free bitmap.
+        APRINTER_FUNCTION_IF_OR_EMPTY(ReserveClusters, void, releaseReserved (Context c))
+        {
+            for (ClusterIndexType i = 0; i < this->m_reserve_count; i++) {
+                bitmap_update(c, this->m_reserve_next + i, true);
+            }
+            this->m_reserve_count = 0;
+        }
+        
     private:
+        APRINTER_FUNCTION_IF_OR_EMPTY(ReserveClusters, void, reserve_init (Context c))
+        {
+            this->m_reserve_count = 0;
+            this->m_reserve_wanted = 1;
+        }
+        
+        APRINTER_FUNCTION_IF_OR_EMPTY(ReserveClusters, void, reserve_set_wanted (Context c, ClusterIndexType wanted_clusters))
+        {
+            this->m_reserve_wanted = MaxValue((ClusterIndexType)1, wanted_clusters);
+        }
+        
         APRINTER_FUNCTION_IF_OR_EMPTY(Writable, void, extra_init (Context c))
         {
             this->m_fat_cache_ref2.init(c, APRINTER_CB_OBJFUNC_T(&ClusterChain::fat_cache_ref_handler, this));
@@ -1552,6 +2123,7 @@ private:
                 o->allocating_chains_list.remove(this);
                 allocation_request_removed(c);
             }
+            releaseReserved(c);
             this->m_fat_cache_ref2.deinit(c);
         }
         
@@ -1621,11 +2193,91 @@ private:
             this->m_prev_cluster = value;
         }
         
+        APRINTER_FUNCTION_IF_OR_EMPTY(EnableFileExtents, void, extents_reset (Context c))
+        {
+            this->m_num_extents = 0;
+            this->m_known_length = 0;
+            if (is_cluster_idx_normal(m_first_cluster)) {
+                this->m_extent_cluster[0] = m_first_cluster;
+                this->m_extent_pos[0] = 0;
+                this->m_num_extents = 1;
+                this->m_known_length = 1;
+            }
+            // The chain may have been modified before the current position,
+            // so don't record anything until rewind.
+            this->m_current_pos = this->m_known_length;
+        }
+        
+        APRINTER_FUNCTION_IF_OR_EMPTY(EnableFileExtents, void, extents_rewind (Context c))
+        {
+            this->m_current_pos = 0;
+            this->m_current_extent = 0;
+        }
+        
+        // Advances by up to count positions without looking at the FAT, as far
+        // as the extents cover the chain. Returns the number of positions advanced.
+        APRINTER_FUNCTION_IF_ELSE(EnableFileExtents, ClusterIndexType, extents_advance (Context c, ClusterIndexType count), {
+            if (this->m_current_pos >= this->m_known_length) {
+                return 0;
+            }
+            ClusterIndexType steps = MinValue(count, (ClusterIndexType)(this->m_known_length - 1 - this->m_current_pos));
+            if (steps == 0) {
+                return 0;
+            }
+            ClusterIndexType target_pos = this->m_current_pos + steps;
+            
+            // Find the last extent starting at or before the target position.
+            ExtentIndexType low = this->m_current_extent;
+            ExtentIndexType high = this->m_num_extents;
+            while (high - low > 1) {
+                ExtentIndexType mid = low + (high - low) / 2;
+                if (this->m_extent_pos[mid] <= target_pos) {
+                    low = mid;
+                } else {
+                    high = mid;
+                }
+            }
+            
+            ExtentIndexType prev_extent = (target_pos > this->m_extent_pos[low]) ? low : (low - 1);
+            extra_set_prev_cluster(c, this->m_extent_cluster[prev_extent] + (target_pos - 1 - this->m_extent_pos[prev_extent]));
+            m_current_cluster = this->m_extent_cluster[low] + (target_pos - this->m_extent_pos[low]);
+            this->m_current_extent = low;
+            this->m_current_pos = target_pos;
+            return steps;
+        }, {
+            return 0;
+        })
+        
+        // Records the next cluster as read from the FAT, extending the last extent
+        // or adding one when we are at the end of the known part of the chain.
+        APRINTER_FUNCTION_IF_OR_EMPTY(EnableFileExtents, void, extents_record_next (Context c, ClusterIndexType next_cluster))
+        {
+            if (this->m_current_pos != this->m_known_length - 1 || !is_cluster_idx_normal(next_cluster)) {
+                this->m_current_pos = this->m_known_length;
+                return;
+            }
+            ClusterIndexType next_pos = this->m_known_length;
+            ExtentIndexType last = this->m_num_extents - 1;
+            if (next_cluster - this->m_extent_cluster[last] != next_pos - this->m_extent_pos[last]) {
+                if (this->m_num_extents == Params::NumFileExtents) {
+                    this->m_current_pos = this->m_known_length;
+                    return;
+                }
+                last = this->m_num_extents++;
+                this->m_extent_cluster[last] = next_cluster;
+                this->m_extent_pos[last] = next_pos;
+            }
+            this->m_known_length++;
+            this->m_current_extent = last;
+            this->m_current_pos = next_pos;
+        }
+        
         void rewind_internal (Context c)
         {
             m_iter_state = IterState::START;
             m_current_cluster = m_first_cluster;
             extra_set_prev_cluster(c, 0);
+            extents_rewind(c);
         }
         
         void complete_request (Context c, bool error, bool first_cluster_changed=false)
@@ -1642,19 +2294,26 @@ private:
             TheDebugObject::access(c);
             
             if (m_state == State::NEXT_CHECK) {
-                if (m_iter_state == IterState::CLUSTER) {
-                    if (!is_cluster_idx_valid_for_fat(c, m_current_cluster)) {
-                        return complete_request(c, true);
-                    }
-                    if (!request_fat_cache_block(c, &m_fat_cache_ref1, m_current_cluster, false)) {
-                        m_state = State::NEXT_REQUESTING_FAT;
-                        return;
+                while (m_advance_count > 0 && m_iter_state != IterState::END) {
+                    if (m_iter_state == IterState::CLUSTER) {
+                        ClusterIndexType steps = extents_advance(c, m_advance_count);
+                        if (steps > 0) {
+                            m_advance_count -= steps;
+                            continue;
+                        }
+                        if (!is_cluster_idx_valid_for_fat(c, m_current_cluster)) {
+                            return complete_request(c, true);
+                        }
+                        if (!request_fat_cache_block(c, &m_fat_cache_ref1, m_current_cluster, false)) {
+                            m_state = State::NEXT_REQUESTING_FAT;
+                            return;
+                        }
+                        extra_set_prev_cluster(c, m_current_cluster);
+                        m_current_cluster = read_fat_entry_in_cache_block(c, &m_fat_cache_ref1, m_current_cluster);
+                        extents_record_next(c, m_current_cluster);
                     }
-                    extra_set_prev_cluster(c, m_current_cluster);
-                    m_current_cluster = read_fat_entry_in_cache_block(c, &m_fat_cache_ref1, m_current_cluster);
-                }
-                if (m_iter_state != IterState::END) {
                     m_iter_state = is_cluster_idx_normal(m_current_cluster) ? IterState::CLUSTER : IterState::END;
+                    m_advance_count--;
                 }
                 return complete_request(c, false);
             }
@@ -1709,6 +2368,7 @@ private:
             } else {
                 update_fat_entry_in_cache_block(c, &m_fat_cache_ref1, this->m_prev_cluster, m_current_cluster);
             }
+            extents_reset(c);
             m_iter_state = IterState::CLUSTER;
             return complete_request(c, false, changing_first_cluster);
         }
@@ -1720,6 +2380,7 @@ private:
         IterState m_iter_state;
         ClusterIndexType m_first_cluster;
         ClusterIndexType m_current_cluster;
+        ClusterIndexType m_advance_count;
     };
     
     template <bool Writable>
@@ -1754,6 +2415,7 @@ private:
             AMBRO_ASSERT(m_state == State::INVALID)
             
             m_state = State::REQUESTING_BLOCK;
+            m_block_index = block_index;
             m_block_offset = block_offset;
             m_block_ref.requestBlock(c, get_abs_block_index(c, block_index), 0, 1, CacheBlockRef::FLAG_NO_IMMEDIATE_COMPLETION);
         }
@@ -1773,6 +2435,7 @@ private:
             uint32_t write_value = update_cluster_entry(read_dir_entry_first_cluster(c, buffer), value);
             write_dir_entry_first_cluster(c, write_value, buffer);
             m_block_ref.markDirty(c);
+            lookup_cache_invalidate(c, m_block_index, m_block_offset);
         }
         
         uint32_t getFileSize (Context c)
@@ -1788,6 +2451,7 @@ private:
             
             WriteBinaryInt<uint32_t, BinaryLittleEndian>(value, get_entry_ptr<true>(c) + DirEntrySizeOffset);
             m_block_ref.markDirty(c);
+            lookup_cache_invalidate(c, m_block_index, m_block_offset);
         }
         
     private:
@@ -1809,6 +2473,7 @@ private:
         CacheBlockRef m_block_ref;
         DirEntryRefHandler m_handler;
         State m_state;
+        BlockIndexType m_block_index;
         DirEntriesPerBlockType m_block_offset;
     };
     
@@ -2128,11 +2793,32 @@ private:
         size_t num_write_references;
     };
     
+    APRINTER_STRUCT_IF_TEMPLATE(FreeBitmapMembers) {
+        uint32_t free_bitmap[FreeBitmapWords];
+        ClusterIndexType bitmap_build_pos;
+        BlockIndexType bitmap_hint_block;
+        ClusterIndexType alloc_candidate;
+        BitmapState bitmap_state;
+    };
+    
+    struct LookupCacheEntry {
+        FsEntry entry;
+        ClusterIndexType dir_cluster;
+        uint32_t name_hash;
+        uint8_t name_len;
+        char name[LookupCacheNameSize + 1];
+    };
+    
+    APRINTER_STRUCT_IF_TEMPLATE(LookupCacheMembers) {
+        LookupCacheEntry lookup_cache[Params::NumLookupCacheEntries];
+        LookupCacheIndexType lookup_cache_next;
+    };
+    
 public:
     struct Object : public ObjBase<FatFs, ParentObject, MakeTypeList<
         TheDebugObject,
         TheBlockCache
-    >>, public FsWritableMembers<FsWritable> {
+    >>, public FsWritableMembers<FsWritable>, public FreeBitmapMembers<EnableFreeBitmap>, public LookupCacheMembers<EnableLookupCache> {
         BlockRange<BlockIndexType> block_range;
         FsState state;
         union {
@@ -2156,7 +2842,10 @@ APRINTER_ALIAS_STRUCT_EXT(FatFsService, (
     APRINTER_AS_VALUE(int, MaxIoBlocks),
     APRINTER_AS_VALUE(bool, CaseInsens),
     APRINTER_AS_VALUE(bool, Writable),
-    APRINTER_AS_VALUE(bool, EnableReadHinting)
+    APRINTER_AS_VALUE(bool, EnableReadHinting),
+    APRINTER_AS_VALUE(int, NumFileExtents),
+    APRINTER_AS_VALUE(int, FreeBitmapClusters),
+    APRINTER_AS_VALUE(int, NumLookupCacheEntries)
 ), (
     APRINTER_ALIAS_STRUCT_EXT(Fs, (
         APRINTER_AS_TYPE(Context),
@@ -30,6 +30,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <sys/timerfd.h>
+#include <sys/prctl.h>
 
 #include <aprinter/platform/linux/linux_support.h>
 #include <aprinter/base/Object.h>
@@ -40,6 +41,8 @@
 #include <aprinter/base/Preprocessor.h>
 #include <aprinter/base/LoopUtils.h>
 #include <aprinter/base/Callback.h>
+#include <aprinter/structure/LinkModel.h>
+#include <aprinter/structure/LinkedHeap.h>
 #include <aprinter/system/InterruptLock.h>
 #include <aprinter/misc/ClockUtils.h>
 
@@ -55,9 +58,11 @@ class LinuxClock {
     
     APRINTER_USE_VAL(Arg::Params, SubSecondBits)
     APRINTER_USE_VAL(Arg::Params, MaxTimers)
+    APRINTER_USE_VAL(Arg::Params, SpinMicros)
     
     static_assert(SubSecondBits >= 10 && SubSecondBits <= 21, "");
     static_assert(MaxTimers > 0 && MaxTimers <= 64, "");
+    static_assert(SpinMicros >= 0 && SpinMicros <= 1000, "");
     
     static long const NsecInSec = 1000000000;
     static int const NanosShift = 63 - SubSecondBits;
@@ -78,6 +83,24 @@ public:
 private:
     using TheClockUtils = ClockUtilsForClock<LinuxClock>;
     using TheDebugObject = DebugObject<Context, Object>;
+    using InternalTimerHandlerType = void (*) (AtomicContext<Context>);
+    
+    // The timer thread busy-waits for deadlines which are closer than this.
+    static TimeType const SpinTicks = SpinMicros * (time_freq / 1000000.0);
+    
+    struct TimerEntry;
+    using TimerLinkModel = PointerLinkModel<TimerEntry>;
+    using TimerHeapNodeAccessor = typename APRINTER_MEMBER_ACCESSOR(&TimerEntry::heap_node);
+    class TimerCompare;
+    using TimerHeap = LinkedHeap<TimerHeapNodeAccessor, TimerCompare, TimerLinkModel>;
+    
+    struct TimerEntry {
+        LinkedHeapNode<TimerLinkModel> heap_node;
+        TimeType time;
+        InternalTimerHandlerType handler;
+        bool active;
+        bool in_heap;
+    };
     
 public:
     static void init (Context c)
@@ -85,9 +108,12 @@ public:
         auto *o = Object::self(c);
         
         for (auto i : LoopRangeAuto(MaxTimers)) {
-            o->m_timer_active[i] = false;
-            o->m_timer_handler[i] = nullptr;
+            o->m_timers[i].active = false;
+            o->m_timers[i].in_heap = false;
+            o->m_timers[i].handler = nullptr;
         }
+        o->m_timer_heap.init();
+        o->m_timerfd_armed = false;
         
         o->m_timer_fd = ::timerfd_create(CLOCK_MONOTONIC, 0);
         AMBRO_ASSERT_FORCE(o->m_timer_fd >= 0)
@@ -161,13 +187,15 @@ public:
     }
     
 private:
-    using InternalTimerHandlerType = void (*) (AtomicContext<Context>);
-    
     static void timer_thread ()
     {
         Context c;
         auto *o = Object::self(c);
         
+        // We need precise wakeups, don't let the kernel delay them to group
+        // them with other wakeups (this has no effect on realtime threads).
+        ::prctl(PR_SET_TIMERSLACK, 1UL);
+        
         while (true) {
             // Wait for the timerfd to expire.
             uint64_t expire_count = 0;
@@ -175,85 +203,180 @@ private:
             AMBRO_ASSERT_FORCE(read_res == sizeof(expire_count))
             AMBRO_ASSERT_FORCE(expire_count > 0)
             
+            if (SpinTicks > 0) {
+                spin_until_first_timer(c);
+            }
+            
             // Get the current time.
             struct timespec now_ts = getTimespec(c);
             TimeType now = timespecToTime(now_ts);
             
             AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
-                // Call handlers for all expired timers.
-                for (auto i : LoopRangeAuto(MaxTimers)) {
-                    if (o->m_timer_active[i] && TheClockUtils::timeGreaterOrEqual(now, o->m_timer_time[i])) {
-                        o->m_timer_handler[i](lock_c);
+                o->m_timerfd_armed = false;
+                
+                // Take all expired timers out of the heap. The handlers are
+                // called only after this so that a timer which is set for
+                // the past is handled at most once per wakeup.
+                TimerEntry *expired[MaxTimers];
+                int num_expired = 0;
+                while (TimerEntry *tmr = o->m_timer_heap.first()) {
+                    if (!TheClockUtils::timeGreaterOrEqual(now, tmr->time)) {
+                        break;
+                    }
+                    o->m_timer_heap.remove(*tmr);
+                    tmr->in_heap = false;
+                    expired[num_expired++] = tmr;
+                }
+                
+                // Call handlers of the expired timers, earliest first. An earlier
+                // handler may have stopped a timer or set it again, in which case
+                // it is back in the heap and must not be handled now.
+                for (auto i : LoopRangeAuto(num_expired)) {
+                    TimerEntry *tmr = expired[i];
+                    if (tmr->active && !tmr->in_heap && TheClockUtils::timeGreaterOrEqual(now, tmr->time)) {
+                        tmr->handler(lock_c);
+                    }
+                }
+                
+                // Put back the timers which the handlers set again.
+                for (auto i : LoopRangeAuto(num_expired)) {
+                    TimerEntry *tmr = expired[i];
+                    if (tmr->active && !tmr->in_heap) {
+                        o->m_timer_heap.insert(*tmr);
+                        tmr->in_heap = true;
                     }
                 }
                 
-                // Arm (or disarm) the timerfd according to the latest timer states.
-                configure_timerfd(lock_c, now_ts, now);
+                // Arm the timerfd for the earliest remaining timer.
+                update_timerfd(lock_c, now_ts, now);
             }
         }
     }
     
-    static void configure_timerfd (AtomicContext<Context> c, struct timespec now_ts, TimeType now)
+    static void spin_until_first_timer (Context c)
     {
         auto *o = Object::self(c);
         
-        bool have_first_time = false;
+        bool have_first = false;
         TimeType first_time;
+        AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
+            if (TimerEntry *tmr = o->m_timer_heap.first()) {
+                have_first = true;
+                first_time = tmr->time;
+            }
+        }
         
-        for (auto i : LoopRangeAuto(MaxTimers)) {
-            if (o->m_timer_active[i]) {
-                TimeType tmr_time = o->m_timer_time[i];
-                if (!TheClockUtils::timeGreaterOrEqual(tmr_time, now)) {
-                    have_first_time = true;
-                    first_time = now;
-                    break;
-                }
-                if (!have_first_time || !TheClockUtils::timeGreaterOrEqual(tmr_time, first_time)) {
-                    have_first_time = true;
-                    first_time = tmr_time;
-                }
+        // Spin without holding the lock, but only if we were woken up early
+        // on purpose, i.e. the earliest deadline is within the spin time.
+        while (have_first) {
+            TimeType now = timespecToTime(getTimespec(c));
+            if (TheClockUtils::timeGreaterOrEqual(now, first_time) ||
+                TheClockUtils::timeDifference(first_time, now) > SpinTicks)
+            {
+                break;
             }
         }
+    }
+    
+    static void update_timerfd (AtomicContext<Context> c, struct timespec now_ts, TimeType now)
+    {
+        auto *o = Object::self(c);
         
-        struct itimerspec itspec = {};
-        if (have_first_time) {
-            TimeType time_from_now = TheClockUtils::timeDifference(first_time, now);
-            itspec.it_value = addTimeToTimespec(now_ts, time_from_now);
+        // With no timers we leave the timerfd alone, at most this results
+        // in one spurious wakeup.
+        TimerEntry *first = o->m_timer_heap.first();
+        if (!first) {
+            return;
         }
         
+        // Wake up at the earliest deadline, or SpinTicks before it so that
+        // the remaining time can be busy-waited. Deadlines in the past (or
+        // within SpinTicks) mean waking up immediately.
+        TimeType time_from_now = 0;
+        if (TheClockUtils::timeGreaterOrEqual(first->time, now)) {
+            TimeType first_diff = TheClockUtils::timeDifference(first->time, now);
+            if (first_diff > SpinTicks) {
+                time_from_now = first_diff - SpinTicks;
+            }
+        }
+        TimeType arm_time = now + time_from_now;
+        
+        // Avoid the syscall if the timerfd is already armed for this time.
+        if (o->m_timerfd_armed && o->m_timerfd_time == arm_time) {
+            return;
+        }
+        
+        struct itimerspec itspec = {};
+        itspec.it_value = addTimeToTimespec(now_ts, time_from_now);
+        
         int res = ::timerfd_settime(o->m_timer_fd, TFD_TIMER_ABSTIME, &itspec, nullptr);
         AMBRO_ASSERT_FORCE(res == 0)
+        
+        o->m_timerfd_armed = true;
+        o->m_timerfd_time = arm_time;
     }
     
-    static void poke_timer_thread (AtomicContext<Context> c, struct timespec now_ts)
+    static void start_timer (AtomicContext<Context> c, int index, TimeType time, struct timespec now_ts)
     {
         auto *o = Object::self(c);
+        TimerEntry *tmr = &o->m_timers[index];
+        AMBRO_ASSERT(!tmr->active)
+        AMBRO_ASSERT(!tmr->in_heap)
         
-        // This is used when a timer is started, to make the timer thread wake
-        // up immediately and arm the timerfd taking the changed timer into account.
-        // It has to be done within the lock, else the adjustment may be overridden
-        // with one that does not account for the timer change.
+        tmr->time = time;
+        tmr->active = true;
+        o->m_timer_heap.insert(*tmr);
+        tmr->in_heap = true;
         
-        struct itimerspec itspec = {};
-        itspec.it_value = now_ts;
+        // Only a new earliest timer requires rearming the timerfd. This has
+        // to be done within the lock, else the adjustment may be overridden
+        // with one that does not account for the timer change.
+        if (o->m_timer_heap.first() == tmr) {
+            update_timerfd(c, now_ts, timespecToTime(now_ts));
+        }
+    }
+    
+    static void stop_timer (AtomicContext<Context> c, int index)
+    {
+        auto *o = Object::self(c);
+        TimerEntry *tmr = &o->m_timers[index];
         
-        int res = ::timerfd_settime(o->m_timer_fd, TFD_TIMER_ABSTIME, &itspec, nullptr);
-        AMBRO_ASSERT_FORCE(res == 0)
+        if (tmr->in_heap) {
+            o->m_timer_heap.remove(*tmr);
+            tmr->in_heap = false;
+        }
+        tmr->active = false;
     }
     
+    class TimerCompare {
+        using State = typename TimerLinkModel::State;
+        using Ref = typename TimerLinkModel::Ref;
+        
+    public:
+        static int compareEntries (State, Ref ref1, Ref ref2)
+        {
+            TimeType time1 = (*ref1).time;
+            TimeType time2 = (*ref2).time;
+            
+            return !TheClockUtils::timeGreaterOrEqual(time1, time2) ? -1 : (time1 == time2) ? 0 : 1;
+        }
+    };
+    
 public:
     struct Object : public ObjBase<LinuxClock, ParentObject, MakeTypeList<TheDebugObject>> {
         int m_timer_fd;
         LinuxRtThread m_timer_thread;
-        bool m_timer_active[MaxTimers];
-        TimeType m_timer_time[MaxTimers];
-        InternalTimerHandlerType m_timer_handler[MaxTimers];
+        TimerEntry m_timers[MaxTimers];
+        TimerHeap m_timer_heap;
+        bool m_timerfd_armed;
+        TimeType m_timerfd_time;
     };
 };
 
 APRINTER_ALIAS_STRUCT_EXT(LinuxClockService, (
     APRINTER_AS_VALUE(int, SubSecondBits),
-    APRINTER_AS_VALUE(int, MaxTimers)
+    APRINTER_AS_VALUE(int, MaxTimers),
+    APRINTER_AS_VALUE(int, SpinMicros)
 ), (
     APRINTER_ALIAS_STRUCT_EXT(Clock, (
         APRINTER_AS_TYPE(Context),
@@ -292,10 +415,10 @@ public:
     static void init (Context c)
     {
         auto *co = Clock::Object::self(c);
-        AMBRO_ASSERT(!co->m_timer_active[Index])
-        AMBRO_ASSERT(co->m_timer_handler[Index] == nullptr)
+        AMBRO_ASSERT(!co->m_timers[Index].active)
+        AMBRO_ASSERT(co->m_timers[Index].handler == nullptr)
         
-        co->m_timer_handler[Index] = LinuxClockInterruptTimer::timer_handler;
+        co->m_timers[Index].handler = LinuxClockInterruptTimer::timer_handler;
         
         TheDebugObject::init(c);
     }
@@ -306,10 +429,10 @@ public:
         TheDebugObject::deinit(c);
         
         AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
-            co->m_timer_active[Index] = false;
+            Clock::stop_timer(lock_c, Index);
         }
         
-        co->m_timer_handler[Index] = nullptr;
+        co->m_timers[Index].handler = nullptr;
     }
     
     template <typename ThisContext>
@@ -317,34 +440,31 @@ public:
     {
         auto *co = Clock::Object::self(c);
         TheDebugObject::access(c);
-        AMBRO_ASSERT(!co->m_timer_active[Index])
-        
-        co->m_timer_time[Index] = time;
+        AMBRO_ASSERT(!co->m_timers[Index].active)
         
         struct timespec now_ts = Clock::getTimespec(c);
         
         AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
-            co->m_timer_active[Index] = true;
-            Clock::poke_timer_thread(lock_c, now_ts);
+            Clock::start_timer(lock_c, Index, time, now_ts);
         }
     }
     
     static void setNext (HandlerContext c, TimeType time)
     {
         auto *co = Clock::Object::self(c);
-        AMBRO_ASSERT(co->m_timer_active[Index])
+        AMBRO_ASSERT(co->m_timers[Index].active)
+        AMBRO_ASSERT(!co->m_timers[Index].in_heap)
         
-        co->m_timer_time[Index] = time;
+        co->m_timers[Index].time = time;
     }
     
     template <typename ThisContext>
     static void unset (ThisContext c)
     {
-        auto *co = Clock::Object::self(c);
         TheDebugObject::access(c);
         
         AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
-            co->m_timer_active[Index] = false;
+            Clock::stop_timer(lock_c, Index);
         }
     }
     
@@ -353,17 +473,17 @@ public:
     {
         auto *co = Clock::Object::self(c);
         
-        return co->m_timer_time[Index];
+        return co->m_timers[Index].time;
     }
     
 private:
     static void timer_handler (AtomicContext<Context> c)
     {
         auto *co = Clock::Object::self(c);
-        AMBRO_ASSERT(co->m_timer_active[Index])
+        AMBRO_ASSERT(co->m_timers[Index].active)
         
         if (!Handler::call(c)) {
-            co->m_timer_active[Index] = false;
+            co->m_timers[Index].active = false;
         }
     }
     
@@ -27,12 +27,16 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <limits.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 
@@ -47,15 +51,31 @@
 #include <aprinter/base/TransferVector.h>
 #include <aprinter/base/OneOf.h>
 #include <aprinter/base/LoopUtils.h>
+#include <aprinter/misc/ClockUtils.h>
 #include <aprinter/platform/linux/linux_support.h>
 
 namespace APrinter {
 
 // NOTE: The existing SD-card API does not support asynchonous execution
 // of deactivate (it assumed that any cleanup can be done immediately),
-// but we have to wait for any operations in the I/O thread to complete.
+// but we have to wait for any operations in the I/O threads to complete.
 // Since the Linux port is for testing only, waiting synchronously in
 // deactivate and deinit is fine.
+//
+// I/O is done by a pool of QueueDepth threads. The SD-card API only
+// allows one command at a time, so each read/write command is split at
+// descriptor boundaries into up to QueueDepth chunks which are submitted
+// to the file concurrently, and the command completes when all chunks
+// are done. With DirectIo the file is opened with O_DIRECT (if the
+// underlying filesystem supports it) and each thread goes through its
+// own aligned bounce buffer, since the callers' buffers are not aligned.
+//
+// With MmapImage there are no I/O threads at all. The image is mapped
+// into memory when activated and commands are completed by memcpy from
+// a timer on the event loop thread. The timer expires after MmapOpLatency
+// plus MmapBlockLatency for each block (both in seconds), which allows
+// simulating slow cards; with zero latency commands complete as soon as
+// the event loop gets to them.
 
 template <typename Arg>
 class LinuxSdCard {
@@ -68,6 +88,8 @@ private:
     using TheDebugObject = DebugObject<Context, Object>;
     
     using CompletedFastEvent = typename Context::EventLoop::template FastEventSpec<LinuxSdCard>;
+    using TheClockUtils = ClockUtils<Context>;
+    using TimeType = typename TheClockUtils::TimeType;
     
     enum class InitState : uint8_t {Inactive, Initing, Running};
     enum class IoState : uint8_t {Inactive, Reading, Writing};
@@ -79,7 +101,8 @@ private:
         StatFailed = 3,
         BadFileSize = 4,
         IoFailed = 5,
-        BadIoResLen = 6
+        BadIoResLen = 6,
+        MmapFailed = 7
     };
     
     static char const * FilePath() { return "sdcard.bin"; }
@@ -92,10 +115,26 @@ public:
     static int const MaxIoDescriptors = Params::MaxIoDescriptors;
     
 private:
+    static int const QueueDepth = Params::QueueDepth;
+    static bool const DirectIo = Params::DirectIo;
+    static size_t const DirectIoAlign = 4096;
+    static bool const MmapImage = Params::MmapImage;
+    static int const NumIoThreads = MmapImage ? 0 : QueueDepth;
+    
     static_assert(BlockSize > 0, "");
     static_assert(BlockSize % sizeof(DataWordType) == 0, "");
     static_assert(MaxIoBlocks > 0, "");
     static_assert(MaxIoDescriptors > 0, "");
+    static_assert(QueueDepth > 0 && QueueDepth <= 64, "");
+    static_assert(!DirectIo || BlockSize % 512 == 0, "");
+    static_assert(!(MmapImage && DirectIo), "DirectIo does not apply to MmapImage");
+    
+    struct IoChunk {
+        off_t offset;
+        size_t num_bytes;
+        int iov_start;
+        int iov_count;
+    };
     
 public:
     static void init (Context c)
@@ -107,16 +146,27 @@ public:
         o->stop_thread = false;
         o->cmd_in_progress = false;
         o->file_fd = -1;
+        o->image = nullptr;
         
         Context::EventLoop::template initFastEvent<CompletedFastEvent>(c, LinuxSdCard::completed_event_handler);
+        o->mmap_timer.init(c, APRINTER_CB_STATFUNC_T(&LinuxSdCard::mmap_timer_handler));
         
         AMBRO_ASSERT_FORCE_MSG(::sem_init(&o->start_cmd_sem, 0, 0) == 0, "sem_init failed")
         
         AMBRO_ASSERT_FORCE_MSG(::sem_init(&o->end_cmd_sem, 0, 1) == 0, "sem_init failed")
         
+        for (auto i : LoopRangeAuto(QueueDepth)) {
+            o->bounce_buf[i] = nullptr;
+            if (DirectIo) {
+                AMBRO_ASSERT_FORCE_MSG(::posix_memalign(&o->bounce_buf[i], DirectIoAlign, MaxIoBlocks * BlockSize) == 0, "posix_memalign failed")
+            }
+        }
+        
         {
             LinuxBlockSignals block_signals;
-            AMBRO_ASSERT_FORCE_MSG(::pthread_create(&o->io_thread, nullptr, LinuxSdCard::io_thread_func, nullptr) == 0, "pthread_create failed")
+            for (auto i : LoopRangeAuto(NumIoThreads)) {
+                AMBRO_ASSERT_FORCE_MSG(::pthread_create(&o->io_threads[i], nullptr, LinuxSdCard::io_thread_func, (void *)(intptr_t)i) == 0, "pthread_create failed")
+            }
         }
         
         TheDebugObject::init(c);
@@ -131,18 +181,25 @@ public:
             wait_for_cmd(c);
         }
         
-        if (o->file_fd >= 0) {
-            ::close(o->file_fd);
-        }
+        close_image(c);
         
         o->stop_thread = true;
-        AMBRO_ASSERT_FORCE_MSG(::sem_post(&o->start_cmd_sem) == 0, "sem_post failed")
-        AMBRO_ASSERT_FORCE_MSG(::pthread_join(o->io_thread, nullptr) == 0, "pthread_join failed")
+        for (auto i : LoopRangeAuto(NumIoThreads)) {
+            (void)i;
+            AMBRO_ASSERT_FORCE_MSG(::sem_post(&o->start_cmd_sem) == 0, "sem_post failed")
+        }
+        for (auto i : LoopRangeAuto(NumIoThreads)) {
+            AMBRO_ASSERT_FORCE_MSG(::pthread_join(o->io_threads[i], nullptr) == 0, "pthread_join failed")
+        }
+        for (auto i : LoopRangeAuto(QueueDepth)) {
+            ::free(o->bounce_buf[i]);
+        }
         
         AMBRO_ASSERT_FORCE_MSG(::sem_destroy(&o->end_cmd_sem) == 0, "sem_destroy failed")
         
         AMBRO_ASSERT_FORCE_MSG(::sem_destroy(&o->start_cmd_sem) == 0, "sem_destroy failed")
         
+        o->mmap_timer.deinit(c);
         Context::EventLoop::template resetFastEvent<CompletedFastEvent>(c);
     }
     
@@ -157,8 +214,13 @@ public:
         AMBRO_ASSERT(o->file_fd == -1)
         
         o->init_state = InitState::Initing;
-        o->cmd_in_progress = true;
-        AMBRO_ASSERT_FORCE_MSG(::sem_post(&o->start_cmd_sem) == 0, "sem_post failed")
+        
+        if (MmapImage) {
+            o->error_code = process_init(c);
+            start_mmap_cmd(c, 0);
+        } else {
+            start_cmd(c, 1);
+        }
     }
     
     static void deactivate (Context c)
@@ -171,10 +233,7 @@ public:
             wait_for_cmd(c);
         }
         
-        if (o->file_fd >= 0) {
-            ::close(o->file_fd);
-            o->file_fd = -1;
-        }
+        close_image(c);
         
         o->init_state = InitState::Inactive;
         o->io_state = IoState::Inactive;
@@ -208,27 +267,103 @@ public:
         AMBRO_ASSERT(num_blocks > 0)
         AMBRO_ASSERT(num_blocks <= o->capacity_blocks - block)
         AMBRO_ASSERT(num_blocks <= MaxIoBlocks)
+        AMBRO_ASSERT(data_vector.num_descriptors > 0)
         AMBRO_ASSERT(data_vector.num_descriptors <= MaxIoDescriptors)
         AMBRO_ASSERT(CheckTransferVector(data_vector, num_blocks * (BlockSize/sizeof(DataWordType))))
         // implies
         AMBRO_ASSERT(!o->cmd_in_progress)
         AMBRO_ASSERT(o->file_fd >= 0)
         
+        int num_descriptors = data_vector.num_descriptors;
+        
+        for (auto i : LoopRangeAuto(num_descriptors)) {
+            o->iov[i].iov_base = data_vector.descriptors[i].buffer_ptr;
+            o->iov[i].iov_len = data_vector.descriptors[i].num_words * sizeof(DataWordType);
+        }
+        
         o->io_state = is_write ? IoState::Writing : IoState::Reading;
-        o->io_block = block;
-        o->io_num_blocks = num_blocks;
-        o->io_vector = data_vector;
-        o->cmd_in_progress = true;
-        AMBRO_ASSERT_FORCE_MSG(::sem_post(&o->start_cmd_sem) == 0, "sem_post failed")
+        
+        if (MmapImage) {
+            IoChunk *chunk = &o->chunks[0];
+            chunk->offset = block * (off_t)BlockSize;
+            chunk->num_bytes = num_blocks * BlockSize;
+            chunk->iov_start = 0;
+            chunk->iov_count = num_descriptors;
+            start_mmap_cmd(c, num_blocks);
+            return;
+        }
+        
+        // Split the descriptors evenly between the chunks. The block cache
+        // uses one descriptor per block so this also splits the blocks evenly.
+        int num_chunks = (num_descriptors < QueueDepth) ? num_descriptors : QueueDepth;
+        off_t offset = block * (off_t)BlockSize;
+        
+        for (auto chunk_idx : LoopRangeAuto(num_chunks)) {
+            IoChunk *chunk = &o->chunks[chunk_idx];
+            chunk->offset = offset;
+            chunk->num_bytes = 0;
+            chunk->iov_start = chunk_idx * num_descriptors / num_chunks;
+            chunk->iov_count = (chunk_idx + 1) * num_descriptors / num_chunks - chunk->iov_start;
+            for (auto i : LoopRangeAuto(chunk->iov_count)) {
+                chunk->num_bytes += o->iov[chunk->iov_start + i].iov_len;
+            }
+            offset += chunk->num_bytes;
+        }
+        
+        start_cmd(c, num_chunks);
     }
     
     using EventLoopFastEvents = MakeTypeList<CompletedFastEvent>;
     
 private:
-    static void * io_thread_func (void *)
+    static void start_cmd (Context c, int num_chunks)
+    {
+        auto *o = Object::self(c);
+        
+        o->error_code = ErrorCode::Success;
+        o->next_chunk = 0;
+        o->chunks_left = num_chunks;
+        o->cmd_in_progress = true;
+        
+        for (auto i : LoopRangeAuto(num_chunks)) {
+            (void)i;
+            AMBRO_ASSERT_FORCE_MSG(::sem_post(&o->start_cmd_sem) == 0, "sem_post failed")
+        }
+    }
+    
+    static void start_mmap_cmd (Context c, size_t num_blocks)
+    {
+        auto *o = Object::self(c);
+        
+        TimeType latency = (Params::MmapOpLatency::value() + num_blocks * Params::MmapBlockLatency::value()) * TheClockUtils::time_freq;
+        
+        o->cmd_in_progress = true;
+        o->mmap_timer.appendAfter(c, latency);
+    }
+    
+    static void mmap_timer_handler (Context c)
+    {
+        auto *o = Object::self(c);
+        AMBRO_ASSERT(MmapImage)
+        AMBRO_ASSERT(o->cmd_in_progress)
+        
+        o->cmd_in_progress = false;
+        
+        if (o->io_state == OneOf(IoState::Reading, IoState::Writing)) {
+            IoChunk const *chunk = &o->chunks[0];
+            char *image_ptr = o->image + chunk->offset;
+            copy_bounce(image_ptr, o->iov, chunk->iov_count, o->io_state == IoState::Writing);
+            o->error_code = ErrorCode::Success;
+        }
+        
+        complete_cmd(c);
+    }
+    
+    static void * io_thread_func (void *arg)
     {
         Context c;
         auto *o = Object::self(c);
+        int thread_idx = (intptr_t)arg;
         
         while (true) {
             AMBRO_ASSERT_FORCE_MSG(::sem_wait(&o->start_cmd_sem) == 0, "sem_wait failed")
@@ -245,17 +380,23 @@ private:
                 err = process_init(c);
             }
             else if (o->io_state == OneOf(IoState::Reading, IoState::Writing)) {
-                err = process_read_or_write(c, o->io_state == IoState::Writing);
+                int chunk_idx = o->next_chunk++;
+                err = process_chunk(c, thread_idx, &o->chunks[chunk_idx], o->io_state == IoState::Writing);
             }
             else {
                 AMBRO_ASSERT(false)
             }
             
-            o->error_code = err;
-            
-            Context::EventLoop::template triggerFastEvent<CompletedFastEvent>(c);
+            if (err != ErrorCode::Success) {
+                ErrorCode expected = ErrorCode::Success;
+                o->error_code.compare_exchange_strong(expected, err);
+            }
             
-            AMBRO_ASSERT_FORCE_MSG(::sem_post(&o->end_cmd_sem) == 0, "sem_post failed")
+            if (--o->chunks_left == 0) {
+                Context::EventLoop::template triggerFastEvent<CompletedFastEvent>(c);
+                
+                AMBRO_ASSERT_FORCE_MSG(::sem_post(&o->end_cmd_sem) == 0, "sem_post failed")
+            }
         }
         
         return nullptr;
@@ -266,7 +407,15 @@ private:
         auto *o = Object::self(c);
         int res;
         
-        int fd = ::open(FilePath(), O_RDWR);
+        int fd = -1;
+        bool direct = false;
+        if (DirectIo) {
+            fd = ::open(FilePath(), O_RDWR|O_DIRECT);
+            direct = (fd >= 0);
+        }
+        if (fd < 0) {
+            fd = ::open(FilePath(), O_RDWR);
+        }
         if (fd < 0) {
             return ErrorCode::OpenFailed;
         }
@@ -286,73 +435,117 @@ private:
             return ErrorCode::BadFileSize;
         }
         
+        char *image = nullptr;
+        if (MmapImage) {
+            void *addr = ::mmap(nullptr, capacity_blocks * BlockSize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+            if (addr == MAP_FAILED) {
+                ::close(fd);
+                return ErrorCode::MmapFailed;
+            }
+            image = (char *)addr;
+        }
+        
         o->file_fd = fd;
+        o->direct_io = direct;
         o->capacity_blocks = capacity_blocks;
+        o->image = image;
         
         return ErrorCode::Success;
     }
     
-    static ErrorCode process_read_or_write (Context c, bool is_write)
+    static ErrorCode process_chunk (Context c, int thread_idx, IoChunk const *chunk, bool is_write)
     {
         auto *o = Object::self(c);
         AMBRO_ASSERT(o->init_state == InitState::Running)
         
-        auto num_descriptors = o->io_vector.num_descriptors;
-        AMBRO_ASSERT(num_descriptors <= MaxIoDescriptors)
-        
-        for (auto i : LoopRangeAuto(num_descriptors)) {
-            o->iov[i].iov_base = o->io_vector.descriptors[i].buffer_ptr;
-            o->iov[i].iov_len = o->io_vector.descriptors[i].num_words * sizeof(DataWordType);
-        }
-        
-        off_t offset = o->io_block * (off_t)BlockSize;
+        struct iovec const *iov = o->iov + chunk->iov_start;
         
         ssize_t res;
-        if (is_write) {
-            res = ::pwritev(o->file_fd, o->iov, num_descriptors, offset);
+        if (o->direct_io) {
+            char *buf = (char *)o->bounce_buf[thread_idx];
+            if (is_write) {
+                copy_bounce(buf, iov, chunk->iov_count, true);
+                res = ::pwrite(o->file_fd, buf, chunk->num_bytes, chunk->offset);
+            } else {
+                res = ::pread(o->file_fd, buf, chunk->num_bytes, chunk->offset);
+                if (res > 0) {
+                    copy_bounce(buf, iov, chunk->iov_count, false);
+                }
+            }
         } else {
-            res = ::preadv(o->file_fd, o->iov, num_descriptors, offset);
+            if (is_write) {
+                res = ::pwritev(o->file_fd, iov, chunk->iov_count, chunk->offset);
+            } else {
+                res = ::preadv(o->file_fd, iov, chunk->iov_count, chunk->offset);
+            }
         }
         
         if (res < 0) {
             return ErrorCode::IoFailed;
         }
         
-        if ((size_t)res != o->io_num_blocks * BlockSize) {
+        if ((size_t)res != chunk->num_bytes) {
             return ErrorCode::BadIoResLen;
         }
         
         return ErrorCode::Success;
     }
     
+    static void copy_bounce (char *buf, struct iovec const *iov, int iov_count, bool to_bounce)
+    {
+        for (auto i : LoopRangeAuto(iov_count)) {
+            if (to_bounce) {
+                ::memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+            } else {
+                ::memcpy(iov[i].iov_base, buf, iov[i].iov_len);
+            }
+            buf += iov[i].iov_len;
+        }
+    }
+    
     static void completed_event_handler (Context c)
     {
         auto *o = Object::self(c);
         AMBRO_ASSERT(o->cmd_in_progress)
         
-        AMBRO_ASSERT_FORCE_MSG(::sem_trywait(&o->end_cmd_sem) == 0, "sem_trywait failed")
+        // The thread completing the command triggers the event before posting
+        // end_cmd_sem (so that wait_for_cmd can reset the event), and with more
+        // than one thread a post from an earlier command may also still be on
+        // its way. Each triggered event is matched by a post, so this does not
+        // block for more than a moment.
+        AMBRO_ASSERT_FORCE_MSG(::sem_wait(&o->end_cmd_sem) == 0, "sem_wait failed")
         
         o->cmd_in_progress = false;
         
+        complete_cmd(c);
+    }
+    
+    static void complete_cmd (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        ErrorCode error_code = o->error_code;
+        
         if (o->init_state == InitState::Initing) {
             AMBRO_ASSERT(o->io_state == IoState::Inactive)
             
-            if (o->error_code == ErrorCode::Success) {
+            if (error_code == ErrorCode::Success) {
                 AMBRO_ASSERT(o->file_fd >= 0)
+                AMBRO_ASSERT(!MmapImage || o->image)
                 o->init_state = InitState::Running;
             } else {
                 AMBRO_ASSERT(o->file_fd == -1)
                 o->init_state = InitState::Inactive;
             }
             
-            return InitHandler::call(c, (uint8_t)o->error_code);
+            return InitHandler::call(c, (uint8_t)error_code);
         }
         else if (o->io_state == OneOf(IoState::Reading, IoState::Writing)) {
             AMBRO_ASSERT(o->init_state == InitState::Running)
             
             o->io_state = IoState::Inactive;
             
-            bool error = o->error_code != ErrorCode::Success;
+            bool error = error_code != ErrorCode::Success;
             return CommandHandler::call(c, error);
         }
         else {
@@ -365,6 +558,14 @@ private:
         auto *o = Object::self(c);
         AMBRO_ASSERT(o->cmd_in_progress)
         
+        // A pending mmap command is simply dropped, like an interrupted
+        // transfer to a real card.
+        if (MmapImage) {
+            o->mmap_timer.unset(c);
+            o->cmd_in_progress = false;
+            return;
+        }
+        
         AMBRO_ASSERT_FORCE_MSG(::sem_wait(&o->end_cmd_sem) == 0, "sem_wait failed")
         AMBRO_ASSERT_FORCE_MSG(::sem_wait(&o->end_cmd_sem) == 0, "sem_wait failed")
         AMBRO_ASSERT_FORCE_MSG(::sem_post(&o->end_cmd_sem) == 0, "sem_post failed")
@@ -373,23 +574,42 @@ private:
         o->cmd_in_progress = false;
     }
     
+    static void close_image (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        if (o->image) {
+            ::munmap(o->image, o->capacity_blocks * BlockSize);
+            o->image = nullptr;
+        }
+        
+        if (o->file_fd >= 0) {
+            ::close(o->file_fd);
+            o->file_fd = -1;
+        }
+    }
+    
 public:
     struct Object : public ObjBase<LinuxSdCard, ParentObject, MakeTypeList<
         TheDebugObject
     >> {
         sem_t start_cmd_sem;
         sem_t end_cmd_sem;
-        pthread_t io_thread;
+        pthread_t io_threads[QueueDepth];
+        void *bounce_buf[QueueDepth];
         InitState init_state;
         IoState io_state;
         std::atomic_bool stop_thread;
         bool cmd_in_progress;
-        ErrorCode error_code;
+        bool direct_io;
+        std::atomic<ErrorCode> error_code;
+        std::atomic_int next_chunk;
+        std::atomic_int chunks_left;
         int file_fd;
         BlockIndexType capacity_blocks;
-        BlockIndexType io_block;
-        size_t io_num_blocks;
-        TransferVector<DataWordType> io_vector;
+        char *image;
+        typename Context::EventLoop::TimedEvent mmap_timer;
+        IoChunk chunks[QueueDepth];
         struct iovec iov[MaxIoDescriptors];
     };
 };
@@ -397,7 +617,12 @@ public:
 APRINTER_ALIAS_STRUCT_EXT(LinuxSdCardService, (
     APRINTER_AS_VALUE(size_t, BlockSize),
     APRINTER_AS_VALUE(size_t, MaxIoBlocks),
-    APRINTER_AS_VALUE(int, MaxIoDescriptors)
+    APRINTER_AS_VALUE(int, MaxIoDescriptors),
+    APRINTER_AS_VALUE(int, QueueDepth),
+    APRINTER_AS_VALUE(bool, DirectIo),
+    APRINTER_AS_VALUE(bool, MmapImage),
+    APRINTER_AS_TYPE(MmapOpLatency),
+    APRINTER_AS_TYPE(MmapBlockLatency)
 ), (
     APRINTER_ALIAS_STRUCT_EXT(SdCard, (
         APRINTER_AS_TYPE(Context),
@@ -119,6 +119,16 @@ float FloatSqrt (float x)
     return sqrtf(x);
 }
 
+double FloatCbrt (double x)
+{
+    return cbrt(x);
+}
+
+float FloatCbrt (float x)
+{
+    return cbrtf(x);
+}
+
 template <typename T>
 T StrToFloat (char const *nptr, char **endptr)
 {
@@ -131,6 +141,87 @@ T StrToFloat (char const *nptr, char **endptr)
 #endif
 }
 
+/**
+ * Converts a plain decimal number, as used for G-code parameters
+ * ([+-]digits[.digits], no exponent), to the correctly rounded value of
+ * type T.
+ * 
+ * If the digits form an integer which is exactly representable in T and
+ * the number of fraction digits is such that the power of ten is exactly
+ * representable too, the result is obtained by a single division, which
+ * IEEE arithmetic rounds correctly. Anything else (too many digits,
+ * exponents, inf/nan, trailing characters) is passed to StrToFloat, so the
+ * result is the same as from StrToFloat wherever that is correctly rounded.
+ */
+template <typename T>
+T DecimalStrToFloat (char const *str)
+{
+    static_assert(IsFpType<T>::Value, "");
+    
+#if !defined(FLT_EVAL_METHOD) || FLT_EVAL_METHOD == 0
+    static int const MantBits = IsFloat<T>::Value ? FLT_MANT_DIG : DBL_MANT_DIG;
+    static int const MaxPow10 = (MantBits >= 53) ? 22 : 10;
+    using MantType = If<(MantBits <= 24), uint32_t, uint64_t>;
+    static MantType const MaxMant = (MantType)1 << MantBits;
+    
+    char const *ptr = str;
+    
+    bool negative = (*ptr == '-');
+    if (negative || *ptr == '+') {
+        ptr++;
+    }
+    
+    MantType mant = 0;
+    int frac_digits = 0;
+    bool have_digits = false;
+    bool in_frac = false;
+    
+    while (true) {
+        char ch = *ptr;
+        if (ch >= '0' && ch <= '9') {
+            mant = 10 * mant + (ch - '0');
+            if (AMBRO_UNLIKELY(mant > MaxMant)) {
+                goto slow;
+            }
+            frac_digits += in_frac;
+            have_digits = true;
+        }
+        else if (ch == '.' && !in_frac) {
+            in_frac = true;
+        }
+        else {
+            break;
+        }
+        ptr++;
+    }
+    
+    if (AMBRO_UNLIKELY(*ptr != '\0' || !have_digits)) {
+        goto slow;
+    }
+    
+    while (AMBRO_UNLIKELY(frac_digits > MaxPow10)) {
+        if (mant % 10 != 0) {
+            goto slow;
+        }
+        mant /= 10;
+        frac_digits--;
+    }
+    
+    {
+        T scale = 1.0f;
+        for (int i = 0; i < frac_digits; i++) {
+            scale *= 10.0f;
+        }
+        
+        T result = (T)mant / scale;
+        return negative ? -result : result;
+    }
+    
+slow:
+#endif
+    return StrToFloat<T>(str, nullptr);
+}
+
 double FloatLdexp (double x, int exp)
 {
     return ldexp(x, exp);
@@ -1196,6 +1196,20 @@ private:
             return m_have_request_body;
         }
         
+        // Returns whether the length of the request body is known in advance
+        // (Content-Length without chunked encoding), and if so, provides it.
+        bool getRequestBodyLength (Context c, uint64_t *out_length)
+        {
+            AMBRO_ASSERT(m_state == State::HEAD_RECEIVED)
+            AMBRO_ASSERT(m_recv_state == RecvState::NOT_STARTED)
+            
+            if (!m_have_content_length || m_have_chunked) {
+                return false;
+            }
+            *out_length = m_rem_req_body_length;
+            return true;
+        }
+        
         void setCallback (Context c, RequestUserCallback *callback)
         {
             AMBRO_ASSERT(m_state == State::HEAD_RECEIVED)
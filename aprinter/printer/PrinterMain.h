@@ -89,6 +89,7 @@ APRINTER_ALIAS_STRUCT(PrinterMainParams, (
     APRINTER_AS_VALUE(int, StepperSegmentBufferSize),
     APRINTER_AS_VALUE(int, LookaheadBufferSize),
     APRINTER_AS_VALUE(int, LookaheadCommitCount),
+    APRINTER_AS_TYPE(PlannerService),
     APRINTER_AS_TYPE(ForceTimeout),
     APRINTER_AS_TYPE(FpType),
     APRINTER_AS_TYPE(WatchdogService),
@@ -235,6 +236,7 @@ public:
     
 public:
     using FpType = typename Params::FpType;
+    using PlannerService = typename Params::PlannerService;
     using Config = ConfigFramework<TheConfigManager, TheConfigCache>;
     static const int NumAxes = TypeListLength<ParamsAxesList>::Value;
     static const bool IsTransformEnabled = TransformParams::Enabled;
@@ -2118,7 +2120,7 @@ private:
 public:
     APRINTER_MAKE_INSTANCE(ThePlanner, (MotionPlannerArg<
         Context, typename PlannerUnionPlanner::Object, Config, MotionPlannerAxes, Params::StepperSegmentBufferSize,
-        Params::LookaheadBufferSize, Params::LookaheadCommitCount, FpType, MaxStepsPerCycle,
+        Params::LookaheadBufferSize, Params::LookaheadCommitCount, typename Params::PlannerService, FpType, MaxStepsPerCycle,
         PlannerPullHandler, PlannerFinishedHandler, PlannerAbortedHandler, PlannerUnderrunCallback,
         MotionPlannerChannels, MotionPlannerLasers
     >))
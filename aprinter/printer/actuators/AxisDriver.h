@@ -35,11 +35,14 @@
 #include <aprinter/meta/StructIf.h>
 #include <aprinter/meta/ConstexprMath.h>
 #include <aprinter/meta/ServiceUtils.h>
+#include <aprinter/meta/ChooseInt.h>
 #include <aprinter/base/Object.h>
 #include <aprinter/math/StoredNumber.h>
 #include <aprinter/base/DebugObject.h>
 #include <aprinter/base/Assert.h>
 #include <aprinter/base/Hints.h>
+#include <aprinter/base/Lock.h>
+#include <aprinter/system/InterruptLock.h>
 #include <aprinter/misc/ClockUtils.h>
 #include <aprinter/printer/actuators/AxisDriverConsumer.h>
 
@@ -85,11 +88,13 @@ private:
     static const int rel_t_extra_prec = Params::PrecisionParams::rel_t_extra_prec;
     static const int amul_shift = 2 * (1 + discriminant_prec);
     static bool const PreloadCommands = Params::PreloadCommands;
+    static int const StepTimesBufferSize = Params::StepTimesBufferSize;
     
     struct TimerHandler;
     
 public:
     struct Object;
+    struct Command;
     using Clock = typename Context::Clock;
     using TimeType = typename Clock::TimeType;
     APRINTER_MAKE_INSTANCE(TimerInstance, (Params::TimerService::template InterruptTimer<Context, Object, TimerHandler>))
@@ -128,6 +133,16 @@ private:
             return accel.template undoShiftBitsLeft<(amul_shift-discriminant_prec)>();
         }
         
+        static ADiscShiftedType get_a_disc (CommandAccelType accel)
+        {
+            return accel.template undoShiftBitsLeft<(amul_shift-discriminant_prec)>();
+        }
+        
+        static AMulType get_a_mul (CommandAccelType accel)
+        {
+            return accel;
+        }
+        
         template <typename TheCommand>
         AMBRO_ALWAYS_INLINE
         static AMulType get_a_mul_for_step (Context c, TheCommand *command)
@@ -157,6 +172,16 @@ private:
             return accel.template shiftBits<(-discriminant_prec)>();
         }
         
+        static ADiscShiftedType get_a_disc (CommandAccelType accel)
+        {
+            return accel.template shiftBits<(-discriminant_prec)>();
+        }
+        
+        static AMulType get_a_mul (CommandAccelType accel)
+        {
+            return accel.template shiftBits<(-amul_shift)>();
+        }
+        
         template <typename TheCommand>
         AMBRO_ALWAYS_INLINE
         static AMulType get_a_mul_for_step (Context c, TheCommand *command)
@@ -167,11 +192,178 @@ private:
         }
     };
     
+    // Optional mode where the step times are computed in the main loop
+    // ahead of time (see precomputeCommand), so that for these commands
+    // the timer handler only needs to pop the next time from a buffer.
+    // Each buffer entry is the time of a step relative to the end of its
+    // command, which is exactly what the analytic mode computes for
+    // accelerating commands. Commands which were not precomputed in time
+    // are stepped analytically.
+    AMBRO_STRUCT_IF(StepTimesFeature, (StepTimesBufferSize > 0)) {
+        static_assert(StepTimesBufferSize >= 2, "StepTimesBufferSize must be at least 2");
+        
+        // With precomputed times, there is next to nothing between stepOn() and stepOff(),
+        // so only the configured step high time ensures that the driver registers the step.
+        static_assert(DelayParams::Enabled, "StepTimesBufferSize requires step delays (DelayParams)");
+        
+        using IndexType = ChooseIntForMax<StepTimesBufferSize, false>;
+        
+        struct CommandExtra {
+            bool precomputed;
+        };
+        
+        static void init_command (CommandExtra *cmd)
+        {
+            cmd->precomputed = false;
+        }
+        
+        static void reset (Context c)
+        {
+            auto *o = Object::self(c);
+            o->m_active = false;
+            o->m_read = 0;
+            o->m_write = 0;
+        }
+        
+        template <typename ThisContext>
+        AMBRO_ALWAYS_INLINE
+        static bool load_command (ThisContext c, CommandExtra const *cmd)
+        {
+            auto *o = Object::self(c);
+            o->m_active = cmd->precomputed;
+            return o->m_active;
+        }
+        
+        template <typename ThisContext>
+        AMBRO_ALWAYS_INLINE
+        static bool is_active (ThisContext c)
+        {
+            auto *o = Object::self(c);
+            return o->m_active;
+        }
+        
+        template <typename ThisContext>
+        AMBRO_ALWAYS_INLINE
+        static TimeType pop_time (ThisContext c)
+        {
+            auto *o = Object::self(c);
+            TimeType time = o->m_times[o->m_read];
+            o->m_read = inc(o->m_read);
+            return time;
+        }
+        
+        template <typename CheckPending>
+        static bool precompute_command (Context c, Command *cmd, CheckPending check_pending)
+        {
+            auto *o = Object::self(c);
+            
+            DirStepFixedType dir_x = cmd->dir_x;
+            StepFixedType x = StepFixedType::importBits(dir_x.bitsValue() & (((DirStepIntType)1 << step_bits) - 1));
+            if (x.bitsValue() == 0 || x.bitsValue() >= StepTimesBufferSize) {
+                return true;
+            }
+            
+            IndexType read;
+            AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
+                read = o->m_read;
+            }
+            IndexType used = (o->m_write >= read) ? (o->m_write - read) : (StepTimesBufferSize - (read - o->m_write));
+            if (x.bitsValue() > (StepTimesBufferSize - 1) - used) {
+                return false;
+            }
+            
+            // This follows the computations in load_command() and timer_handler() exactly.
+            bool notdecel = (dir_x.bitsValue() & ((DirStepIntType)1 << (step_bits + 1)));
+            auto xs = x.toSigned().template shiftBits<(-discriminant_prec)>();
+            ADiscShiftedType a = AccelShiftMode::get_a_disc(cmd->accel);
+            AMulType a_mul = AccelShiftMode::get_a_mul(cmd->accel);
+            auto x_minus_a = (xs - a).toUnsignedUnsafe();
+            V0Type v0;
+            StepFixedType pos;
+            if (notdecel) {
+                v0 = (xs + a).toUnsignedUnsafe();
+                pos = StepFixedType::importBits(x.bitsValue() - 1);
+            } else {
+                v0 = x_minus_a;
+                pos = StepFixedType::importBits(1);
+            }
+            DiscriminantType discriminant;
+            discriminant.m_bits.m_int = (x_minus_a * x_minus_a).bitsValue();
+            auto t_mul = TimeMulFixedType::importBits(TMulStored::retrieve(cmd->t_mul_stored));
+            TimeType duration = t_mul.template bitsTo<time_bits>().bitsValue();
+            
+            IndexType write = o->m_write;
+            while (true) {
+                discriminant.m_bits.m_int += a_mul.m_bits.m_int;
+                auto q = (v0 + FixedSquareRoot<true>(discriminant)).template shift<-1>();
+                auto t_frac = FixedFracDivide<rel_t_extra_prec>(pos, q);
+                TimeFixedType t = FixedResMultiply(t_mul, t_frac);
+                
+                if (notdecel) {
+                    o->m_times[write] = t.bitsValue();
+                    write = inc(write);
+                    if (pos.bitsValue() == 0) {
+                        break;
+                    }
+                    pos.m_bits.m_int--;
+                } else {
+                    if (pos == x) {
+                        o->m_times[write] = 0;
+                        write = inc(write);
+                        break;
+                    }
+                    o->m_times[write] = duration - (TimeType)t.bitsValue();
+                    write = inc(write);
+                    pos.m_bits.m_int++;
+                }
+            }
+            
+            // Publish the times, unless the command was already taken by the
+            // timer handler in the meantime.
+            AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
+                if (check_pending()) {
+                    cmd->precomputed = true;
+                    o->m_write = write;
+                }
+            }
+            
+            return true;
+        }
+        
+        static IndexType inc (IndexType a)
+        {
+            a++;
+            if (AMBRO_UNLIKELY(a == StepTimesBufferSize)) {
+                a = 0;
+            }
+            return a;
+        }
+        
+        struct Object : public ObjBase<StepTimesFeature, typename AxisDriver::Object, EmptyTypeList> {
+            bool m_active;
+            IndexType m_read;
+            IndexType m_write;
+            TimeType m_times[StepTimesBufferSize];
+        };
+    }
+    AMBRO_STRUCT_ELSE(StepTimesFeature) {
+        struct CommandExtra {};
+        static void init_command (CommandExtra *cmd) {}
+        static void reset (Context c) {}
+        template <typename ThisContext> static bool load_command (ThisContext c, CommandExtra const *cmd) { return false; }
+        template <typename ThisContext> static bool is_active (ThisContext c) { return false; }
+        template <typename ThisContext> static TimeType pop_time (ThisContext c) { return 0; }
+        template <typename CheckPending> static bool precompute_command (Context c, Command *cmd, CheckPending check_pending) { return true; }
+        struct Object {};
+    };
+    
 public:
     static constexpr double AsyncMinStepTime() { return DelayFeature::AsyncMinStepTime(); }
     static constexpr double SyncMinStepTime() { return DelayFeature::SyncMinStepTime(); }
     
-    struct Command {
+    static bool const PrecomputesSteps = (StepTimesBufferSize > 0);
+    
+    struct Command : public StepTimesFeature::CommandExtra {
         DirStepFixedType dir_x;
         typename AccelShiftMode::CommandAccelType accel;
         TMulStored t_mul_stored;
@@ -190,6 +382,7 @@ public:
             ((DirStepIntType)(a.bitsValue() >= 0) << (step_bits + 1))
         );
         cmd->accel = AccelShiftMode::make_command_accel(a);
+        StepTimesFeature::init_command(cmd);
     }
     
     static void init (Context c)
@@ -197,6 +390,7 @@ public:
         auto *o = Object::self(c);
         
         TimerInstance::init(c);
+        StepTimesFeature::reset(c);
 #ifdef AMBROLIB_ASSERTIONS
         o->m_running = false;
 #endif
@@ -255,6 +449,7 @@ public:
         TheDebugObject::access(c);
         
         TimerInstance::unset(c);
+        StepTimesFeature::reset(c);
 #ifdef AMBROLIB_ASSERTIONS
         o->m_running = false;
 #endif
@@ -284,6 +479,26 @@ public:
         return StepFixedType::importBits(cmd->dir_x.bitsValue() & (((DirStepIntType)1 << step_bits) - 1));
     }
     
+    /**
+     * Computes the step times of a command ahead of time, if precomputation
+     * is enabled (PrecomputesSteps). This is called from the main loop for
+     * commands which have been committed but not yet been taken by the timer
+     * handler, in the order in which they will be executed.
+     * 
+     * check_pending is called with interrupts disabled and must return whether
+     * the command has still not been taken by the timer handler. Returns false
+     * if there is currently no space for the step times of this command, in
+     * which case it should be retried later. Commands which have too many
+     * steps to ever fit are left for the analytic computation.
+     */
+    template <typename CheckPending>
+    static bool precomputeCommand (Context c, Command *cmd, CheckPending check_pending)
+    {
+        TheDebugObject::access(c);
+        
+        return StepTimesFeature::precompute_command(c, cmd, check_pending);
+    }
+    
 #ifdef AXISDRIVER_DETECT_OVERLOAD
     static bool overloadOccurred (Context c)
     {
@@ -357,6 +572,13 @@ private:
             return true;
         }
         
+        if (StepTimesFeature::load_command(c, command)) {
+            o->m_notdecel = true;
+            o->m_pos = StepFixedType::importBits(x.bitsValue() - 1);
+            o->m_time += TimeMulFixedType::importBits(TMulStored::retrieve(command->t_mul_stored)).template bitsTo<time_bits>().bitsValue();
+            return false;
+        }
+        
         auto xs = x.toSigned().template shiftBits<(-discriminant_prec)>();
         auto command_accel = AccelShiftMode::CommandAccelType::importBits(volatile_read(command->accel.m_bits.m_int));
         ADiscShiftedType a = AccelShiftMode::compute_accel_for_load(c, command_accel);
@@ -443,44 +665,57 @@ private:
             Stepper::stepOn(c);
             DelayFeature::set_step_timer_for_high(c);
             
-            // We need to ensure that the step signal is sufficiently long for the stepper driver
-            // to register. To this end, we do the timely calculations in between stepOn and stepOff().
-            // But to prevent the compiler from moving upwards any significant part of the calculation,
-            // we do a volatile read of the discriminant (an input to the calculation).
-            
-            auto discriminant_bits = volatile_read(o->m_discriminant.m_bits.m_int);
-            o->m_discriminant.m_bits.m_int = discriminant_bits + AccelShiftMode::get_a_mul_for_step(c, current_command).m_bits.m_int;
-            AMBRO_ASSERT(o->m_discriminant.bitsValue() >= 0)
-            
-            auto q = (o->m_v0 + FixedSquareRoot<true>(o->m_discriminant, OptionForceInline())).template shift<-1>();
-            
-            auto t_frac = FixedFracDivide<rel_t_extra_prec>(o->m_pos, q, OptionForceInline());
-            
-            auto t_mul = TimeMulFixedType::importBits(TMulStored::retrieve(current_command->t_mul_stored));
-            TimeFixedType t = FixedResMultiply(t_mul, t_frac);
-            
-            // Now make sure the calculations above happen before stepOff().
-            volatile_write(o->m_dummy, (uint8_t)t.bitsValue());
-            
-            DelayFeature::wait_for_step_high(c);
-            Stepper::stepOff(c);
-            DelayFeature::set_step_timer_for_low(c);
-            
-            if (AMBRO_LIKELY(!o->m_notdecel)) {
-                if (AMBRO_LIKELY(o->m_pos == o->m_x)) {
-                    o->m_time += t_mul.template bitsTo<time_bits>().bitsValue();
-                    o->m_notend = false;
-                    next_time = o->m_time;
-                } else {
-                    o->m_pos.m_bits.m_int++;
-                    next_time = (o->m_time + t.bitsValue());
-                }
-            } else {
+            if (StepTimesFeature::is_active(c)) {
+                next_time = o->m_time - StepTimesFeature::pop_time(c);
+                
+                DelayFeature::wait_for_step_high(c);
+                Stepper::stepOff(c);
+                DelayFeature::set_step_timer_for_low(c);
+                
                 if (o->m_pos.bitsValue() == 0) {
                     o->m_notend = false;
                 }
                 o->m_pos.m_bits.m_int--;
-                next_time = (o->m_time - t.bitsValue());
+            } else {
+                // We need to ensure that the step signal is sufficiently long for the stepper driver
+                // to register. To this end, we do the timely calculations in between stepOn and stepOff().
+                // But to prevent the compiler from moving upwards any significant part of the calculation,
+                // we do a volatile read of the discriminant (an input to the calculation).
+                
+                auto discriminant_bits = volatile_read(o->m_discriminant.m_bits.m_int);
+                o->m_discriminant.m_bits.m_int = discriminant_bits + AccelShiftMode::get_a_mul_for_step(c, current_command).m_bits.m_int;
+                AMBRO_ASSERT(o->m_discriminant.bitsValue() >= 0)
+                
+                auto q = (o->m_v0 + FixedSquareRoot<true>(o->m_discriminant, OptionForceInline())).template shift<-1>();
+                
+                auto t_frac = FixedFracDivide<rel_t_extra_prec>(o->m_pos, q, OptionForceInline());
+                
+                auto t_mul = TimeMulFixedType::importBits(TMulStored::retrieve(current_command->t_mul_stored));
+                TimeFixedType t = FixedResMultiply(t_mul, t_frac);
+                
+                // Now make sure the calculations above happen before stepOff().
+                volatile_write(o->m_dummy, (uint8_t)t.bitsValue());
+                
+                DelayFeature::wait_for_step_high(c);
+                Stepper::stepOff(c);
+                DelayFeature::set_step_timer_for_low(c);
+                
+                if (AMBRO_LIKELY(!o->m_notdecel)) {
+                    if (AMBRO_LIKELY(o->m_pos == o->m_x)) {
+                        o->m_time += t_mul.template bitsTo<time_bits>().bitsValue();
+                        o->m_notend = false;
+                        next_time = o->m_time;
+                    } else {
+                        o->m_pos.m_bits.m_int++;
+                        next_time = (o->m_time + t.bitsValue());
+                    }
+                } else {
+                    if (o->m_pos.bitsValue() == 0) {
+                        o->m_notend = false;
+                    }
+                    o->m_pos.m_bits.m_int--;
+                    next_time = (o->m_time - t.bitsValue());
+                }
             }
         } else {
             DelayFeature::wait_for_step_low(c);
@@ -605,7 +840,8 @@ public:
     struct Object : public ObjBase<AxisDriver, ParentObject, MakeTypeList<
         TheDebugObject,
         TimerInstance,
-        DelayFeature
+        DelayFeature,
+        StepTimesFeature
     >>, public AccelShiftMode::ExtraMembers
     {
 #ifdef AMBROLIB_ASSERTIONS
@@ -644,7 +880,8 @@ APRINTER_ALIAS_STRUCT_EXT(AxisDriverService, (
     APRINTER_AS_TYPE(TimerService),
     APRINTER_AS_TYPE(PrecisionParams),
     APRINTER_AS_VALUE(bool, PreloadCommands),
-    APRINTER_AS_TYPE(DelayParams)
+    APRINTER_AS_TYPE(DelayParams),
+    APRINTER_AS_VALUE(int, StepTimesBufferSize)
 ), (
     APRINTER_ALIAS_STRUCT_EXT(Driver, (
         APRINTER_AS_TYPE(Context),
@@ -71,6 +71,11 @@ private:
     struct FsInitHandler;
     struct FsWriteMountHandler;
     APRINTER_MAKE_INSTANCE(TheFs, (Params::FsService::template Fs<Context, typename UnionFsPart::Object, TheBlockAccess, FsInitHandler, FsWriteMountHandler>))
+    using TheFile = typename TheFs::template File<false>;
+    
+    // With read hinting, file data is read through the block cache so that
+    // blocks brought in by read-ahead are used, and copied into the caller's buffer.
+    static typename TheFile::IoMode const FileIoMode = TheFs::EnableReadHinting ? TheFile::IoMode::FS_BUFFER : TheFile::IoMode::USER_BUFFER;
     
     static size_t const BlockSize = TheBlockAccess::BlockSize;
     static size_t const DirListReplyRequestExtra = 24;
@@ -153,17 +158,24 @@ public:
         o->file_state = FILE_STATE_PAUSED;
     }
     
-    static bool rewind (Context c, typename ThePrinterMain::TheCommand *err_output)
+    // Seeking to a nonzero offset is done when the next read is started.
+    static bool seek (Context c, typename ThePrinterMain::TheCommand *err_output, uint32_t offset)
     {
         auto *o = Object::self(c);
         auto *fs_o = UnionFsPart::Object::self(c);
         TheDebugObject::access(c);
         AMBRO_ASSERT(o->file_state == FILE_STATE_INACTIVE || o->file_state == FILE_STATE_PAUSED)
+        AMBRO_ASSERT(offset % BlockSize == 0)
         
         if (!check_file_paused(c, err_output)) {
             return false;
         }
+        if (offset > fs_o->file.getFileSize(c)) {
+            err_output->reply_append_error(c, AMBRO_PSTR("SeekPastEnd"));
+            return false;
+        }
         fs_o->file.rewind(c);
+        fs_o->seek_offset = offset;
         o->file_eof = false;
         ClientParams::ClearBufferHandler::call(c);
         return true;
@@ -195,7 +207,12 @@ public:
         AMBRO_ASSERT(o->file_state == FILE_STATE_RUNNING)
         AMBRO_ASSERT(!o->file_eof)
         
-        fs_o->file.startReadUserBuf(c, buf);
+        fs_o->read_buffer = buf;
+        if (fs_o->seek_offset != 0) {
+            fs_o->file.startSeek(c, fs_o->seek_offset);
+        } else {
+            start_file_read(c);
+        }
         o->file_state = FILE_STATE_READING;
     }
     
@@ -715,7 +732,8 @@ private:
                     fs_o->file.deinit(c);
                 }
                 
-                fs_o->file.init(c, entry, APRINTER_CB_STATFUNC_T(&SdFatInput::file_handler));
+                fs_o->file.init(c, entry, APRINTER_CB_STATFUNC_T(&SdFatInput::file_handler), FileIoMode);
+                fs_o->seek_offset = 0;
                 o->file_state = FILE_STATE_PAUSED;
                 o->file_eof = false;
                 ClientParams::ClearBufferHandler::call(c);
@@ -770,14 +788,36 @@ private:
         o->listing_state = LISTING_STATE_INACTIVE;
     }
     
+    static void start_file_read (Context c)
+    {
+        auto *fs_o = UnionFsPart::Object::self(c);
+        
+        if (TheFs::EnableReadHinting) {
+            fs_o->file.startRead(c);
+        } else {
+            fs_o->file.startReadUserBuf(c, fs_o->read_buffer);
+        }
+    }
+    
     static void file_handler (Context c, bool is_error, size_t length)
     {
         auto *o = Object::self(c);
+        auto *fs_o = UnionFsPart::Object::self(c);
         TheDebugObject::access(c);
         AMBRO_ASSERT(o->init_state == INIT_STATE_DONE)
         AMBRO_ASSERT(o->file_state == FILE_STATE_READING)
         AMBRO_ASSERT(!o->file_eof)
         
+        if (fs_o->seek_offset != 0 && !is_error) {
+            fs_o->seek_offset = 0;
+            return start_file_read(c);
+        }
+        
+        if (TheFs::EnableReadHinting && !is_error && length > 0) {
+            memcpy(fs_o->read_buffer, fs_o->file.getReadPointer(c), length);
+            fs_o->file.finishRead(c);
+        }
+        
         if (!is_error && length < BlockSize) {
             o->file_eof = true;
         }
@@ -1010,7 +1050,9 @@ private:
             TheFs
         >> {
             typename TheFs::FsEntry current_directory;
-            typename TheFs::template File<false> file;
+            TheFile file;
+            DataWordType *read_buffer;
+            uint32_t seek_offset;
         };
     };
     
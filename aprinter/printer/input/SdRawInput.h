@@ -100,16 +100,21 @@ public:
         o->state = STATE_PAUSED;
     }
     
-    static bool rewind (Context c, typename ThePrinterMain::TheCommand *cmd)
+    static bool seek (Context c, typename ThePrinterMain::TheCommand *cmd, uint32_t offset)
     {
         auto *o = Object::self(c);
         TheDebugObject::access(c);
         AMBRO_ASSERT(o->state <= STATE_PAUSED)
+        AMBRO_ASSERT(offset % BlockSize == 0)
         
         if (!check_file_paused(c, cmd)) {
             return false;
         }
-        o->block = 0;
+        if (offset / BlockSize > TheSdCard::getCapacityBlocks(c)) {
+            cmd->reportError(c, AMBRO_PSTR("SeekPastEnd"));
+            return false;
+        }
+        o->block = offset / BlockSize;
         ClientParams::ClearBufferHandler::call(c);
         return true;
     }
@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef APRINTER_EVENT_LOOP_PROFILING_MODULE_H
+#define APRINTER_EVENT_LOOP_PROFILING_MODULE_H
+
+#include <stdint.h>
+
+#include <type_traits>
+
+#include <aprinter/meta/ServiceUtils.h>
+#include <aprinter/meta/AliasStruct.h>
+#include <aprinter/base/ProgramMemory.h>
+#include <aprinter/system/EventLoopProfiler.h>
+#include <aprinter/printer/utils/ModuleUtils.h>
+
+namespace APrinter {
+
+/*
+ * Reports the dispatch statistics of the event loop, which must have
+ * been built with EVENTLOOP_PROFILING defined.
+ * 
+ * M949 prints one line per handler which was dispatched: the kind
+ * (Q=queued, T=timed, D=fd, F=fast event index, O=overflow), the
+ * handler address, the dispatch count and the total and maximum
+ * runtime in microseconds. M949 R additionally resets the statistics.
+ */
+
+template <typename ModuleArg>
+class EventLoopProfilingModule {
+    APRINTER_UNPACK_MODULE_ARG(ModuleArg)
+    
+    using Clock = typename Context::Clock;
+    using Loop = typename Context::EventLoop;
+    using TheCommand = typename ThePrinterMain::TheCommand;
+    using FpType = typename ThePrinterMain::FpType;
+
+public:
+    static bool check_command (Context c, TheCommand *cmd)
+    {
+        if (cmd->getCmdNumber(c) == 949) {
+            if (!cmd->tryUnplannedCommand(c)) {
+                return false;
+            }
+            print_stats(c, cmd);
+            if (cmd->find_command_param(c, 'R', nullptr)) {
+                Loop::getProfiler(c)->reset();
+            }
+            cmd->finishCommand(c);
+            return false;
+        }
+        return true;
+    }
+
+private:
+    template <typename Stat>
+    static void print_stat (Context c, TheCommand *cmd, Stat const *stat)
+    {
+        FpType us_per_tick = 1000000.0 / Clock::time_freq;
+        
+        cmd->reply_append_pstr(c, AMBRO_PSTR(" n="));
+        cmd->reply_append_uint32(c, stat->count);
+        cmd->reply_append_pstr(c, AMBRO_PSTR(" tot="));
+        cmd->reply_append_fp(c, stat->total * us_per_tick);
+        cmd->reply_append_pstr(c, AMBRO_PSTR(" max="));
+        cmd->reply_append_fp(c, stat->max * us_per_tick);
+        cmd->reply_append_ch(c, '\n');
+        cmd->reply_poke(c);
+    }
+    
+    static void print_address (Context c, TheCommand *cmd, void const *addr)
+    {
+        uintptr_t value = (uintptr_t)addr;
+        char buf[2 + 2 * sizeof(value)];
+        buf[0] = '0';
+        buf[1] = 'x';
+        for (int i = 0; i < 2 * (int)sizeof(value); i++) {
+            int digit = (value >> (4 * (2 * sizeof(value) - 1 - i))) & 0xF;
+            buf[2 + i] = (digit < 10) ? ('0' + digit) : ('a' + (digit - 10));
+        }
+        cmd->reply_append_buffer(c, buf, sizeof(buf));
+    }
+    
+    static void print_stats (Context c, TheCommand *cmd)
+    {
+        auto *profiler = Loop::getProfiler(c);
+        using Profiler = typename std::remove_pointer<decltype(profiler)>::type;
+        
+        for (int i = 0; i < Profiler::NumHandlerSlots; i++) {
+            auto const *entry = profiler->getHandlerEntry(i);
+            if (entry->kind == EventLoopProfilerKind::UNUSED) {
+                continue;
+            }
+            char kind_ch = (entry->kind == EventLoopProfilerKind::QUEUED) ? 'Q' :
+                           (entry->kind == EventLoopProfilerKind::TIMED) ? 'T' : 'D';
+            cmd->reply_append_ch(c, kind_ch);
+            cmd->reply_append_ch(c, ' ');
+            print_address(c, cmd, entry->handler);
+            print_stat(c, cmd, &entry->stat);
+        }
+        
+        for (int i = 0; i < Profiler::NumFastEvents; i++) {
+            auto const *stat = profiler->getFastStat(i);
+            if (stat->count == 0) {
+                continue;
+            }
+            cmd->reply_append_ch(c, 'F');
+            cmd->reply_append_ch(c, ' ');
+            cmd->reply_append_uint32(c, i);
+            print_stat(c, cmd, stat);
+        }
+        
+        auto const *overflow = profiler->getOverflowStat();
+        if (overflow->count != 0) {
+            cmd->reply_append_ch(c, 'O');
+            print_stat(c, cmd, overflow);
+        }
+    }
+
+public:
+    struct Object {};
+};
+
+struct EventLoopProfilingModuleService {
+    APRINTER_MODULE_TEMPLATE(EventLoopProfilingModuleService, EventLoopProfilingModule)
+};
+
+}
+
+#endif
@@ -0,0 +1,406 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef APRINTER_FS_BENCH_MODULE_H
+#define APRINTER_FS_BENCH_MODULE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <aprinter/meta/MinMax.h>
+#include <aprinter/meta/ServiceUtils.h>
+#include <aprinter/base/Object.h>
+#include <aprinter/base/DebugObject.h>
+#include <aprinter/base/Assert.h>
+#include <aprinter/base/ProgramMemory.h>
+#include <aprinter/base/Callback.h>
+#include <aprinter/fs/BufferedFile.h>
+#include <aprinter/fs/DirLister.h>
+#include <aprinter/printer/utils/ModuleUtils.h>
+
+namespace APrinter {
+
+/*
+ * Filesystem benchmarks, timed from when the file or directory has been
+ * opened until the last operation completes. Files must already exist.
+ * 
+ * M950 F<file> [S<bytes>] - sequential write (default 1MiB)
+ * M951 F<file> - sequential read of the whole file
+ * M952 F<file> [N<reads>] [R<seed>] - random single-block reads (default 100)
+ * M953 [F<dir>] [N<passes>] - listing of a directory (default the current one)
+ * 
+ * The result line gives the bytes transferred, the number of operations
+ * (blocks, or directory entries), the time, the throughput and operation
+ * rate, the block cache hits and lookups, and the read and write commands
+ * and blocks issued to the block device by the cache.
+ */
+
+#define APRINTER_FSBENCH_DATA16 "0123456789ABCDEF"
+#define APRINTER_FSBENCH_DATA64 APRINTER_FSBENCH_DATA16 APRINTER_FSBENCH_DATA16 APRINTER_FSBENCH_DATA16 APRINTER_FSBENCH_DATA16
+#define APRINTER_FSBENCH_DATA256 APRINTER_FSBENCH_DATA64 APRINTER_FSBENCH_DATA64 APRINTER_FSBENCH_DATA64 APRINTER_FSBENCH_DATA64
+
+template <typename ModuleArg>
+class FsBenchModule {
+    APRINTER_UNPACK_MODULE_ARG(ModuleArg)
+    
+public:
+    struct Object;
+    
+private:
+    using TheDebugObject = DebugObject<Context, Object>;
+    using Clock = typename Context::Clock;
+    using TimeType = typename Clock::TimeType;
+    using FpType = typename ThePrinterMain::FpType;
+    using TheCommand = typename ThePrinterMain::TheCommand;
+    using TheFsAccess = typename ThePrinterMain::template GetFsAccess<>;
+    using TheFs = typename TheFsAccess::TheFileSystem;
+    using TheBufferedFile = BufferedFile<Context, TheFsAccess>;
+    using TheDirLister = DirLister<Context, TheFsAccess>;
+    
+    static size_t const BlockSize = TheFs::BlockSize;
+    
+    enum class Test : uint8_t {SEQ_WRITE, SEQ_READ, RANDOM_READ, DIR_LIST};
+    
+    enum class State : uint8_t {
+        IDLE,
+        FILE_OPEN, WRITE_DATA, WRITE_EOF, READ_DATA, RANDOM_SEEK, RANDOM_READ,
+        DIR_OPEN, DIR_ENTRY
+    };
+    
+    static char const * WriteData () { return APRINTER_FSBENCH_DATA256; }
+    static size_t const WriteDataSize = 256;
+    
+public:
+    static void init (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        o->buffered_file.init(c, APRINTER_CB_STATFUNC_T(&FsBenchModule::file_handler));
+        o->dir_lister.init(c, APRINTER_CB_STATFUNC_T(&FsBenchModule::dir_lister_handler));
+        o->state = State::IDLE;
+        
+        TheDebugObject::init(c);
+    }
+    
+    static void deinit (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::deinit(c);
+        
+        o->dir_lister.deinit(c);
+        o->buffered_file.deinit(c);
+    }
+    
+    static bool check_command (Context c, TheCommand *cmd)
+    {
+        TheDebugObject::access(c);
+        
+        auto cmd_number = cmd->getCmdNumber(c);
+        if (cmd_number >= 950 && cmd_number <= 953) {
+            handle_bench_command(c, cmd, (Test)(cmd_number - 950));
+            return false;
+        }
+        return true;
+    }
+    
+private:
+    static void handle_bench_command (Context c, TheCommand *cmd, Test test)
+    {
+        auto *o = Object::self(c);
+        
+        if (!cmd->tryLockedCommand(c)) {
+            return;
+        }
+        AMBRO_ASSERT(o->state == State::IDLE)
+        
+        o->test = test;
+        o->timing = false;
+        o->bytes = 0;
+        o->ops = 0;
+        
+        char const *name = cmd->get_command_param_str(c, 'F', nullptr);
+        
+        if (test == Test::DIR_LIST) {
+            o->count = cmd->get_command_param_uint32(c, 'N', 1);
+            o->dir_name = name ? name : "";
+            return start_dir_pass(c);
+        }
+        
+        if (!name) {
+            return complete_command(c, AMBRO_PSTR("NoFileSpecified"));
+        }
+        
+        auto mode = TheBufferedFile::OpenMode::OPEN_READ;
+        uint32_t size_hint = 0;
+        if (test == Test::SEQ_WRITE) {
+            o->count = cmd->get_command_param_uint32(c, 'S', UINT32_C(1048576));
+            mode = TheBufferedFile::OpenMode::OPEN_WRITE;
+            size_hint = o->count;
+        }
+        else if (test == Test::RANDOM_READ) {
+            o->count = cmd->get_command_param_uint32(c, 'N', 100);
+            o->random_state = cmd->get_command_param_uint32(c, 'R', 1);
+            if (o->random_state == 0) {
+                o->random_state = 1;
+            }
+        }
+        
+        o->buffered_file.startOpen(c, name, true, mode, nullptr, size_hint);
+        o->state = State::FILE_OPEN;
+    }
+    
+    static void start_timing (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        TheFs::resetCacheStats(c);
+        o->start_time = Clock::getTime(c);
+        o->timing = true;
+    }
+    
+    static void complete_command (Context c, AMBRO_PGM_P errstr)
+    {
+        auto *o = Object::self(c);
+        
+        o->buffered_file.reset(c);
+        o->dir_lister.reset(c);
+        o->state = State::IDLE;
+        
+        auto *cmd = ThePrinterMain::get_locked(c);
+        if (errstr) {
+            cmd->reportError(c, errstr);
+        }
+        cmd->finishCommand(c);
+    }
+    
+    // Needs to be called while the filesystem is still held open.
+    static void report_and_complete (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        TimeType elapsed = Clock::getTime(c) - o->start_time;
+        typename TheFs::CacheStats stats = TheFs::getCacheStats(c);
+        FpType seconds = elapsed * (FpType)(1.0 / Clock::time_freq);
+        
+        auto *cmd = ThePrinterMain::get_locked(c);
+        cmd->reply_append_pstr(c, AMBRO_PSTR("FsBench bytes="));
+        cmd->reply_append_uint32(c, o->bytes);
+        cmd->reply_append_pstr(c, AMBRO_PSTR(" ops="));
+        cmd->reply_append_uint32(c, o->ops);
+        cmd->reply_append_pstr(c, AMBRO_PSTR(" time="));
+        cmd->reply_append_fp(c, seconds);
+        if (seconds > 0.0f) {
+            cmd->reply_append_pstr(c, AMBRO_PSTR(" MB/s="));
+            cmd->reply_append_fp(c, o->bytes / (seconds * 1000000.0f));
+            cmd->reply_append_pstr(c, AMBRO_PSTR(" IOPS="));
+            cmd->reply_append_fp(c, o->ops / seconds);
+        }
+        cmd->reply_append_pstr(c, AMBRO_PSTR(" hits="));
+        cmd->reply_append_uint32(c, stats.hits);
+        cmd->reply_append_ch(c, '/');
+        cmd->reply_append_uint32(c, stats.hits + stats.misses);
+        cmd->reply_append_pstr(c, AMBRO_PSTR(" rd="));
+        cmd->reply_append_uint32(c, stats.read_ops);
+        cmd->reply_append_ch(c, '/');
+        cmd->reply_append_uint32(c, stats.read_blocks);
+        cmd->reply_append_pstr(c, AMBRO_PSTR(" wr="));
+        cmd->reply_append_uint32(c, stats.write_ops);
+        cmd->reply_append_ch(c, '/');
+        cmd->reply_append_uint32(c, stats.write_blocks);
+        cmd->reply_append_ch(c, '\n');
+        
+        return complete_command(c, nullptr);
+    }
+    
+    static void file_handler (Context c, typename TheBufferedFile::Error error, size_t read_length)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        if (error != TheBufferedFile::Error::NO_ERROR) {
+            return complete_command(c, (o->state == State::FILE_OPEN) ? AMBRO_PSTR("Open") : AMBRO_PSTR("Io"));
+        }
+        
+        switch (o->state) {
+            case State::FILE_OPEN: {
+                start_timing(c);
+                if (o->test == Test::SEQ_WRITE) {
+                    work_write(c);
+                }
+                else if (o->test == Test::SEQ_READ) {
+                    work_read(c);
+                }
+                else {
+                    o->file_blocks = o->buffered_file.getFileSize(c) / BlockSize;
+                    if (o->file_blocks == 0) {
+                        return complete_command(c, AMBRO_PSTR("FileTooSmall"));
+                    }
+                    work_random(c);
+                }
+            } break;
+            
+            case State::WRITE_DATA: {
+                work_write(c);
+            } break;
+            
+            case State::WRITE_EOF: {
+                o->ops = (o->bytes + (BlockSize - 1)) / BlockSize;
+                return report_and_complete(c);
+            } break;
+            
+            case State::READ_DATA: {
+                if (read_length == 0) {
+                    o->ops = (o->bytes + (BlockSize - 1)) / BlockSize;
+                    return report_and_complete(c);
+                }
+                o->bytes += read_length;
+                o->buffered_file.consumeReadRef(c, read_length);
+                work_read(c);
+            } break;
+            
+            case State::RANDOM_SEEK: {
+                o->buffered_file.startReadRef(c);
+                o->state = State::RANDOM_READ;
+            } break;
+            
+            case State::RANDOM_READ: {
+                o->bytes += read_length;
+                o->ops++;
+                o->buffered_file.consumeReadRef(c, read_length);
+                work_random(c);
+            } break;
+            
+            default: AMBRO_ASSERT(false);
+        }
+    }
+    
+    static void work_write (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        if (o->bytes == o->count) {
+            o->buffered_file.startWriteEof(c);
+            o->state = State::WRITE_EOF;
+            return;
+        }
+        
+        size_t amount = MinValue((uint32_t)WriteDataSize, (uint32_t)(o->count - o->bytes));
+        o->bytes += amount;
+        o->buffered_file.startWriteData(c, WriteData(), amount);
+        o->state = State::WRITE_DATA;
+    }
+    
+    static void work_read (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        o->buffered_file.startReadRef(c);
+        o->state = State::READ_DATA;
+    }
+    
+    static void work_random (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        if (o->ops == o->count) {
+            return report_and_complete(c);
+        }
+        
+        // xorshift32
+        uint32_t x = o->random_state;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        o->random_state = x;
+        
+        o->buffered_file.startSeek(c, (x % o->file_blocks) * BlockSize);
+        o->state = State::RANDOM_SEEK;
+    }
+    
+    static void start_dir_pass (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        if (o->state != State::IDLE) {
+            o->dir_lister.reset(c);
+        }
+        
+        o->dir_lister.startOpen(c, o->dir_name, true);
+        o->state = State::DIR_OPEN;
+    }
+    
+    static void dir_lister_handler (Context c, typename TheDirLister::Error error, char const *name, typename TheFs::FsEntry entry)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        AMBRO_ASSERT(o->state == State::DIR_OPEN || o->state == State::DIR_ENTRY)
+        
+        if (error != TheDirLister::Error::NO_ERROR) {
+            return complete_command(c, (o->state == State::DIR_OPEN) ? AMBRO_PSTR("Open") : AMBRO_PSTR("Io"));
+        }
+        
+        if (o->state == State::DIR_OPEN && !o->timing) {
+            start_timing(c);
+        }
+        else if (o->state == State::DIR_ENTRY) {
+            if (!name) {
+                if (o->count <= 1) {
+                    return report_and_complete(c);
+                }
+                o->count--;
+                return start_dir_pass(c);
+            }
+            o->ops++;
+        }
+        
+        o->dir_lister.requestEntry(c);
+        o->state = State::DIR_ENTRY;
+    }
+    
+public:
+    struct Object : public ObjBase<FsBenchModule, ParentObject, MakeTypeList<
+        TheDebugObject
+    >> {
+        TheBufferedFile buffered_file;
+        TheDirLister dir_lister;
+        State state;
+        Test test;
+        bool timing;
+        TimeType start_time;
+        uint32_t bytes;
+        uint32_t ops;
+        uint32_t count;
+        uint32_t random_state;
+        uint32_t file_blocks;
+        char const *dir_name;
+    };
+};
+
+struct FsBenchModuleService {
+    APRINTER_MODULE_TEMPLATE(FsBenchModuleService, FsBenchModule)
+};
+
+}
+
+#endif
@@ -54,8 +54,6 @@ private:
     
     enum class State : uint8_t {IDLE, WRITE_OPEN, WRITE_DATA, WRITE_EOF, READ_OPEN, READ_DATA};
     
-    static size_t const ReadBufferSize = 128;
-    
 public:
     static void init (Context c)
     {
@@ -126,7 +124,8 @@ private:
         }
         
         auto mode = is_write ? TheBufferedFile::OpenMode::OPEN_WRITE : TheBufferedFile::OpenMode::OPEN_READ;
-        o->buffered_file.startOpen(c, open_file_name, true, mode);
+        uint32_t size_hint = is_write ? o->write_size : 0;
+        o->buffered_file.startOpen(c, open_file_name, true, mode, nullptr, size_hint);
         o->state = is_write ? State::WRITE_OPEN : State::READ_OPEN;
     }
     
@@ -169,6 +168,7 @@ private:
                 if (read_length == 0) {
                     return complete_command(c, nullptr);
                 }
+                o->buffered_file.consumeReadRef(c, read_length);
                 work_read(c);
             } break;
             
@@ -199,7 +199,7 @@ private:
     {
         auto *o = Object::self(c);
         
-        o->buffered_file.startReadData(c, o->read_buffer, ReadBufferSize);
+        o->buffered_file.startReadRef(c);
         o->state = State::READ_DATA;
     }
     
@@ -209,16 +209,9 @@ public:
     >> {
         TheBufferedFile buffered_file;
         State state;
-        union {
-            struct {
-                char const *write_data;
-                size_t write_data_size;
-                uint32_t write_size;
-            };
-            struct {
-                char read_buffer[ReadBufferSize];
-            };
-        };
+        char const *write_data;
+        size_t write_data_size;
+        uint32_t write_size;
     };
 };
 
@@ -46,6 +46,7 @@
 #include <aprinter/printer/utils/GcodeCommand.h>
 #include <aprinter/printer/utils/ModuleUtils.h>
 #include <aprinter/printer/utils/JsonBuilder.h>
+#include <aprinter/printer/utils/LzStreamDecoder.h>
 
 namespace APrinter {
 
@@ -85,11 +86,32 @@ private:
     using ParserSizeType = ChooseIntForMax<MaxCommandSize, false>;
     using TheGcodeParser = typename Params::TheGcodeParserService::template Parser<Context, ParserSizeType, typename ThePrinterMain::FpType>;
     
+    // Commands are parsed into a ring of parsers, the first of which holds the
+    // command being executed (if any). The others are filled ahead of time from
+    // the data following it in the buffer, so that when a command finishes,
+    // the next one can be started right away.
+    static int const NumParsers = Params::PrefetchCommands + 1;
+    static_assert(NumParsers >= 1 && NumParsers <= 64, "");
+    
+    // Files starting with an LzStreamDecoder header are decompressed on the fly
+    // if DecompressWindowBits is nonzero. Reads then go to the staging block
+    // and are decoded from there into the buffer as space becomes available.
+    // Other files are read directly into the buffer, except for the first block
+    // which is needed to check for the header.
+    static int const DecompressWindowBits = Params::DecompressWindowBits;
+    static bool const Decompress = (DecompressWindowBits > 0);
+    using TheLzDecoder = LzStreamDecoder<DecompressWindowBits>;
+    static size_t const StagingSizeWords = Decompress ? (BlockSize / sizeof(DataWordType)) : 1;
+    
     static TimeType const BaseRetryTimeTicks = 0.5 * Context::Clock::time_freq;
     static int const ReadRetryCount = 5;
     
     enum {SDCARD_PAUSED, SDCARD_RUNNING, SDCARD_PAUSING};
     
+    enum {LZ_DETECT, LZ_RAW, LZ_ACTIVE, LZ_UNSUPPORTED, LZ_NO_SEEK};
+    
+    enum {FILE_FORMAT_UNKNOWN, FILE_FORMAT_RAW, FILE_FORMAT_COMPRESSED};
+    
 public:
     static void init (Context c)
     {
@@ -99,10 +121,12 @@ public:
         o->command_stream.setAcceptMsg(c, false);
         o->command_stream.setAutoOkAndPoke(c, false);
         o->m_next_event.init(c, APRINTER_CB_STATFUNC_T(&SdCardModule::next_event_handler));
+        o->m_parse_event.init(c, APRINTER_CB_STATFUNC_T(&SdCardModule::parse_event_handler));
         o->m_retry_timer.init(c, APRINTER_CB_STATFUNC_T(&SdCardModule::retry_timer_handler));
         o->m_state = SDCARD_PAUSED;
         o->m_echo_pending = true;
         o->m_poke_pending = false;
+        o->m_file_format = FILE_FORMAT_UNKNOWN;
         init_buffering(c);
     }
     
@@ -111,6 +135,7 @@ public:
         auto *o = Object::self(c);
         deinit_buffering(c);
         o->m_retry_timer.deinit(c);
+        o->m_parse_event.deinit(c);
         o->m_next_event.deinit(c);
         o->command_stream.deinit(c);
         TheInput::deinit(c);
@@ -172,18 +197,22 @@ private:
                 return;
             }
             
-            AMBRO_ASSERT(!o->gcode_parser.haveCommand(c))
-            AMBRO_ASSERT(o->gcode_parser.getLength(c) <= o->m_length)
+            AMBRO_ASSERT(o->m_num_parsed > 0)
+            
+            TheGcodeParser *parser = &o->gcode_parsers[o->m_parser_head];
+            AMBRO_ASSERT(!parser->haveCommand(c))
+            AMBRO_ASSERT(parser->getLength(c) <= o->m_parse_offset)
             
-            size_t cmd_len = o->gcode_parser.getLength(c);
+            size_t cmd_len = parser->getLength(c);
             o->m_start = buf_add(o->m_start, cmd_len);
             o->m_length -= cmd_len;
+            o->m_parse_offset -= cmd_len;
+            o->m_parser_head = parser_index(o->m_parser_head + 1);
+            o->m_num_parsed--;
             
             o->m_next_event.prependNowNotAlready(c);
             
-            if (!o->m_reading && can_read(c) && o->m_retry_counter == 0) {
-                start_read(c);
-            }
+            fill_buffer(c);
         }
         
         void reply_poke_impl (Context c, bool push)
@@ -284,9 +313,7 @@ private:
         o->m_retry_counter = 0;
         o->command_stream.clearError(c);
         
-        if (can_read(c)) {
-            start_read(c);
-        }
+        fill_buffer(c);
         
         if (!o->command_stream.maybeResumeCommand(c)) {
             o->m_next_event.prependNowNotAlready(c);
@@ -328,6 +355,7 @@ private:
             }
             AMBRO_ASSERT(o->m_state != SDCARD_PAUSING || o->m_reading)
             o->m_next_event.unset(c);
+            o->m_parse_event.unset(c);
             if (o->command_stream.getGcodeCommand(c) == &o->gcode_m400_command) {
                 o->command_stream.maybeCancelCommand(c);
             } else {
@@ -356,13 +384,31 @@ private:
                 break;
             }
             uint32_t seek_pos = cmd->get_command_param_uint32(c, 'S', 0);
-            if (seek_pos != 0) {
-                cmd->reportError(c, AMBRO_PSTR("CanOnlySeekToZero"));
+            if (seek_pos != 0 && !TheGcodeParser::CanStartMidStream) {
+                cmd->reportError(c, AMBRO_PSTR("SdSeekNotSupported"));
+                break;
+            }
+            uint8_t file_format = o->m_file_format;
+            if (seek_pos != 0 && file_format == FILE_FORMAT_COMPRESSED) {
+                cmd->reportError(c, AMBRO_PSTR("SdSeekCompressed"));
                 break;
             }
-            if (!TheInput::rewind(c, cmd)) {
+            // The input seeks to the start of the block, and the bytes before
+            // the requested position are dropped once they have been read.
+            // Whether the file is compressed can only be seen at its start, so
+            // if that is not known yet, the file is read from the start and
+            // a compressed file is refused then.
+            uint32_t seek_block_pos = (Decompress && file_format == FILE_FORMAT_UNKNOWN) ? 0 : (seek_pos - seek_pos % BlockSize);
+            if (!TheInput::seek(c, cmd, seek_block_pos)) {
                 cmd->reportError(c, nullptr);
+                break;
             }
+            // Seeking has cleared the buffer, but it is still the same file.
+            o->m_file_format = file_format;
+            if (file_format == FILE_FORMAT_RAW) {
+                o->m_lz_state = LZ_RAW;
+            }
+            o->m_skip_length = seek_pos - seek_block_pos;
         } while (false);
         cmd->finishCommand(c);
     }
@@ -373,21 +419,23 @@ private:
         AMBRO_ASSERT(o->m_state == SDCARD_RUNNING || o->m_state == SDCARD_PAUSING)
         buf_sanity(c);
         AMBRO_ASSERT(o->m_reading)
-        AMBRO_ASSERT(bytes_read <= BufferBaseSize - o->m_length)
+        AMBRO_ASSERT(!reading_raw(c) || bytes_read <= BufferBaseSize - o->m_length)
         AMBRO_ASSERT(!o->m_retry_timer.isSet(c))
         AMBRO_ASSERT(o->m_retry_counter <= ReadRetryCount)
         
         o->m_reading = false;
         
         if (!error) {
-            size_t write_offset = buf_add(o->m_start, o->m_length);
-            if (write_offset < WrapExtraSize) {
-                memcpy((char *)o->m_buffer + BufferBaseSize + write_offset, (char *)o->m_buffer + write_offset, MinValue(bytes_read, WrapExtraSize - write_offset));
-            }
-            if (bytes_read > BufferBaseSize - write_offset) {
-                memcpy((char *)o->m_buffer + BufferBaseSize, (char *)o->m_buffer, MinValue(bytes_read - (BufferBaseSize - write_offset), WrapExtraSize));
+            if (reading_raw(c)) {
+                buf_written(c, bytes_read);
+            } else {
+                o->m_staging_pos = 0;
+                o->m_staging_length = bytes_read;
+                if (o->m_lz_state == LZ_DETECT) {
+                    detect_compression(c);
+                }
+                decompress_staging(c);
             }
-            o->m_length += bytes_read;
         }
         
         if (o->m_state == SDCARD_PAUSING) {
@@ -413,8 +461,12 @@ private:
             }
         }
         
-        if (!o->command_stream.hasCommand(c) && !o->m_eof && !o->m_next_event.isSet(c)) {
-            o->m_next_event.prependNowNotAlready(c);
+        if (!o->command_stream.hasCommand(c)) {
+            if (!o->m_eof && !o->m_next_event.isSet(c)) {
+                o->m_next_event.prependNowNotAlready(c);
+            }
+        } else {
+            schedule_parse_ahead(c);
         }
     }
     struct InputReadHandler : public AMBRO_WFUNC_TD(&SdCardModule::input_read_handler) {};
@@ -427,6 +479,7 @@ private:
         o->command_stream.maybeCancelCommand(c);
         deinit_buffering(c);
         init_buffering(c);
+        o->m_file_format = FILE_FORMAT_UNKNOWN;
     }
     struct InputClearBufferHandler : public AMBRO_WFUNC_TD(&SdCardModule::clear_input_buffer) {};
     
@@ -445,35 +498,54 @@ private:
         AMBRO_ASSERT(!o->m_eof)
         
         AMBRO_PGM_P eof_str;
-        ParserSizeType avail;
-        bool line_buffer_exhausted;
         
         if (o->command_stream.haveError(c)) {
             eof_str = AMBRO_PSTR("//SdCmdError\n");
             goto eof;
         }
         
-        if (!o->gcode_parser.haveCommand(c)) {
-            o->gcode_parser.startCommand(c, (char *)o->m_buffer + o->m_start, 0);
+        while (o->m_skip_length > 0) {
+            AMBRO_ASSERT(o->m_num_parsed == 0)
+            AMBRO_ASSERT(o->m_parse_offset == 0)
+            size_t skip = MinValueU(o->m_skip_length, o->m_length);
+            o->m_start = buf_add(o->m_start, skip);
+            o->m_length -= skip;
+            o->m_skip_length -= skip;
+            fill_buffer(c);
+            if (o->m_skip_length > 0 && o->m_length == 0) {
+                goto no_data;
+            }
         }
         
-        avail = MinValue(MaxCommandSize, o->m_length);
-        line_buffer_exhausted = (avail == MaxCommandSize);
+        parse_ahead(c);
         
-        if (o->gcode_parser.extendCommand(c, avail, line_buffer_exhausted)) {
-            if (o->gcode_parser.getNumParts(c) == GCODE_ERROR_EOF) {
+        if (o->m_num_parsed > 0) {
+            TheGcodeParser *parser = &o->gcode_parsers[o->m_parser_head];
+            if (parser->getNumParts(c) == GCODE_ERROR_EOF) {
                 eof_str = AMBRO_PSTR("//SdEof\n");
                 goto eof;
             }
-            return o->command_stream.startCommand(c, &o->gcode_parser);
+            schedule_parse_ahead(c);
+            return o->command_stream.startCommand(c, parser);
         }
         
-        if (line_buffer_exhausted) {
+        if (o->m_parse_stopped) {
             eof_str = AMBRO_PSTR("//SdLnEr\n");
             goto eof;
         }
         
-        if (TheInput::eofReached(c)) {
+    no_data:
+        if (Decompress && o->m_lz_state == LZ_UNSUPPORTED) {
+            eof_str = AMBRO_PSTR("//SdLzUnsupported\n");
+            goto eof;
+        }
+        
+        if (Decompress && o->m_lz_state == LZ_NO_SEEK) {
+            eof_str = AMBRO_PSTR("//SdLzNoSeek\n");
+            goto eof;
+        }
+        
+        if (TheInput::eofReached(c) && (reading_raw(c) || (o->m_staging_pos == o->m_staging_length && !o->m_lz_decoder.hasPendingOutput()))) {
             eof_str = AMBRO_PSTR("//SdEnd\n");
             goto eof;
         }
@@ -490,6 +562,71 @@ private:
         return o->command_stream.startCommand(c, &o->gcode_m400_command);
     }
     
+    static void parse_event_handler (Context c)
+    {
+        auto *o = Object::self(c);
+        AMBRO_ASSERT(o->m_state == SDCARD_RUNNING)
+        
+        parse_ahead(c);
+    }
+    
+    static void schedule_parse_ahead (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        // Parse ahead with low priority, after whatever the current command
+        // is waiting for had a chance to run.
+        if (o->m_num_parsed < NumParsers && !o->m_parse_stopped && !o->m_parse_event.isSet(c)) {
+            o->m_parse_event.appendNowNotAlready(c);
+        }
+    }
+    
+    // Parses as many commands as there are free parsers and complete commands
+    // in the buffer. Parsing stops for good at the EOF command and when a
+    // command does not fit into MaxCommandSize.
+    static void parse_ahead (Context c)
+    {
+        auto *o = Object::self(c);
+        buf_sanity(c);
+        AMBRO_ASSERT(o->m_parse_offset <= o->m_length)
+        
+        if (o->m_skip_length > 0) {
+            return;
+        }
+        
+        while (o->m_num_parsed < NumParsers && !o->m_parse_stopped) {
+            int index = parser_index(o->m_parser_head + o->m_num_parsed);
+            TheGcodeParser *parser = &o->gcode_parsers[index];
+            
+            if (!parser->haveCommand(c)) {
+                parser->takeLineState(c, &o->gcode_parsers[parser_index(index + NumParsers - 1)]);
+                parser->startCommand(c, (char *)o->m_buffer + buf_add(o->m_start, o->m_parse_offset), 0);
+            }
+            
+            ParserSizeType avail = MinValue(MaxCommandSize, o->m_length - o->m_parse_offset);
+            bool line_buffer_exhausted = (avail == MaxCommandSize);
+            
+            if (!parser->extendCommand(c, avail, line_buffer_exhausted)) {
+                if (line_buffer_exhausted) {
+                    o->m_parse_stopped = true;
+                }
+                break;
+            }
+            
+            o->m_num_parsed++;
+            o->m_parse_offset += parser->getLength(c);
+            
+            if (parser->getNumParts(c) == GCODE_ERROR_EOF) {
+                o->m_parse_stopped = true;
+            }
+        }
+    }
+    
+    static int parser_index (int index)
+    {
+        return (index >= NumParsers) ? (index - NumParsers) : index;
+    }
+    
     static void retry_timer_handler (Context c)
     {
         auto *o = Object::self(c);
@@ -505,23 +642,45 @@ private:
     {
         auto *o = Object::self(c);
         
-        o->gcode_parser.init(c);
+        for (auto &parser : o->gcode_parsers) {
+            parser.init(c);
+        }
+        o->m_parser_head = 0;
+        o->m_num_parsed = 0;
+        o->m_parse_stopped = false;
+        o->m_parse_offset = 0;
         o->m_start = 0;
         o->m_length = 0;
+        o->m_skip_length = 0;
+        o->m_lz_state = Decompress ? LZ_DETECT : LZ_RAW;
+        o->m_staging_pos = 0;
+        o->m_staging_length = 0;
     }
     
     static void deinit_buffering (Context c)
     {
         auto *o = Object::self(c);
-        o->gcode_parser.deinit(c);
+        o->m_parse_event.unset(c);
+        for (auto &parser : o->gcode_parsers) {
+            parser.deinit(c);
+        }
     }
     
     static bool can_read (Context c)
     {
         auto *o = Object::self(c);
+        if (!reading_raw(c)) {
+            return (o->m_lz_state != LZ_UNSUPPORTED && o->m_lz_state != LZ_NO_SEEK && o->m_staging_pos == o->m_staging_length && TheInput::canRead(c));
+        }
         return (BufferBaseSize - o->m_length >= BlockSize && TheInput::canRead(c));
     }
     
+    static bool reading_raw (Context c)
+    {
+        auto *o = Object::self(c);
+        return (!Decompress || o->m_lz_state == LZ_RAW);
+    }
+    
     static size_t buf_add (size_t start, size_t count)
     {
         static_assert(BufferBaseSize <= SIZE_MAX / 2, "");
@@ -539,11 +698,114 @@ private:
         AMBRO_ASSERT(can_read(c))
         
         o->m_reading = true;
+        if (!reading_raw(c)) {
+            TheInput::startRead(c, o->m_staging);
+            return;
+        }
         size_t write_offset = buf_add(o->m_start, o->m_length);
         AMBRO_ASSERT(write_offset % BlockSize == 0)
         TheInput::startRead(c, o->m_buffer + write_offset / sizeof(DataWordType));
     }
     
+    // Accounts for data written at the end of the buffer,
+    // updating the copy of the start beyond the end.
+    static void buf_written (Context c, size_t bytes)
+    {
+        auto *o = Object::self(c);
+        AMBRO_ASSERT(bytes <= BufferBaseSize - o->m_length)
+        
+        size_t write_offset = buf_add(o->m_start, o->m_length);
+        if (write_offset < WrapExtraSize) {
+            memcpy((char *)o->m_buffer + BufferBaseSize + write_offset, (char *)o->m_buffer + write_offset, MinValue(bytes, WrapExtraSize - write_offset));
+        }
+        if (bytes > BufferBaseSize - write_offset) {
+            memcpy((char *)o->m_buffer + BufferBaseSize, (char *)o->m_buffer, MinValue(bytes - (BufferBaseSize - write_offset), WrapExtraSize));
+        }
+        o->m_length += bytes;
+    }
+    
+    // Moves data towards the buffer: decompresses what is in the staging
+    // block and starts reading the next block if there is space for it.
+    static void fill_buffer (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        decompress_staging(c);
+        
+        if (!o->m_reading && can_read(c) && o->m_retry_counter == 0) {
+            start_read(c);
+        }
+    }
+    
+    static void detect_compression (Context c)
+    {
+        auto *o = Object::self(c);
+        AMBRO_ASSERT(o->m_lz_state == LZ_DETECT)
+        AMBRO_ASSERT(o->m_start == 0)
+        AMBRO_ASSERT(o->m_length == 0)
+        
+        uint8_t const *data = (uint8_t const *)o->m_staging;
+        int window_bits;
+        auto header_result = TheLzDecoder::checkHeader(data, o->m_staging_length, &window_bits);
+        o->m_file_format = (header_result == TheLzDecoder::HEADER_NONE) ? FILE_FORMAT_RAW : FILE_FORMAT_COMPRESSED;
+        
+        // Positions given to M26 are in the uncompressed data, which we
+        // cannot seek in. We only get here with a nonzero M26 position
+        // if the format was not known at the time.
+        if (header_result != TheLzDecoder::HEADER_NONE && o->m_skip_length > 0) {
+            o->m_lz_state = LZ_NO_SEEK;
+            o->m_staging_pos = o->m_staging_length;
+            return;
+        }
+        
+        switch (header_result) {
+            case TheLzDecoder::HEADER_OK: {
+                o->m_lz_state = LZ_ACTIVE;
+                o->m_lz_decoder.init(window_bits);
+                o->m_staging_pos = TheLzDecoder::HeaderSize;
+            } break;
+            
+            case TheLzDecoder::HEADER_UNSUPPORTED: {
+                o->m_lz_state = LZ_UNSUPPORTED;
+                o->m_staging_pos = o->m_staging_length;
+            } break;
+            
+            default: {
+                // Not compressed, hand the block over to the buffer and
+                // read the rest of the file directly into the buffer.
+                o->m_lz_state = LZ_RAW;
+                memcpy(o->m_buffer, o->m_staging, o->m_staging_length);
+                buf_written(c, o->m_staging_length);
+                o->m_staging_pos = o->m_staging_length;
+            } break;
+        }
+    }
+    
+    static void decompress_staging (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        if (!Decompress || o->m_lz_state != LZ_ACTIVE) {
+            return;
+        }
+        
+        uint8_t const *in = (uint8_t const *)o->m_staging + o->m_staging_pos;
+        uint8_t const *in_end = (uint8_t const *)o->m_staging + o->m_staging_length;
+        
+        while (o->m_length < BufferBaseSize) {
+            size_t write_offset = buf_add(o->m_start, o->m_length);
+            uint8_t *out_start = (uint8_t *)o->m_buffer + write_offset;
+            uint8_t *out = out_start;
+            o->m_lz_decoder.decode(&in, in_end, &out, out_start + MinValue(BufferBaseSize - o->m_length, BufferBaseSize - write_offset));
+            if (out == out_start) {
+                break;
+            }
+            buf_written(c, out - out_start);
+        }
+        
+        o->m_staging_pos = in - (uint8_t const *)o->m_staging;
+    }
+    
     static void buf_sanity (Context c)
     {
         auto *o = Object::self(c);
@@ -559,6 +821,7 @@ private:
         
         TheInput::pausingIo(c);
         o->m_retry_timer.unset(c);
+        o->m_parse_event.unset(c);
         o->m_state = SDCARD_PAUSED;
     }
     
@@ -566,11 +829,12 @@ public:
     struct Object : public ObjBase<SdCardModule, ParentObject, MakeTypeList<
         TheInput
     >> {
-        TheGcodeParser gcode_parser;
+        TheGcodeParser gcode_parsers[NumParsers];
         typename ThePrinterMain::CommandStream command_stream;
         StreamCallback callback;
         GcodeM400Command<Context, typename ThePrinterMain::FpType> gcode_m400_command;
         typename Context::EventLoop::QueuedEvent m_next_event;
+        typename Context::EventLoop::QueuedEvent m_parse_event;
         typename Context::EventLoop::TimedEvent m_retry_timer;
         uint8_t m_state : 3;
         uint8_t m_eof : 1;
@@ -579,8 +843,19 @@ public:
         uint8_t m_echo_pending : 1;
         uint8_t m_poke_pending : 1;
         uint8_t m_retry_counter;
+        uint8_t m_parser_head;
+        uint8_t m_num_parsed;
+        bool m_parse_stopped;
+        size_t m_parse_offset;
         size_t m_start;
         size_t m_length;
+        uint32_t m_skip_length;
+        uint8_t m_lz_state;
+        uint8_t m_file_format;
+        size_t m_staging_pos;
+        size_t m_staging_length;
+        TheLzDecoder m_lz_decoder;
+        DataWordType m_staging[StagingSizeWords];
         DataWordType m_buffer[BufferBaseSizeWords + WrapExtraSizeWords];
     };
 };
@@ -589,7 +864,9 @@ APRINTER_ALIAS_STRUCT_EXT(SdCardModuleService, (
     APRINTER_AS_TYPE(InputService),
     APRINTER_AS_TYPE(TheGcodeParserService),
     APRINTER_AS_VALUE(size_t, BufferBaseSize),
-    APRINTER_AS_VALUE(size_t, MaxCommandSize)
+    APRINTER_AS_VALUE(size_t, MaxCommandSize),
+    APRINTER_AS_VALUE(int, PrefetchCommands),
+    APRINTER_AS_VALUE(int, DecompressWindowBits)
 ), (
     APRINTER_MODULE_TEMPLATE(SdCardModuleService, SdCardModule)
     
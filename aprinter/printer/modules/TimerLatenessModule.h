@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef APRINTER_TIMER_LATENESS_MODULE_H
+#define APRINTER_TIMER_LATENESS_MODULE_H
+
+#include <stdint.h>
+
+#include <aprinter/meta/ServiceUtils.h>
+#include <aprinter/meta/AliasStruct.h>
+#include <aprinter/meta/ListForEach.h>
+#include <aprinter/base/ProgramMemory.h>
+#include <aprinter/printer/utils/JsonBuilder.h>
+#include <aprinter/printer/utils/ModuleUtils.h>
+
+namespace APrinter {
+
+/*
+ * Reports the histograms of LatenessInterruptTimer timers.
+ * 
+ * Timers is a struct with a List member type, a list of entries each
+ * having a TheTimer member type (the timer instance) and a static name()
+ * function. It is only used from function bodies so that it may be
+ * defined after the printer.
+ * 
+ * M948 prints one line per timer with the counts of the buckets up to the
+ * last nonzero one; M948 R additionally resets the histograms.
+ */
+
+template <typename ModuleArg>
+class TimerLatenessModule {
+    APRINTER_UNPACK_MODULE_ARG(ModuleArg)
+    
+    using Clock = typename Context::Clock;
+    using TheCommand = typename ThePrinterMain::TheCommand;
+
+public:
+    static bool check_command (Context c, TheCommand *cmd)
+    {
+        if (cmd->getCmdNumber(c) == 948) {
+            if (!cmd->tryUnplannedCommand(c)) {
+                return false;
+            }
+            bool reset = cmd->find_command_param(c, 'R', nullptr);
+            ListFor<typename Params::Timers::List>([&] APRINTER_TL(entry, print_timer<entry>(c, cmd, reset)));
+            cmd->finishCommand(c);
+            return false;
+        }
+        return true;
+    }
+    
+    template <typename TheJsonBuilder>
+    static void get_json_status (Context c, TheJsonBuilder *json)
+    {
+        json->addKeyObject(JsonSafeString{"timerLateness"});
+        json->addSafeKeyVal("tick", JsonDouble{1.0 / Clock::time_freq});
+        ListFor<typename Params::Timers::List>([&] APRINTER_TL(entry, json_timer<entry>(c, json)));
+        json->endObject();
+    }
+
+private:
+    template <typename Entry>
+    static int get_histogram (Context c, uint32_t *counts)
+    {
+        using TheTimer = typename Entry::TheTimer;
+        
+        TheTimer::getLatenessHistogram(c, counts);
+        
+        int num_used = TheTimer::NumLatenessBuckets;
+        while (num_used > 0 && counts[num_used - 1] == 0) {
+            num_used--;
+        }
+        return num_used;
+    }
+    
+    template <typename Entry>
+    static void print_timer (Context c, TheCommand *cmd, bool reset)
+    {
+        uint32_t counts[Entry::TheTimer::NumLatenessBuckets];
+        int num_used = get_histogram<Entry>(c, counts);
+        
+        if (reset) {
+            Entry::TheTimer::resetLatenessHistogram(c);
+        }
+        
+        cmd->reply_append_str(c, Entry::name());
+        cmd->reply_append_ch(c, ':');
+        for (int i = 0; i < num_used; i++) {
+            cmd->reply_append_ch(c, ' ');
+            cmd->reply_append_uint32(c, counts[i]);
+        }
+        cmd->reply_append_ch(c, '\n');
+        cmd->reply_poke(c);
+    }
+    
+    template <typename Entry, typename TheJsonBuilder>
+    static void json_timer (Context c, TheJsonBuilder *json)
+    {
+        uint32_t counts[Entry::TheTimer::NumLatenessBuckets];
+        int num_used = get_histogram<Entry>(c, counts);
+        
+        json->addKeyArray(JsonSafeString{Entry::name()});
+        for (int i = 0; i < num_used; i++) {
+            json->add(JsonUint32{counts[i]});
+        }
+        json->endArray();
+    }
+
+public:
+    struct Object {};
+};
+
+APRINTER_ALIAS_STRUCT_EXT(TimerLatenessModuleService, (
+    APRINTER_AS_TYPE(Timers)
+), (
+    APRINTER_MODULE_TEMPLATE(TimerLatenessModuleService, TimerLatenessModule)
+))
+
+}
+
+#endif
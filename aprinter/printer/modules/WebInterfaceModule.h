@@ -391,9 +391,16 @@ private:
         {
             accept_request_common(c, request);
             
+            // Pass the upload size to the filesystem so it can allocate the file contiguously.
+            uint64_t body_length;
+            uint32_t size_hint = 0;
+            if (request->getRequestBodyLength(c, &body_length)) {
+                size_hint = MinValue(body_length, (uint64_t)UINT32_MAX);
+            }
+            
             m_state = State::WRITE_OPEN;
             init_file(c);
-            m_buffered_file.startOpen(c, file_path, false, TheBufferedFile::OpenMode::OPEN_WRITE, UploadBasePath());
+            m_buffered_file.startOpen(c, file_path, false, TheBufferedFile::OpenMode::OPEN_WRITE, UploadBasePath(), size_hint);
         }
         
         void acceptJsonResponseRequest (Context c, TheRequestInterface *request, AIpStack::MemRef req_type)
@@ -495,16 +502,25 @@ private:
         {
             switch (m_state) {
                 case State::READ_WAIT: {
+                    // Copy from the cached block straight into the send buffer,
+                    // avoiding small chunks unless it is the end of the block.
                     AIpStack::IpBufRef resp_buf = m_request->getResponseBodyBuffer(c);
-                    size_t allowed_length = MinValue(GetSdChunkSize, resp_buf.tot_len);
-                    if (allowed_length > m_cur_chunk_size) {
-                        size_t avail_len = allowed_length - m_cur_chunk_size;
-                        resp_buf.skipBytes(m_cur_chunk_size);
-                        m_buffered_file.startReadData(c, resp_buf.getChunkPtr(),
-                            MinValue(resp_buf.getChunkLength(), avail_len));
-                        m_state = State::READ_READ;
-                        m_request->controlResponseBodyTimeout(c, false);
+                    if (resp_buf.tot_len < MinValue(GetSdChunkSize, m_cur_chunk_size)) {
+                        return;
                     }
+                    size_t length = MinValue(m_cur_chunk_size, resp_buf.tot_len);
+                    resp_buf.giveBytes({m_buffered_file.getReadRefPointer(c), length});
+                    m_request->provideResponseBodyData(c, length);
+                    m_buffered_file.consumeReadRef(c, length);
+                    m_cur_chunk_size -= length;
+                    
+                    if (m_cur_chunk_size > 0) {
+                        return;
+                    }
+                    
+                    m_state = State::READ_READ;
+                    m_request->controlResponseBodyTimeout(c, false);
+                    m_buffered_file.startReadRef(c);
                 } break;
                 
                 case State::READ_READ:
@@ -606,9 +622,8 @@ private:
                         m_request->setResponseContentType(c, get_content_type(m_file_path));
                         m_request->adoptResponseBody(c);
                         
-                        m_state = State::READ_WAIT;
-                        m_cur_chunk_size = 0;
-                        m_request->controlResponseBodyTimeout(c, true);
+                        m_state = State::READ_READ;
+                        m_buffered_file.startReadRef(c);
                     } else {
                         m_request->adoptRequestBody(c);
                         
@@ -623,18 +638,12 @@ private:
                         return complete_request(c);
                     }
                     
-                    AMBRO_ASSERT(read_length <= GetSdChunkSize - m_cur_chunk_size)
-                    m_cur_chunk_size += read_length;
-                    
-                    if (m_cur_chunk_size == GetSdChunkSize || (read_length == 0 && m_cur_chunk_size > 0)) {
-                        m_request->provideResponseBodyData(c, m_cur_chunk_size);
-                        m_cur_chunk_size = 0;
-                    }
-                    
                     if (read_length == 0) {
                         return complete_request(c);
                     }
                     
+                    m_cur_chunk_size = read_length;
+                    
                     m_state = State::READ_WAIT;
                     m_request->controlResponseBodyTimeout(c, true);
                     m_request->pokeResponseBodyBufferEvent(c);
@@ -32,6 +32,9 @@ namespace APrinter {
 
 template <typename FpType>
 struct LinearPlanner {
+    // Number of stepper commands used for each acceleration or deceleration phase.
+    static int const RampCommands = 1;
+    
     struct SegmentData {
         FpType a_x;
         FpType max_v;
@@ -76,6 +79,11 @@ struct LinearPlanner {
         return FloatMin(segment->max_start_v, end_v + segment->a_x);
     }
 
+    static bool isConverged (SegmentState const *s, FpType end_v)
+    {
+        return end_v == s->end_v;
+    }
+    
     static FpType pull (SegmentData *segment, SegmentState *s, FpType start_v, SegmentResult *result)
     {
         AMBRO_ASSERT(s->end_v <= segment->max_v)
@@ -112,6 +120,11 @@ struct LinearPlanner {
     }
 };
 
+struct LinearPlannerService {
+    template <typename FpType>
+    using SegmentPlanner = LinearPlanner<FpType>;
+};
+
 }
 
 #endif
@@ -45,6 +45,7 @@
 #include <aprinter/meta/MemberType.h>
 #include <aprinter/meta/MinMax.h>
 #include <aprinter/meta/ServiceUtils.h>
+#include <aprinter/meta/StructIf.h>
 #include <aprinter/base/Object.h>
 #include <aprinter/base/Assert.h>
 #include <aprinter/base/Hints.h>
@@ -95,6 +96,7 @@ class MotionPlanner {
     static int const StepperSegmentBufferSize = Arg::StepperSegmentBufferSize;
     static int const LookaheadBufferSize      = Arg::LookaheadBufferSize;
     static int const LookaheadCommitCount     = Arg::LookaheadCommitCount;
+    using PlannerService                      = typename Arg::PlannerService;
     using FpType                              = typename Arg::FpType;
     using MaxStepsPerCycle                    = typename Arg::MaxStepsPerCycle;
     using PullHandler                         = typename Arg::PullHandler;
@@ -119,8 +121,10 @@ private:
     static_assert(NumAxes > 0, "");
     static const int NumChannels = TypeListLength<ParamsChannelsList>::Value;
     using SegmentBufferSizeType = ChooseIntForMax<2 * LookaheadBufferSize, false>; // twice for segments_add()
-    static const size_t StepperCommitBufferSize = 3 * StepperSegmentBufferSize;
-    static const size_t StepperBackupBufferSize = 3 * (LookaheadBufferSize - LookaheadCommitCount);
+    using TheSegmentPlanner = typename PlannerService::template SegmentPlanner<FpType>;
+    static const int StepperCommandsPerSegment = 1 + 2 * TheSegmentPlanner::RampCommands;
+    static const size_t StepperCommitBufferSize = StepperCommandsPerSegment * StepperSegmentBufferSize;
+    static const size_t StepperBackupBufferSize = StepperCommandsPerSegment * (LookaheadBufferSize - LookaheadCommitCount);
     using StepperCommitBufferSizeType = ChooseIntForMax<StepperCommitBufferSize, false>;
     using StepperBackupBufferSizeType = ChooseIntForMax<2 * StepperBackupBufferSize, false>;
     using StepperFastEvent = typename Context::EventLoop::template FastEventSpec<MotionPlanner>;
@@ -128,16 +132,12 @@ private:
     static const int TypeBits = BitsInInt<NumChannels>::Value;
     using AxisMaskType = ChooseInt<NumAxes + TypeBits, false>;
     static const AxisMaskType TypeMask = ((AxisMaskType)1 << TypeBits) - 1;
-    using TheLinearPlanner = LinearPlanner<FpType>;
     using Constants = MotionPlannerConstants<Context>;
     
     using MinSecondsPerStep = decltype(ExprRec(MaxStepsPerCycle() * typename Constants::FCpu()));
     
     using CMinSegmentTime = decltype(ExprCast<FpType>(typename Constants::TimeConversion() * MinSecondsPerStep()));
     
-public:
-    using ConfigExprs = MakeTypeList<CMinSegmentTime>;
-    
 private:
     AMBRO_DECLARE_GET_MEMBER_TYPE_FUNC(GetMemberType_TheCommon, TheCommon)
     AMBRO_DECLARE_GET_MEMBER_TYPE_FUNC(GetMemberType_ComputeState, ComputeState)
@@ -231,7 +231,7 @@ private:
     };
     
     struct SegmentAxesPart : public SegmentAxesHelper, public SegmentLasersHelper {
-        typename TheLinearPlanner::SegmentData lp_seg;
+        typename TheSegmentPlanner::SegmentData lp_seg;
         FpType max_accel_rec;
         FpType rel_max_speed_rec;
     };
@@ -244,6 +244,142 @@ private:
         };
     };
     
+    AMBRO_STRUCT_IF(SCurveFeature, (TheSegmentPlanner::RampCommands > 1)) {
+        using CRampTime = decltype(ExprCast<FpType>(typename Constants::TimeConversion() * Config::e(PlannerService::RampTime::i())));
+        
+        static void init_segment (Context c, Segment *entry, FpType prev_max_v, FpType max_start_v, FpType max_v, FpType a_x)
+        {
+            FpType ramp_v = APRINTER_CFG(Config, CRampTime, c) / entry->axes.max_accel_rec;
+            TheSegmentPlanner::initSegment(&entry->axes.lp_seg, prev_max_v, max_start_v, max_v, a_x, ramp_v);
+        }
+        
+        static FpType ramp_time (Segment *entry, FpType vdiff)
+        {
+            return TheSegmentPlanner::rampTime(&entry->axes.lp_seg, vdiff) * entry->axes.max_accel_rec;
+        }
+        
+        template <typename TheAxis, typename StepFixedType, typename TheMinTimeType>
+        static void gen_axis_ramp_commands (Context c, Segment *entry, bool dir, bool decel, StepFixedType x, TheMinTimeType t, FpType accel_conversion, FpType vdiff_squared, FpType from_u, FpType to_u)
+        {
+            typename TheSegmentPlanner::RampSplit split;
+            TheSegmentPlanner::splitRamp(&entry->axes.lp_seg, from_u, to_u, &split);
+            
+            FpType xfp = x.template fpValue<FpType>();
+            StepFixedType x1 = x;
+            StepFixedType x0 = FixedMin(x1, StepFixedType::importFpSaturatedRound(split.x0 * xfp));
+            x1.m_bits.m_int -= x0.bitsValue();
+            StepFixedType x2 = FixedMin(x1, StepFixedType::importFpSaturatedRound(split.x2 * xfp));
+            x1.m_bits.m_int -= x2.bitsValue();
+            
+            TheMinTimeType t1 = t;
+            TheMinTimeType t0 = FixedMin(t1, TheMinTimeType::importFpSaturatedRound(split.ramp_t * t.template fpValue<FpType>()));
+            t1.m_bits.m_int -= t0.bitsValue();
+            TheMinTimeType t2 = FixedMin(t1, t0);
+            t1.m_bits.m_int -= t2.bitsValue();
+            
+            if (x0.bitsValue() == 0) {
+                t1.m_bits.m_int += t0.bitsValue();
+            }
+            if (x2.bitsValue() == 0) {
+                t1.m_bits.m_int += t2.bitsValue();
+            }
+            
+            bool skip1 = (x1.bitsValue() == 0 && (x0.bitsValue() != 0 || x2.bitsValue() != 0));
+            if (skip1) {
+                if (x0.bitsValue() != 0) {
+                    t0.m_bits.m_int += t1.bitsValue();
+                } else {
+                    t2.m_bits.m_int += t1.bitsValue();
+                }
+            }
+            
+            if (x0.bitsValue() != 0) {
+                gen_axis_command<TheAxis>(c, dir, decel, x0, t0, FloatAbs(split.a0) * xfp);
+            }
+            if (!skip1) {
+                gen_axis_command<TheAxis>(c, dir, decel, x1, t1, FloatAbs(split.a1) * xfp);
+            }
+            if (x2.bitsValue() != 0) {
+                gen_axis_command<TheAxis>(c, dir, decel, x2, t2, FloatAbs(split.a2) * xfp);
+            }
+        }
+        
+        template <typename TheLaser, typename TheMinTimeType>
+        static void gen_laser_ramp_commands (Context c, Segment *entry, TheMinTimeType t, FpType x_by_distance, FpType from_u, FpType to_u)
+        {
+            typename TheSegmentPlanner::RampSplit split;
+            TheSegmentPlanner::splitRamp(&entry->axes.lp_seg, from_u, to_u, &split);
+            
+            TheMinTimeType t1 = t;
+            TheMinTimeType t0 = FixedMin(t1, TheMinTimeType::importFpSaturatedRound(split.ramp_t * t.template fpValue<FpType>()));
+            t1.m_bits.m_int -= t0.bitsValue();
+            TheMinTimeType t2 = FixedMin(t1, t0);
+            t1.m_bits.m_int -= t2.bitsValue();
+            
+            if (t0.bitsValue() < TheLaser::AdjustmentIntervalTicks) {
+                TheLaser::TheCommon::gen_stepper_command(c, t, x_by_distance * from_u, x_by_distance * to_u);
+                return;
+            }
+            
+            FpType xv_a = x_by_distance * (from_u + split.ramp_u);
+            FpType xv_b = x_by_distance * (to_u - split.ramp_u);
+            if (t1.bitsValue() < TheLaser::AdjustmentIntervalTicks) {
+                t0.m_bits.m_int += t1.bitsValue();
+                TheLaser::TheCommon::gen_stepper_command(c, t0, x_by_distance * from_u, xv_b);
+            } else {
+                TheLaser::TheCommon::gen_stepper_command(c, t0, x_by_distance * from_u, xv_a);
+                TheLaser::TheCommon::gen_stepper_command(c, t1, xv_a, xv_b);
+            }
+            TheLaser::TheCommon::gen_stepper_command(c, t2, xv_b, x_by_distance * to_u);
+        }
+        
+        template <typename TheAxis, typename StepFixedType, typename TheMinTimeType>
+        static void gen_axis_command (Context c, bool dir, bool decel, StepFixedType x, TheMinTimeType t, FpType a)
+        {
+            StepFixedType a_fixed = FixedMin(x, StepFixedType::importFpSaturatedRound(a));
+            if (decel) {
+                TheAxis::TheCommon::gen_stepper_command(c, dir, x, t, -a_fixed);
+            } else {
+                TheAxis::TheCommon::gen_stepper_command(c, dir, x, t, a_fixed);
+            }
+        }
+        
+        using ConfigExprs = MakeTypeList<CRampTime>;
+    } AMBRO_STRUCT_ELSE(SCurveFeature) {
+        static void init_segment (Context c, Segment *entry, FpType prev_max_v, FpType max_start_v, FpType max_v, FpType a_x)
+        {
+            TheSegmentPlanner::initSegment(&entry->axes.lp_seg, prev_max_v, max_start_v, max_v, a_x);
+        }
+        
+        static FpType ramp_time (Segment *entry, FpType vdiff)
+        {
+            return vdiff * entry->axes.max_accel_rec;
+        }
+        
+        template <typename TheAxis, typename StepFixedType, typename TheMinTimeType>
+        static void gen_axis_ramp_commands (Context c, Segment *entry, bool dir, bool decel, StepFixedType x, TheMinTimeType t, FpType accel_conversion, FpType vdiff_squared, FpType from_u, FpType to_u)
+        {
+            StepFixedType a_fixed = FixedMin(x, StepFixedType::importFpSaturatedRound(accel_conversion * vdiff_squared));
+            if (decel) {
+                TheAxis::TheCommon::gen_stepper_command(c, dir, x, t, -a_fixed);
+            } else {
+                TheAxis::TheCommon::gen_stepper_command(c, dir, x, t, a_fixed);
+            }
+        }
+        
+        template <typename TheLaser, typename TheMinTimeType>
+        static void gen_laser_ramp_commands (Context c, Segment *entry, TheMinTimeType t, FpType x_by_distance, FpType from_u, FpType to_u)
+        {
+            TheLaser::TheCommon::gen_stepper_command(c, t, x_by_distance * from_u, x_by_distance * to_u);
+        }
+        
+        using ConfigExprs = EmptyTypeList;
+    };
+    
+public:
+    using ConfigExprs = JoinTypeLists<MakeTypeList<CMinSegmentTime>, typename SCurveFeature::ConfigExprs>;
+    
+private:
     enum {STATE_BUFFERING, STATE_STEPPING, STATE_ABORTED};
     
     template <typename TheAxis>
@@ -309,7 +445,7 @@ private:
         static bool have_commit_space (bool accum, Context c)
         {
             auto *o = Object::self(c);
-            return (accum && commit_avail(o->m_commit_start, o->m_commit_end) >= 3 * LookaheadCommitCount);
+            return (accum && commit_avail(o->m_commit_start, o->m_commit_end) >= StepperCommandsPerSegment * LookaheadCommitCount);
         }
         
         static void start_commands (Context c)
@@ -410,6 +546,11 @@ private:
             return (end >= start) ? ((StepperCommitBufferSize - 1) - (end - start)) : ((start - end) - 1);
         }
         
+        static StepperCommitBufferSizeType commit_dist (StepperCommitBufferSizeType start, StepperCommitBufferSizeType end)
+        {
+            return (end >= start) ? (end - start) : (StepperCommitBufferSize - (start - end));
+        }
+        
         struct Object : public ObjBase<AxisCommon, typename MotionPlanner::Object, MakeTypeList<
             TheAxis
         >> {
@@ -457,6 +598,7 @@ public:
             auto *o = Object::self(c);
             TheAxisDriver::setPrestepCallbackEnabled(c, prestep_callback_enabled);
             o->last_x_by_distance = 0.0f;
+            o->precompute_pos = 0;
         }
         
         static void deinit_impl (Context c)
@@ -568,7 +710,7 @@ public:
         }
         
         template <typename TheMinTimeType>
-        static void gen_segment_stepper_commands (Context c, Segment *entry, FpType frac_x0, FpType frac_x2, TheMinTimeType t0, TheMinTimeType t2, TheMinTimeType t1, FpType vdiff0_squared, FpType vdiff2_squared)
+        static void gen_segment_stepper_commands (Context c, Segment *entry, FpType frac_x0, FpType frac_x2, TheMinTimeType t0, TheMinTimeType t2, TheMinTimeType t1, FpType vdiff0_squared, FpType vdiff2_squared, FpType v_start, FpType v_end, FpType v_const)
         {
             TheAxisSegment *axis_entry = TupleGetElem<AxisIndex>(entry->axes.axes());
             
@@ -599,13 +741,13 @@ public:
             FpType accel_conversion = entry->axes.lp_seg.a_x_rec * xfp;
             
             if (x0.bitsValue() != 0) {
-                TheCommon::gen_stepper_command(c, dir, x0, t0, FixedMin(x0, StepperStepFixedType::importFpSaturatedRound(accel_conversion * vdiff0_squared)));
+                SCurveFeature::template gen_axis_ramp_commands<Axis>(c, entry, dir, false, x0, t0, accel_conversion, vdiff0_squared, v_start, v_const);
             }
             if (!skip1) {
                 TheCommon::gen_stepper_command(c, dir, x1, t1, StepperStepFixedType::importBits(0));
             }
             if (x2.bitsValue() != 0) {
-                TheCommon::gen_stepper_command(c, dir, x2, t2, -FixedMin(x2, StepperStepFixedType::importFpSaturatedRound(accel_conversion * vdiff2_squared)));
+                SCurveFeature::template gen_axis_ramp_commands<Axis>(c, entry, dir, true, x2, t2, accel_conversion, vdiff2_squared, v_const, v_end);
             }
         }
         
@@ -614,6 +756,38 @@ public:
             TheAxisDriver::template start<TheAxisDriverConsumer<AxisIndex>>(c, start_time, cmd);
         }
         
+        // Lets the driver precompute step times for the committed commands
+        // which it has not yet taken. Backup commands are not precomputed,
+        // they are only used when we fail to keep up anyway.
+        static void precompute_commands (Context c)
+        {
+            auto *o = Object::self(c);
+            auto *co = TheCommon::Object::self(c);
+            
+            if (!TheAxisDriver::PrecomputesSteps) {
+                return;
+            }
+            
+            StepperCommitBufferSizeType start;
+            AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
+                start = co->m_commit_start;
+            }
+            if (TheCommon::commit_dist(start, o->precompute_pos) > TheCommon::commit_dist(start, co->m_commit_end)) {
+                o->precompute_pos = start;
+            }
+            
+            while (o->precompute_pos != co->m_commit_end) {
+                StepperCommitBufferSizeType index = o->precompute_pos;
+                bool done = TheAxisDriver::precomputeCommand(c, &co->m_commit_buffer[index], [&] {
+                    return TheCommon::commit_dist(co->m_commit_start, index) < TheCommon::commit_dist(co->m_commit_start, co->m_commit_end);
+                });
+                if (!done) {
+                    break;
+                }
+                o->precompute_pos = TheCommon::commit_inc(index);
+            }
+        }
+        
         AMBRO_ALWAYS_INLINE
         static bool stepper_prestep_callback (StepperCommandCallbackContext c)
         {
@@ -706,6 +880,7 @@ public:
         
         struct Object : public ObjBase<Axis, typename TheCommon::Object, EmptyTypeList> {
             FpType last_x_by_distance;
+            StepperCommitBufferSizeType precompute_pos;
         };
     };
     
@@ -800,8 +975,6 @@ public:
         {
             TheLaserSegment *laser_segment = TupleGetElem<LaserIndex>(entry->axes.lasers());
             
-            FpType xv_start = laser_segment->x_by_distance * v_start;
-            FpType xv_end = laser_segment->x_by_distance * v_end;
             FpType xv_const = laser_segment->x_by_distance * v_const;
             
             bool skip0 = (t0.bitsValue() < AdjustmentIntervalTicks);
@@ -824,13 +997,13 @@ public:
             }
             
             if (!skip0) {
-                TheCommon::gen_stepper_command(c, t0, xv_start, xv_const);
+                SCurveFeature::template gen_laser_ramp_commands<Laser>(c, entry, t0, laser_segment->x_by_distance, v_start, v_const);
             }
             if (!skip1) {
                 TheCommon::gen_stepper_command(c, t1, xv_const, xv_const);
             }
             if (!skip2) {
-                TheCommon::gen_stepper_command(c, t2, xv_const, xv_end);
+                SCurveFeature::template gen_laser_ramp_commands<Laser>(c, entry, t2, laser_segment->x_by_distance, v_const, v_end);
             }
         }
         
@@ -1082,6 +1255,9 @@ public:
         o->m_aborted = false;
         o->m_syncing = false;
         o->m_current_backup = false;
+#ifdef MOTIONPLANNER_PLAN_STATS
+        resetPlanStats(c);
+#endif
 #ifdef AMBROLIB_ASSERTIONS
         o->m_pulling = false;
         o->m_planned = false;
@@ -1190,6 +1366,26 @@ public:
     }
 #endif
     
+#ifdef MOTIONPLANNER_PLAN_STATS
+    struct PlanStats {
+        uint32_t plans;
+        uint32_t visited_segments;
+        SegmentBufferSizeType last_visited;
+    };
+    
+    static PlanStats getPlanStats (Context c)
+    {
+        auto *o = Object::self(c);
+        return o->m_plan_stats;
+    }
+    
+    static void resetPlanStats (Context c)
+    {
+        auto *o = Object::self(c);
+        o->m_plan_stats = PlanStats{0, 0, 0};
+    }
+#endif
+    
     template <int ChannelIndex>
     using GetChannelTimer = typename Channel<ChannelIndex>::TheTimer;
     
@@ -1230,16 +1426,31 @@ private:
         AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) { AMBRO_ASSERT(planner_have_commit_space(c)) }
 #endif
         
-        SegmentBufferSizeType i = o->m_segments_length;
+        // Backward pass. The first m_segments_staging_length segments still have
+        // their state from the previous plan. Once the end velocity we arrive at
+        // for such a segment equals the stored one, none of the preceding
+        // segments can change either, so we can stop there.
+        SegmentBufferSizeType j = o->m_segments_length;
         FpType v = 0.0f;
         do {
-            i--;
-            Segment *entry = &o->m_segments[segments_add(o->m_segments_start, i)];
+            j--;
+            SegmentBufferSizeType index = segments_add(o->m_segments_start, j);
+            Segment *entry = &o->m_segments[index];
             if (AMBRO_LIKELY((entry->dir_and_type & TypeMask) == 0)) {
-                v = TheLinearPlanner::push(&entry->axes.lp_seg, &o->m_segment_state[i], v);
+                if (j < o->m_segments_staging_length && TheSegmentPlanner::isConverged(&o->m_segment_state[index], v)) {
+                    break;
+                }
+                v = TheSegmentPlanner::push(&entry->axes.lp_seg, &o->m_segment_state[index], v);
             }
-        } while (i != 0);
+        } while (j != 0);
+        
+#ifdef MOTIONPLANNER_PLAN_STATS
+        o->m_plan_stats.plans++;
+        o->m_plan_stats.last_visited = o->m_segments_length - j;
+        o->m_plan_stats.visited_segments += o->m_plan_stats.last_visited;
+#endif
         
+        SegmentBufferSizeType i = 0;
         SegmentBufferSizeType commit_count = MinValue(o->m_segments_length, (SegmentBufferSizeType)LookaheadCommitCount);
         
         o->m_new_to_backup = false;
@@ -1251,17 +1462,18 @@ private:
         FpType v_start = o->m_staging_v;
         
         do {
-            Segment *entry = &o->m_segments[segments_add(o->m_segments_start, i)];
+            SegmentBufferSizeType index = segments_add(o->m_segments_start, i);
+            Segment *entry = &o->m_segments[index];
             if (AMBRO_LIKELY((entry->dir_and_type & TypeMask) == 0)) {
-                typename TheLinearPlanner::SegmentResult result;
-                v = TheLinearPlanner::pull(&entry->axes.lp_seg, &o->m_segment_state[i], v, &result);
+                typename TheSegmentPlanner::SegmentResult result;
+                v = TheSegmentPlanner::pull(&entry->axes.lp_seg, &o->m_segment_state[index], v, &result);
                 FpType v_end = FloatSqrt(v);
                 FpType v_const = FloatSqrt(result.const_v);
                 FpType vdiff0 = v_const - v_start;
                 FpType vdiff2 = v_const - v_end;
-                FpType t0_double = vdiff0 * entry->axes.max_accel_rec;
+                FpType t0_double = SCurveFeature::ramp_time(entry, vdiff0);
                 MinTimeType t0 = MinTimeType::importFpSaturatedRound(t0_double);
-                FpType t2_double = vdiff2 * entry->axes.max_accel_rec;
+                FpType t2_double = SCurveFeature::ramp_time(entry, vdiff2);
                 MinTimeType t2 = MinTimeType::importFpSaturatedRound(t2_double);
                 FpType t1_double = (1.0f - result.const_start - result.const_end) * entry->axes.rel_max_speed_rec;
                 MinTimeType t1 = MinTimeType::importFpSaturatedRound(t1_double);
@@ -1277,7 +1489,7 @@ private:
                 time += t_sum.bitsValue();
                 ListFor<AxesList>([&] APRINTER_TL(axis, axis::gen_segment_stepper_commands(c, entry,
                                     result.const_start, result.const_end, t0, t2, t1,
-                                    vdiff0 * vdiff0, vdiff2 * vdiff2)));
+                                    vdiff0 * vdiff0, vdiff2 * vdiff2, v_start, v_end, v_const)));
                 ListFor<LasersList>([&] APRINTER_TL(laser, laser::gen_segment_stepper_commands(c, entry,
                     t0, t2, t1, v_start, v_end, v_const)));
                 v_start = v_end;
@@ -1314,6 +1526,7 @@ private:
         }
         
         if (AMBRO_LIKELY(ok)) {
+            ListFor<AxesList>([&] APRINTER_TL(axis, axis::precompute_commands(c)));
             o->m_segments_start = segments_add(o->m_segments_start, commit_count);
             o->m_segments_length -= commit_count;
             o->m_segments_staging_length = o->m_segments_length;
@@ -1395,6 +1608,8 @@ private:
             
             if (AMBRO_UNLIKELY(!busy)) {
                 recover_from_underrun(c);
+            } else {
+                ListFor<AxesList>([&] APRINTER_TL(axis, axis::precompute_commands(c)));
             }
         }
         
@@ -1526,7 +1741,7 @@ private:
             FpType distance_squared = distance * distance;
             FpType max_v = distance_squared / (entry->axes.rel_max_speed_rec * entry->axes.rel_max_speed_rec);
             FpType a_x = FloatLdexp(half_rel_max_accel * distance_squared, 2);
-            TheLinearPlanner::initSegment(&entry->axes.lp_seg, o->m_last_max_v, junction_max_start_v, max_v, a_x);
+            SCurveFeature::init_segment(c, entry, o->m_last_max_v, junction_max_start_v, max_v, a_x);
             o->m_last_max_v = max_v;
             
             if (AMBRO_LIKELY(o->m_split_buffer.axes.split_pos == o->m_split_buffer.axes.split_count)) {
@@ -1575,10 +1790,13 @@ public:
 #ifdef AMBROLIB_ASSERTIONS
         bool m_pulling;
         bool m_planned;
+#endif
+#ifdef MOTIONPLANNER_PLAN_STATS
+        PlanStats m_plan_stats;
 #endif
         SplitBuffer m_split_buffer;
         Segment m_segments[LookaheadBufferSize];
-        typename TheLinearPlanner::SegmentState m_segment_state[LookaheadBufferSize];
+        typename TheSegmentPlanner::SegmentState m_segment_state[LookaheadBufferSize];
     };
 };
 
@@ -1590,6 +1808,7 @@ APRINTER_ALIAS_STRUCT_EXT(MotionPlannerArg, (
     APRINTER_AS_VALUE(int, StepperSegmentBufferSize),
     APRINTER_AS_VALUE(int, LookaheadBufferSize),
     APRINTER_AS_VALUE(int, LookaheadCommitCount),
+    APRINTER_AS_TYPE(PlannerService),
     APRINTER_AS_TYPE(FpType),
     APRINTER_AS_TYPE(MaxStepsPerCycle),
     APRINTER_AS_TYPE(PullHandler),
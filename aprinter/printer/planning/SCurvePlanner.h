@@ -0,0 +1,319 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMBROLIB_SCURVE_PLANNER_H
+#define AMBROLIB_SCURVE_PLANNER_H
+
+#include <aprinter/base/Assert.h>
+#include <aprinter/math/FloatTools.h>
+
+namespace APrinter {
+
+/*
+ * Jerk-limited counterpart of LinearPlanner, with the same interface
+ * toward MotionPlanner. Speeds passed in and out are squared, like in
+ * LinearPlanner.
+ *
+ * Each acceleration and deceleration phase ramps the acceleration up
+ * and down linearly in time, over a fixed ramp time. The ramp time is
+ * given to initSegment() as ramp_v, the speed change which happens
+ * during the two ramps of a phase reaching full acceleration
+ * (max_accel * ramp_time). Phases with smaller speed changes never reach
+ * full acceleration. The acceleration is zero at segment boundaries.
+ *
+ * Internally, distances are scaled so that the segment length is a_x
+ * (2 * max_accel * distance, as in LinearPlanner). A phase changing speed
+ * from u0 to u1 then covers the distance (u0 + u1) * rampTime(|u1 - u0|).
+ */
+template <typename FpType>
+struct SCurvePlanner {
+    // Number of stepper commands used for each acceleration or deceleration phase.
+    // The acceleration ramps are approximated with constant acceleration.
+    static int const RampCommands = 3;
+    
+    struct SegmentData {
+        FpType a_x;
+        FpType max_v;
+        FpType max_start_v;
+        FpType ramp_v;
+        FpType a_x_rec;
+    };
+    
+    class SegmentState {
+        friend SCurvePlanner;
+        FpType end_v;
+    };
+    
+    struct SegmentResult {
+        FpType const_start;
+        FpType const_end;
+        FpType const_v;
+    };
+    
+    // Describes how one acceleration or deceleration phase is split into the
+    // ramp-up, constant and ramp-down parts. The time fraction and the
+    // (signed) speed change are those of each of the two ramps. The distance
+    // fractions and acceleration terms are relative to the entire phase.
+    struct RampSplit {
+        FpType ramp_t;
+        FpType ramp_u;
+        FpType x0;
+        FpType x2;
+        FpType a0;
+        FpType a1;
+        FpType a2;
+    };
+    
+    static void initSegment (SegmentData *segment, FpType prev_max_v, FpType max_start_v, FpType max_v, FpType a_x, FpType ramp_v)
+    {
+        AMBRO_ASSERT(FloatIsPosOrPosZero(prev_max_v))
+        AMBRO_ASSERT(FloatIsPosOrPosZero(max_start_v))
+        AMBRO_ASSERT(FloatIsPosOrPosZero(max_v))
+        AMBRO_ASSERT(FloatIsPosOrPosZero(a_x))
+        AMBRO_ASSERT(FloatIsPosOrPosZero(ramp_v))
+        
+        segment->max_v = max_v;
+        segment->max_start_v = FloatMin(prev_max_v, FloatMin(max_start_v, max_v));
+        segment->a_x = a_x;
+        segment->ramp_v = ramp_v;
+        segment->a_x_rec = 1.0f / a_x;
+    }
+    
+    static FpType push (SegmentData *segment, SegmentState *s, FpType end_v)
+    {
+        AMBRO_ASSERT(FloatIsPosOrPosZero(segment->a_x))
+        AMBRO_ASSERT(FloatIsPosOrPosZero(segment->max_v))
+        AMBRO_ASSERT(FloatIsPosOrPosZero(segment->max_start_v))
+        AMBRO_ASSERT(segment->max_start_v <= segment->max_v)
+        AMBRO_ASSERT(FloatIsPosOrPosZero(end_v))
+        AMBRO_ASSERT(end_v <= segment->max_v)
+        
+        s->end_v = end_v;
+        FpType start_u = reach(segment, FloatSqrt(end_v));
+        return FloatMin(segment->max_start_v, start_u * start_u);
+    }
+    
+    static bool isConverged (SegmentState const *s, FpType end_v)
+    {
+        return end_v == s->end_v;
+    }
+    
+    static FpType pull (SegmentData *segment, SegmentState *s, FpType start_v, SegmentResult *result)
+    {
+        AMBRO_ASSERT(s->end_v <= segment->max_v)
+        AMBRO_ASSERT(FloatIsPosOrPosZero(start_v))
+        AMBRO_ASSERT(start_v <= segment->max_start_v)
+        
+        FpType start_u = FloatSqrt(start_v);
+        FpType end_u = FloatMin(FloatSqrt(s->end_v), reach(segment, start_u));
+        FpType max_u = FloatSqrt(segment->max_v);
+        
+        FpType accel_dist = phase_distance(segment, start_u, max_u);
+        FpType decel_dist = phase_distance(segment, end_u, max_u);
+        FpType const_u;
+        
+        if (accel_dist + decel_dist <= segment->a_x) {
+            const_u = max_u;
+            result->const_start = accel_dist * segment->a_x_rec;
+            result->const_end = decel_dist * segment->a_x_rec;
+        } else {
+            const_u = find_peak(segment, start_u, end_u, max_u);
+            accel_dist = phase_distance(segment, start_u, const_u);
+            decel_dist = phase_distance(segment, end_u, const_u);
+            // The two phases cover the whole segment, fix up any rounding errors.
+            FpType sum = accel_dist + decel_dist;
+            result->const_start = (sum > 0.0f) ? (accel_dist / sum) : 0.0f;
+            result->const_end = 1.0f - result->const_start;
+        }
+        result->const_v = const_u * const_u;
+        
+        AMBRO_ASSERT(FloatIsPosOrPosZero(end_u))
+        AMBRO_ASSERT(FloatIsPosOrPosZero(result->const_v))
+        
+        return FloatMin(s->end_v, end_u * end_u);
+    }
+    
+    // Duration of a phase changing the speed by vdiff, multiplied by max_accel.
+    static FpType rampTime (SegmentData const *segment, FpType vdiff)
+    {
+        FpType k = segment->ramp_v;
+        if (vdiff >= k) {
+            return vdiff + k;
+        }
+        return FloatLdexp(FloatSqrt(vdiff * k), 1);
+    }
+    
+    // Fraction of the time of a phase spent in each of its two ramps.
+    static FpType rampFraction (SegmentData const *segment, FpType vdiff)
+    {
+        FpType k = segment->ramp_v;
+        if (vdiff >= k) {
+            FpType sum = vdiff + k;
+            return (sum > 0.0f) ? (k / sum) : 0.0f;
+        }
+        return 0.5f;
+    }
+    
+    // Splits a phase changing the speed from from_u to to_u (not squared)
+    // into three constant-acceleration parts.
+    static void splitRamp (SegmentData const *segment, FpType from_u, FpType to_u, RampSplit *split)
+    {
+        FpType diff = to_u - from_u;
+        FpType r = rampFraction(segment, FloatAbs(diff));
+        FpType ramp_diff = diff * (r / (2.0f * (1.0f - r)));
+        FpType a_u = from_u + ramp_diff;
+        FpType b_u = to_u - ramp_diff;
+        FpType sum = from_u + to_u;
+        FpType sum_rec = (sum > 0.0f) ? (1.0f / sum) : 0.0f;
+        FpType r_by_sum = r * sum_rec;
+        
+        split->ramp_t = r;
+        split->ramp_u = ramp_diff;
+        split->x0 = (from_u + a_u) * r_by_sum;
+        split->x2 = (b_u + to_u) * r_by_sum;
+        split->a0 = ramp_diff * r_by_sum;
+        split->a1 = (b_u - a_u) * (1.0f - 2.0f * r) * sum_rec;
+        split->a2 = split->a0;
+    }
+
+private:
+    static FpType phase_distance (SegmentData const *segment, FpType u0, FpType u1)
+    {
+        return (u0 + u1) * rampTime(segment, FloatAbs(u1 - u0));
+    }
+    
+    // Highest speed which can be reached (or started from, by symmetry) within
+    // the segment, when starting (or ending) at speed u.
+    static FpType reach (SegmentData const *segment, FpType u)
+    {
+        FpType k = segment->ramp_v;
+        FpType a_x = segment->a_x;
+        
+        // Full acceleration is reached: a_x = (u1^2 - u^2) + (u1 + u) * k.
+        if (a_x >= 2.0f * k * (2.0f * u + k)) {
+            FpType t = 2.0f * u - k;
+            return FloatLdexp(FloatSqrt(t * t + 4.0f * a_x) - k, -1);
+        }
+        
+        // Otherwise a_x = 2 * (2 * u + d) * sqrt(d * k), where d = u1 - u.
+        // With s = sqrt(d) this is the cubic s^3 + p * s - q = 0.
+        FpType p = 2.0f * u;
+        FpType q = a_x / (2.0f * FloatSqrt(k));
+        FpType w = FloatCbrt(0.5f * q + FloatSqrt(0.25f * q * q + p * p * p * (FpType)(1.0 / 27.0)));
+        FpType sd = 0.0f;
+        if (w > 0.0f) {
+            sd = w - p / (3.0f * w);
+            sd -= (sd * (sd * sd + p) - q) / (3.0f * sd * sd + p);
+            sd = FloatMakePosOrPosZero(sd);
+        }
+        return u + sd * sd;
+    }
+    
+    // Peak speed between max(u0, u1) and max_u at which the acceleration
+    // from u0 and the deceleration to u1 together cover the segment.
+    static FpType find_peak (SegmentData const *segment, FpType u0, FpType u1, FpType max_u)
+    {
+        FpType k = segment->ramp_v;
+        FpType low = FloatMax(u0, u1);
+        
+        // Try the case where both phases reach full acceleration.
+        FpType c = (u0 + u1) * k - u0 * u0 - u1 * u1 - segment->a_x;
+        FpType disc = k * k - 2.0f * c;
+        if (disc >= 0.0f) {
+            FpType peak = FloatLdexp(FloatSqrt(disc) - k, -1);
+            if (peak - u0 >= k && peak - u1 >= k && peak <= max_u) {
+                return peak;
+            }
+        }
+        
+        // Otherwise solve numerically. The total distance is monotonic in the
+        // peak speed, but near low it grows with the square root of the speed
+        // change, so search for s = sqrt(peak - low) instead. Bisection gives
+        // a bracket and Newton steps refine the result within it.
+        if (peak_distance(segment, u0, u1, low) >= segment->a_x) {
+            return low;
+        }
+        FpType s_low = 0.0f;
+        FpType s_high = FloatSqrt(max_u - low);
+        for (int i = 0; i < BisectionIterations; i++) {
+            FpType mid = FloatLdexp(s_low + s_high, -1);
+            if (peak_distance(segment, u0, u1, low + mid * mid) > segment->a_x) {
+                s_high = mid;
+            } else {
+                s_low = mid;
+            }
+        }
+        FpType s = s_low;
+        for (int i = 0; i < NewtonIterations; i++) {
+            FpType peak = low + s * s;
+            FpType deriv = phase_distance_deriv(segment, u0, peak, s) + phase_distance_deriv(segment, u1, peak, s);
+            if (!(deriv > 0.0f)) {
+                break;
+            }
+            FpType next_s = s - (peak_distance(segment, u0, u1, peak) - segment->a_x) / deriv;
+            if (!(next_s >= s_low && next_s <= s_high)) {
+                break;
+            }
+            s = next_s;
+        }
+        return low + s * s;
+    }
+    
+    static FpType peak_distance (SegmentData const *segment, FpType u0, FpType u1, FpType peak)
+    {
+        return phase_distance(segment, u0, peak) + phase_distance(segment, u1, peak);
+    }
+    
+    // Derivative of phase_distance(u, peak) with respect to s, where peak = low + s^2.
+    static FpType phase_distance_deriv (SegmentData const *segment, FpType u, FpType peak, FpType s)
+    {
+        FpType k = segment->ramp_v;
+        FpType d = FloatMakePosOrPosZero(peak - u);
+        FpType two_s = FloatLdexp(s, 1);
+        if (d >= k) {
+            return (d + k + u + peak) * two_s;
+        }
+        // The distance is 2 * (u + peak) * sqrt(d * k). The derivative of sqrt(d)
+        // with respect to s is s / sqrt(d), which tends to 1 for the phase from low.
+        FpType sqrt_k = FloatSqrt(k);
+        FpType sqrt_d = FloatSqrt(d);
+        FpType sqrt_d_deriv = (sqrt_d > 0.0f) ? (s / sqrt_d) : 1.0f;
+        return 2.0f * sqrt_k * (sqrt_d * two_s + (u + peak) * sqrt_d_deriv);
+    }
+    
+    static int const BisectionIterations = 20;
+    static int const NewtonIterations = 4;
+};
+
+template <typename TRampTime>
+struct SCurvePlannerService {
+    using RampTime = TRampTime;
+    
+    template <typename FpType>
+    using SegmentPlanner = SCurvePlanner<FpType>;
+};
+
+}
+
+#endif
@@ -39,6 +39,23 @@
 
 namespace APrinter {
 
+/**
+ * Parser for the binary G-code format produced by aprinter_encode.py.
+ * 
+ * Each packet starts with a header byte whose high nibble is the command type.
+ * For the basic (v1) command types the low nibble is the number of parameters,
+ * followed by an index byte for each parameter (data type and letter) and the
+ * parameter values.
+ * 
+ * Format v2 adds compact moves (command types 4-7 for G0, G1, G0 with F and G1
+ * with F). The low nibble is a mask of the axes present (bit 0 to 3 for X, Y,
+ * Z, E). The header is followed by the F value, if present, as an unsigned
+ * varint in units of 0.001, and then for each axis present the zig-zag encoded
+ * varint difference to the value of this axis in the previous compact move,
+ * in units of 0.001 (0.00001 for E). Varints are little-endian base-128.
+ * The previous values start at zero at the beginning of the file, so the
+ * file can only be restarted from the beginning.
+ */
 template <typename Context, typename TBufferSizeType, typename FpType, typename Params>
 class BinaryGcodeParser
 : public GcodeCommand<Context, FpType>,
@@ -50,6 +67,10 @@ class BinaryGcodeParser
         CMD_TYPE_G0 = 1,
         CMD_TYPE_G1 = 2,
         CMD_TYPE_G92 = 3,
+        CMD_TYPE_DELTA_G0 = 4,
+        CMD_TYPE_DELTA_G1 = 5,
+        CMD_TYPE_DELTA_G0_F = 6,
+        CMD_TYPE_DELTA_G1_F = 7,
         CMD_TYPE_EOF = 14,
         CMD_TYPE_LONG = 15,
     };
@@ -59,27 +80,41 @@ class BinaryGcodeParser
         DATA_TYPE_DOUBLE = 2,
         DATA_TYPE_UINT32 = 3,
         DATA_TYPE_UINT64 = 4,
-        DATA_TYPE_VOID = 5
+        DATA_TYPE_VOID = 5,
+        DATA_TYPE_FIXED = 6
     };
     
+    static int const NumDeltaAxes = 4;
+    static int const MaxVarintBytes = 5;
+    
 public:
     using BufferSizeType = TBufferSizeType;
     using PartsSizeType = int8_t;
     using TheGcodeCommand = GcodeCommand<Context, FpType>;
     using PartRef = typename TheGcodeCommand::PartRef;
     
+    // Compact moves depend on the previous ones, so parsing
+    // cannot start in the middle of a file.
+    static bool const CanStartMidStream = false;
+    
 private:
     struct Part {
         uint8_t data_type;
         char code;
         uint8_t data_size;
-        uint8_t *data;
+        union {
+            uint8_t *data;
+            int32_t fixed_value;
+        };
     };
     
 public:
     void init (Context c)
     {
         m_state = STATE_NOCMD;
+        for (auto &base : m_delta_base) {
+            base = 0;
+        }
         
         this->debugInit(c);
     }
@@ -109,6 +144,16 @@ public:
         m_num_parts = assume_error;
     }
     
+    void takeLineState (Context c, BinaryGcodeParser const *prev)
+    {
+        this->debugAccess(c);
+        AMBRO_ASSERT(m_state == STATE_NOCMD)
+        
+        for (auto i : LoopRangeAuto(NumDeltaAxes)) {
+            m_delta_base[i] = prev->m_delta_base[i];
+        }
+    }
+    
     bool extendCommand (Context c, BufferSizeType avail, bool line_buffer_exhausted=false)
     {
         this->debugAccess(c);
@@ -126,6 +171,10 @@ public:
                         return false;
                     }
                     m_length = 1;
+                    if ((m_buffer[0] >> 4) >= CMD_TYPE_DELTA_G0 && (m_buffer[0] >> 4) <= CMD_TYPE_DELTA_G1_F) {
+                        m_state = STATE_DELTA;
+                        break;
+                    }
                     m_num_parts = m_buffer[0] & 0x0f;
                     if (m_num_parts > Params::MaxParts) {
                         m_num_parts = GCODE_ERROR_TOO_MANY_PARTS;
@@ -197,6 +246,18 @@ public:
                     m_state = STATE_PAYLOAD;
                 } break;
                 
+                case STATE_DELTA: {
+                    AMBRO_ASSERT(m_length == 1)
+                    int8_t res = parse_delta(avail);
+                    if (res == 0) {
+                        return false;
+                    }
+                    if (res < 0) {
+                        m_num_parts = GCODE_ERROR_INVALID_PART;
+                    }
+                    goto finish;
+                } break;
+                
                 case STATE_PAYLOAD: {
                     if (avail < m_total_size) {
                         return false;
@@ -300,6 +361,10 @@ public:
                 return val;
             } break;
             
+            case DATA_TYPE_FIXED: {
+                return (FpType)cast_part_ref(part)->fixed_value / fixed_scale(cast_part_ref(part)->code);
+            } break;
+            
             default:
                 return 0.0f;
         }
@@ -334,13 +399,103 @@ public:
     }
     
 private:
-    enum {STATE_NOCMD, STATE_HEADER, STATE_HEADER_LONG, STATE_INDEX, STATE_PAYLOAD};
+    enum {STATE_NOCMD, STATE_HEADER, STATE_HEADER_LONG, STATE_INDEX, STATE_PAYLOAD, STATE_DELTA};
     
     static Part * cast_part_ref (PartRef part_ref)
     {
         return (Part *)part_ref.ptr;
     }
     
+    static char delta_axis_code (int axis)
+    {
+        return (axis == 3) ? 'E' : ('X' + axis);
+    }
+    
+    static FpType fixed_scale (char code)
+    {
+        return (code == 'E') ? 100000.0f : 1000.0f;
+    }
+    
+    void set_fixed_part (PartsSizeType index, char code, int32_t value)
+    {
+        m_parts[index].data_type = DATA_TYPE_FIXED;
+        m_parts[index].code = code;
+        m_parts[index].data_size = 0;
+        m_parts[index].fixed_value = value;
+    }
+    
+    // Returns 1 if a varint was read, 0 if more data is needed and -1 if it is too long.
+    int8_t read_varint (BufferSizeType avail, BufferSizeType *pos, uint32_t *out)
+    {
+        uint32_t value = 0;
+        for (auto i : LoopRangeAuto(MaxVarintBytes)) {
+            if (*pos >= avail) {
+                return 0;
+            }
+            uint8_t byte = m_buffer[(*pos)++];
+            value |= (uint32_t)(byte & 0x7f) << (7 * i);
+            if (!(byte & 0x80)) {
+                *out = value;
+                return 1;
+            }
+        }
+        return -1;
+    }
+    
+    // Decodes a whole compact move, returning like read_varint. The previous axis
+    // values are only updated once the complete packet is available.
+    int8_t parse_delta (BufferSizeType avail)
+    {
+        uint8_t cmd_type = m_buffer[0] >> 4;
+        uint8_t axis_mask = m_buffer[0] & 0x0f;
+        bool have_f = (cmd_type >= CMD_TYPE_DELTA_G0_F);
+        
+        BufferSizeType pos = 1;
+        PartsSizeType num_parts = 0;
+        
+        if (have_f) {
+            if (num_parts == Params::MaxParts) {
+                return -1;
+            }
+            uint32_t f_value;
+            int8_t res = read_varint(avail, &pos, &f_value);
+            if (res <= 0) {
+                return res;
+            }
+            set_fixed_part(num_parts++, 'F', f_value);
+        }
+        
+        for (auto axis : LoopRangeAuto(NumDeltaAxes)) {
+            if (!(axis_mask & (1 << axis))) {
+                continue;
+            }
+            if (num_parts == Params::MaxParts) {
+                return -1;
+            }
+            uint32_t zigzag;
+            int8_t res = read_varint(avail, &pos, &zigzag);
+            if (res <= 0) {
+                return res;
+            }
+            uint32_t delta = (zigzag >> 1) ^ -(zigzag & 1);
+            int32_t value = (int32_t)((uint32_t)m_delta_base[axis] + delta);
+            set_fixed_part(num_parts++, delta_axis_code(axis), value);
+        }
+        
+        for (auto i : LoopRange<PartsSizeType>(num_parts)) {
+            char code = m_parts[i].code;
+            if (code != 'F') {
+                m_delta_base[(code == 'E') ? 3 : (code - 'X')] = m_parts[i].fixed_value;
+            }
+        }
+        
+        m_cmd_code = 'G';
+        m_cmd_num = (cmd_type == CMD_TYPE_DELTA_G0 || cmd_type == CMD_TYPE_DELTA_G0_F) ? 0 : 1;
+        m_num_parts = num_parts;
+        m_length = pos;
+        return 1;
+    }
+    
     uint8_t m_state;
     uint8_t *m_buffer;
     BufferSizeType m_length;
@@ -348,6 +503,7 @@ private:
     uint16_t m_cmd_num;
     PartsSizeType m_num_parts;
     BufferSizeType m_total_size;
+    int32_t m_delta_base[NumDeltaAxes];
     Part m_parts[Params::MaxParts];
 };
 
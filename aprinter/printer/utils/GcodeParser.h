@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 
 #include <aprinter/meta/ServiceUtils.h>
 #include <aprinter/math/FloatTools.h>
@@ -66,12 +67,17 @@ public:
     using TheGcodeCommand = GcodeCommand<Context, FpType>;
     using PartRef = typename TheGcodeCommand::PartRef;
     
+    // Parsing may start at the beginning of any line.
+    static bool const CanStartMidStream = true;
+    
     template <typename TheParserType, typename Dummy = void>
     struct CommandExtra {};
     
     struct CommandPart {
         char code;
+        bool have_fp_value;
         char *data;
+        FpType fp_value;
     };
     
     struct Command : public CommandExtra<ParserType> {
@@ -121,6 +127,17 @@ public:
         TheTypeHelper::init_command_hook(c, this);
     }
     
+    // For users which parse consecutive commands with different parser objects,
+    // this takes over the state which spans commands from the parser which
+    // parsed the previous command. Call before startCommand.
+    void takeLineState (Context c, GcodeParser const *prev)
+    {
+        this->debugAccess(c);
+        AMBRO_ASSERT(m_state == STATE_NOCMD)
+        
+        TheTypeHelper::take_line_state_hook(c, this, prev);
+    }
+    
     bool extendCommand (Context c, BufferSizeType avail, bool line_buffer_exhausted=false)
     {
         this->debugAccess(c);
@@ -153,6 +170,7 @@ public:
             }
             
             if (AMBRO_UNLIKELY(m_command.num_parts < 0 || (TheTypeHelper::ChecksumEnabled && m_state == STATE_CHECKSUM))) {
+                skip_to_newline(avail);
                 continue;
             }
             
@@ -162,6 +180,7 @@ public:
                 }
                 m_temp = m_command.length;
                 m_state = STATE_CHECKSUM;
+                skip_to_newline(avail);
                 continue;
             }
             
@@ -169,6 +188,7 @@ public:
             
             if (TheTypeHelper::CommentsEnabled) {
                 if (AMBRO_UNLIKELY(m_state == STATE_COMMENT)) {
+                    skip_to_newline(avail);
                     continue;
                 }
                 if (AMBRO_UNLIKELY(ch == ';')) {
@@ -176,6 +196,7 @@ public:
                         finish_part(c);
                     }
                     m_state = STATE_COMMENT;
+                    skip_to_newline(avail);
                     continue;
                 }
             }
@@ -281,7 +302,14 @@ public:
         AMBRO_ASSERT(m_state == STATE_NOCMD)
         AMBRO_ASSERT(m_command.num_parts >= 0)
         
-        return StrToFloat<FpType>(cast_part_ref(part)->data, NULL);
+        // The value is converted on first use and then remembered, since
+        // commands commonly look at the same parameter more than once.
+        CommandPart *cmd_part = cast_part_ref(part);
+        if (!cmd_part->have_fp_value) {
+            cmd_part->fp_value = DecimalStrToFloat<FpType>(cmd_part->data);
+            cmd_part->have_fp_value = true;
+        }
+        return cmd_part->fp_value;
     }
     
     uint32_t getPartUint32Value (Context c, PartRef part)
@@ -340,6 +368,10 @@ private:
             o->m_command.have_line_number = false;
         }
         
+        static void take_line_state_hook (Context c, GcodeParser *o, GcodeParser const *prev)
+        {
+        }
+        
         static bool finish_part_hook (Context c, GcodeParser *o, char code)
         {
             if (AMBRO_UNLIKELY(!o->m_command.have_line_number && o->m_command.num_parts == 0 && code == 'N')) {
@@ -396,6 +428,11 @@ private:
             }
         }
         
+        static void take_line_state_hook (Context c, GcodeParser *o, GcodeParser const *prev)
+        {
+            o->m_continuing_comment_line = prev->m_continuing_comment_line;
+        }
+        
         static bool finish_part_hook (Context c, GcodeParser *o, char code)
         {
             return false;
@@ -461,6 +498,18 @@ private:
         return (received_len == 0);
     }
     
+    // Used when the rest of the line is ignored (comment, checksum or error), with
+    // m_command.length at a character which is not a newline. Instead of going
+    // through the loop for each character, let memchr (which the C library
+    // implements a word or more at a time) find the newline, and leave
+    // m_command.length just before it so the loop increment lands on it.
+    void skip_to_newline (BufferSizeType avail)
+    {
+        BufferSizeType pos = m_command.length + 1;
+        char const *newline = (char const *)memchr(m_buffer + pos, '\n', avail - pos);
+        m_command.length = (newline ? (BufferSizeType)(newline - m_buffer) : avail) - 1;
+    }
+    
     void finish_part (Context c)
     {
         AMBRO_ASSERT(m_command.num_parts >= 0)
@@ -504,6 +553,7 @@ private:
         }
         
         m_command.parts[m_command.num_parts].code = code;
+        m_command.parts[m_command.num_parts].have_fp_value = false;
         m_command.parts[m_command.num_parts].data = m_buffer + (m_temp + 1);
         m_command.num_parts++;
     }
@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef APRINTER_LZ_STREAM_DECODER_H
+#define APRINTER_LZ_STREAM_DECODER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <aprinter/base/Assert.h>
+
+namespace APrinter {
+
+/**
+ * Incremental decoder for the LZSS format produced by aprinter_compress.py.
+ * 
+ * The stream starts with the header "ALZ" followed by a byte giving the
+ * window size as a power of two (8 to MaxWindowBits). The rest is a sequence
+ * of groups, each consisting of a flags byte and eight items, one for each
+ * bit of the flags byte starting with the lowest. A set bit denotes a literal
+ * byte, a clear bit a match, which is a 16-bit little-endian value with the
+ * distance minus one in the upper window-bits bits and the length minus
+ * MinMatch in the remaining bits. The stream may end in the middle of a group.
+ * 
+ * Input and output can be provided in arbitrary pieces. Decoded bytes are
+ * also written into a window of 2^MaxWindowBits bytes, which is the only
+ * memory needed besides a few bytes of state. With MaxWindowBits of zero the
+ * decoder is disabled and the window is reduced to a single byte.
+ */
+template <int MaxWindowBits>
+class LzStreamDecoder {
+    static_assert(MaxWindowBits == 0 || (MaxWindowBits >= 8 && MaxWindowBits <= 12), "");
+    
+    static size_t const WindowSize = (size_t)1 << MaxWindowBits;
+    static int const MinMatch = 3;
+    
+public:
+    static size_t const HeaderSize = 4;
+    
+    enum HeaderResult {HEADER_NONE, HEADER_OK, HEADER_UNSUPPORTED};
+    
+    // Checks whether the data starts with a header and returns the
+    // window size of the stream in *out_window_bits if it is supported.
+    static HeaderResult checkHeader (uint8_t const *data, size_t length, int *out_window_bits)
+    {
+        if (length < HeaderSize || data[0] != 'A' || data[1] != 'L' || data[2] != 'Z') {
+            return HEADER_NONE;
+        }
+        if (data[3] < 8 || data[3] > MaxWindowBits) {
+            return HEADER_UNSUPPORTED;
+        }
+        *out_window_bits = data[3];
+        return HEADER_OK;
+    }
+    
+    void init (int window_bits)
+    {
+        AMBRO_ASSERT(window_bits >= 8 && window_bits <= MaxWindowBits)
+        
+        m_length_bits = 16 - window_bits;
+        m_flags = 1;
+        m_have_low_byte = false;
+        m_window_pos = 0;
+        m_copy_dist = 0;
+        m_copy_length = 0;
+        for (auto &byte : m_window) {
+            byte = 0;
+        }
+    }
+    
+    // Decodes until the input is exhausted or the output is full,
+    // advancing *in and *out past the consumed and produced bytes.
+    void decode (uint8_t const **in, uint8_t const *in_end, uint8_t **out, uint8_t *out_end)
+    {
+        uint8_t const *in_ptr = *in;
+        uint8_t *out_ptr = *out;
+        
+        while (out_ptr != out_end) {
+            if (m_copy_length > 0) {
+                put_byte(&out_ptr, m_window[(uint16_t)(m_window_pos - m_copy_dist) & (WindowSize - 1)]);
+                m_copy_length--;
+                continue;
+            }
+            
+            if (in_ptr == in_end) {
+                break;
+            }
+            
+            if (m_flags == 1) {
+                m_flags = 0x100 | *in_ptr++;
+                continue;
+            }
+            
+            if (m_flags & 1) {
+                put_byte(&out_ptr, *in_ptr++);
+                m_flags >>= 1;
+                continue;
+            }
+            
+            if (!m_have_low_byte) {
+                m_low_byte = *in_ptr++;
+                m_have_low_byte = true;
+                continue;
+            }
+            
+            uint16_t match = m_low_byte | ((uint16_t)*in_ptr++ << 8);
+            m_have_low_byte = false;
+            m_flags >>= 1;
+            m_copy_dist = (match >> m_length_bits) + 1;
+            m_copy_length = (match & ((1 << m_length_bits) - 1)) + MinMatch;
+        }
+        
+        *in = in_ptr;
+        *out = out_ptr;
+    }
+    
+    // Whether there are bytes of a match left to output.
+    bool hasPendingOutput ()
+    {
+        return m_copy_length > 0;
+    }
+    
+private:
+    void put_byte (uint8_t **out_ptr, uint8_t byte)
+    {
+        m_window[m_window_pos & (WindowSize - 1)] = byte;
+        m_window_pos++;
+        *(*out_ptr)++ = byte;
+    }
+    
+    uint8_t m_length_bits;
+    uint8_t m_low_byte;
+    bool m_have_low_byte;
+    uint16_t m_flags;
+    uint16_t m_window_pos;
+    uint16_t m_copy_dist;
+    uint16_t m_copy_length;
+    uint8_t m_window[WindowSize];
+};
+
+}
+
+#endif
@@ -106,6 +106,20 @@ public:
         this->m_last = e;
     }
     
+    void insertBefore (Entry *e, Entry *before)
+    {
+        AMBRO_ASSERT(before)
+        
+        ac(*e).next = before;
+        if (before != m_first) {
+            ac(*e).prev = ac(*before).prev;
+            ac(*ac(*before).prev).next = e;
+        } else {
+            m_first = e;
+        }
+        ac(*before).prev = e;
+    }
+    
     void remove (Entry *e)
     {
         if (e != m_first) {
@@ -44,8 +44,10 @@
 #include <aprinter/base/Lock.h>
 #include <aprinter/base/Hints.h>
 #include <aprinter/base/Callback.h>
+#include <aprinter/base/BitScan.h>
 #include <aprinter/system/InterruptLock.h>
 #include <aprinter/system/TimedEventCompat.h>
+#include <aprinter/system/EventLoopProfiler.h>
 #include <aprinter/misc/ClockUtils.h>
 
 namespace APrinter {
@@ -82,13 +84,16 @@ public:
         o->m_queued_event_list.init();
         o->m_timed_event_list.init();
         Delay::extra(c)->m_fast_event_pos = 0;
-        for (typename Delay::Extra::FastEventSizeType i = 0; i < Delay::Extra::NumFastEvents; i++) {
-            Delay::extra(c)->m_fast_events[i].not_triggered = true;
+        for (int i = 0; i < Delay::Extra::NumFastEventWords; i++) {
+            Delay::extra(c)->m_fast_pending[i] = 0;
         }
         o->m_now = Clock::getTime(c);
 #ifdef EVENTLOOP_BENCHMARK
         o->m_bench_time = 0;
 #endif
+#ifdef EVENTLOOP_PROFILING
+        Delay::extra(c)->m_profiler.reset();
+#endif
         
         TheDebugObject::init(c);
     }
@@ -109,23 +114,15 @@ public:
         dispatch_queued_events(c);
         
         while (1) {
-            for (typename Delay::Extra::FastEventSizeType i = 0; i < Delay::Extra::NumFastEvents; i++) {
-                Delay::extra(c)->m_fast_event_pos++;
-                if (AMBRO_UNLIKELY(Delay::extra(c)->m_fast_event_pos == Delay::Extra::NumFastEvents)) {
-                    Delay::extra(c)->m_fast_event_pos = 0;
-                }
-                cli();
-                if (!Delay::extra(c)->m_fast_events[Delay::extra(c)->m_fast_event_pos].not_triggered) {
-                    Delay::extra(c)->m_fast_events[Delay::extra(c)->m_fast_event_pos].not_triggered = true;
-                    sei();
-                    bench_start_measuring(c);
-                    Delay::extra(c)->m_fast_events[Delay::extra(c)->m_fast_event_pos].handler(c);
-                    dispatch_queued_events(c);
-                    c.check();
-                    bench_stop_measuring(c);
-                    break;
-                }
-                sei();
+            int index = take_fast_event(c);
+            if (index >= 0) {
+                bench_start_measuring(c);
+                TimeType start_time = profile_start(c);
+                Delay::extra(c)->m_fast_event_handlers[index](c);
+                profile_fast(c, index, start_time);
+                dispatch_queued_events(c);
+                c.check();
+                bench_stop_measuring(c);
             }
             
             o->m_now = Clock::getTime(c);
@@ -138,7 +135,9 @@ public:
                     o->m_timed_event_list.remove(*tev);
                     TimedEventList::markRemoved(*tev);
                     bench_start_measuring(c);
+                    TimeType start_time = profile_start(c);
                     tev->handleTimerExpired(c);
+                    profile_handler(c, EventLoopProfilerKind::TIMED, tev, start_time);
                     dispatch_queued_events(c);
                     c.check();
                     bench_stop_measuring(c);
@@ -168,6 +167,14 @@ public:
     }
 #endif
     
+#ifdef EVENTLOOP_PROFILING
+    template <typename This=BusyEventLoop>
+    static typename This::Delay::Extra::Profiler * getProfiler (Context c)
+    {
+        return &Delay::extra(c)->m_profiler;
+    }
+#endif
+    
     template <typename Id>
     struct FastEventSpec {};
     
@@ -176,7 +183,7 @@ public:
     {
         TheDebugObject::access(c);
         
-        Delay::extra(c)->m_fast_events[Delay::Extra::template get_event_index<EventSpec>()].handler = handler;
+        Delay::extra(c)->m_fast_event_handlers[Delay::Extra::template get_event_index<EventSpec>()] = handler;
     }
     
     template <typename EventSpec>
@@ -184,7 +191,12 @@ public:
     {
         TheDebugObject::access(c);
         
-        Delay::extra(c)->m_fast_events[Delay::Extra::template get_event_index<EventSpec>()].not_triggered = true;
+        int const word = Delay::Extra::template get_event_word<EventSpec>();
+        auto const mask = Delay::Extra::template get_event_mask<EventSpec>();
+        
+        AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
+            Delay::extra(c)->m_fast_pending[word] &= ~mask;
+        }
     }
     
     template <typename EventSpec, typename ThisContext>
@@ -193,8 +205,11 @@ public:
     {
         TheDebugObject::access(c);
         
+        int const word = Delay::Extra::template get_event_word<EventSpec>();
+        auto const mask = Delay::Extra::template get_event_mask<EventSpec>();
+        
         AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
-            Delay::extra(c)->m_fast_events[Delay::Extra::template get_event_index<EventSpec>()].not_triggered = false;
+            Delay::extra(c)->m_fast_pending[word] |= mask;
         }
     }
     
@@ -226,6 +241,72 @@ private:
 #endif
     }
     
+    static TimeType profile_start (Context c)
+    {
+#ifdef EVENTLOOP_PROFILING
+        return Delay::extra(c)->m_profiler.start(c);
+#else
+        return 0;
+#endif
+    }
+    
+    static void profile_handler (Context c, EventLoopProfilerKind kind, void const *handler, TimeType start_time)
+    {
+#ifdef EVENTLOOP_PROFILING
+        Delay::extra(c)->m_profiler.finishHandler(c, kind, handler, start_time);
+#endif
+    }
+    
+    static void profile_fast (Context c, int index, TimeType start_time)
+    {
+#ifdef EVENTLOOP_PROFILING
+        Delay::extra(c)->m_profiler.finishFast(c, index, start_time);
+#endif
+    }
+    
+    // Finds and clears the first pending fast event following the one
+    // dispatched last, wrapping around, so that events are served in turn.
+    // Returns -1 if no fast event is pending.
+    static int take_fast_event (Context c)
+    {
+        using Extra = typename Delay::Extra;
+        using Word = typename Extra::FastEventWord;
+        auto *e = Delay::extra(c);
+        
+        if (Extra::NumFastEvents == 0) {
+            return -1;
+        }
+        
+        int start = e->m_fast_event_pos + 1;
+        if (start >= Extra::NumFastEvents) {
+            start = 0;
+        }
+        int start_word = start / Extra::FastEventWordBits;
+        int num_words = MaxValue(1, Extra::NumFastEventWords);
+        
+        int index = -1;
+        cli();
+        for (int k = 0; k <= Extra::NumFastEventWords; k++) {
+            int word = (start_word + k) % num_words;
+            Word bits = e->m_fast_pending[word];
+            if (k == 0) {
+                bits &= (Word)-1 << (start % Extra::FastEventWordBits);
+            }
+            if (bits != 0) {
+                int bit = CountTrailingZeros(bits);
+                e->m_fast_pending[word] &= ~((Word)1 << bit);
+                index = word * Extra::FastEventWordBits + bit;
+                break;
+            }
+        }
+        sei();
+        
+        if (index >= 0) {
+            e->m_fast_event_pos = index;
+        }
+        return index;
+    }
+    
     static void dispatch_queued_events (Context c)
     {
         auto *o = Object::self(c);
@@ -238,7 +319,9 @@ private:
             o->m_queued_event_list.removeFirst();
             QueuedEventList::markRemoved(*qev);
             
+            TimeType start_time = profile_start(c);
             qev->m_handler(c);
+            profile_handler(c, EventLoopProfilerKind::QUEUED, (void const *)qev->m_handler.m_func, start_time);
         }
     }
     
@@ -273,10 +356,10 @@ class BusyEventLoopExtra {
     static const int NumFastEvents = TypeListLength<FastEventList>::Value;
     using FastEventSizeType = ChooseInt<MaxValue(1, BitsInInt<NumFastEvents>::Value), false>;
     
-    struct FastEventState {
-        bool not_triggered;
-        typename Loop::FastHandlerType handler;
-    };
+    // Pending fast events are bits in an array of words.
+    using FastEventWord = unsigned int;
+    static int const FastEventWordBits = 8 * sizeof(FastEventWord);
+    static int const NumFastEventWords = (NumFastEvents + FastEventWordBits - 1) / FastEventWordBits;
     
     template <typename EventSpec>
     static constexpr FastEventSizeType get_event_index ()
@@ -284,10 +367,28 @@ class BusyEventLoopExtra {
         return TypeListIndex<FastEventList, EventSpec>::Value;
     }
     
+    template <typename EventSpec>
+    static constexpr int get_event_word ()
+    {
+        return get_event_index<EventSpec>() / FastEventWordBits;
+    }
+    
+    template <typename EventSpec>
+    static constexpr FastEventWord get_event_mask ()
+    {
+        return (FastEventWord)1 << (get_event_index<EventSpec>() % FastEventWordBits);
+    }
+    
 public:
+    using Profiler = EventLoopProfiler<typename Loop::Context, NumFastEvents>;
+    
     struct Object : public ObjBase<BusyEventLoopExtra, ParentObject, EmptyTypeList> {
         FastEventSizeType m_fast_event_pos;
-        FastEventState m_fast_events[NumFastEvents];
+        FastEventWord m_fast_pending[NumFastEventWords];
+        typename Loop::FastHandlerType m_fast_event_handlers[NumFastEvents];
+#ifdef EVENTLOOP_PROFILING
+        Profiler m_profiler;
+#endif
     };
 };
 
@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef APRINTER_EVENT_LOOP_PROFILER_H
+#define APRINTER_EVENT_LOOP_PROFILER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <aprinter/base/Hints.h>
+
+namespace APrinter {
+
+/*
+ * Dispatch statistics for event loops, used when EVENTLOOP_PROFILING
+ * is defined.
+ * 
+ * Handlers are identified by an address: the callback function for
+ * queued events and fd events, and the TimedEvent object for timed
+ * events (these dispatch through a virtual function). The addresses
+ * can be resolved using the symbol table of the firmware. Fast events
+ * are identified by their index.
+ * 
+ * The handler table is a small open-addressing hash table. When it is
+ * full, the statistics for new handlers are added to a shared
+ * overflow entry.
+ */
+enum class EventLoopProfilerKind : uint8_t {UNUSED, QUEUED, TIMED, FD};
+
+template <typename Context, int FastEventCount>
+class EventLoopProfiler {
+    using Clock = typename Context::Clock;
+
+public:
+    using TimeType = typename Clock::TimeType;
+    
+    using Kind = EventLoopProfilerKind;
+    
+    static int const NumHandlerSlots = 32;
+    static int const NumFastEvents = FastEventCount;
+    
+    struct Stat {
+        uint32_t count;
+        uint64_t total;
+        TimeType max;
+    };
+    
+    struct HandlerEntry {
+        Kind kind;
+        void const *handler;
+        Stat stat;
+    };
+    
+    void reset ()
+    {
+        for (int i = 0; i < NumHandlerSlots; i++) {
+            m_handlers[i].kind = Kind::UNUSED;
+        }
+        for (int i = 0; i < NumFastEvents; i++) {
+            reset_stat(&m_fast[i]);
+        }
+        reset_stat(&m_overflow);
+    }
+    
+    AMBRO_ALWAYS_INLINE
+    TimeType start (Context c)
+    {
+        return Clock::getTime(c);
+    }
+    
+    void finishHandler (Context c, Kind kind, void const *handler, TimeType start_time)
+    {
+        TimeType duration = Clock::getTime(c) - start_time;
+        add_to_stat(find_stat(kind, handler), duration);
+    }
+    
+    void finishFast (Context c, int index, TimeType start_time)
+    {
+        TimeType duration = Clock::getTime(c) - start_time;
+        add_to_stat(&m_fast[index], duration);
+    }
+    
+    HandlerEntry const * getHandlerEntry (int index) const
+    {
+        return &m_handlers[index];
+    }
+    
+    Stat const * getFastStat (int index) const
+    {
+        return &m_fast[index];
+    }
+    
+    Stat const * getOverflowStat () const
+    {
+        return &m_overflow;
+    }
+
+private:
+    static void reset_stat (Stat *stat)
+    {
+        stat->count = 0;
+        stat->total = 0;
+        stat->max = 0;
+    }
+    
+    static void add_to_stat (Stat *stat, TimeType duration)
+    {
+        stat->count++;
+        stat->total += duration;
+        if (duration > stat->max) {
+            stat->max = duration;
+        }
+    }
+    
+    Stat * find_stat (Kind kind, void const *handler)
+    {
+        uintptr_t hash = (uintptr_t)handler;
+        hash ^= hash >> 7;
+        hash ^= hash >> 13;
+        
+        for (int probe = 0; probe < NumHandlerSlots; probe++) {
+            HandlerEntry *entry = &m_handlers[(hash + probe) % NumHandlerSlots];
+            if (entry->kind == Kind::UNUSED) {
+                entry->kind = kind;
+                entry->handler = handler;
+                reset_stat(&entry->stat);
+                return &entry->stat;
+            }
+            if (entry->kind == kind && entry->handler == handler) {
+                return &entry->stat;
+            }
+        }
+        
+        return &m_overflow;
+    }
+
+private:
+    HandlerEntry m_handlers[NumHandlerSlots];
+    Stat m_fast[NumFastEvents];
+    Stat m_overflow;
+};
+
+}
+
+#endif
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef APRINTER_INTERRUPT_TIMER_LATENESS_H
+#define APRINTER_INTERRUPT_TIMER_LATENESS_H
+
+#include <stdint.h>
+
+#include <aprinter/meta/WrapFunction.h>
+#include <aprinter/meta/Instance.h>
+#include <aprinter/meta/AliasStruct.h>
+#include <aprinter/base/Object.h>
+#include <aprinter/base/Lock.h>
+#include <aprinter/system/InterruptLock.h>
+
+namespace APrinter {
+
+/*
+ * Interrupt timer wrapper which keeps a histogram of how late the handler
+ * runs compared to the time the timer was set for (getLastSetTime()).
+ * Bucket 0 counts handlers which were not late; bucket i>0 counts lateness
+ * in [2^(i-1), 2^i) clock ticks, with the last bucket also counting all
+ * greater lateness. The counters are written only from the handler, readers
+ * take a snapshot with interrupts disabled.
+ * 
+ * The wrapper derives from the platform interrupt timer, so the ISR macros
+ * of the platform can be used with it unchanged.
+ */
+
+template <typename Arg>
+class LatenessInterruptTimer;
+
+template <typename Arg>
+struct LatenessInterruptTimer__Base {
+    struct Object;
+    struct Handler;
+    APRINTER_MAKE_INSTANCE(Timer, (Arg::Params::TimerService::template InterruptTimer<typename Arg::Context, Object, Handler>))
+};
+
+template <typename Arg>
+class LatenessInterruptTimer : public LatenessInterruptTimer__Base<Arg>::Timer {
+    using Context      = typename Arg::Context;
+    using ParentObject = typename Arg::ParentObject;
+    using Handler      = typename Arg::Handler;
+    
+    using Base = LatenessInterruptTimer__Base<Arg>;
+    using Clock = typename Context::Clock;
+    using TimeType = typename Clock::TimeType;
+    
+    friend Base;
+
+public:
+    using Object = typename Base::Object;
+    using HandlerContext = typename Base::Timer::HandlerContext;
+    
+    static int const NumLatenessBuckets = 16;
+    
+    template <typename ThisContext>
+    static void getLatenessHistogram (ThisContext c, uint32_t *counts)
+    {
+        auto *o = Object::self(c);
+        
+        AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
+            for (int i = 0; i < NumLatenessBuckets; i++) {
+                counts[i] = o->lateness_counts[i];
+            }
+        }
+    }
+    
+    template <typename ThisContext>
+    static void resetLatenessHistogram (ThisContext c)
+    {
+        auto *o = Object::self(c);
+        
+        AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
+            for (int i = 0; i < NumLatenessBuckets; i++) {
+                o->lateness_counts[i] = 0;
+            }
+        }
+    }
+    
+    static void init (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        for (int i = 0; i < NumLatenessBuckets; i++) {
+            o->lateness_counts[i] = 0;
+        }
+        
+        Base::Timer::init(c);
+    }
+
+private:
+    static bool timer_handler (HandlerContext c)
+    {
+        auto *o = Object::self(c);
+        
+        TimeType lateness = Clock::getTime(c) - Base::Timer::getLastSetTime(c);
+        
+        // A handler running early shows up as a huge unsigned lateness.
+        int bucket = 0;
+        if (lateness < (TimeType)-1 / 2) {
+            while (lateness > 0 && bucket < NumLatenessBuckets - 1) {
+                lateness >>= 1;
+                bucket++;
+            }
+        }
+        o->lateness_counts[bucket]++;
+        
+        return Handler::call(c);
+    }
+};
+
+template <typename Arg>
+struct LatenessInterruptTimer__Base<Arg>::Handler : public AMBRO_WFUNC_TD(&LatenessInterruptTimer<Arg>::timer_handler) {};
+
+template <typename Arg>
+struct LatenessInterruptTimer__Base<Arg>::Object : public ObjBase<LatenessInterruptTimer<Arg>, typename Arg::ParentObject, MakeTypeList<
+    typename LatenessInterruptTimer__Base<Arg>::Timer
+>> {
+    uint32_t lateness_counts[LatenessInterruptTimer<Arg>::NumLatenessBuckets];
+};
+
+APRINTER_ALIAS_STRUCT_EXT(LatenessInterruptTimerService, (
+    APRINTER_AS_TYPE(TimerService)
+), (
+    APRINTER_ALIAS_STRUCT_EXT(InterruptTimer, (
+        APRINTER_AS_TYPE(Context),
+        APRINTER_AS_TYPE(ParentObject),
+        APRINTER_AS_TYPE(Handler)
+    ), (
+        using Params = LatenessInterruptTimerService;
+        APRINTER_DEF_INSTANCE(InterruptTimer, LatenessInterruptTimer)
+    ))
+))
+
+}
+
+#endif
@@ -56,8 +56,10 @@
 #include <aprinter/base/LoopUtils.h>
 #include <aprinter/base/Preprocessor.h>
 #include <aprinter/base/OneOf.h>
+#include <aprinter/base/BitScan.h>
 #include <aprinter/misc/ClockUtils.h>
 #include <aprinter/system/TimedEventCompat.h>
+#include <aprinter/system/EventLoopProfiler.h>
 
 namespace APrinter {
 
@@ -67,7 +69,7 @@ template <typename> class LinuxEventLoopFdEvent;
 
 template <typename Arg>
 class LinuxEventLoop {
-    APRINTER_USE_TYPES1(Arg, (ParentObject, ExtraDelay, TimersStructureService))
+    APRINTER_USE_TYPES1(Arg, (ParentObject, ExtraDelay, TimersStructureService, BackendService))
     
     template <typename> friend class LinuxEventLoopQueuedEvent;
     template <typename> friend class LinuxEventLoopTimedEvent;
@@ -100,7 +102,8 @@ private:
     
     using TimerLinkModel = PointerLinkModel<TimedEventNew>;
     
-    static int const NumEpollEvents = 16;
+    // The backend waits for fd events and timer expiration.
+    APRINTER_MAKE_INSTANCE(TheBackend, (BackendService::template Backend<Context, Object, LinuxEventLoop>))
     
     // Number of lowest order bits in timer state which define the
     // order for the heap. This allows the TEMP_UNSET and TEMP_SET
@@ -158,29 +161,24 @@ public:
         o->timed_event_heap.init();
         
         // Initialize other event-related states.
-        o->cur_epoll_event = 0;
-        o->num_epoll_events = 0;
-        o->timerfd_configured = false;
         o->timers_now = Clock::getTime(c);
         
-        // Clear the fastevent pending flags.
-        for (auto i : LoopRangeAuto(Extra<>::NumFastEvents)) {
-            extra(c)->m_event_pending[i] = false;
+        // Clear the fastevent pending bits.
+        for (auto i : LoopRangeAuto(Extra<>::NumFastEventWords)) {
+            extra(c)->m_event_pending[i] = 0;
         }
+        extra(c)->m_dispatch_word = 0;
+        extra(c)->m_dispatch_bits = 0;
         
-        // Create the epoll instance.
-        o->epoll_fd = ::epoll_create1(0);
-        AMBRO_ASSERT_FORCE(o->epoll_fd >= 0)
-        
-        // Create the timerfd and add to epoll.
-        o->timer_fd = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
-        AMBRO_ASSERT_FORCE(o->timer_fd >= 0)
-        control_epoll(c, EPOLL_CTL_ADD, o->timer_fd, EPOLLIN, nullptr);
+#ifdef EVENTLOOP_PROFILING
+        extra(c)->m_profiler.reset();
+#endif
         
-        // Create the eventfd and add to epoll.
-        o->event_fd = ::eventfd(0, EFD_NONBLOCK);
+        // Create the eventfd, the backend will watch it.
+        o->event_fd = ::eventfd(0, TheBackend::EventFdFlags);
         AMBRO_ASSERT_FORCE(o->event_fd >= 0)
-        control_epoll(c, EPOLL_CTL_ADD, o->event_fd, EPOLLIN, &o->event_fd);
+        
+        TheBackend::init(c);
         
         TheDebugObject::init(c);
     }
@@ -221,86 +219,66 @@ public:
                 o->timed_event_heap.fixup(*tev);
                 
                 // Call the handler.
+                TimeType start_time = profile_start(c);
                 tev->handleTimerExpired(c);
+                profile_handler(c, EventLoopProfilerKind::TIMED, tev, start_time);
                 dispatch_queued_events(c);
             }
             
-            // Process epoll events.
-            while (o->cur_epoll_event < o->num_epoll_events) {
-                // Take an event.
-                struct epoll_event *ev = &o->epoll_events[o->cur_epoll_event++];
-                void *data_ptr = ev->data.ptr;
+            // Process fd events reported by the backend. The backend
+            // also consumes the eventfd here.
+            FdEvent *fdev;
+            int events;
+            while (TheBackend::take_fd_event(c, &fdev, &events)) {
+                fdev->debugAccess(c);
+                AMBRO_ASSERT(fdev->m_handler)
+                AMBRO_ASSERT(fdev->m_fd >= 0)
+                AMBRO_ASSERT(fd_req_events_valid(fdev->m_events))
+                AMBRO_ASSERT(events != 0)
                 
-                if (data_ptr == &o->event_fd) {
-                    // Consume the eventfd.
-                    uint64_t event_count = 0;
-                    ssize_t read_res = ::read(o->event_fd, &event_count, sizeof(event_count));
-                    if (read_res < 0) {
-                        // The only possibly expected error is that there are no events.
-                        // But even this should not happen since the fd was found readable.
-                        int err = errno;
-                        AMBRO_ASSERT_FORCE(err == EAGAIN || err == EWOULDBLOCK)
-                    } else {
-                        // If the read succeeds we are supposed to get a nonzero event count.
-                        AMBRO_ASSERT_FORCE(read_res == sizeof(event_count))
-                        AMBRO_ASSERT_FORCE(event_count > 0)
-                    }
-                }
-                else if (data_ptr != nullptr) {
-                    // It must be for an FdEvent.
-                    FdEvent *fdev = (FdEvent *)data_ptr;
-                    fdev->debugAccess(c);
-                    AMBRO_ASSERT(fdev->m_handler)
-                    AMBRO_ASSERT(fdev->m_fd >= 0)
-                    AMBRO_ASSERT(fd_req_events_valid(fdev->m_events))
-                    
-                    // Calculate events to report.
-                    int events = get_fd_events_to_report(ev->events, fdev->m_events);
-                    
-                    if (events != 0) {
-                        // Call the handler.
-                        fdev->m_handler(c, events);
-                        dispatch_queued_events(c);
-                    }
-                }
+                // Call the handler.
+                TimeType start_time = profile_start(c);
+                fdev->m_handler(c, events);
+                profile_handler(c, EventLoopProfilerKind::FD, (void const *)fdev->m_handler.m_func, start_time);
+                dispatch_queued_events(c);
             }
             
             // Dispatch any pending fastevents.
-            // It is important to do this after reading the eventfd above.
+            // It is important to do this after consuming the eventfd above.
             // If we did it before, we might miss an event that wrote into
             // the eventfd after checking.
-            for (auto i : LoopRangeAuto(Extra<>::NumFastEvents)) {
-                // Atomically set the pending flag to false and check if it was true.
-                if (extra(c)->m_event_pending[i].exchange(false)) {
+            for (auto word : LoopRangeAuto(Extra<>::NumFastEventWords)) {
+                if (extra(c)->m_event_pending[word].load(std::memory_order_relaxed) == 0) {
+                    continue;
+                }
+                
+                // Atomically take all pending events in this word. They are kept
+                // in m_dispatch_bits so that resetFastEvent can still cancel them.
+                extra(c)->m_dispatch_word = word;
+                extra(c)->m_dispatch_bits = extra(c)->m_event_pending[word].exchange(0);
+                
+                while (extra(c)->m_dispatch_bits != 0) {
+                    int bit = CountTrailingZeros(extra(c)->m_dispatch_bits);
+                    extra(c)->m_dispatch_bits &= extra(c)->m_dispatch_bits - 1;
+                    int index = word * Extra<>::FastEventWordBits + bit;
+                    
                     // Call the handler.
-                    extra(c)->m_event_handler[i](c);
+                    TimeType start_time = profile_start(c);
+                    extra(c)->m_event_handler[index](c);
+                    profile_fast(c, index, start_time);
                     dispatch_queued_events(c);
                 }
             }
             
             // All previous events must have been processed.
             AMBRO_ASSERT(!has_timers_for_dispatch(c))
-            AMBRO_ASSERT(o->cur_epoll_event == o->num_epoll_events)
             
             // Adjust any TEMP_* state timers and make sure the
-            // timerfd is set correctly for the current timers.
+            // backend timer is set correctly for the current timers.
             prepare_timers_for_wait(c, now_ts);
             
-            // Wait for events with epoll.
-            int wait_res;
-            while (true) {
-                wait_res = ::epoll_wait(o->epoll_fd, o->epoll_events, NumEpollEvents, -1);
-                if (wait_res >= 0) {
-                    break;
-                }
-                int err = errno;
-                AMBRO_ASSERT_FORCE(err == EINTR) // nothign else should happen here
-            }
-            AMBRO_ASSERT_FORCE(wait_res <= NumEpollEvents)
-            
-            // Set the epoll event count and position.
-            o->cur_epoll_event = 0;
-            o->num_epoll_events = wait_res;
+            // Wait for events.
+            TheBackend::wait(c);
         }
     }
     
@@ -328,8 +306,15 @@ public:
     {
         TheDebugObject::access(c);
         
-        int const index = Extra<>::template get_event_index<EventSpec>();
-        extra(c)->m_event_pending[index] = false;
+        int const word = Extra<>::template get_event_word<EventSpec>();
+        auto const mask = Extra<>::template get_event_mask<EventSpec>();
+        
+        extra(c)->m_event_pending[word].fetch_and(~mask);
+        
+        // Also cancel it if it has been taken for dispatch but not dispatched yet.
+        if (word == extra(c)->m_dispatch_word) {
+            extra(c)->m_dispatch_bits &= ~mask;
+        }
     }
     
     template <typename EventSpec, typename ThisContext>
@@ -338,10 +323,14 @@ public:
         auto *o = Object::self(c);
         TheDebugObject::access(c);
         
-        int const index = Extra<>::template get_event_index<EventSpec>();
+        int const word = Extra<>::template get_event_word<EventSpec>();
+        auto const mask = Extra<>::template get_event_mask<EventSpec>();
         
-        // Set the pending flag and raise the eventfd if the flag was not already set.
-        if (!extra(c)->m_event_pending[index].exchange(true)) {
+        // Set the pending bit and raise the eventfd if no event in the same
+        // word was pending. Otherwise the eventfd has already been raised
+        // for an event which the loop has not yet taken, and it will take
+        // ours at the same time.
+        if (extra(c)->m_event_pending[word].fetch_or(mask) == 0) {
             uint64_t event_count = 1;
             ssize_t write_res = ::write(o->event_fd, &event_count, sizeof(event_count));
 #ifdef AMBROLIB_ASSERTIONS
@@ -378,16 +367,27 @@ private:
     template <typename This=LinuxEventLoop>
     static typename Extra<This>::Object * extra (Context c) { return Extra<>::Object::self(c); }
     
-    static void control_epoll (Context c, int op, int fd, uint32_t events, void *data_ptr)
+    static TimeType profile_start (Context c)
     {
-        auto *o = Object::self(c);
-        
-        struct epoll_event ev = {};
-        ev.events = events;
-        ev.data.ptr = data_ptr;
-        
-        int res = ::epoll_ctl(o->epoll_fd, op, fd, &ev);
-        AMBRO_ASSERT_FORCE(res == 0)
+#ifdef EVENTLOOP_PROFILING
+        return extra(c)->m_profiler.start(c);
+#else
+        return 0;
+#endif
+    }
+    
+    static void profile_handler (Context c, EventLoopProfilerKind kind, void const *handler, TimeType start_time)
+    {
+#ifdef EVENTLOOP_PROFILING
+        extra(c)->m_profiler.finishHandler(c, kind, handler, start_time);
+#endif
+    }
+    
+    static void profile_fast (Context c, int index, TimeType start_time)
+    {
+#ifdef EVENTLOOP_PROFILING
+        extra(c)->m_profiler.finishFast(c, index, start_time);
+#endif
     }
     
     static void dispatch_queued_events (Context c)
@@ -402,11 +402,13 @@ private:
             o->queued_event_list.removeFirst();
             QueuedEventList::markRemoved(qev);
             
+            TimeType start_time = profile_start(c);
             qev->m_handler(c);
+            profile_handler(c, EventLoopProfilerKind::QUEUED, (void const *)qev->m_handler.m_func, start_time);
         }
     }
     
-    // This is called after epoll_wait to transition to DISPATCH state
+    // This is called after waiting to transition to DISPATCH state
     // any timers which are expired and to update timers_now.
     // There MUST be no DISPATCH or TEMP_* timers in the heap.
     static void update_timers_for_dispatch (Context c, TimeType now)
@@ -453,8 +455,8 @@ private:
         return tev != nullptr && tev->m_state == TimState::DISPATCH;
     }
     
-    // This is called before epoll_wait to transition any TEMP_* state
-    // timers to other states and ensure that the timerfd is configured
+    // This is called before waiting to transition any TEMP_* state
+    // timers to other states and ensure that the backend timer is configured
     // correctly. Any DISPATCH state timers MUST have been dispatched and
     // now_ts MUST correspond to timers_now.
     static void prepare_timers_for_wait (Context c, struct timespec now_ts)
@@ -482,7 +484,7 @@ private:
                 o->timed_event_heap.fixup(*tev);
             }
             // Otherwise it's the smallest PAST or FUTURE timer, and the
-            // timerds is to be configured based on this timer.
+            // backend timer is to be configured based on this timer.
             else {
                 have_first_time = true;
                 if (tev->m_state == TimState::FUTURE) {
@@ -496,91 +498,7 @@ private:
             }
         }
         
-        struct itimerspec itspec = {};
-        
-        if (have_first_time) {
-            // Avoid redundant timerfd_settime.
-            time_t now_high_sec = now_ts.tv_sec >> Clock::SecondBits;
-            if (o->timerfd_configured &&
-                first_time == o->timerfd_time &&
-                now_high_sec == o->timerfd_now_high_sec) {
-                return;
-            }
-            
-            // Compute the target timespec based on difference between first_time and now.
-            TimeType time_from_now = TheClockUtils::timeDifference(first_time, o->timers_now);
-            itspec.it_value = Clock::addTimeToTimespec(now_ts, time_from_now);
-            
-            o->timerfd_time = first_time;
-            o->timerfd_now_high_sec = now_high_sec;
-        } else {
-            // Avoid redundant timerfd_settime.
-            if (!o->timerfd_configured) {
-                return;
-            }
-            
-            // Leave itspec zeroed to disable the timer.
-        }
-        
-        o->timerfd_configured = have_first_time;
-        
-        int res = ::timerfd_settime(o->timer_fd, TFD_TIMER_ABSTIME, &itspec, nullptr);
-        AMBRO_ASSERT_FORCE(res == 0)
-    }
-    
-    static uint32_t events_to_epoll (int events)
-    {
-        uint32_t epoll_events = 0;
-        if ((events & FdEvFlags::EV_READ) != 0) {
-            epoll_events |= EPOLLIN;
-        }
-        if ((events & FdEvFlags::EV_WRITE) != 0) {
-            epoll_events |= EPOLLOUT;
-        }
-        return epoll_events;
-    }
-    
-    static int get_fd_events_to_report (uint32_t epoll_events, int req_events)
-    {
-        int events = 0;
-        if ((req_events & FdEvFlags::EV_READ) != 0 && (epoll_events & EPOLLIN) != 0) {
-            events |= FdEvFlags::EV_READ;
-        }
-        if ((req_events & FdEvFlags::EV_WRITE) != 0 && (epoll_events & EPOLLOUT) != 0) {
-            events |= FdEvFlags::EV_WRITE;
-        }
-        if ((epoll_events & EPOLLERR) != 0) {
-            events |= FdEvFlags::EV_ERROR;
-        }
-        if ((epoll_events & EPOLLHUP) != 0) {
-            events |= FdEvFlags::EV_HUP;
-        }
-        return events;
-    }
-    
-    static void add_fd_event (Context c, FdEvent *fdev)
-    {
-        control_epoll(c, EPOLL_CTL_ADD, fdev->m_fd, events_to_epoll(fdev->m_events), fdev);
-    }
-    
-    static void change_fd_event (Context c, FdEvent *fdev)
-    {
-        control_epoll(c, EPOLL_CTL_MOD, fdev->m_fd, events_to_epoll(fdev->m_events), fdev);
-    }
-    
-    static void remove_fd_event (Context c, FdEvent *fdev)
-    {
-        auto *o = Object::self(c);
-        
-        control_epoll(c, EPOLL_CTL_DEL, fdev->m_fd, 0, nullptr);
-        
-        // Set the data pointer to null in any pending epoll events for this FdEvent.
-        for (auto i : LoopRangeAuto(o->cur_epoll_event, o->num_epoll_events)) {
-            struct epoll_event *ev = &o->epoll_events[i];
-            if (ev->data.ptr == fdev) {
-                ev->data.ptr = nullptr;
-            }
-        }
+        TheBackend::set_timer(c, have_first_time, first_time, o->timers_now, now_ts);
     }
     
     static bool fd_req_events_valid (int events)
@@ -653,19 +571,22 @@ private:
     };
     
 public:
-    struct Object : public ObjBase<LinuxEventLoop, ParentObject, MakeTypeList<TheDebugObject>> {
+#ifdef EVENTLOOP_PROFILING
+    template <typename This=LinuxEventLoop>
+    static typename Extra<This>::Profiler * getProfiler (Context c)
+    {
+        return &extra(c)->m_profiler;
+    }
+#endif
+    
+    struct Object : public ObjBase<LinuxEventLoop, ParentObject, MakeTypeList<
+        TheDebugObject,
+        TheBackend
+    >> {
         QueuedEventList queued_event_list;
         TimedEventHeap timed_event_heap;
-        int cur_epoll_event;
-        int num_epoll_events;
-        int epoll_fd;
-        int timer_fd;
         int event_fd;
         TimeType timers_now;
-        TimeType timerfd_time;
-        time_t timerfd_now_high_sec;
-        bool timerfd_configured;
-        struct epoll_event epoll_events[NumEpollEvents];
     };
 };
 
@@ -673,7 +594,8 @@ APRINTER_ALIAS_STRUCT_EXT(LinuxEventLoopArg, (
     APRINTER_AS_TYPE(Context),
     APRINTER_AS_TYPE(ParentObject),
     APRINTER_AS_TYPE(ExtraDelay),
-    APRINTER_AS_TYPE(TimersStructureService)
+    APRINTER_AS_TYPE(TimersStructureService),
+    APRINTER_AS_TYPE(BackendService)
 ), (
     APRINTER_DEF_INSTANCE(LinuxEventLoopArg, LinuxEventLoop)
 ))
@@ -688,16 +610,40 @@ class LinuxEventLoopExtra {
     
     static int const NumFastEvents = TypeListLength<FastEventList>::Value;
     
+    // Pending fast events are bits in an array of words.
+    using FastEventWord = uintptr_t;
+    static int const FastEventWordBits = 8 * sizeof(FastEventWord);
+    static int const NumFastEventWords = (NumFastEvents + FastEventWordBits - 1) / FastEventWordBits;
+    
     template <typename EventSpec>
     static constexpr int get_event_index ()
     {
         return TypeListIndex<FastEventList, EventSpec>::Value;
     }
     
+    template <typename EventSpec>
+    static constexpr int get_event_word ()
+    {
+        return get_event_index<EventSpec>() / FastEventWordBits;
+    }
+    
+    template <typename EventSpec>
+    static constexpr FastEventWord get_event_mask ()
+    {
+        return (FastEventWord)1 << (get_event_index<EventSpec>() % FastEventWordBits);
+    }
+    
 public:
+    using Profiler = EventLoopProfiler<typename Loop::Context, NumFastEvents>;
+    
     struct Object : public ObjBase<LinuxEventLoopExtra, ParentObject, EmptyTypeList> {
-        std::atomic_bool m_event_pending[NumFastEvents];
+        std::atomic<FastEventWord> m_event_pending[NumFastEventWords];
+        FastEventWord m_dispatch_bits;
+        int m_dispatch_word;
         typename Loop::FastHandlerType m_event_handler[NumFastEvents];
+#ifdef EVENTLOOP_PROFILING
+        Profiler m_profiler;
+#endif
     };
 };
 
@@ -937,6 +883,9 @@ class LinuxEventLoopFdEvent
 : private SimpleDebugObject<typename Loop::Context>
 {
     friend Loop;
+    friend typename Loop::TheBackend;
+    
+    using TheBackend = typename Loop::TheBackend;
     
 public:
     APRINTER_USE_TYPE1(Loop, Context)
@@ -948,6 +897,7 @@ public:
         
         m_handler = handler;
         m_fd = -1;
+        TheBackend::init_fd_event(c, this);
         
         this->debugInit(c);
     }
@@ -957,7 +907,7 @@ public:
         this->debugDeinit(c);
         
         if (m_fd >= 0) {
-            Loop::remove_fd_event(c, this);
+            TheBackend::remove_fd_event(c, this);
         }
     }
     
@@ -966,7 +916,7 @@ public:
         this->debugAccess(c);
         
         if (m_fd >= 0) {
-            Loop::remove_fd_event(c, this);
+            TheBackend::remove_fd_event(c, this);
             m_fd = -1;
         }
     }
@@ -980,7 +930,7 @@ public:
         
         m_fd = fd;
         m_events = events;
-        Loop::add_fd_event(c, this);
+        TheBackend::add_fd_event(c, this);
     }
     
     void changeEvents (Context c, int events)
@@ -991,7 +941,7 @@ public:
         
         if (m_events != events) {
             m_events = events;
-            Loop::change_fd_event(c, this);
+            TheBackend::change_fd_event(c, this);
         }
     }
     
@@ -999,6 +949,244 @@ private:
     HandlerType m_handler;
     int m_fd;
     int m_events;
+    typename TheBackend::FdEventState m_backend_state;
+};
+
+template <typename Arg>
+class LinuxEpollBackend {
+    APRINTER_USE_TYPES1(Arg, (Context, ParentObject, Loop))
+    APRINTER_USE_TYPES1(Loop, (FdEvent, FdEvFlags, TimeType))
+    APRINTER_USE_TYPE1(Context, Clock)
+    
+    static int const NumEpollEvents = 16;
+    
+public:
+    struct Object;
+    
+    struct FdEventState {};
+    
+    static int const EventFdFlags = EFD_NONBLOCK;
+    
+    static void init (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        o->cur_epoll_event = 0;
+        o->num_epoll_events = 0;
+        o->timerfd_configured = false;
+        
+        // Create the epoll instance.
+        o->epoll_fd = ::epoll_create1(0);
+        AMBRO_ASSERT_FORCE(o->epoll_fd >= 0)
+        
+        // Create the timerfd and add to epoll.
+        o->timer_fd = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        AMBRO_ASSERT_FORCE(o->timer_fd >= 0)
+        control_epoll(c, EPOLL_CTL_ADD, o->timer_fd, EPOLLIN, nullptr);
+        
+        // Add the eventfd of the loop to epoll.
+        control_epoll(c, EPOLL_CTL_ADD, event_fd(c), EPOLLIN, &o->epoll_fd);
+    }
+    
+    static void init_fd_event (Context c, FdEvent *fdev)
+    {
+    }
+    
+    static void add_fd_event (Context c, FdEvent *fdev)
+    {
+        control_epoll(c, EPOLL_CTL_ADD, fdev->m_fd, events_to_epoll(fdev->m_events), fdev);
+    }
+    
+    static void change_fd_event (Context c, FdEvent *fdev)
+    {
+        control_epoll(c, EPOLL_CTL_MOD, fdev->m_fd, events_to_epoll(fdev->m_events), fdev);
+    }
+    
+    static void remove_fd_event (Context c, FdEvent *fdev)
+    {
+        auto *o = Object::self(c);
+        
+        control_epoll(c, EPOLL_CTL_DEL, fdev->m_fd, 0, nullptr);
+        
+        // Set the data pointer to null in any pending epoll events for this FdEvent.
+        for (auto i : LoopRangeAuto(o->cur_epoll_event, o->num_epoll_events)) {
+            struct epoll_event *ev = &o->epoll_events[i];
+            if (ev->data.ptr == fdev) {
+                ev->data.ptr = nullptr;
+            }
+        }
+    }
+    
+    static bool take_fd_event (Context c, FdEvent **out_fdev, int *out_events)
+    {
+        auto *o = Object::self(c);
+        
+        while (o->cur_epoll_event < o->num_epoll_events) {
+            // Take an event.
+            struct epoll_event *ev = &o->epoll_events[o->cur_epoll_event++];
+            void *data_ptr = ev->data.ptr;
+            
+            if (data_ptr == &o->epoll_fd) {
+                // Consume the eventfd.
+                uint64_t event_count = 0;
+                ssize_t read_res = ::read(event_fd(c), &event_count, sizeof(event_count));
+                if (read_res < 0) {
+                    // The only possibly expected error is that there are no events.
+                    // But even this should not happen since the fd was found readable.
+                    int err = errno;
+                    AMBRO_ASSERT_FORCE(err == EAGAIN || err == EWOULDBLOCK)
+                } else {
+                    // If the read succeeds we are supposed to get a nonzero event count.
+                    AMBRO_ASSERT_FORCE(read_res == sizeof(event_count))
+                    AMBRO_ASSERT_FORCE(event_count > 0)
+                }
+            }
+            else if (data_ptr != nullptr) {
+                // It must be for an FdEvent.
+                FdEvent *fdev = (FdEvent *)data_ptr;
+                
+                // Calculate events to report.
+                int events = get_fd_events_to_report(ev->events, fdev->m_events);
+                
+                if (events != 0) {
+                    *out_fdev = fdev;
+                    *out_events = events;
+                    return true;
+                }
+            }
+        }
+        
+        return false;
+    }
+    
+    static void set_timer (Context c, bool have_first_time, TimeType first_time, TimeType now, struct timespec now_ts)
+    {
+        auto *o = Object::self(c);
+        
+        struct itimerspec itspec = {};
+        
+        if (have_first_time) {
+            // Avoid redundant timerfd_settime.
+            time_t now_high_sec = now_ts.tv_sec >> Clock::SecondBits;
+            if (o->timerfd_configured &&
+                first_time == o->timerfd_time &&
+                now_high_sec == o->timerfd_now_high_sec) {
+                return;
+            }
+            
+            // Compute the target timespec based on difference between first_time and now.
+            TimeType time_from_now = TheClockUtils::timeDifference(first_time, now);
+            itspec.it_value = Clock::addTimeToTimespec(now_ts, time_from_now);
+            
+            o->timerfd_time = first_time;
+            o->timerfd_now_high_sec = now_high_sec;
+        } else {
+            // Avoid redundant timerfd_settime.
+            if (!o->timerfd_configured) {
+                return;
+            }
+            
+            // Leave itspec zeroed to disable the timer.
+        }
+        
+        o->timerfd_configured = have_first_time;
+        
+        int res = ::timerfd_settime(o->timer_fd, TFD_TIMER_ABSTIME, &itspec, nullptr);
+        AMBRO_ASSERT_FORCE(res == 0)
+    }
+    
+    static void wait (Context c)
+    {
+        auto *o = Object::self(c);
+        AMBRO_ASSERT(o->cur_epoll_event == o->num_epoll_events)
+        
+        int wait_res;
+        while (true) {
+            wait_res = ::epoll_wait(o->epoll_fd, o->epoll_events, NumEpollEvents, -1);
+            if (wait_res >= 0) {
+                break;
+            }
+            int err = errno;
+            AMBRO_ASSERT_FORCE(err == EINTR) // nothign else should happen here
+        }
+        AMBRO_ASSERT_FORCE(wait_res <= NumEpollEvents)
+        
+        // Set the epoll event count and position.
+        o->cur_epoll_event = 0;
+        o->num_epoll_events = wait_res;
+    }
+    
+private:
+    using TheClockUtils = ClockUtils<Context>;
+    
+    static int event_fd (Context c)
+    {
+        return Loop::Object::self(c)->event_fd;
+    }
+    
+    static void control_epoll (Context c, int op, int fd, uint32_t events, void *data_ptr)
+    {
+        auto *o = Object::self(c);
+        
+        struct epoll_event ev = {};
+        ev.events = events;
+        ev.data.ptr = data_ptr;
+        
+        int res = ::epoll_ctl(o->epoll_fd, op, fd, &ev);
+        AMBRO_ASSERT_FORCE(res == 0)
+    }
+    
+    static uint32_t events_to_epoll (int events)
+    {
+        uint32_t epoll_events = 0;
+        if ((events & FdEvFlags::EV_READ) != 0) {
+            epoll_events |= EPOLLIN;
+        }
+        if ((events & FdEvFlags::EV_WRITE) != 0) {
+            epoll_events |= EPOLLOUT;
+        }
+        return epoll_events;
+    }
+    
+    static int get_fd_events_to_report (uint32_t epoll_events, int req_events)
+    {
+        int events = 0;
+        if ((req_events & FdEvFlags::EV_READ) != 0 && (epoll_events & EPOLLIN) != 0) {
+            events |= FdEvFlags::EV_READ;
+        }
+        if ((req_events & FdEvFlags::EV_WRITE) != 0 && (epoll_events & EPOLLOUT) != 0) {
+            events |= FdEvFlags::EV_WRITE;
+        }
+        if ((epoll_events & EPOLLERR) != 0) {
+            events |= FdEvFlags::EV_ERROR;
+        }
+        if ((epoll_events & EPOLLHUP) != 0) {
+            events |= FdEvFlags::EV_HUP;
+        }
+        return events;
+    }
+    
+public:
+    struct Object : public ObjBase<LinuxEpollBackend, ParentObject, EmptyTypeList> {
+        int cur_epoll_event;
+        int num_epoll_events;
+        int epoll_fd;
+        int timer_fd;
+        TimeType timerfd_time;
+        time_t timerfd_now_high_sec;
+        bool timerfd_configured;
+        struct epoll_event epoll_events[NumEpollEvents];
+    };
+};
+
+struct LinuxEpollBackendService {
+    APRINTER_ALIAS_STRUCT_EXT(Backend, (
+        APRINTER_AS_TYPE(Context),
+        APRINTER_AS_TYPE(ParentObject),
+        APRINTER_AS_TYPE(Loop)
+    ), (
+        APRINTER_DEF_INSTANCE(Backend, LinuxEpollBackend)
+    ))
 };
 
 }
@@ -0,0 +1,458 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef APRINTER_LINUX_IO_URING_BACKEND_H
+#define APRINTER_LINUX_IO_URING_BACKEND_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include <aprinter/meta/ServiceUtils.h>
+#include <aprinter/base/Object.h>
+#include <aprinter/base/Assert.h>
+#include <aprinter/base/Preprocessor.h>
+#include <aprinter/misc/ClockUtils.h>
+
+namespace APrinter {
+
+/*
+ * LinuxEventLoop backend based on io_uring.
+ * 
+ * Fd polls, the timeout for the earliest timer and reads of the
+ * eventfd are all requests in a single ring. Requests are queued
+ * as the event loop runs and are submitted together with waiting
+ * for completions, in a single io_uring_enter() call.
+ * 
+ * Polls are one-shot and are queued again as soon as they complete
+ * (before the handler is called). This preserves the level-triggered
+ * semantics of FdEvent, which users such as LinuxTapEthernet rely on
+ * (it reads only one frame per event), while not costing any extra
+ * syscalls. Multishot polls would report only new readiness.
+ * 
+ * Completions of polls refer directly to the FdEvent, so an FdEvent
+ * which was ever started must stay in memory for the lifetime of the
+ * loop (as is the case with objects in the Program object).
+ * 
+ * Requires Linux 5.11 or newer (timeout updates).
+ */
+template <typename Arg>
+class LinuxIoUringBackend {
+    APRINTER_USE_TYPES1(Arg, (Context, ParentObject, Loop, Params))
+    APRINTER_USE_TYPES1(Loop, (FdEvent, FdEvFlags, TimeType))
+    APRINTER_USE_TYPE1(Context, Clock)
+    APRINTER_USE_VAL(Params, QueueEntries)
+    
+    static_assert(QueueEntries >= 8 && QueueEntries <= 4096, "");
+    
+    using TheClockUtils = ClockUtils<Context>;
+    
+    // Special user_data values, FdEvent pointers are used for polls.
+    static uint64_t const TimeoutUserData = 1;
+    static uint64_t const EventFdUserData = 2;
+    static uint64_t const IgnoreUserData = 3;
+    
+public:
+    struct Object;
+    
+    struct FdEventState {
+        bool poll_pending;
+        bool cancelling;
+        uint32_t poll_mask;
+    };
+    
+    // The eventfd is only read through the ring, and writes cannot block
+    // since the loop writes at most once per fast event until it reads.
+    static int const EventFdFlags = 0;
+    
+    static void init (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        struct io_uring_params params;
+        ::memset(&params, 0, sizeof(params));
+        
+        o->ring_fd = ::syscall(__NR_io_uring_setup, QueueEntries, &params);
+        AMBRO_ASSERT_FORCE(o->ring_fd >= 0)
+        AMBRO_ASSERT_FORCE((params.features & IORING_FEAT_NODROP) != 0)
+        AMBRO_ASSERT_FORCE((params.features & IORING_FEAT_EXT_ARG) != 0) // implies timeout updates
+        
+        size_t sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        char *sq_ring = (char *)map_ring(c, sq_ring_size, IORING_OFF_SQ_RING);
+        o->sq_head = (unsigned *)(sq_ring + params.sq_off.head);
+        o->sq_tail = (unsigned *)(sq_ring + params.sq_off.tail);
+        o->sq_array = (unsigned *)(sq_ring + params.sq_off.array);
+        o->sq_mask = *(unsigned *)(sq_ring + params.sq_off.ring_mask);
+        o->sq_entries = params.sq_entries;
+        
+        size_t cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        char *cq_ring = (char *)map_ring(c, cq_ring_size, IORING_OFF_CQ_RING);
+        o->cq_head = (unsigned *)(cq_ring + params.cq_off.head);
+        o->cq_tail = (unsigned *)(cq_ring + params.cq_off.tail);
+        o->cqes = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
+        o->cq_mask = *(unsigned *)(cq_ring + params.cq_off.ring_mask);
+        
+        o->sqes = (struct io_uring_sqe *)map_ring(c, params.sq_entries * sizeof(struct io_uring_sqe), IORING_OFF_SQES);
+        
+        o->sq_local_tail = *o->sq_tail;
+        o->to_submit = 0;
+        o->timeout_pending = false;
+        o->timeout_active = false;
+        
+        queue_eventfd_read(c);
+    }
+    
+    static void init_fd_event (Context c, FdEvent *fdev)
+    {
+        FdEventState *st = &fdev->m_backend_state;
+        st->poll_pending = false;
+        st->cancelling = false;
+    }
+    
+    static void add_fd_event (Context c, FdEvent *fdev)
+    {
+        sync_fd_event(c, fdev);
+    }
+    
+    static void change_fd_event (Context c, FdEvent *fdev)
+    {
+        sync_fd_event(c, fdev);
+    }
+    
+    static void remove_fd_event (Context c, FdEvent *fdev)
+    {
+        FdEventState *st = &fdev->m_backend_state;
+        
+        // The completion of the poll will be ignored.
+        if (st->poll_pending && !st->cancelling) {
+            cancel_poll(c, fdev);
+        }
+    }
+    
+    static bool take_fd_event (Context c, FdEvent **out_fdev, int *out_events)
+    {
+        auto *o = Object::self(c);
+        
+        while (true) {
+            // Take a completion, if any.
+            unsigned head = *o->cq_head;
+            if (head == __atomic_load_n(o->cq_tail, __ATOMIC_ACQUIRE)) {
+                return false;
+            }
+            struct io_uring_cqe *cqe = &o->cqes[head & o->cq_mask];
+            uint64_t user_data = cqe->user_data;
+            int32_t res = cqe->res;
+            __atomic_store_n(o->cq_head, head + 1, __ATOMIC_RELEASE);
+            
+            if (user_data == TimeoutUserData) {
+                // The timeout expired or was removed.
+                o->timeout_pending = false;
+            }
+            else if (user_data == EventFdUserData) {
+                // The eventfd was read, read it again.
+                AMBRO_ASSERT_FORCE(res == sizeof(uint64_t) || res == -EINTR || res == -EAGAIN)
+                queue_eventfd_read(c);
+            }
+            else if (user_data != IgnoreUserData) {
+                // It must be for an FdEvent.
+                FdEvent *fdev = (FdEvent *)user_data;
+                FdEventState *st = &fdev->m_backend_state;
+                
+                // A poll we no longer know about (the FdEvent was reinitialized).
+                if (!st->poll_pending) {
+                    continue;
+                }
+                
+                st->poll_pending = false;
+                bool cancelled = st->cancelling;
+                st->cancelling = false;
+                
+                // Queue the next poll right away, if still wanted.
+                sync_fd_event(c, fdev);
+                
+                if (cancelled || res == -ECANCELED || fdev->m_fd < 0) {
+                    continue;
+                }
+                
+                int events = (res < 0) ? FdEvFlags::EV_ERROR : get_fd_events_to_report(res, fdev->m_events);
+                if (events != 0) {
+                    *out_fdev = fdev;
+                    *out_events = events;
+                    return true;
+                }
+            }
+        }
+    }
+    
+    static void set_timer (Context c, bool have_first_time, TimeType first_time, TimeType now, struct timespec now_ts)
+    {
+        auto *o = Object::self(c);
+        
+        if (have_first_time) {
+            // Avoid a redundant timeout update.
+            time_t now_high_sec = now_ts.tv_sec >> Clock::SecondBits;
+            if (o->timeout_pending && o->timeout_active &&
+                first_time == o->timeout_time &&
+                now_high_sec == o->timeout_now_high_sec) {
+                return;
+            }
+            
+            // Compute the target timespec based on difference between first_time and now.
+            TimeType time_from_now = TheClockUtils::timeDifference(first_time, now);
+            struct timespec ts = Clock::addTimeToTimespec(now_ts, time_from_now);
+            o->timeout_ts.tv_sec = ts.tv_sec;
+            o->timeout_ts.tv_nsec = ts.tv_nsec;
+            
+            struct io_uring_sqe *sqe = get_sqe(c);
+            if (o->timeout_pending) {
+                // Move the existing timeout. If it has already expired the
+                // update fails and we will queue a new timeout once we
+                // see the completion of the old one.
+                sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+                sqe->fd = -1;
+                sqe->addr = TimeoutUserData;
+                sqe->off = (uintptr_t)&o->timeout_ts;
+                sqe->timeout_flags = IORING_TIMEOUT_UPDATE|IORING_TIMEOUT_ABS;
+                sqe->user_data = IgnoreUserData;
+            } else {
+                sqe->opcode = IORING_OP_TIMEOUT;
+                sqe->fd = -1;
+                sqe->addr = (uintptr_t)&o->timeout_ts;
+                sqe->len = 1;
+                sqe->timeout_flags = IORING_TIMEOUT_ABS;
+                sqe->user_data = TimeoutUserData;
+                o->timeout_pending = true;
+            }
+            
+            o->timeout_active = true;
+            o->timeout_time = first_time;
+            o->timeout_now_high_sec = now_high_sec;
+        } else {
+            // Remove the timeout unless already done.
+            if (!o->timeout_pending || !o->timeout_active) {
+                return;
+            }
+            
+            struct io_uring_sqe *sqe = get_sqe(c);
+            sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+            sqe->fd = -1;
+            sqe->addr = TimeoutUserData;
+            sqe->user_data = IgnoreUserData;
+            
+            o->timeout_active = false;
+        }
+    }
+    
+    static void wait (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        // Submit the queued requests and wait for at least one completion.
+        while (true) {
+            int res = enter(c, IORING_ENTER_GETEVENTS, 1);
+            if (res >= 0) {
+                break;
+            }
+            int err = errno;
+            AMBRO_ASSERT_FORCE(err == EINTR || err == EAGAIN || err == EBUSY)
+            // With EAGAIN/EBUSY completions must be reaped first.
+            if (err != EINTR) {
+                break;
+            }
+        }
+    }
+    
+private:
+    static void * map_ring (Context c, size_t size, off_t offset)
+    {
+        auto *o = Object::self(c);
+        
+        void *ptr = ::mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, o->ring_fd, offset);
+        AMBRO_ASSERT_FORCE(ptr != MAP_FAILED)
+        return ptr;
+    }
+    
+    static int enter (Context c, unsigned flags, unsigned min_complete)
+    {
+        auto *o = Object::self(c);
+        
+        __atomic_store_n(o->sq_tail, o->sq_local_tail, __ATOMIC_RELEASE);
+        
+        int res = ::syscall(__NR_io_uring_enter, o->ring_fd, o->to_submit, min_complete, flags, nullptr, 0);
+        if (res >= 0) {
+            AMBRO_ASSERT_FORCE((unsigned)res <= o->to_submit)
+            o->to_submit -= res;
+        }
+        return res;
+    }
+    
+    static struct io_uring_sqe * get_sqe (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        // If the submission queue is full, submit what we have.
+        while (o->sq_local_tail - __atomic_load_n(o->sq_head, __ATOMIC_ACQUIRE) == o->sq_entries) {
+            int res = enter(c, 0, 0);
+            AMBRO_ASSERT_FORCE(res >= 0 || errno == EINTR || errno == EAGAIN || errno == EBUSY)
+        }
+        
+        unsigned index = o->sq_local_tail & o->sq_mask;
+        struct io_uring_sqe *sqe = &o->sqes[index];
+        ::memset(sqe, 0, sizeof(*sqe));
+        o->sq_array[index] = index;
+        o->sq_local_tail++;
+        o->to_submit++;
+        return sqe;
+    }
+    
+    static void queue_eventfd_read (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        struct io_uring_sqe *sqe = get_sqe(c);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = Loop::Object::self(c)->event_fd;
+        sqe->addr = (uintptr_t)&o->eventfd_count;
+        sqe->len = sizeof(o->eventfd_count);
+        sqe->user_data = EventFdUserData;
+    }
+    
+    static void sync_fd_event (Context c, FdEvent *fdev)
+    {
+        FdEventState *st = &fdev->m_backend_state;
+        
+        uint32_t want_mask = (fdev->m_fd >= 0) ? events_to_poll(fdev->m_events) : 0;
+        
+        if (st->poll_pending) {
+            // Cancel a poll for the wrong events, we will get back here
+            // when the cancellation completes.
+            if (!st->cancelling && want_mask != st->poll_mask) {
+                cancel_poll(c, fdev);
+            }
+        }
+        else if (want_mask != 0) {
+            struct io_uring_sqe *sqe = get_sqe(c);
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = fdev->m_fd;
+            sqe->poll32_events = want_mask;
+            sqe->user_data = (uintptr_t)fdev;
+            
+            st->poll_pending = true;
+            st->poll_mask = want_mask;
+        }
+    }
+    
+    static void cancel_poll (Context c, FdEvent *fdev)
+    {
+        FdEventState *st = &fdev->m_backend_state;
+        AMBRO_ASSERT(st->poll_pending)
+        AMBRO_ASSERT(!st->cancelling)
+        
+        struct io_uring_sqe *sqe = get_sqe(c);
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = (uintptr_t)fdev;
+        sqe->user_data = IgnoreUserData;
+        
+        st->cancelling = true;
+    }
+    
+    static uint32_t events_to_poll (int events)
+    {
+        uint32_t poll_events = 0;
+        if ((events & FdEvFlags::EV_READ) != 0) {
+            poll_events |= POLLIN;
+        }
+        if ((events & FdEvFlags::EV_WRITE) != 0) {
+            poll_events |= POLLOUT;
+        }
+        return poll_events;
+    }
+    
+    static int get_fd_events_to_report (uint32_t poll_events, int req_events)
+    {
+        int events = 0;
+        if ((req_events & FdEvFlags::EV_READ) != 0 && (poll_events & POLLIN) != 0) {
+            events |= FdEvFlags::EV_READ;
+        }
+        if ((req_events & FdEvFlags::EV_WRITE) != 0 && (poll_events & POLLOUT) != 0) {
+            events |= FdEvFlags::EV_WRITE;
+        }
+        if ((poll_events & POLLERR) != 0) {
+            events |= FdEvFlags::EV_ERROR;
+        }
+        if ((poll_events & POLLHUP) != 0) {
+            events |= FdEvFlags::EV_HUP;
+        }
+        return events;
+    }
+    
+public:
+    struct Object : public ObjBase<LinuxIoUringBackend, ParentObject, EmptyTypeList> {
+        int ring_fd;
+        unsigned *sq_head;
+        unsigned *sq_tail;
+        unsigned *sq_array;
+        unsigned sq_mask;
+        unsigned sq_entries;
+        unsigned sq_local_tail;
+        unsigned to_submit;
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned cq_mask;
+        struct io_uring_cqe *cqes;
+        struct io_uring_sqe *sqes;
+        uint64_t eventfd_count;
+        bool timeout_pending;
+        bool timeout_active;
+        TimeType timeout_time;
+        time_t timeout_now_high_sec;
+        struct __kernel_timespec timeout_ts;
+    };
+};
+
+APRINTER_ALIAS_STRUCT_EXT(LinuxIoUringBackendService, (
+    APRINTER_AS_VALUE(int, QueueEntries)
+), (
+    APRINTER_ALIAS_STRUCT_EXT(Backend, (
+        APRINTER_AS_TYPE(Context),
+        APRINTER_AS_TYPE(ParentObject),
+        APRINTER_AS_TYPE(Loop)
+    ), (
+        using Params = LinuxIoUringBackendService;
+        APRINTER_DEF_INSTANCE(Backend, LinuxIoUringBackend)
+    ))
+))
+
+}
+
+#endif
@@ -0,0 +1,140 @@
+#!/usr/bin/env python2.7
+# Copyright (c) 2017 Ambroz Bizjak
+# All rights reserved.
+# 
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+# 
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+# DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# Compressor for G-code files (text or output of aprinter_encode.py) which the
+# firmware decompresses while printing from the SD card, if enabled by the
+# DecompressWindowBits SD card option. The format is described in
+# aprinter/printer/utils/LzStreamDecoder.h. The window size used here must not
+# exceed the one configured in the firmware.
+
+from __future__ import print_function
+from __future__ import with_statement
+
+MinMatch = 3
+MaxChainLength = 64
+
+def compress(data, window_bits=10):
+    if not (8 <= window_bits <= 12):
+        raise ValueError('window_bits must be between 8 and 12')
+    data = bytearray(data)
+    length_bits = 16 - window_bits
+    window_size = 1 << window_bits
+    max_match = (1 << length_bits) - 1 + MinMatch
+    out = bytearray(b'ALZ')
+    out.append(window_bits)
+    heads = {}
+    prev = [-1] * len(data)
+    flags_pos = None
+    flags_bit = 8
+    pos = 0
+    while pos < len(data):
+        best_len, best_dist = _find_match(data, pos, heads, prev, window_size, max_match)
+        if flags_bit == 8:
+            flags_pos = len(out)
+            out.append(0)
+            flags_bit = 0
+        if best_len >= MinMatch:
+            value = ((best_dist - 1) << length_bits) | (best_len - MinMatch)
+            out.append(value & 0xFF)
+            out.append(value >> 8)
+            advance = best_len
+        else:
+            out[flags_pos] |= 1 << flags_bit
+            out.append(data[pos])
+            advance = 1
+        flags_bit += 1
+        for i in range(pos, pos + advance):
+            _insert(data, i, heads, prev)
+        pos += advance
+    return bytes(out)
+
+def decompress(data):
+    data = bytearray(data)
+    if data[0:3] != bytearray(b'ALZ') or not (8 <= data[3] <= 12):
+        raise ValueError('not a compressed file')
+    length_bits = 16 - data[3]
+    out = bytearray()
+    pos = 4
+    while pos < len(data):
+        flags = data[pos]
+        pos += 1
+        for bit in range(8):
+            if pos >= len(data):
+                break
+            if flags & (1 << bit):
+                out.append(data[pos])
+                pos += 1
+            else:
+                value = data[pos] | (data[pos + 1] << 8)
+                pos += 2
+                dist = (value >> length_bits) + 1
+                for i in range(MinMatch + (value & ((1 << length_bits) - 1))):
+                    out.append(out[len(out) - dist] if dist <= len(out) else 0)
+    return bytes(out)
+
+def _insert(data, pos, heads, prev):
+    if pos + MinMatch <= len(data):
+        key = bytes(data[pos:pos + MinMatch])
+        prev[pos] = heads.get(key, -1)
+        heads[key] = pos
+
+def _find_match(data, pos, heads, prev, window_size, max_match):
+    best_len = 0
+    best_dist = 0
+    if pos + MinMatch > len(data):
+        return (best_len, best_dist)
+    limit = min(max_match, len(data) - pos)
+    candidate = heads.get(bytes(data[pos:pos + MinMatch]), -1)
+    chain = 0
+    while candidate >= 0 and pos - candidate <= window_size and chain < MaxChainLength:
+        length = 0
+        while length < limit and data[candidate + length] == data[pos + length]:
+            length += 1
+        if length > best_len:
+            best_len = length
+            best_dist = pos - candidate
+            if length == limit:
+                break
+        candidate = prev[candidate]
+        chain += 1
+    return (best_len, best_dist)
+
+def main():
+    import argparse
+    parser = argparse.ArgumentParser(description='Compress G-code for APrinter firmware.')
+    parser.add_argument('--input', required=True)
+    parser.add_argument('--output', required=True)
+    parser.add_argument('--window-bits', type=int, choices=range(8, 13), default=10)
+    parser.add_argument('--decompress', action='store_true')
+    args = parser.parse_args()
+    with open(args.input, 'rb') as input_file:
+        data = input_file.read()
+    if args.decompress:
+        result = decompress(data)
+    else:
+        result = compress(data, args.window_bits)
+    with open(args.output, 'wb') as output_file:
+        output_file.write(result)
+
+if __name__ == '__main__':
+    main()
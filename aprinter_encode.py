@@ -98,16 +98,79 @@ def encode_line(line):
     packet = packet_header + packet_index + packet_payload
     return packet
 
+class DeltaEncoder(object):
+    """Encoder for format v2, which encodes G0/G1 moves using only X, Y, Z, E
+    and F as compact packets with varint-encoded differences to the previous
+    compact move. Other lines, and moves whose values cannot be represented
+    exactly in the fixed-point units, are encoded as with encode_line."""
+    
+    def __init__(self):
+        self._base = [0] * len(_DeltaAxes)
+        self._last_f = None
+    
+    def encode_line(self, line):
+        packet = self._encode_delta(line)
+        if packet is None:
+            packet = encode_line(line)
+            if len(packet) > 0:
+                # The saved feedrate in the firmware may have changed.
+                self._last_f = None
+        return packet
+    
+    def _encode_delta(self, line):
+        comment_index = line.find(';')
+        if comment_index >= 0:
+            line = line[:comment_index]
+        parts = line.split()
+        if len(parts) == 0 or parts[0] not in _DeltaCommands:
+            return None
+        values = {}
+        for part in parts[1:]:
+            letter = part[0]
+            if letter not in _DeltaDecimals or letter in values:
+                return None
+            value = _parse_fixed(part[1:], _DeltaDecimals[letter])
+            if value is None:
+                return None
+            values[letter] = value
+        f_value = values.get('F')
+        if f_value is not None and not (f_value >= 0 and f_value < 2**31):
+            return None
+        payload = ''
+        axis_mask = 0
+        new_base = list(self._base)
+        for (axis, letter) in enumerate(_DeltaAxes):
+            if letter not in values:
+                continue
+            delta = values[letter] - self._base[axis]
+            if not (delta >= -2**31 and delta < 2**31):
+                return None
+            axis_mask |= 1 << axis
+            payload += _encode_varint(((delta << 1) ^ (delta >> 31)) & 0xFFFFFFFF)
+            new_base[axis] = values[letter]
+        command_type_code = _DeltaCommands[parts[0]]
+        if f_value is not None and f_value != self._last_f:
+            command_type_code += 2
+            payload = _encode_varint(f_value) + payload
+        self._base = new_base
+        if f_value is not None:
+            self._last_f = f_value
+        return chr((command_type_code << 4) + axis_mask) + payload
+
 EncodeFileErrors = (IOError, GcodeSyntaxError)
 
-def encode_file(input_file_name, output_file_name):
+def encode_file(input_file_name, output_file_name, format_version=2):
     line_num = 0
+    if format_version == 2:
+        encode_func = DeltaEncoder().encode_line
+    else:
+        encode_func = encode_line
     with open(input_file_name, "r") as input_file:
         with open(output_file_name, "w") as output_file:
             for line in input_file:
                 line_num += 1
                 try:
-                    encoded_data = encode_line(line)
+                    encoded_data = encode_func(line)
                 except GcodeSyntaxError as e:
                     e.args = ('line {}: {}'.format(line_num, e.args[0]),)
                     raise
@@ -120,16 +183,55 @@ _SmallCommands = {
     ('G', 92) : 3
 }
 
+_DeltaCommands = {
+    'G0' : 4,
+    'G1' : 5
+}
+
+_DeltaAxes = 'XYZE'
+
+_DeltaDecimals = {
+    'X' : 3,
+    'Y' : 3,
+    'Z' : 3,
+    'E' : 5,
+    'F' : 3
+}
+
 def _letter_ok(ch):
     return (ord(ch) >= ord('A') and ord(ch) <= ord('Z'))
 
+def _parse_fixed(value_str, decimals):
+    # Returns the value in units of 10^-decimals, or None if not exact.
+    negative = value_str.startswith('-')
+    if negative or value_str.startswith('+'):
+        value_str = value_str[1:]
+    int_str, _, frac_str = value_str.partition('.')
+    if not (int_str + frac_str).isdigit():
+        return None
+    frac_str = frac_str.rstrip('0')
+    if len(frac_str) > decimals:
+        return None
+    value = int('0' + int_str + frac_str.ljust(decimals, '0'))
+    if not (value < 2**31):
+        return None
+    return -value if negative else value
+
+def _encode_varint(value):
+    data = ''
+    while value >= 0x80:
+        data += chr((value & 0x7F) | 0x80)
+        value >>= 7
+    return data + chr(value)
+
 def main():
     import argparse
     parser = argparse.ArgumentParser(description='G-code packet for APrinter firmware.')
     parser.add_argument('--input', required=True)
     parser.add_argument('--output', required=True)
+    parser.add_argument('--format', type=int, choices=[1, 2], default=2)
     args = parser.parse_args()
-    encode_file(args.input, args.output)
+    encode_file(args.input, args.output, args.format)
 
 if __name__ == '__main__':
     main()
@@ -447,11 +447,13 @@ def setup_platform(gen, config, key):
     def option(platform):
         timers_structure = get_heap_structure(gen, platform, 'TimersStructure')
         
+        event_loop_backend = get_linux_event_loop_backend(gen, platform, 'EventLoopBackend')
+        
         gen.add_platform_include('aprinter/platform/linux/linux_support.h')
         gen.add_init_call(-1, 'platform_init(argc, argv);')
         gen.register_singleton_object('event_loop_impl', {
             'name': 'LinuxEventLoop',
-            'extra_args': [timers_structure],
+            'extra_args': [timers_structure, event_loop_backend],
         })
     
     config.do_selection(key, platform_sel)
@@ -488,6 +490,7 @@ class CommonClock(object):
         gen.add_aprinter_include(self._clockdef.INCLUDE)
         self._timers = self._load_timers(config)
         self._interrupt_timers = []
+        self._lateness_timers = None
         self._primary_timer = self.check_timer(config.get_string('primary_timer'), config.key_path('primary_timer'))
     
     def _load_timers (self, config):
@@ -512,13 +515,36 @@ class CommonClock(object):
             path.error('Incorrect OC unit format.')
         return {'tc':m.group(1), 'channel':m.group(2)}
     
-    def add_interrupt_timer (self, name, user, clearance, path):
+    def enable_lateness_histograms (self):
+        assert not self._interrupt_timers
+        self._lateness_timers = []
+        self._gen.add_aprinter_include('system/InterruptTimerLateness.h')
+        self._gen.add_aprinter_include('printer/modules/TimerLatenessModule.h')
+        lateness_module = self._gen.add_module()
+        lateness_module.set_expr(TemplateExpr('TimerLatenessModuleService', ['TimerLatenessTimers']))
+    
+    def add_interrupt_timer (self, name, user, clearance, path, label):
         it = self.check_oc_unit(name, path)
         self._interrupt_timers.append(it)
         clearance_name = '{}_{}_Clearance'.format(self._my_clock, name)
         self._gen.add_float_constant(clearance_name, clearance)
         self._gen.add_isr(self._clockdef.INTERRUPT_TIMER_ISR(it, user))
-        return self._clockdef.INTERRUPT_TIMER_EXPR(it, clearance_name)
+        timer_expr = self._clockdef.INTERRUPT_TIMER_EXPR(it, clearance_name)
+        if self._lateness_timers is not None:
+            self._lateness_timers.append({'label': label, 'user': user})
+            timer_expr = TemplateExpr('LatenessInterruptTimerService', [timer_expr])
+        return timer_expr
+    
+    def _add_lateness_timers_code (self):
+        code = 'struct TimerLatenessTimers {\n'
+        for (i, lt) in enumerate(self._lateness_timers):
+            code += '    struct Timer{} {{\n'.format(i)
+            code += '        using TheTimer = {};\n'.format(lt['user'])
+            code += '        static char const * name () {{ return "{}"; }}\n'.format(lt['label'])
+            code += '    };\n'
+        code += '    using List = MakeTypeList<{}>;\n'.format(', '.join('Timer{}'.format(i) for i in range(len(self._lateness_timers))))
+        code += '};\n'
+        self._gen.add_global_code(0, code)
     
     def finalize (self):
         auto_timers = (set(it['tc'] for it in self._interrupt_timers) | set([self._primary_timer])) - set(self._timers)
@@ -538,6 +564,9 @@ class CommonClock(object):
         
         clock_service_expr = self._clockdef.CLOCK_SERVICE(self._config)
         service_code = 'using {}Service = {};'.format(self._my_clock, clock_service_expr.build(indent=0))
+        if self._lateness_timers is not None:
+            service_code = 'struct TimerLatenessTimers;\n' + service_code
+            self._add_lateness_timers_code()
         clock_expr = TemplateExpr('{}Service::Clock'.format(self._my_clock), ['Context', 'Program', timers_expr])
         self._gen.add_global_resource(self._priority, self._my_clock, clock_expr, use_instance=True, code_before=service_code, context_name=self._clock_name)
 
@@ -617,9 +646,17 @@ def Stm32f4ClockDef(x):
     x.TIMER_EXPR = lambda tc: 'Stm32f4ClockTIM{}'.format(tc)
     x.TIMER_ISR = lambda my_clock, tc: 'AMBRO_STM32F4_CLOCK_TC_GLOBAL({}, {}, Context())'.format(tc, my_clock)
 
+def linux_clock_spin_micros (config):
+    if not config.has('SpinMicros'):
+        return 0
+    spin_micros = config.get_int('SpinMicros')
+    if not 0 <= spin_micros <= 1000:
+        config.key_path('SpinMicros').error('Value out of range.')
+    return spin_micros
+
 def LinuxClockDef(x):
     x.INCLUDE = 'hal/linux/LinuxClock.h'
-    x.CLOCK_SERVICE = lambda config: TemplateExpr('LinuxClockService', [config.get_int_constant('SubSecondBits'), config.get_int_constant('MaxTimers')])
+    x.CLOCK_SERVICE = lambda config: TemplateExpr('LinuxClockService', [config.get_int_constant('SubSecondBits'), config.get_int_constant('MaxTimers'), linux_clock_spin_micros(config)])
     x.TIMER_RE = '\\A()\\Z'
     x.CHANNEL_RE = '\\A()([0-9]{1,2})\\Z'
     x.INTERRUPT_TIMER_EXPR = lambda it, clearance: 'LinuxClockInterruptTimerService<{}, {}>'.format(it['channel'], clearance)
@@ -773,6 +810,29 @@ def setup_watchdog (gen, config, key, user):
     
     return config.do_selection(key, watchdog_sel)
 
+def setup_motion_profile (gen, config, key):
+    if not config.has(key):
+        return 'LinearPlannerService'
+    
+    profile_sel = selection.Selection()
+    
+    @profile_sel.option('Trapezoidal')
+    def option(profile):
+        return 'LinearPlannerService'
+    
+    @profile_sel.option('SCurve')
+    def option(profile):
+        ramp_time = profile.get_float('AccelRampTime')
+        if not 0.0 <= ramp_time <= 1.0:
+            profile.key_path('AccelRampTime').error('Value out of range.')
+        
+        gen.add_aprinter_include('printer/planning/SCurvePlanner.h')
+        return TemplateExpr('SCurvePlannerService', [
+            gen.add_float_config('AccelRampTime', ramp_time),
+        ])
+    
+    return config.do_selection(key, profile_sel)
+
 def setup_adc (gen, config, key):
     adc_sel = selection.Selection()
     
@@ -948,11 +1008,11 @@ def use_analog_input (gen, config, key, user):
     
     return ai.do_selection('Driver', analog_input_sel)
 
-def use_interrupt_timer (gen, config, key, user, clearance=0.0):
+def use_interrupt_timer (gen, config, key, user, label, clearance=0.0):
     clock = gen.get_singleton_object('Clock')
     
     for it_config in config.enter_config(key):
-        return clock.add_interrupt_timer(it_config.get_string('oc_unit'), user, clearance, it_config.path())
+        return clock.add_interrupt_timer(it_config.get_string('oc_unit'), user, clearance, it_config.path(), label)
 
 def use_pwm_output (gen, config, key, user, username, hard=False):
     pwm_output = gen.get_object('pwm_output', config, key)
@@ -969,7 +1029,7 @@ def use_pwm_output (gen, config, key, user, username, hard=False):
             get_pin(gen, backend, 'OutputPin'),
             backend.get_bool('OutputInvert'),
             gen.add_float_constant('{}PulseInterval'.format(username), backend.get_float('PulseInterval')),
-            use_interrupt_timer(gen, backend, 'Timer', '{}::TheTimer'.format(user))
+            use_interrupt_timer(gen, backend, 'Timer', '{}::TheTimer'.format(user), '{}Pwm'.format(username))
         ])
     
     @backend_sel.option('HardPwm')
@@ -1205,10 +1265,33 @@ def use_sdcard(gen, config, key, user):
     @sd_service_sel.option('LinuxSdCard')
     def option(linux_sd):
         gen.add_aprinter_include('hal/linux/LinuxSdCard.h')
+        
+        queue_depth = linux_sd.get_int('QueueDepth') if linux_sd.has('QueueDepth') else 1
+        if not (1 <= queue_depth <= 64):
+            linux_sd.key_path('QueueDepth').error('Bad value.')
+        
+        direct_io = linux_sd.get_bool('DirectIo') if linux_sd.has('DirectIo') else False
+        
+        mmap_image = linux_sd.get_bool('MmapImage') if linux_sd.has('MmapImage') else False
+        if mmap_image and direct_io:
+            linux_sd.key_path('MmapImage').error('Cannot be combined with DirectIo.')
+        
+        mmap_op_latency = linux_sd.get_float('MmapOpLatency') if linux_sd.has('MmapOpLatency') else 0.0
+        mmap_block_latency = linux_sd.get_float('MmapBlockLatency') if linux_sd.has('MmapBlockLatency') else 0.0
+        if not (mmap_op_latency >= 0.0):
+            linux_sd.key_path('MmapOpLatency').error('Bad value.')
+        if not (mmap_block_latency >= 0.0):
+            linux_sd.key_path('MmapBlockLatency').error('Bad value.')
+        
         return TemplateExpr('LinuxSdCardService', [
             linux_sd.get_int('BlockSize'),
             linux_sd.get_int('MaxIoBlocks'),
             linux_sd.get_int('MaxIoDescriptors'),
+            queue_depth,
+            direct_io,
+            mmap_image,
+            gen.add_float_constant('LinuxSdCardMmapOpLatency', mmap_op_latency),
+            gen.add_float_constant('LinuxSdCardMmapBlockLatency', mmap_block_latency),
         ])
     
     return config.do_selection(key, sd_service_sel)
@@ -1324,6 +1407,26 @@ def get_heap_structure(gen, config, key):
     gen.add_aprinter_include('structure/{}.h'.format(structure_name))
     return 'APrinter::{}Service'.format(structure_name)
 
+def get_linux_event_loop_backend(gen, config, key):
+    if not config.has(key):
+        return 'LinuxEpollBackendService'
+    
+    backend_sel = selection.Selection()
+    
+    @backend_sel.option('Epoll')
+    def option(backend_config):
+        return 'LinuxEpollBackendService'
+    
+    @backend_sel.option('IoUring')
+    def option(backend_config):
+        queue_entries = backend_config.get_int('QueueEntries')
+        if not 8 <= queue_entries <= 4096 or (queue_entries & (queue_entries - 1)) != 0:
+            backend_config.key_path('QueueEntries').error('Value out of range.')
+        gen.add_aprinter_include('system/LinuxIoUringBackend.h')
+        return TemplateExpr('LinuxIoUringBackendService', [queue_entries])
+    
+    return config.do_selection(key, backend_sel)
+
 class NetworkConfigState(object):
     def __init__(self, min_send_buf, min_recv_buf):
         self.min_send_buf = min_send_buf
@@ -1558,8 +1661,6 @@ def generate(config_root_data, cfg_name, main_template):
                     optimize_for_size = performance.get_bool('OptimizeForSize')
                     optimize_libc_for_size = performance.get_bool('OptimizeLibcForSize')
                 
-                event_channel_timer_expr = use_interrupt_timer(gen, board_data, 'EventChannelTimer', user='{}::GetEventChannelTimer<>'.format(aux_control_module_user), clearance=event_channel_timer_clearance)
-                
                 for development in board_data.enter_config('development'):
                     assertions_enabled = development.get_bool('AssertionsEnabled')
                     event_loop_benchmark_enabled = development.get_bool('EventLoopBenchmarkEnabled')
@@ -1568,6 +1669,8 @@ def generate(config_root_data, cfg_name, main_template):
                     build_with_clang = development.get_bool('BuildWithClang')
                     verbose_build = development.get_bool('VerboseBuild')
                     debug_symbols = development.get_bool('DebugSymbols')
+                    timer_lateness_histograms = development.get_bool('TimerLatenessHistograms') if development.has('TimerLatenessHistograms') else False
+                    event_loop_profiling = development.get_bool('EventLoopProfiling') if development.has('EventLoopProfiling') else False
                     
                     if assertions_enabled:
                         gen.add_define('AMBROLIB_ASSERTIONS')
@@ -1578,6 +1681,15 @@ def generate(config_root_data, cfg_name, main_template):
                     if detect_overload_enabled:
                         gen.add_define('AXISDRIVER_DETECT_OVERLOAD')
                     
+                    if timer_lateness_histograms:
+                        gen.get_singleton_object('Clock').enable_lateness_histograms()
+                    
+                    if event_loop_profiling:
+                        gen.add_define('EVENTLOOP_PROFILING')
+                        gen.add_aprinter_include('printer/modules/EventLoopProfilingModule.h')
+                        profiling_module = gen.add_module()
+                        profiling_module.set_expr('EventLoopProfilingModuleService')
+                    
                     if development.get_bool('EnableBulkOutputTest'):
                         gen.add_aprinter_include('printer/modules/BulkOutputTestModule.h')
                         bulk_output_test_module = gen.add_module()
@@ -1595,6 +1707,8 @@ def generate(config_root_data, cfg_name, main_template):
                         stub_command_module = gen.add_module()
                         stub_command_module.set_expr('StubCommandModuleService')
                 
+                event_channel_timer_expr = use_interrupt_timer(gen, board_data, 'EventChannelTimer', user='{}::GetEventChannelTimer<>'.format(aux_control_module_user), label='EventChannel', clearance=event_channel_timer_clearance)
+                
                 for serial in board_data.iter_list_config('serial_ports', max_count=5):
                     gen.add_aprinter_include('printer/modules/SerialModule.h')
                     gen.add_aprinter_include('printer/utils/GcodeParser.h')
@@ -1657,13 +1771,25 @@ def generate(config_root_data, cfg_name, main_template):
                             fs_config.key_path('MaxFileNameSize').error('Bad value.')
                         
                         num_cache_entries = fs_config.get_int('NumCacheEntries')
-                        if not (1 <= num_cache_entries <= 64):
+                        if not (1 <= num_cache_entries <= 1024):
                             fs_config.key_path('NumCacheEntries').error('Bad value.')
                         
                         max_io_blocks = fs_config.get_int('MaxIoBlocks')
                         if not (1 <= max_io_blocks <= num_cache_entries):
                             fs_config.key_path('MaxIoBlocks').error('Bad value.')
                         
+                        num_file_extents = fs_config.get_int('NumFileExtents') if fs_config.has('NumFileExtents') else 0
+                        if not (0 <= num_file_extents <= 255):
+                            fs_config.key_path('NumFileExtents').error('Bad value.')
+                        
+                        free_bitmap_clusters = fs_config.get_int('FreeBitmapClusters') if fs_config.has('FreeBitmapClusters') else 0
+                        if not (0 <= free_bitmap_clusters <= 268435445):
+                            fs_config.key_path('FreeBitmapClusters').error('Bad value.')
+                        
+                        num_lookup_cache_entries = fs_config.get_int('NumLookupCacheEntries') if fs_config.has('NumLookupCacheEntries') else 0
+                        if not (0 <= num_lookup_cache_entries <= 255):
+                            fs_config.key_path('NumLookupCacheEntries').error('Bad value.')
+                        
                         gen.add_aprinter_include('printer/input/SdFatInput.h')
                         gen.add_aprinter_include('fs/FatFs.h')
                         
@@ -1672,6 +1798,11 @@ def generate(config_root_data, cfg_name, main_template):
                             fs_test_module = gen.add_module()
                             fs_test_module.set_expr('FsTestModuleService')
                         
+                        if fs_config.has('EnableFsBench') and fs_config.get_bool('EnableFsBench'):
+                            gen.add_aprinter_include('printer/modules/FsBenchModule.h')
+                            fs_bench_module = gen.add_module()
+                            fs_bench_module.set_expr('FsBenchModuleService')
+                        
                         gcode_upload_sel = selection.Selection()
                         
                         @gcode_upload_sel.option('NoGcodeUpload')
@@ -1703,15 +1834,28 @@ def generate(config_root_data, cfg_name, main_template):
                                 fs_config.get_bool_constant('CaseInsensFileName'),
                                 fs_config.get_bool_constant('FsWritable'),
                                 fs_config.get_bool_constant('EnableReadHinting'),
+                                num_file_extents,
+                                free_bitmap_clusters,
+                                num_lookup_cache_entries,
                             ]),
                             fs_config.get_bool_constant('HaveAccessInterface'),
                         ])
                     
+                    prefetch_commands = sdcard.get_int('PrefetchCommands') if sdcard.has('PrefetchCommands') else 0
+                    if not (0 <= prefetch_commands <= 63):
+                        sdcard.key_path('PrefetchCommands').error('Bad value.')
+                    
+                    decompress_window_bits = sdcard.get_int('DecompressWindowBits') if sdcard.has('DecompressWindowBits') else 0
+                    if not (decompress_window_bits == 0 or 8 <= decompress_window_bits <= 12):
+                        sdcard.key_path('DecompressWindowBits').error('Bad value.')
+                    
                     sdcard_module.set_expr(TemplateExpr('SdCardModuleService', [
                         sdcard.do_selection('FsType', fs_sel),
                         sdcard.do_selection('GcodeParser', gcode_parser_sel),
                         sdcard.get_int('BufferBaseSize'),
                         sdcard.get_int('MaxCommandSize'),
+                        prefetch_commands,
+                        decompress_window_bits,
                     ]))
                 
                 board_data.get_config('sdcard_config').do_selection('sdcard', sdcard_sel)
@@ -2014,6 +2158,12 @@ def generate(config_root_data, cfg_name, main_template):
                 if first_stepper_port.get_config('StepperTimer').get_string('_compoundName') != 'interrupt_timer':
                     first_stepper_port.key_path('StepperTimer').error('Stepper port of first stepper in axis must have a timer unit defined.')
                 
+                step_times_buffer_size = stepper.get_int('StepTimesBufferSize') if stepper.has('StepTimesBufferSize') else 0
+                if not (step_times_buffer_size == 0 or 2 <= step_times_buffer_size <= 4096):
+                    stepper.key_path('StepTimesBufferSize').error('Value out of range.')
+                if step_times_buffer_size > 0 and stepper.get_config('delay').get_string('_compoundName') != 'Delay':
+                    stepper.key_path('StepTimesBufferSize').error('Precomputed step times require step delays (step signals timing).')
+                
                 return TemplateExpr('PrinterMainAxisParams', [
                     TemplateChar(name),
                     gen.add_float_config('{}StepsPerUnit'.format(name), stepper.get_float('StepsPerUnit')),
@@ -2028,10 +2178,11 @@ def generate(config_root_data, cfg_name, main_template):
                     stepper.get_bool('IsExtruder'),
                     32,
                     TemplateExpr('AxisDriverService', [
-                        use_interrupt_timer(gen, first_stepper_port, 'StepperTimer', user='MyPrinter::GetAxisTimer<{}>'.format(stepper_index)),
+                        use_interrupt_timer(gen, first_stepper_port, 'StepperTimer', user='MyPrinter::GetAxisTimer<{}>'.format(stepper_index), label='Stepper{}'.format(name)),
                         'TheAxisDriverPrecisionParams',
                         stepper.get_bool('PreloadCommands'),
                         stepper.do_selection('delay', delay_sel),
+                        step_times_buffer_size,
                     ]),
                     slave_steppers_expr,
                 ])
@@ -2434,7 +2585,7 @@ def generate(config_root_data, cfg_name, main_template):
                     use_pwm_output(gen, laser_port, 'pwm_output', '', '', hard=True),
                     TemplateExpr('LinearDutyFormulaService', [15]),
                     TemplateExpr('LaserDriverService', [
-                        use_interrupt_timer(gen, laser_port, 'LaserTimer', user='MyPrinter::GetLaserDriver<{}>::TheTimer'.format(laser_index)),
+                        use_interrupt_timer(gen, laser_port, 'LaserTimer', user='MyPrinter::GetLaserDriver<{}>::TheTimer'.format(laser_index), label='Laser{}'.format(name)),
                         gen.add_float_constant('{}AdjustmentInterval'.format(name), laser.get_float('AdjustmentInterval')),
                         'LaserDriverDefaultPrecisionParams',
                     ]),
@@ -2545,6 +2696,7 @@ def generate(config_root_data, cfg_name, main_template):
                 performance.get_int_constant('StepperSegmentBufferSize'),
                 performance.get_int_constant('LookaheadBufferSize'),
                 performance.get_int_constant('LookaheadCommitCount'),
+                setup_motion_profile(gen, performance, 'MotionProfile'),
                 'ForceTimeout',
                 performance.get_identifier('FpType', lambda x: x in ('float', 'double')),
                 setup_watchdog(gen, platform, 'watchdog', 'MyPrinter::GetWatchdog'),
@@ -306,6 +306,7 @@ def platform_Linux():
         ce.Compound('LinuxClock', key='clock', title='Clock', collapsable=True, attrs=[
             ce.Integer(key='SubSecondBits', title='Sub-second time bits (clock precision)', default=21),
             ce.Integer(key='MaxTimers', title='Maximum number of timers', default=10),
+            ce.Integer(key='SpinMicros', title='Busy-wait before timer deadlines [us] (0 to disable)', default=0),
             ce.Constant(key='primary_timer', value=''),
             ce.Constant(key='avail_oc_units', value=[
                 {
@@ -319,6 +320,12 @@ def platform_Linux():
             ce.Constant(key='input_mode_type', value='StubPinInputMode'),
         ]),
         heap_structure_choice(key='TimersStructure', title='Data structure for timers'),
+        ce.OneOf(key='EventLoopBackend', title='Event loop backend', choices=[
+            ce.Compound('Epoll', title='epoll', attrs=[]),
+            ce.Compound('IoUring', title='io_uring (Linux 5.11+)', attrs=[
+                ce.Integer(key='QueueEntries', title='Queue entries (power of two)', default=64),
+            ]),
+        ]),
     ])
 
 def hard_pwm_choice(**kwargs):
@@ -517,6 +524,7 @@ def editor():
                         ce.Float(key='StepLowTime', title='Minimum step low time [us]', default=1.0),
                     ]),
                 ]),
+                ce.Integer(key='StepTimesBufferSize', title='Precomputed step times buffer size (0 to compute step times in the interrupt; nonzero requires step delays)', default=0),
             ])),
             ce.OneOf(key='transform', title='Coordinate transformation', choices=[
                 ce.Compound('NoTransform', title='None (cartesian)', attrs=[]),
@@ -796,8 +804,12 @@ def editor():
                                 ce.Boolean(key='CaseInsensFileName', title='Case-insensitive filename matching', default=True),
                                 ce.Boolean(key='FsWritable', title='Writable filesystem', default=False),
                                 ce.Boolean(key='EnableReadHinting', title='Enable read-ahead hinting', default=False),
+                                ce.Integer(key='NumFileExtents', title='Cached cluster extents per open file (0 to disable)', default=0),
+                                ce.Integer(key='FreeBitmapClusters', title='Free-cluster bitmap capacity in clusters (0 to disable)', default=0),
+                                ce.Integer(key='NumLookupCacheEntries', title='Cached directory lookups (0 to disable)', default=0),
                                 ce.Boolean(key='HaveAccessInterface', title='Enable internal FS access interface', default=False),
                                 ce.Boolean(key='EnableFsTest', title='Enable FS test module', default=False),
+                                ce.Boolean(key='EnableFsBench', title='Enable FS benchmark module', default=False),
                                 ce.OneOf(key='GcodeUpload', title='G-code upload', choices=[
                                     ce.Compound('NoGcodeUpload', title='Disabled', attrs=[]),
                                     ce.Compound('GcodeUpload', title='Enabled', attrs=[
@@ -808,6 +820,8 @@ def editor():
                         ]),
                         ce.Integer(key='BufferBaseSize', title='Buffer size'),
                         ce.Integer(key='MaxCommandSize', title='Maximum command size'),
+                        ce.Integer(key='PrefetchCommands', title='Commands parsed ahead', default=0),
+                        ce.Integer(key='DecompressWindowBits', title='Decompression window size bits (0 to disable, 8-12)', default=0),
                         ce.OneOf(key='GcodeParser', title='G-code parser', choices=[
                             ce.Compound('TextGcodeParser', title='Text G-code parser', attrs=[
                                 ce.Integer(key='MaxParts', title='Maximum number of command parts')
@@ -828,6 +842,11 @@ def editor():
                                 ce.Integer(key='BlockSize', default=512),
                                 ce.Integer(key='MaxIoBlocks', default=1024),
                                 ce.Integer(key='MaxIoDescriptors', default=32),
+                                ce.Integer(key='QueueDepth', title='I/O threads (requests in flight)', default=4),
+                                ce.Boolean(key='DirectIo', title='Use O_DIRECT if supported', default=False),
+                                ce.Boolean(key='MmapImage', title='Memory-map the image (no I/O threads)', default=False),
+                                ce.Float(key='MmapOpLatency', title='Simulated latency per command with mmap [s]', default=0.0),
+                                ce.Float(key='MmapBlockLatency', title='Simulated latency per block with mmap [s]', default=0.0),
                             ]),
                         ])
                     ])
@@ -911,6 +930,12 @@ def editor():
                 ce.Integer(key='EventChannelBufferSize', title='Event channel buffer size'),
                 ce.Integer(key='LookaheadBufferSize', title='Lookahead buffer size'),
                 ce.Integer(key='LookaheadCommitCount', title='Lookahead commit count'),
+                ce.OneOf(key='MotionProfile', title='Motion profile', choices=[
+                    ce.Compound('Trapezoidal', title='Trapezoidal (constant acceleration)', attrs=[]),
+                    ce.Compound('SCurve', title='S-curve (limited jerk)', attrs=[
+                        ce.Float(key='AccelRampTime', title='Acceleration ramp-up time [s]', default=0.02),
+                    ]),
+                ]),
                 ce.String(key='FpType', enum=['float', 'double']),
                 ce.String(key='AxisDriverPrecisionParams', title='Stepping precision parameters', enum=['AxisDriverAvrPrecisionParams', 'AxisDriverDuePrecisionParams']),
                 ce.Float(key='EventChannelTimerClearance', title='Event channel timer clearance'),
@@ -921,6 +946,8 @@ def editor():
                 ce.Boolean(key='AssertionsEnabled', title='Enable assertions', default=False),
                 ce.Boolean(key='EventLoopBenchmarkEnabled', title='Enable event-loop execution timing', default=False),
                 ce.Boolean(key='DetectOverloadEnabled', title='Enable interrupt overload detection', default=False),
+                ce.Boolean(key='TimerLatenessHistograms', title='Record interrupt timer lateness histograms (M948, may need a larger JSON buffer)', default=False),
+                ce.Boolean(key='EventLoopProfiling', title='Record per-handler event loop dispatch statistics (M949)', default=False),
                 ce.Boolean(key='WatchdogDebugMode', title='Setup watchdog for debugging (depends on hardware)', default=False),
                 ce.Boolean(key='BuildWithClang', title='Build with the Clang compiler', default=False),
                 ce.Boolean(key='VerboseBuild', title='Verbose build output', default=False),
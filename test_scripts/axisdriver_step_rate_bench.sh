@@ -0,0 +1,33 @@
+#!/usr/bin/env bash
+
+# Builds tests/motionplanner_bench.cpp with the AxisDriver step times computed
+# in the timer handler (analytic mode) and with precomputed step times,
+# and runs both on the given G-code file. The output is one JSON object per
+# line, see timer_ns_per_step and max_step_rate. Both runs must report the
+# same step_hash.
+#
+# Usage: axisdriver_step_rate_bench.sh <file.gcode> [STEP_TIMES_BUFFER_SIZE]
+
+set -e
+
+CXX=${CXX:-g++}
+CXXFLAGS=${CXXFLAGS:-"-O2 -std=c++14 -ftemplate-depth=1024 -fno-access-control -DNDEBUG"}
+
+if [[ -z $1 ]]; then
+    echo "ERROR: Usage: $0 <file.gcode> [STEP_TIMES_BUFFER_SIZE]" >&2
+    exit 1
+fi
+
+GCODE_FILE=$1
+BUFFER_SIZE=${2:-256}
+
+SRC_DIR=$(cd "$(dirname "$0")/.." && pwd)
+BUILD_DIR=$(mktemp -d)
+trap 'rm -rf "$BUILD_DIR"' EXIT
+
+for size in 0 "$BUFFER_SIZE"; do
+    EXE="$BUILD_DIR/motionplanner_bench_steptimes_${size}"
+    $CXX $CXXFLAGS -I"$SRC_DIR" -DSTEP_TIMES_BUFFER_SIZE="$size" \
+        "$SRC_DIR/tests/motionplanner_bench.cpp" -o "$EXE"
+    "$EXE" "$GCODE_FILE"
+done
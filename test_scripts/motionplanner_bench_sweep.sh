@@ -0,0 +1,41 @@
+#!/usr/bin/env bash
+
+# Builds tests/motionplanner_bench.cpp for a number of lookahead
+# configurations and runs each on the given G-code file.
+# The output is one JSON object per line, one for each configuration.
+#
+# Usage: motionplanner_bench_sweep.sh <file.gcode> [BUFFER_SIZE:COMMIT_COUNT ...]
+
+set -e
+
+CXX=${CXX:-g++}
+CXXFLAGS=${CXXFLAGS:-"-O2 -std=c++14 -ftemplate-depth=1024 -fno-access-control -DNDEBUG"}
+DEFAULT_CONFIGS=(8:2 16:4 32:8 32:16 48:12 64:16 64:32)
+
+if [[ -z $1 ]]; then
+    echo "ERROR: Usage: $0 <file.gcode> [BUFFER_SIZE:COMMIT_COUNT ...]" >&2
+    exit 1
+fi
+
+GCODE_FILE=$1
+shift
+
+if [[ $# -gt 0 ]]; then
+    CONFIGS=("$@")
+else
+    CONFIGS=("${DEFAULT_CONFIGS[@]}")
+fi
+
+SRC_DIR=$(cd "$(dirname "$0")/.." && pwd)
+BUILD_DIR=$(mktemp -d)
+trap 'rm -rf "$BUILD_DIR"' EXIT
+
+for config in "${CONFIGS[@]}"; do
+    BUFFER_SIZE=${config%%:*}
+    COMMIT_COUNT=${config##*:}
+    EXE="$BUILD_DIR/motionplanner_bench_${BUFFER_SIZE}_${COMMIT_COUNT}"
+    $CXX $CXXFLAGS -I"$SRC_DIR" \
+        -DLOOKAHEAD_BUFFER_SIZE="$BUFFER_SIZE" -DLOOKAHEAD_COMMIT_COUNT="$COMMIT_COUNT" \
+        "$SRC_DIR/tests/motionplanner_bench.cpp" -o "$EXE"
+    "$EXE" "$GCODE_FILE"
+done
@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Compares DecimalStrToFloat with StrToFloat (strtof/strtod):
+ * 
+ *   g++ -O2 -std=c++14 -I.. gcode_float_bench.cpp -o gcode_float_bench
+ *   ./gcode_float_bench [iterations]
+ * 
+ * The parameter values are taken from a set of G-code lines as produced by
+ * common slicers. Both functions must give bit-identical results for these
+ * and for a large number of random decimal strings, for float and double.
+ * The time per conversion of both functions is printed as a JSON object.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <aprinter/base/Assert.h>
+#include <aprinter/math/FloatTools.h>
+
+using namespace APrinter;
+
+static char const *const gcode_lines[] = {
+    "G1 Z0.350 F7800.000",
+    "G1 X98.652 Y91.271 E0.03261 F1800.000",
+    "G1 X99.318 Y90.690 E0.02916",
+    "G1 X100.050 Y90.197 E0.02911",
+    "G1 X100.839 Y89.799 E0.02918",
+    "G1 E-1.00000 F2400.00000",
+    "G92 E0",
+    "G1 X120.5 Y85.25 F9000",
+    "G1 F1200 X113.861 Y116.472 E4.95183",
+    "G1 X113.582 Y116.715 E4.96548",
+    "G0 F7200 X72.05 Y70.853",
+    "G1 F1500 E6.5",
+    "G1 X-12.75 Y0.0125 E0.00042",
+    "M104 S210",
+    "M140 S60.5",
+    "G1 X150.0000 Y150.0000 Z0.2000 E12.34567 F3600",
+    "G1 X137.904 Y103.167 E1562.37891",
+    "G1 Z10.2 F600",
+};
+
+// Shapes which must fall back to StrToFloat or need special care.
+static char const *const edge_values[] = {
+    "", "-", "+", ".", "-.", "0", "-0", "-0.000", "+3.5", ".5", "5.",
+    "1e3", "1.5E-2", "12abc", "inf", "nan", "16777217", "9007199254740993",
+    "0.1000000000000000000000000", "123456789012345678901234567890",
+    "3.4028235e38", "0.00000000000000000000000000000000000000000001",
+};
+
+static int const MaxValues = 256;
+static char values[MaxValues][32];
+static int num_values;
+
+static void collect_values ()
+{
+    for (char const *line : gcode_lines) {
+        char const *ptr = line;
+        while (*ptr) {
+            char const *end = strchr(ptr, ' ');
+            size_t len = end ? (size_t)(end - ptr) : strlen(ptr);
+            if (len > 1 && ptr[0] != 'G' && ptr[0] != 'M') {
+                AMBRO_ASSERT_FORCE(num_values < MaxValues && len < sizeof(values[0]))
+                memcpy(values[num_values], ptr + 1, len - 1);
+                values[num_values][len - 1] = '\0';
+                num_values++;
+            }
+            ptr += len;
+            while (*ptr == ' ') {
+                ptr++;
+            }
+        }
+    }
+}
+
+template <typename T>
+static bool same_bits (T a, T b)
+{
+    return memcmp(&a, &b, sizeof(T)) == 0;
+}
+
+template <typename T>
+static void check_string (char const *str)
+{
+    T expected = StrToFloat<T>(str, nullptr);
+    T result = DecimalStrToFloat<T>(str);
+    if (!same_bits(expected, result)) {
+        printf("MISMATCH %s: %.17g != %.17g\n", str, (double)result, (double)expected);
+        exit(1);
+    }
+}
+
+template <typename T>
+static void check_random (unsigned int seed, int count)
+{
+    srand(seed);
+    char buf[40];
+    for (int i = 0; i < count; i++) {
+        int int_digits = rand() % 8;
+        int frac_digits = rand() % 12;
+        char *ptr = buf;
+        if (rand() % 4 == 0) {
+            *ptr++ = '-';
+        }
+        for (int j = 0; j < int_digits; j++) {
+            *ptr++ = '0' + rand() % 10;
+        }
+        if (frac_digits > 0 || rand() % 2 == 0) {
+            *ptr++ = '.';
+        }
+        for (int j = 0; j < frac_digits; j++) {
+            *ptr++ = '0' + rand() % 10;
+        }
+        *ptr = '\0';
+        check_string<T>(buf);
+    }
+}
+
+static double now ()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+template <typename T, typename Func>
+static double time_conversions (int iterations, Func func)
+{
+    volatile T sink = 0.0f;
+    double start = now();
+    for (int i = 0; i < iterations; i++) {
+        for (int j = 0; j < num_values; j++) {
+            sink = func(values[j]);
+        }
+    }
+    (void)sink;
+    return (now() - start) / ((double)iterations * num_values) * 1e9;
+}
+
+template <typename T>
+static void bench (char const *type_name, int iterations)
+{
+    for (int j = 0; j < num_values; j++) {
+        check_string<T>(values[j]);
+    }
+    for (char const *str : edge_values) {
+        check_string<T>(str);
+    }
+    check_random<T>(1, 1000000);
+    
+    double strtofloat_ns = time_conversions<T>(iterations, [](char const *str) { return StrToFloat<T>(str, nullptr); });
+    double decimal_ns = time_conversions<T>(iterations, [](char const *str) { return DecimalStrToFloat<T>(str); });
+    
+    printf("{\"type\": \"%s\", \"num_values\": %d, \"strtofloat_ns\": %.2f, \"decimal_ns\": %.2f, \"speedup\": %.2f}\n",
+           type_name, num_values, strtofloat_ns, decimal_ns, strtofloat_ns / decimal_ns);
+}
+
+int main (int argc, char *argv[])
+{
+    int iterations = (argc > 1) ? atoi(argv[1]) : 100000;
+    
+    collect_values();
+    
+    bench<float>("float", iterations);
+    bench<double>("double", iterations);
+    
+    return 0;
+}
@@ -0,0 +1,988 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Host-side throughput benchmark for MotionPlanner.
+ *
+ * The complete MotionPlanner is instantiated together with real AxisDrivers,
+ * on top of a virtual clock and a trivial event loop. Moves are read from
+ * a G-code file (G0/G1/G90/G91/G92/M82/M83 are understood, everything else
+ * is ignored). Virtual time only advances when the main loop has nothing
+ * left to do, so the planner never underruns due to the simulation, and
+ * the wall-clock time spent in planner code is what is being measured.
+ *
+ * Build (from the repository root):
+ *   g++ -O2 -std=c++14 -ftemplate-depth=1024 -fno-access-control -DNDEBUG -I. \
+ *       tests/motionplanner_bench.cpp -o motionplanner_bench
+ *
+ * The lookahead parameters are compile-time, override them with
+ * -DLOOKAHEAD_BUFFER_SIZE=n -DLOOKAHEAD_COMMIT_COUNT=n (and optionally
+ * -DSTEPPER_SEGMENT_BUFFER_SIZE=n). See test_scripts/motionplanner_bench_sweep.sh.
+ * With -DSCURVE_RAMP_TIME=seconds, the jerk-limited SCurvePlanner is used
+ * instead of LinearPlanner. With -DSTEP_TIMES_BUFFER_SIZE=n, the AxisDrivers
+ * precompute step times in the main loop (see test_scripts/axisdriver_step_rate_bench.sh).
+ *
+ * The time spent in the timer handlers is measured too, and reported as the
+ * average per step and the resulting maximum step rate of a single axis.
+ * The step times are hashed so that runs can be checked to step identically.
+ *
+ * Run:
+ *   ./motionplanner_bench file.gcode
+ *
+ * A single line with a JSON object containing the results is printed.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include <aprinter/system/InterruptLockCommon.h>
+
+// Like on Linux, F_CPU is 1 so that MaxStepsPerCycle means max steps per second.
+#define F_CPU (1.0)
+
+#define APRINTER_INTERRUPT_LOCK_MODE APRINTER_INTERRUPT_LOCK_MODE_SIMPLE
+
+// Have the planner count the segments visited by the backward pass.
+#define MOTIONPLANNER_PLAN_STATS
+
+// The simulation is single-threaded and "interrupts" are only dispatched
+// from the main loop, so there is nothing to lock against.
+inline static void cli (void) {}
+inline static void sei (void) {}
+
+#include <aprinter/meta/TypeList.h>
+#include <aprinter/meta/TypeListUtils.h>
+#include <aprinter/meta/ListForEach.h>
+#include <aprinter/meta/TupleGet.h>
+#include <aprinter/meta/WrapFunction.h>
+#include <aprinter/meta/ServiceUtils.h>
+#include <aprinter/meta/Expr.h>
+#include <aprinter/base/Object.h>
+#include <aprinter/base/DebugObject.h>
+#include <aprinter/base/Assert.h>
+#include <aprinter/base/Preprocessor.h>
+#include <aprinter/system/InterruptLock.h>
+#include <aprinter/misc/ClockUtils.h>
+#include <aprinter/printer/actuators/AxisDriver.h>
+#include <aprinter/printer/planning/MotionPlanner.h>
+#include <aprinter/printer/planning/SCurvePlanner.h>
+
+using namespace APrinter;
+
+#ifndef LOOKAHEAD_BUFFER_SIZE
+#define LOOKAHEAD_BUFFER_SIZE 32
+#endif
+
+#ifndef LOOKAHEAD_COMMIT_COUNT
+#define LOOKAHEAD_COMMIT_COUNT 8
+#endif
+
+#ifndef STEPPER_SEGMENT_BUFFER_SIZE
+#define STEPPER_SEGMENT_BUFFER_SIZE (LOOKAHEAD_COMMIT_COUNT + 56)
+#endif
+
+#ifndef STEP_TIMES_BUFFER_SIZE
+#define STEP_TIMES_BUFFER_SIZE 0
+#endif
+
+using FpType = double;
+
+static int const NumAxes = 4;
+static char const AxisNames[NumAxes] = {'X', 'Y', 'Z', 'E'};
+static constexpr double AxisStepsPerUnit[NumAxes] = {80.0, 80.0, 4000.0, 400.0};
+static constexpr double AxisMaxSpeed[NumAxes] = {300.0, 300.0, 10.0, 45.0};
+static constexpr double AxisMaxAccel[NumAxes] = {1500.0, 1500.0, 100.0, 250.0};
+static constexpr double AxisCorneringDistance = 40.0;
+static constexpr double AxisDistanceFactor = 1.0;
+static bool const AxisIsCartesian[NumAxes] = {true, true, true, false};
+
+static constexpr double BenchMaxStepsPerCycle = 100000.0;
+static constexpr double DefaultFeedrate = 50.0;
+
+static uint64_t wall_time_ns ()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+// Average time measured for an empty interval, subtracted from the
+// timer handler measurements which are far shorter than the planner's.
+static double wall_time_overhead_ns ()
+{
+    int const count = 1000000;
+    uint64_t total = 0;
+    for (int i = 0; i < count; i++) {
+        uint64_t start = wall_time_ns();
+        total += wall_time_ns() - start;
+    }
+    return (double)total / count;
+}
+
+/*
+ * Virtual clock with interrupt timers. A timer fires only when the
+ * main loop calls runNextTimer(), which advances the virtual time
+ * to the earliest pending timer.
+ */
+
+template <typename> class BenchInterruptTimer;
+
+template <typename Arg>
+class BenchClock {
+    APRINTER_USE_TYPE1(Arg, Context)
+    APRINTER_USE_TYPE1(Arg, ParentObject)
+    APRINTER_USE_VAL(Arg, MaxTimers)
+    
+    template <typename> friend class BenchInterruptTimer;
+
+public:
+    struct Object;
+    using TimeType = uint32_t;
+    
+    static constexpr double time_freq = 1048576.0;
+    static constexpr double time_unit = 1.0 / time_freq;
+
+private:
+    using TheClockUtils = ClockUtilsForClock<BenchClock>;
+    using InternalTimerHandlerType = void (*) (AtomicContext<Context>);
+
+public:
+    static void init (Context c)
+    {
+        auto *o = Object::self(c);
+        o->m_now = 0;
+        o->m_elapsed = 0;
+        for (int i = 0; i < MaxTimers; i++) {
+            o->m_timer_active[i] = false;
+            o->m_timer_handler[i] = nullptr;
+        }
+    }
+    
+    template <typename ThisContext>
+    static TimeType getTime (ThisContext c)
+    {
+        auto *o = Object::self(c);
+        return o->m_now;
+    }
+    
+    static uint64_t getElapsedTicks (Context c)
+    {
+        auto *o = Object::self(c);
+        return o->m_elapsed;
+    }
+    
+    static bool runNextTimer (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        int first = -1;
+        for (int i = 0; i < MaxTimers; i++) {
+            if (o->m_timer_active[i] && (first < 0 || !TheClockUtils::timeGreaterOrEqual(o->m_timer_time[i], o->m_timer_time[first]))) {
+                first = i;
+            }
+        }
+        if (first < 0) {
+            return false;
+        }
+        
+        TimeType time = o->m_timer_time[first];
+        if (TheClockUtils::timeGreaterOrEqual(time, o->m_now)) {
+            o->m_elapsed += TheClockUtils::timeDifference(time, o->m_now);
+            o->m_now = time;
+        }
+        
+        o->m_timer_handler[first](MakeAtomicContext(c));
+        return true;
+    }
+
+public:
+    struct Object : public ObjBase<BenchClock, ParentObject, EmptyTypeList> {
+        TimeType m_now;
+        uint64_t m_elapsed;
+        bool m_timer_active[MaxTimers];
+        TimeType m_timer_time[MaxTimers];
+        InternalTimerHandlerType m_timer_handler[MaxTimers];
+    };
+};
+
+APRINTER_ALIAS_STRUCT_EXT(BenchClockArg, (
+    APRINTER_AS_TYPE(Context),
+    APRINTER_AS_TYPE(ParentObject),
+    APRINTER_AS_VALUE(int, MaxTimers)
+), (
+    APRINTER_DEF_INSTANCE(BenchClockArg, BenchClock)
+))
+
+/*
+ * Clock for the step signal delays of the AxisDrivers (precomputed step
+ * times require them). The delays are not simulated, so this clock advances
+ * by one tick whenever it is read, which ends any delay after a few reads.
+ */
+
+static uint32_t bench_fast_clock_now;
+
+struct BenchFastClock {
+    using TimeType = uint32_t;
+    
+    static constexpr double time_freq = 1048576.0;
+    static constexpr double time_unit = 1.0 / time_freq;
+    
+    template <typename ThisContext>
+    static TimeType getTime (ThisContext c)
+    {
+        return bench_fast_clock_now++;
+    }
+};
+
+template <typename Arg>
+class BenchInterruptTimer {
+    APRINTER_USE_TYPE1(Arg, Context)
+    APRINTER_USE_TYPE1(Arg, ParentObject)
+    APRINTER_USE_TYPE1(Arg, Handler)
+    APRINTER_USE_VAL(Arg::Params, Index)
+
+public:
+    struct Object;
+    APRINTER_USE_TYPE1(Context, Clock)
+    APRINTER_USE_TYPE1(Clock, TimeType)
+    using HandlerContext = AtomicContext<Context>;
+    
+    static_assert(Index >= 0 && Index < Clock::MaxTimers, "");
+    
+    static void init (Context c)
+    {
+        auto *co = Clock::Object::self(c);
+        co->m_timer_handler[Index] = BenchInterruptTimer::timer_handler;
+    }
+    
+    static void deinit (Context c)
+    {
+        auto *co = Clock::Object::self(c);
+        co->m_timer_active[Index] = false;
+        co->m_timer_handler[Index] = nullptr;
+    }
+    
+    template <typename ThisContext>
+    static void setFirst (ThisContext c, TimeType time)
+    {
+        auto *co = Clock::Object::self(c);
+        AMBRO_ASSERT(!co->m_timer_active[Index])
+        co->m_timer_time[Index] = time;
+        co->m_timer_active[Index] = true;
+    }
+    
+    static void setNext (HandlerContext c, TimeType time)
+    {
+        auto *co = Clock::Object::self(c);
+        AMBRO_ASSERT(co->m_timer_active[Index])
+        co->m_timer_time[Index] = time;
+    }
+    
+    template <typename ThisContext>
+    static void unset (ThisContext c)
+    {
+        auto *co = Clock::Object::self(c);
+        co->m_timer_active[Index] = false;
+    }
+    
+    template <typename ThisContext>
+    static TimeType getLastSetTime (ThisContext c)
+    {
+        auto *co = Clock::Object::self(c);
+        return co->m_timer_time[Index];
+    }
+
+private:
+    static void timer_handler (AtomicContext<Context> c)
+    {
+        auto *co = Clock::Object::self(c);
+        if (!Handler::call(c)) {
+            co->m_timer_active[Index] = false;
+        }
+    }
+
+public:
+    struct Object {};
+};
+
+template <int TIndex>
+struct BenchInterruptTimerService {
+    static int const Index = TIndex;
+    
+    APRINTER_ALIAS_STRUCT_EXT(InterruptTimer, (
+        APRINTER_AS_TYPE(Context),
+        APRINTER_AS_TYPE(ParentObject),
+        APRINTER_AS_TYPE(Handler)
+    ), (
+        using Params = BenchInterruptTimerService;
+        APRINTER_DEF_INSTANCE(InterruptTimer, BenchInterruptTimer)
+    ))
+};
+
+/*
+ * Minimal event loop, only fast events are supported (that is all that
+ * MotionPlanner and AxisDriver need). Fast events are registered on the
+ * fly when initialized, the order is irrelevant for the simulation.
+ */
+
+template <typename Arg>
+class BenchEventLoop {
+    APRINTER_USE_TYPE1(Arg, Context)
+    APRINTER_USE_TYPE1(Arg, ParentObject)
+    
+    static int const MaxFastEvents = 8;
+
+public:
+    struct Object;
+    using FastHandlerType = void (*) (Context);
+    
+    template <typename Id>
+    struct FastEventSpec {};
+    
+    static void init (Context c)
+    {
+        auto *o = Object::self(c);
+        o->m_num_fast_events = 0;
+    }
+    
+    template <typename EventSpec>
+    static void initFastEvent (Context c, FastHandlerType handler)
+    {
+        auto *o = Object::self(c);
+        AMBRO_ASSERT_FORCE(o->m_num_fast_events < MaxFastEvents)
+        
+        int index = o->m_num_fast_events++;
+        FastEventIndex<EventSpec>::index = index;
+        o->m_fast_events[index].handler = handler;
+        o->m_fast_events[index].pending = false;
+    }
+    
+    template <typename EventSpec>
+    static void resetFastEvent (Context c)
+    {
+        auto *o = Object::self(c);
+        o->m_fast_events[FastEventIndex<EventSpec>::index].pending = false;
+    }
+    
+    template <typename EventSpec, typename ThisContext>
+    static void triggerFastEvent (ThisContext c)
+    {
+        auto *o = Object::self(c);
+        o->m_fast_events[FastEventIndex<EventSpec>::index].pending = true;
+    }
+    
+    // Dispatches one pending fast event, if any. The handler is wrapped
+    // into the given function, which is used for measurements.
+    template <typename WrapFunc>
+    static bool dispatchFastEvent (Context c, WrapFunc wrap_func)
+    {
+        auto *o = Object::self(c);
+        
+        for (int i = 0; i < o->m_num_fast_events; i++) {
+            if (o->m_fast_events[i].pending) {
+                o->m_fast_events[i].pending = false;
+                wrap_func(o->m_fast_events[i].handler);
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    template <typename EventSpec>
+    struct FastEventIndex {
+        static int index;
+    };
+    
+    struct FastEventState {
+        bool pending;
+        FastHandlerType handler;
+    };
+
+public:
+    struct Object : public ObjBase<BenchEventLoop, ParentObject, EmptyTypeList> {
+        int m_num_fast_events;
+        FastEventState m_fast_events[MaxFastEvents];
+    };
+};
+
+template <typename Arg>
+template <typename EventSpec>
+int BenchEventLoop<Arg>::FastEventIndex<EventSpec>::index;
+
+APRINTER_ALIAS_STRUCT_EXT(BenchEventLoopArg, (
+    APRINTER_AS_TYPE(Context),
+    APRINTER_AS_TYPE(ParentObject)
+), (
+    APRINTER_DEF_INSTANCE(BenchEventLoopArg, BenchEventLoop)
+))
+
+/*
+ * Stub stepper pins. Steps are counted so that the final positions
+ * can be checked against the G-code.
+ */
+
+static int64_t stepper_pos[NumAxes];
+static bool stepper_dir[NumAxes];
+static uint64_t stepper_commands;
+static uint64_t stepper_steps;
+static uint64_t stepper_hash = UINT64_C(14695981039346656037);
+
+static void hash_step (int axis_index, uint32_t time)
+{
+    uint32_t data[2] = {(uint32_t)axis_index, time};
+    for (size_t i = 0; i < sizeof(data); i++) {
+        stepper_hash ^= ((unsigned char const *)data)[i];
+        stepper_hash *= UINT64_C(1099511628211);
+    }
+}
+
+template <int AxisIndex>
+struct BenchStepper {
+    template <typename ThisContext>
+    static void setDir (ThisContext c, bool dir)
+    {
+        stepper_dir[AxisIndex] = dir;
+        stepper_commands++;
+    }
+    
+    template <typename ThisContext>
+    static void stepOn (ThisContext c);
+    
+    template <typename ThisContext>
+    static void stepOff (ThisContext c)
+    {
+    }
+};
+
+/*
+ * Constant configuration, all expressions are compile-time constants.
+ */
+
+struct BenchConfig {
+    template <typename TheExpr>
+    struct Helper {
+        static constexpr typename TheExpr::Type value ()
+        {
+            return TheExpr::value();
+        }
+        
+        template <typename ThisContext>
+        static typename TheExpr::Type eval (ThisContext c)
+        {
+            return TheExpr::value();
+        }
+    };
+    
+    // Config options are represented by types with an Expr member giving the value.
+    template <typename Option>
+    static typename Option::Expr e (Option);
+    
+    template <typename TheExpr>
+    static TheExpr getExpr (TheExpr);
+    
+    template <typename TheExpr>
+    static Helper<TheExpr> getHelper (TheExpr);
+};
+
+/*
+ * Program structure.
+ */
+
+struct Context;
+struct Program;
+
+using MyDebugObjectGroup = DebugObjectGroup<Context, Program>;
+
+APRINTER_MAKE_INSTANCE(MyClock, (BenchClockArg<Context, Program, NumAxes>))
+
+APRINTER_MAKE_INSTANCE(MyLoop, (BenchEventLoopArg<Context, Program>))
+
+struct Context {
+    using DebugGroup = MyDebugObjectGroup;
+    using Clock = MyClock;
+    using FastClock = BenchFastClock;
+    using EventLoop = MyLoop;
+};
+
+template <int AxisIndex>
+struct BenchAxisConsumers;
+
+// Zero step delays, the same in both step time modes so that they can be compared.
+using BenchStepDelayTime = AMBRO_WRAP_DOUBLE(0.0);
+
+template <int AxisIndex>
+struct BenchAxis {
+    using TimeConversion = APRINTER_FP_CONST_EXPR(MyClock::time_freq);
+    
+    using DriverService = AxisDriverService<
+        BenchInterruptTimerService<AxisIndex>,
+        AxisDriverDuePrecisionParams,
+        false,
+        AxisDriverDelayParams<BenchStepDelayTime, BenchStepDelayTime, BenchStepDelayTime>,
+        STEP_TIMES_BUFFER_SIZE
+    >;
+    
+    APRINTER_MAKE_INSTANCE(Driver, (DriverService::template Driver<
+        Context, Program, BenchStepper<AxisIndex>, BenchAxisConsumers<AxisIndex>
+    >))
+    
+    static bool prestep_callback (typename Driver::CommandCallbackContext c)
+    {
+        return false;
+    }
+    struct PrestepCallback : public AMBRO_WFUNC_TD(&BenchAxis::prestep_callback) {};
+    
+    using DistanceFactor = APRINTER_FP_CONST_EXPR(AxisDistanceFactor);
+    using CorneringDistance = APRINTER_FP_CONST_EXPR(AxisCorneringDistance);
+    using MaxSpeedRec = APRINTER_FP_CONST_EXPR(MyClock::time_freq / (AxisMaxSpeed[AxisIndex] * AxisStepsPerUnit[AxisIndex]));
+    using MaxAccelRec = APRINTER_FP_CONST_EXPR(MyClock::time_freq * MyClock::time_freq / (AxisMaxAccel[AxisIndex] * AxisStepsPerUnit[AxisIndex]));
+    
+    using PlannerAxisSpec = MotionPlannerAxisSpec<
+        Driver, 32, DistanceFactor, CorneringDistance, MaxSpeedRec, MaxAccelRec, PrestepCallback
+    >;
+};
+
+template <typename TheBenchAxis>
+using GetPlannerAxisSpec = typename TheBenchAxis::PlannerAxisSpec;
+
+using BenchAxesList = MakeTypeList<BenchAxis<0>, BenchAxis<1>, BenchAxis<2>, BenchAxis<3>>;
+static_assert(TypeListLength<BenchAxesList>::Value == NumAxes, "");
+
+static void planner_pull_handler (Context c);
+static void planner_finished_handler (Context c);
+static void planner_aborted_handler (Context c);
+static void planner_underrun_callback (Context c);
+
+using BenchMaxStepsPerCycleExpr = APRINTER_FP_CONST_EXPR(BenchMaxStepsPerCycle);
+
+#ifdef SCURVE_RAMP_TIME
+struct BenchRampTime {
+    using Expr = APRINTER_FP_CONST_EXPR(SCURVE_RAMP_TIME);
+    static constexpr BenchRampTime i () { return BenchRampTime(); }
+};
+using BenchPlannerService = SCurvePlannerService<BenchRampTime>;
+#else
+using BenchPlannerService = LinearPlannerService;
+#endif
+
+APRINTER_MAKE_INSTANCE(ThePlanner, (MotionPlannerArg<
+    Context, Program, BenchConfig,
+    MapTypeList<BenchAxesList, TemplateFunc<GetPlannerAxisSpec>>,
+    STEPPER_SEGMENT_BUFFER_SIZE, LOOKAHEAD_BUFFER_SIZE, LOOKAHEAD_COMMIT_COUNT,
+    BenchPlannerService, FpType, BenchMaxStepsPerCycleExpr,
+    AMBRO_WFUNC(planner_pull_handler),
+    AMBRO_WFUNC(planner_finished_handler),
+    AMBRO_WFUNC(planner_aborted_handler),
+    AMBRO_WFUNC(planner_underrun_callback),
+    EmptyTypeList, EmptyTypeList
+>))
+
+template <int AxisIndex>
+struct BenchAxisConsumers {
+    using List = MakeTypeList<typename ThePlanner::template TheAxisDriverConsumer<AxisIndex>>;
+};
+
+struct Program : public ObjBase<void, void, MakeTypeList<
+    MyDebugObjectGroup,
+    MyClock,
+    MyLoop,
+    BenchAxis<0>::Driver,
+    BenchAxis<1>::Driver,
+    BenchAxis<2>::Driver,
+    BenchAxis<3>::Driver,
+    ThePlanner
+>> {
+    static Program * self (Context c);
+};
+
+Program program;
+
+Program * Program::self (Context c) { return &program; }
+
+template <int AxisIndex>
+template <typename ThisContext>
+void BenchStepper<AxisIndex>::stepOn (ThisContext c)
+{
+    stepper_pos[AxisIndex] += stepper_dir[AxisIndex] ? 1 : -1;
+    stepper_steps++;
+    hash_step(AxisIndex, MyClock::getTime(c));
+}
+
+/*
+ * G-code input.
+ */
+
+struct Move {
+    int64_t steps[NumAxes];
+    FpType rel_max_v_rec;
+};
+
+static FILE *gcode_file;
+static double gcode_pos[NumAxes];
+static int64_t gcode_steps[NumAxes];
+static double gcode_feedrate = DefaultFeedrate;
+static bool gcode_relative;
+static bool gcode_relative_e;
+static uint64_t gcode_lines;
+
+static char * skip_spaces (char *p)
+{
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    return p;
+}
+
+static bool parse_line (char *line, char *out_letter, int *out_number, double values[26], bool have[26])
+{
+    for (char *p = line; *p; p++) {
+        if (*p == ';' || *p == '\r' || *p == '\n') {
+            *p = '\0';
+            break;
+        }
+    }
+    
+    for (int i = 0; i < 26; i++) {
+        have[i] = false;
+    }
+    
+    char *p = skip_spaces(line);
+    if (*p == 'N' || *p == 'n') {
+        strtol(p + 1, &p, 10);
+        p = skip_spaces(p);
+    }
+    
+    char letter = *p;
+    if (letter >= 'a' && letter <= 'z') {
+        letter -= 32;
+    }
+    if (letter != 'G' && letter != 'M') {
+        return false;
+    }
+    char *end;
+    *out_number = strtol(p + 1, &end, 10);
+    if (end == p + 1) {
+        return false;
+    }
+    *out_letter = letter;
+    p = end;
+    
+    while (true) {
+        p = skip_spaces(p);
+        if (*p == '\0' || *p == '*') {
+            break;
+        }
+        if (*p == '(') {
+            while (*p != '\0' && *p != ')') {
+                p++;
+            }
+            if (*p == ')') {
+                p++;
+            }
+            continue;
+        }
+        char part = *p;
+        if (part >= 'a' && part <= 'z') {
+            part -= 32;
+        }
+        if (part < 'A' || part > 'Z') {
+            return false;
+        }
+        double value = strtod(p + 1, &end);
+        if (end == p + 1) {
+            value = 0.0;
+        }
+        values[part - 'A'] = value;
+        have[part - 'A'] = true;
+        p = end;
+    }
+    
+    return true;
+}
+
+static bool read_next_move (Move *move)
+{
+    char line[512];
+    
+    while (fgets(line, sizeof(line), gcode_file)) {
+        gcode_lines++;
+        
+        char letter;
+        int number;
+        double values[26];
+        bool have[26];
+        if (!parse_line(line, &letter, &number, values, have)) {
+            continue;
+        }
+        
+        if (letter == 'G' && (number == 0 || number == 1)) {
+            if (have['F' - 'A'] && values['F' - 'A'] > 0.0) {
+                gcode_feedrate = values['F' - 'A'] / 60.0;
+            }
+            
+            bool moved = false;
+            double cart_dist_sq = 0.0;
+            double other_dist = 0.0;
+            for (int i = 0; i < NumAxes; i++) {
+                int letter_index = AxisNames[i] - 'A';
+                if (have[letter_index]) {
+                    bool relative = (i == NumAxes - 1) ? gcode_relative_e : gcode_relative;
+                    double new_pos = relative ? (gcode_pos[i] + values[letter_index]) : values[letter_index];
+                    double delta = new_pos - gcode_pos[i];
+                    if (AxisIsCartesian[i]) {
+                        cart_dist_sq += delta * delta;
+                    } else {
+                        other_dist = fmax(other_dist, fabs(delta));
+                    }
+                    gcode_pos[i] = new_pos;
+                }
+                int64_t new_steps = llround(gcode_pos[i] * AxisStepsPerUnit[i]);
+                move->steps[i] = new_steps - gcode_steps[i];
+                gcode_steps[i] = new_steps;
+                moved = moved || (move->steps[i] != 0);
+            }
+            
+            if (!moved) {
+                continue;
+            }
+            
+            double distance = (cart_dist_sq > 0.0) ? sqrt(cart_dist_sq) : other_dist;
+            move->rel_max_v_rec = distance * (MyClock::time_freq / gcode_feedrate);
+            return true;
+        }
+        else if (letter == 'G' && number == 90) {
+            gcode_relative = false;
+            gcode_relative_e = false;
+        }
+        else if (letter == 'G' && number == 91) {
+            gcode_relative = true;
+            gcode_relative_e = true;
+        }
+        else if (letter == 'M' && number == 82) {
+            gcode_relative_e = false;
+        }
+        else if (letter == 'M' && number == 83) {
+            gcode_relative_e = true;
+        }
+        else if (letter == 'G' && number == 92) {
+            bool any = false;
+            for (int i = 0; i < NumAxes; i++) {
+                any = any || have[AxisNames[i] - 'A'];
+            }
+            // Only the logical position changes, the steppers stay where they are.
+            for (int i = 0; i < NumAxes; i++) {
+                if (!any || have[AxisNames[i] - 'A']) {
+                    double new_pos = any ? values[AxisNames[i] - 'A'] : 0.0;
+                    gcode_steps[i] -= llround(gcode_pos[i] * AxisStepsPerUnit[i]) - llround(new_pos * AxisStepsPerUnit[i]);
+                    gcode_pos[i] = new_pos;
+                }
+            }
+        }
+    }
+    
+    return false;
+}
+
+/*
+ * Planner handlers and the simulation loop.
+ */
+
+static bool bench_finished;
+static uint64_t bench_moves;
+static uint64_t bench_underruns;
+static int64_t expected_pos[NumAxes];
+
+static void planner_pull_handler (Context c)
+{
+    Move move;
+    if (!read_next_move(&move)) {
+        ThePlanner::waitFinished(c);
+        return;
+    }
+    
+    bench_moves++;
+    
+    auto *cmd = ThePlanner::getBuffer(c);
+    cmd->axes.rel_max_v_rec = move.rel_max_v_rec;
+    
+    ListFor<MakeTypeList<WrapInt<0>, WrapInt<1>, WrapInt<2>, WrapInt<3>>>([&] APRINTER_TL(axis_index, {
+        static int const i = axis_index::Value;
+        auto *axis_split = TupleGetElem<axis_index::Value>(cmd->axes.axes());
+        using StepFixedType = typename ThePlanner::template AxisSplitBuffer<axis_index::Value>::StepFixedType;
+        int64_t steps = move.steps[i];
+        axis_split->dir = (steps >= 0);
+        uint64_t abs_steps = (steps >= 0) ? steps : -steps;
+        axis_split->x = StepFixedType::importBits(abs_steps);
+        expected_pos[i] += steps;
+        FpType max_v_rec = (FpType)(MyClock::time_freq / (AxisMaxSpeed[i] * AxisStepsPerUnit[i]));
+        cmd->axes.rel_max_v_rec = FloatMax(cmd->axes.rel_max_v_rec, (FpType)abs_steps * max_v_rec);
+    }));
+    
+    ThePlanner::axesCommandDone(c);
+}
+
+static void planner_finished_handler (Context c)
+{
+    bench_finished = true;
+}
+
+static void planner_aborted_handler (Context c)
+{
+    AMBRO_ASSERT_FORCE(0)
+}
+
+static void planner_underrun_callback (Context c)
+{
+    bench_underruns++;
+}
+
+int main (int argc, char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <file.gcode>\n", argv[0]);
+        return 1;
+    }
+    
+    gcode_file = fopen(argv[1], "r");
+    if (!gcode_file) {
+        fprintf(stderr, "Failed to open %s\n", argv[1]);
+        return 1;
+    }
+    
+    Context c;
+    
+    MyDebugObjectGroup::init(c);
+    MyClock::init(c);
+    MyLoop::init(c);
+    ListFor<BenchAxesList>([&] APRINTER_TL(axis, axis::Driver::init(c)));
+    ThePlanner::init(c, false);
+    
+    auto *po = ThePlanner::Object::self(c);
+    
+    uint64_t plan_count = 0;
+    uint64_t plan_time_total = 0;
+    uint64_t plan_time_max = 0;
+    uint64_t planner_time_total = 0;
+    uint64_t committed_segments = 0;
+    uint64_t visited_max = 0;
+    uint64_t timer_time_total = 0;
+    uint64_t timer_count = 0;
+    double overhead_ns = wall_time_overhead_ns();
+    
+    uint64_t start_time = wall_time_ns();
+    
+    while (!bench_finished) {
+        bool dispatched = MyLoop::dispatchFastEvent(c, [&](typename MyLoop::FastHandlerType handler) {
+            auto old_segments_start = po->m_segments_start;
+            uint64_t handler_start = wall_time_ns();
+            handler(c);
+            uint64_t handler_time = wall_time_ns() - handler_start;
+            planner_time_total += handler_time;
+            
+            // A (successful) plan() is the only thing that advances the start
+            // of the segment buffer while stepping, by the number of committed
+            // segments. Note that this always includes emitting one segment too.
+            if (po->m_segments_start != old_segments_start) {
+                int commit_count = (int)po->m_segments_start - (int)old_segments_start;
+                if (commit_count < 0) {
+                    commit_count += LOOKAHEAD_BUFFER_SIZE;
+                }
+                committed_segments += commit_count;
+                plan_count++;
+                plan_time_total += handler_time;
+                if (handler_time > plan_time_max) {
+                    plan_time_max = handler_time;
+                }
+                if (ThePlanner::getPlanStats(c).last_visited > visited_max) {
+                    visited_max = ThePlanner::getPlanStats(c).last_visited;
+                }
+            }
+        });
+        
+        if (!dispatched) {
+            uint64_t timer_start = wall_time_ns();
+            bool ran = MyClock::runNextTimer(c);
+            timer_time_total += wall_time_ns() - timer_start;
+            timer_count++;
+            if (!ran) {
+                fprintf(stderr, "Simulation stalled\n");
+                return 1;
+            }
+        }
+    }
+    
+    uint64_t total_time = wall_time_ns() - start_time;
+    
+    ThePlanner::deinit(c);
+    ListForReverse<BenchAxesList>([&] APRINTER_TL(axis, axis::Driver::deinit(c)));
+    fclose(gcode_file);
+    
+    bool positions_ok = true;
+    for (int i = 0; i < NumAxes; i++) {
+        positions_ok = positions_ok && (stepper_pos[i] == expected_pos[i]);
+    }
+    
+    double planner_secs = planner_time_total * 1e-9;
+    auto plan_stats = ThePlanner::getPlanStats(c);
+    double timer_ns = fmax(0.0, timer_time_total - overhead_ns * timer_count);
+    double timer_ns_per_step = (stepper_steps > 0) ? timer_ns / stepper_steps : 0.0;
+
+#ifdef SCURVE_RAMP_TIME
+    double ramp_time = SCURVE_RAMP_TIME;
+#else
+    double ramp_time = 0.0;
+#endif
+
+    printf("{\"ramp_time\": %g, \"lookahead_buffer_size\": %d, \"lookahead_commit_count\": %d, \"stepper_segment_buffer_size\": %d, "
+           "\"moves\": %llu, \"segments\": %llu, \"plans\": %llu, "
+           "\"segments_per_sec\": %.1f, \"plan_avg_us\": %.3f, \"plan_max_us\": %.3f, "
+           "\"visited_per_plan\": %.2f, \"visited_max\": %llu, "
+           "\"stepper_commands\": %llu, \"stepper_commands_per_sec\": %.1f, "
+           "\"underruns\": %llu, \"print_time_s\": %.3f, \"planner_time_s\": %.6f, \"total_time_s\": %.6f, "
+           "\"step_times_buffer_size\": %d, \"steps\": %llu, \"timer_ns_per_step\": %.2f, \"max_step_rate\": %.0f, "
+           "\"step_hash\": \"%016llx\", \"positions_ok\": %s}\n",
+           ramp_time, LOOKAHEAD_BUFFER_SIZE, LOOKAHEAD_COMMIT_COUNT, (int)(STEPPER_SEGMENT_BUFFER_SIZE),
+           (unsigned long long)bench_moves, (unsigned long long)committed_segments, (unsigned long long)plan_count,
+           (planner_secs > 0.0) ? committed_segments / planner_secs : 0.0,
+           (plan_count > 0) ? plan_time_total * 1e-3 / plan_count : 0.0,
+           plan_time_max * 1e-3,
+           (plan_stats.plans > 0) ? (double)plan_stats.visited_segments / plan_stats.plans : 0.0,
+           (unsigned long long)visited_max,
+           (unsigned long long)stepper_commands,
+           (planner_secs > 0.0) ? stepper_commands / planner_secs : 0.0,
+           (unsigned long long)bench_underruns,
+           MyClock::getElapsedTicks(c) * MyClock::time_unit,
+           planner_secs, total_time * 1e-9,
+           (int)(STEP_TIMES_BUFFER_SIZE), (unsigned long long)stepper_steps, timer_ns_per_step,
+           (timer_ns_per_step > 0.0) ? 1e9 / timer_ns_per_step : 0.0,
+           (unsigned long long)stepper_hash, positions_ok ? "true" : "false");
+    
+    return positions_ok ? 0 : 1;
+}
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Compares the total move time of LinearPlanner (trapezoidal) and
+ * SCurvePlanner (jerk-limited) on the paths from linearplanner_gen_paths.py:
+ *
+ *   python linearplanner_gen_paths.py > linearplanner_paths.cpp
+ *   g++ -O2 -std=c++14 -I.. scurveplanner_bench.cpp -o scurveplanner_bench
+ *   ./scurveplanner_bench [ramp_time] [accel_factor]
+ *
+ * The S-curve planner is run twice, once with the same acceleration limits
+ * and once with the limits multiplied by accel_factor. A line with a JSON
+ * object containing the total times is printed.
+ */
+
+#include <stdlib.h>
+#include <math.h>
+#include <stdio.h>
+
+#include <aprinter/base/Assert.h>
+#include <aprinter/printer/planning/LinearPlanner.h>
+#include <aprinter/printer/planning/SCurvePlanner.h>
+
+using namespace APrinter;
+
+using FpType = double;
+
+static constexpr FpType SpeedEpsilon = 0.00001;
+static constexpr FpType PositionEpsilon = 0.00001;
+
+struct Segment {
+    FpType distance;
+    FpType max_speed_squared;
+    FpType two_max_accel;
+};
+
+struct Path {
+    Segment const *segs;
+    size_t num_segs;
+};
+
+#include "linearplanner_paths.cpp"
+
+using TheLinearPlanner = LinearPlanner<FpType>;
+using TheSCurvePlanner = SCurvePlanner<FpType>;
+
+TheLinearPlanner::SegmentData lp_sd[max_path_len];
+TheLinearPlanner::SegmentState lp_ss[max_path_len];
+TheSCurvePlanner::SegmentData sp_sd[max_path_len];
+TheSCurvePlanner::SegmentState sp_ss[max_path_len];
+
+static void check_result (Path path, size_t i, FpType start_v, FpType end_v, FpType const_start, FpType const_end, FpType const_v)
+{
+    FpType speed_limit = path.segs[i].max_speed_squared + SpeedEpsilon;
+    AMBRO_ASSERT_FORCE(start_v <= speed_limit)
+    AMBRO_ASSERT_FORCE(const_v <= speed_limit)
+    AMBRO_ASSERT_FORCE(end_v <= speed_limit)
+    
+    AMBRO_ASSERT_FORCE(const_start >= -PositionEpsilon)
+    AMBRO_ASSERT_FORCE(const_end >= -PositionEpsilon)
+    AMBRO_ASSERT_FORCE(const_start + const_end <= 1.0f + PositionEpsilon)
+}
+
+static FpType cruise_time (Segment const *seg, FpType const_start, FpType const_end, FpType const_v)
+{
+    FpType frac = 1.0f - const_start - const_end;
+    return (frac > 0.0f) ? (frac * seg->distance / sqrt(const_v)) : 0.0f;
+}
+
+static FpType linear_path_time (Path path)
+{
+    FpType prev_max_v = 0.0f;
+    for (size_t i = 0; i < path.num_segs; i++) {
+        Segment const *seg = &path.segs[i];
+        TheLinearPlanner::initSegment(&lp_sd[i], prev_max_v, INFINITY, seg->max_speed_squared, seg->two_max_accel * seg->distance);
+        prev_max_v = seg->max_speed_squared;
+    }
+    
+    FpType v = 0.0;
+    for (size_t j = path.num_segs; j > 0; j--) {
+        v = TheLinearPlanner::push(&lp_sd[j - 1], &lp_ss[j - 1], v);
+    }
+    
+    FpType time = 0.0;
+    v = 0.0;
+    for (size_t i = 0; i < path.num_segs; i++) {
+        Segment const *seg = &path.segs[i];
+        FpType start_v = v;
+        TheLinearPlanner::SegmentResult result;
+        v = TheLinearPlanner::pull(&lp_sd[i], &lp_ss[i], v, &result);
+        check_result(path, i, start_v, v, result.const_start, result.const_end, result.const_v);
+        
+        FpType accel = 0.5f * seg->two_max_accel;
+        FpType const_u = sqrt(result.const_v);
+        time += (const_u - sqrt(start_v)) / accel;
+        time += (const_u - sqrt(v)) / accel;
+        time += cruise_time(seg, result.const_start, result.const_end, result.const_v);
+    }
+    
+    return time;
+}
+
+static FpType scurve_path_time (Path path, FpType ramp_time, FpType accel_factor)
+{
+    FpType prev_max_v = 0.0f;
+    for (size_t i = 0; i < path.num_segs; i++) {
+        Segment const *seg = &path.segs[i];
+        FpType two_accel = accel_factor * seg->two_max_accel;
+        TheSCurvePlanner::initSegment(&sp_sd[i], prev_max_v, INFINITY, seg->max_speed_squared, two_accel * seg->distance, 0.5f * two_accel * ramp_time);
+        prev_max_v = seg->max_speed_squared;
+    }
+    
+    FpType v = 0.0;
+    for (size_t j = path.num_segs; j > 0; j--) {
+        v = TheSCurvePlanner::push(&sp_sd[j - 1], &sp_ss[j - 1], v);
+    }
+    
+    FpType time = 0.0;
+    v = 0.0;
+    for (size_t i = 0; i < path.num_segs; i++) {
+        Segment const *seg = &path.segs[i];
+        FpType start_v = v;
+        TheSCurvePlanner::SegmentResult result;
+        v = TheSCurvePlanner::pull(&sp_sd[i], &sp_ss[i], v, &result);
+        check_result(path, i, start_v, v, result.const_start, result.const_end, result.const_v);
+        
+        // The phases must cover the distance they claim at the speeds they go.
+        FpType const_u = sqrt(result.const_v);
+        FpType accel_time = TheSCurvePlanner::rampTime(&sp_sd[i], const_u - sqrt(start_v));
+        FpType decel_time = TheSCurvePlanner::rampTime(&sp_sd[i], const_u - sqrt(v));
+        FpType accel_dist = (sqrt(start_v) + const_u) * accel_time / sp_sd[i].a_x;
+        FpType decel_dist = (sqrt(v) + const_u) * decel_time / sp_sd[i].a_x;
+        AMBRO_ASSERT_FORCE(fabs(accel_dist - result.const_start) <= 0.001)
+        AMBRO_ASSERT_FORCE(fabs(decel_dist - result.const_end) <= 0.001)
+        
+        FpType accel = 0.5f * accel_factor * seg->two_max_accel;
+        time += (accel_time + decel_time) / accel;
+        time += cruise_time(seg, result.const_start, result.const_end, result.const_v);
+    }
+    
+    return time;
+}
+
+int main (int argc, char *argv[])
+{
+    FpType ramp_time = (argc > 1) ? atof(argv[1]) : 0.05;
+    FpType accel_factor = (argc > 2) ? atof(argv[2]) : 1.5;
+    
+    FpType linear_time = 0.0;
+    FpType scurve_time = 0.0;
+    FpType scurve_factor_time = 0.0;
+    
+    for (size_t i = 0; i < num_paths; i++) {
+        linear_time += linear_path_time(paths[i]);
+        scurve_time += scurve_path_time(paths[i], ramp_time, 1.0);
+        scurve_factor_time += scurve_path_time(paths[i], ramp_time, accel_factor);
+    }
+    
+    // With no ramp time, the S-curve planner must match the linear one.
+    FpType zero_ramp_time = 0.0;
+    for (size_t i = 0; i < num_paths; i++) {
+        zero_ramp_time += scurve_path_time(paths[i], 0.0, 1.0);
+    }
+    AMBRO_ASSERT_FORCE(fabs(zero_ramp_time - linear_time) <= 0.0001 * linear_time)
+    
+    printf("{\"num_paths\": %zu, \"ramp_time\": %g, \"accel_factor\": %g, "
+           "\"trapezoid_time\": %.4f, \"scurve_time\": %.4f, \"scurve_accel_factor_time\": %.4f, "
+           "\"scurve_ratio\": %.4f, \"scurve_accel_factor_ratio\": %.4f}\n",
+           num_paths, ramp_time, accel_factor,
+           linear_time, scurve_time, scurve_factor_time,
+           scurve_time / linear_time, scurve_factor_time / linear_time);
+    
+    return 0;
+}